@@ -9,6 +9,7 @@
 
 #include "Config.h"
 #include "Mathematics.h"
+#include "Thread.h"
 #include <vector>
 
 namespace activation
@@ -113,6 +114,18 @@ namespace activation
 			return objects[count++];
 		}
 
+		// bulk insert: grows at most once, to exactly the size needed, and returns the first new slot
+
+		T * InsertObjects( int n )
+		{
+			assert( n >= 0 );
+			if ( count + n > size )
+				Resize( count + n );
+			T * first = objects + count;
+			count += n;
+			return first;
+		}
+
 		void DeleteObject( ObjectId id )
 		{
 			assert( count >= 1 );
@@ -148,6 +161,13 @@ namespace activation
 			return objects[index];
 		}
 
+ 		const T & GetObject( int index ) const
+		{
+			assert( index >= 0 );
+			assert( index < count );
+			return objects[index];
+		}
+
  		T * FindObject( ObjectId id )
 		{
 			assert( count >= 0 );
@@ -202,6 +222,17 @@ namespace activation
 			delete[] oldObjects;
 		}
 
+		void Resize( int newSize )
+		{
+			assert( newSize >= count );
+			size = newSize;
+			T * oldObjects = objects;
+			objects = new T[size];
+			if ( count > 0 )
+				memcpy( &objects[0], &oldObjects[0], sizeof(T)*count );
+			delete[] oldObjects;
+		}
+
 		int count;
 		int size;
 		T * objects;
@@ -336,6 +367,11 @@ namespace activation
 			return cellObject;
 		}
 
+		CellObject * InsertObjects( int n )
+		{
+			return objects.InsertObjects( n );
+		}
+
 		void DeleteObject( ActiveObject * activeObjects, ObjectId id )
 		{
 			objects.DeleteObject( activeObjects, id );
@@ -601,7 +637,7 @@ namespace activation
 							else
 							{
 								ActiveObject & activeObject = active_objects.GetObject( cellObject.activeObjectIndex );
-								activeObject.pendingDeactivation = false;
+								CancelDeactivation( activeObject );
 							}
 						}
 					}
@@ -705,7 +741,7 @@ namespace activation
 							else
 							{
 								ActiveObject & activeObject = active_objects.GetObject( cellObject.activeObjectIndex );
-								activeObject.pendingDeactivation = false;						
+								CancelDeactivation( activeObject );
 							}
 						}
 						else if ( cellObject.active )
@@ -737,6 +773,121 @@ namespace activation
 			idToCellIndex[id] = (int) ( cell - &cells[0] );
 		}
 
+		/*
+			Bulk insert of objects firstId .. firstId + count - 1.
+			The objects are binned by cell with a counting sort: each chunk of
+			the input counts its objects per cell, a prefix sum over the counts
+			gives each chunk its own range inside every cell, then the chunks
+			fill their ranges and idToCellIndex. Every cell is resized at most
+			once and ends up in the same order as inserting one at a time.
+			The count and fill passes run across the worker pool if one is given.
+		*/
+
+		void InsertObjects( ObjectId firstId, const float * x, const float * y, int count, platform::WorkerPool * pool = NULL )
+		{
+			assert( firstId > 0 );
+			assert( (int) firstId + count <= maxObjects );
+			if ( count <= 0 )
+				return;
+
+			const int MinChunkSize = 4096;
+			int numChunks = pool ? pool->GetNumThreads() : 1;
+			if ( numChunks > ( count + MinChunkSize - 1 ) / MinChunkSize )
+				numChunks = ( count + MinChunkSize - 1 ) / MinChunkSize;
+
+			BulkInsert bulk;
+			bulk.system = this;
+			bulk.firstId = firstId;
+			bulk.x = x;
+			bulk.y = y;
+			bulk.count = count;
+			bulk.numChunks = numChunks;
+			bulk.chunkSize = ( count + numChunks - 1 ) / numChunks;
+			bulk.numCells = width * height;
+			bulk.objectCell.resize( count );
+			bulk.chunkOffset.assign( numChunks * bulk.numCells, 0 );
+			bulk.cellBase.resize( bulk.numCells );
+
+			// count objects per cell, per chunk
+
+			if ( pool )
+				pool->Run( CountObjectsTask, &bulk, numChunks );
+			else
+				for ( int i = 0; i < numChunks; ++i )
+					CountObjectsTask( &bulk, i );
+
+			// prefix sum: each chunk writes after the chunks before it. size each cell once
+
+			for ( int i = 0; i < bulk.numCells; ++i )
+			{
+				int total = 0;
+				for ( int j = 0; j < numChunks; ++j )
+				{
+					int & offset = bulk.chunkOffset[j*bulk.numCells+i];
+					const int chunkCount = offset;
+					offset = total;
+					total += chunkCount;
+				}
+				bulk.cellBase[i] = total > 0 ? cells[i].InsertObjects( total ) : NULL;
+			}
+
+			// fill cells and the id to cell index
+
+			if ( pool )
+				pool->Run( FillObjectsTask, &bulk, numChunks );
+			else
+				for ( int i = 0; i < numChunks; ++i )
+					FillObjectsTask( &bulk, i );
+
+			Validate();
+		}
+
+		/*
+			Bulk insert into a single cell, for restoring a grid that was saved
+			cell by cell. The cell is resized once to hold them all. T is any
+			entry with id, x and y. Every object must lie inside this cell and
+			not be in the grid already.
+		*/
+
+		template <typename T> void InsertCellObjects( int cellIndex, const T * objects, int count )
+		{
+			assert( cellIndex >= 0 );
+			assert( cellIndex < width * height );
+			if ( count <= 0 )
+				return;
+			CellObject * cellObjects = cells[cellIndex].InsertObjects( count );
+			for ( int i = 0; i < count; ++i )
+			{
+				const ObjectId id = objects[i].id;
+				assert( id > 0 );
+				assert( (int) id < maxObjects );
+				assert( CellAtPosition( objects[i].x, objects[i].y ) == &cells[cellIndex] );
+				CellObject & cellObject = cellObjects[i];
+				cellObject.id = id;
+				cellObject.x = objects[i].x;
+				cellObject.y = objects[i].y;
+				cellObject.active = 0;
+				cellObject.activeObjectIndex = 0;
+				#ifdef DEBUG
+				cellObject.cellIndex = cellIndex;
+				#endif
+				assert( idToCellIndex[id] == -1 );
+				idToCellIndex[id] = cellIndex;
+			}
+		}
+
+		// positions from outside the game, like snapshots, are checked with these before inserting
+
+		bool IsInBounds( float x, float y ) const
+		{
+			return x >= -bound_x && x <= +bound_x && y >= -bound_y && y <= +bound_y;
+		}
+
+		int GetCellIndex( float x, float y )
+		{
+			return (int) ( CellAtPosition( x, y ) - cells );
+		}
+
 		float GetBoundX() const
 		{
 			return bound_x;
@@ -833,7 +984,7 @@ namespace activation
 						QueueObjectForDeactivation( *activeObject, warp );
 				}
 				else
-					activeObject->pendingDeactivation = 0;
+					CancelDeactivation( *activeObject );
 			}
 			else
 			{
@@ -890,6 +1041,15 @@ namespace activation
 			assert( !activeObject.pendingDeactivation );
 			activeObject.pendingDeactivation = true;
 			activeObject.pendingDeactivationTime = warp ? deactivationTime : 0.0f;
+			pending_changes.push_back( activeObject.id );
+		}
+
+		void CancelDeactivation( ActiveObject & activeObject )
+		{
+			if ( !activeObject.pendingDeactivation )
+				return;
+			activeObject.pendingDeactivation = false;
+			pending_changes.push_back( activeObject.id );
 		}
 
 		void DeleteObject( ObjectId id, float x, float y )
@@ -915,6 +1075,26 @@ namespace activation
 			activation_events.clear();
 		}
 
+		// objects queued for deactivation or taken off the queue since the last clear.
+		// an id can appear more than once, or belong to an object that has since deactivated
+
+		int GetPendingChangeCount() const
+		{
+			return pending_changes.size();
+		}
+
+		ObjectId GetPendingChange( int index ) const
+		{
+			assert( index >= 0 );
+			assert( index < (int) pending_changes.size() );
+			return pending_changes[index];
+		}
+
+		void ClearPendingChanges()
+		{
+			pending_changes.clear();
+		}
+
 		float GetX() const
 		{
 			return activation_x;
@@ -925,6 +1105,40 @@ namespace activation
 			return activation_y;
 		}
 
+		float GetActivationRadius() const
+		{
+			return activation_radius;
+		}
+
+		// objects outside a shrunk circle are queued for deactivation, a grown circle activates immediately
+
+		void SetActivationRadius( float radius )
+		{
+			assert( radius > 0.0f );
+			const bool growing = radius > activation_radius;
+			activation_radius = radius;
+			activation_radius_squared = radius * radius;
+			if ( !enabled || !enabled_last_frame )
+				return;
+			if ( growing )
+			{
+				ActivateObjectsInsideCircle();
+				return;
+			}
+			for ( int i = 0; i < active_objects.GetCount(); ++i )
+			{
+				ActiveObject & activeObject = active_objects.GetObject( i );
+				if ( activeObject.pendingDeactivation )
+					continue;
+				CellObject & cellObject = cells[activeObject.cellIndex].GetObject( activeObject.cellObjectIndex );
+				const float dx = cellObject.x - activation_x;
+				const float dy = cellObject.y - activation_y;
+				if ( dx*dx + dy*dy > activation_radius_squared )
+					QueueObjectForDeactivation( activeObject );
+			}
+			Validate();
+		}
+
 		int GetActiveCount() const
 		{
 			return active_objects.GetCount();
@@ -935,10 +1149,15 @@ namespace activation
 			return active_objects.FindObject( id ) != NULL;
 		}
 
+		// note: goes through the object's cell, searching the whole active set per call was quadratic in the game
+
 		bool IsPendingDeactivation( ObjectId id ) const
 		{
-			const ActiveObject * object = active_objects.FindObject( id );
-			return object && object->pendingDeactivation;
+			assert( id < (ObjectId) maxObjects );
+			const CellObject * cellObject = cells[idToCellIndex[id]].FindObject( id );
+			if ( !cellObject || !cellObject->active )
+				return false;
+			return active_objects.GetObject( cellObject->activeObjectIndex ).pendingDeactivation;
 		}
 		
 		void Validate()
@@ -1008,6 +1227,61 @@ namespace activation
 
 	private:
 
+		struct BulkInsert
+		{
+			ActivationSystem * system;
+			ObjectId firstId;
+			const float * x;
+			const float * y;
+			int count;
+			int numChunks;
+			int chunkSize;
+			int numCells;
+			std::vector<int> objectCell;				// input index -> cell index
+			std::vector<int> chunkOffset;				// chunk * numCells + cell -> count, then write offset
+			std::vector<CellObject*> cellBase;			// first new slot in each cell
+		};
+
+		static void CountObjectsTask( void * data, int chunk )
+		{
+			BulkInsert & bulk = *(BulkInsert*) data;
+			ActivationSystem * system = bulk.system;
+			const int begin = chunk * bulk.chunkSize;
+			const int end = math::min( begin + bulk.chunkSize, bulk.count );
+			int * counts = &bulk.chunkOffset[chunk*bulk.numCells];
+			for ( int i = begin; i < end; ++i )
+			{
+				const int cellIndex = (int) ( system->CellAtPosition( bulk.x[i], bulk.y[i] ) - system->cells );
+				bulk.objectCell[i] = cellIndex;
+				counts[cellIndex]++;
+			}
+		}
+
+		static void FillObjectsTask( void * data, int chunk )
+		{
+			BulkInsert & bulk = *(BulkInsert*) data;
+			ActivationSystem * system = bulk.system;
+			const int begin = chunk * bulk.chunkSize;
+			const int end = math::min( begin + bulk.chunkSize, bulk.count );
+			int * offsets = &bulk.chunkOffset[chunk*bulk.numCells];
+			for ( int i = begin; i < end; ++i )
+			{
+				const int cellIndex = bulk.objectCell[i];
+				const ObjectId id = bulk.firstId + i;
+				CellObject & cellObject = bulk.cellBase[cellIndex][ offsets[cellIndex]++ ];
+				cellObject.id = id;
+				cellObject.x = bulk.x[i];
+				cellObject.y = bulk.y[i];
+				cellObject.active = 0;
+				cellObject.activeObjectIndex = 0;
+				#ifdef DEBUG
+				cellObject.cellIndex = cellIndex;
+				#endif
+				assert( system->idToCellIndex[id] == -1 );
+				system->idToCellIndex[id] = cellIndex;
+			}
+		}
+
 		Cell * CellAtPosition( float x, float y )
 		{
 			assert( x >= -bound_x );
@@ -1054,6 +1328,7 @@ namespace activation
 		Cell * cells;
  		int * idToCellIndex;
 		Events activation_events;
+		std::vector<ObjectId> pending_changes;
 		ActiveObjectSet active_objects;
 	};
 }
@@ -0,0 +1,407 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef AUTHORITY_H
+#define AUTHORITY_H
+
+#include "Config.h"
+#include "Game.h"
+#include "Cubes.h"
+
+#include <stdlib.h>
+#include <vector>
+
+namespace game
+{
+	/*
+		Authority world.
+		The world, packet format and packet handling behind the authority demo,
+		pulled out of the demo so the headless replay driver runs exactly the
+		same code against a recorded session.
+	*/
+
+	typedef Instance<cubes::DatabaseObject, cubes::ActiveObject> AuthorityInstance;
+
+	enum { MaxObjectsInAuthorityPacket = 256 };
+
+	enum SyncMode
+	{
+		SYNC_Disabled,
+		SYNC_Naive,
+		SYNC_PlayerAuthority,
+		SYNC_TieBreakAuthority,
+		SYNC_InteractionAuthority
+	};
+
+	struct AuthorityObject
+	{
+		ObjectId id;
+		uint32_t enabled : 1;
+		uint32_t authority : 3;				// [0,MaxPlayers]
+		math::Quaternion orientation;
+		math::Vector position;
+		math::Vector linearVelocity;
+		math::Vector angularVelocity;
+	};
+
+	struct AuthorityPacket
+	{
+		uint32_t frame;
+		Input input;
+		int objectCount;
+		AuthorityObject object[MaxObjectsInAuthorityPacket];
+
+		// only the objects actually in the packet are sent
+
+		int GetBytes() const
+		{
+			return sizeof( AuthorityPacket ) - sizeof( AuthorityObject ) * ( MaxObjectsInAuthorityPacket - objectCount );
+		}
+	};
+
+	/*
+		Authority object encoding.
+		Quantizes an object for the network instead of sending the struct as
+		is. On a range coded stream the models learn what objects in this
+		world usually look like: ids and positions close to the previous
+		object's, almost all enabled, mostly nobody's authority and velocities
+		near rest. Both sides start each packet with fresh models, so packets
+		still decode on their own when others are lost.
+	*/
+
+	enum { MaxAuthorityObjectId = ( 1 << 20 ) - 1 };
+
+	const float AuthorityPositionBound = 512.0f;
+	const float AuthorityMinimumHeight = -16.0f;
+	const float AuthorityMaximumHeight = 240.0f;
+	const float AuthorityPositionResolution = 1.0f / 512;
+	const float AuthorityOrientationResolution = 1.0f / 2048;
+	const float AuthorityVelocityBound = 128.0f;
+	const float AuthorityVelocityResolution = 1.0f / 256;
+
+	struct AuthorityModels
+	{
+		net::IntegerModel id;
+		net::BitModel enabled;
+		net::IntegerModel authority;
+		net::IntegerModel position;
+		net::IntegerModel linearVelocity;
+		net::IntegerModel angularVelocity;
+		unsigned int previousId;
+		unsigned int previousPosition[3];			// quantized, so both sides predict alike
+
+		AuthorityModels()
+		{
+			previousId = 0;
+			previousPosition[0] = net::Stream::QuantizeFloat( 0.0f, -AuthorityPositionBound, +AuthorityPositionBound, AuthorityPositionResolution );
+			previousPosition[1] = previousPosition[0];
+			previousPosition[2] = net::Stream::QuantizeFloat( 0.0f, AuthorityMinimumHeight, AuthorityMaximumHeight, AuthorityPositionResolution );
+		}
+	};
+
+	inline bool SerializeAuthorityObject( net::Stream & stream, AuthorityObject & object, AuthorityModels & models )
+	{
+		unsigned int id = object.id;
+		bool enabled = object.enabled;
+		unsigned int owner = MaxPlayers - object.authority;			// 0 for nobody, the common case
+
+		// objects in a packet are neighbours and so are their ids: range coded, send the step from the last one
+
+		if ( stream.GetBackend() == net::Stream::RangeCoded )
+		{
+			int step = (int) id - (int) models.previousId;
+			if ( !stream.SerializeInteger( step, -MaxAuthorityObjectId, +MaxAuthorityObjectId, models.id ) )
+				return false;
+			id = models.previousId + step;
+			if ( id > MaxAuthorityObjectId )
+				return false;
+			models.previousId = id;
+		}
+		else if ( !stream.SerializeInteger( id, 0, MaxAuthorityObjectId ) )
+			return false;
+
+		if ( !stream.SerializeBoolean( enabled, models.enabled ) )
+			return false;
+		if ( !stream.SerializeInteger( owner, 0, MaxPlayers, models.authority ) )
+			return false;
+
+		// so are their positions
+
+		if ( !stream.SerializeCompressedFloat( object.position.x, -AuthorityPositionBound, +AuthorityPositionBound, AuthorityPositionResolution, models.position, models.previousPosition[0] ) )
+			return false;
+		if ( !stream.SerializeCompressedFloat( object.position.y, -AuthorityPositionBound, +AuthorityPositionBound, AuthorityPositionResolution, models.position, models.previousPosition[1] ) )
+			return false;
+		if ( !stream.SerializeCompressedFloat( object.position.z, AuthorityMinimumHeight, AuthorityMaximumHeight, AuthorityPositionResolution, models.position, models.previousPosition[2] ) )
+			return false;
+
+		if ( !stream.SerializeCompressedQuaternion( object.orientation.w, object.orientation.x, object.orientation.y, object.orientation.z, AuthorityOrientationResolution ) )
+			return false;
+
+		for ( int i = 0; i < 3; ++i )
+		{
+			if ( !stream.SerializeCompressedFloat( object.linearVelocity[i], -AuthorityVelocityBound, +AuthorityVelocityBound, AuthorityVelocityResolution, models.linearVelocity ) )
+				return false;
+			if ( !stream.SerializeCompressedFloat( object.angularVelocity[i], -AuthorityVelocityBound, +AuthorityVelocityBound, AuthorityVelocityResolution, models.angularVelocity ) )
+				return false;
+		}
+
+		if ( stream.IsReading() )
+		{
+			object.id = id;
+			object.enabled = enabled;
+			object.authority = MaxPlayers - owner;
+		}
+
+		return true;
+	}
+
+	inline void AddAuthorityCube( AuthorityInstance * instance, float scale, const math::Vector & position, const math::Vector & linearVelocity = math::Vector(0,0,0), const math::Vector & angularVelocity = math::Vector(0,0,0) )
+	{
+		cubes::DatabaseObject object;
+		object.position = position;
+		object.orientation = math::Quaternion(1,0,0,0);
+		object.scale = scale;
+		object.linearVelocity = linearVelocity;
+		object.angularVelocity = angularVelocity;
+		object.enabled = 1;
+		object.activated = 0;
+		instance->AddObject( object, position.x, position.y );
+	}
+
+	// every instance has all players joined, each focused on its own player cube
+
+	inline void JoinAuthorityPlayers( AuthorityInstance * instance, int localPlayer )
+	{
+		for ( int j = 0; j < MaxPlayers; ++j )
+		{
+			instance->OnPlayerJoined( j );
+			instance->SetPlayerFocus( j, j + 1 );
+		}
+
+		instance->SetLocalPlayer( localPlayer );
+	}
+
+	// pass a snapshot of an authority world to skip building it again
+
+	inline AuthorityInstance * CreateAuthorityInstance( int localPlayer, const std::vector<uint8_t> * snapshot = NULL )
+	{
+		const float MinScale = 0.2f;
+		const float MaxScale = 0.8f;
+		const float CubeDensity = 5.0;
+		const float CellSize = 4.0f;
+		const float GridSize = 200;
+
+		Config config;
+		config.maxObjects = GridSize * GridSize * CubeDensity + MaxPlayers + 1;
+		config.deactivationTime = 0.5f;
+		config.cellSize = CellSize;
+		config.cellWidth = GridSize + 2;
+		config.cellHeight = GridSize + 2;
+		config.activationDistance = 5.0f;
+		config.tieredUpdates = true;
+		config.rollbackFrames = 15;
+		config.simConfig.QuickStep = false;
+		config.simConfig.ERP = 0.1f;
+		config.simConfig.CFM = 0.001f;
+		config.simConfig.MaxIterations = 12;
+		config.simConfig.MaximumCorrectingVelocity = 100.0f;
+		config.simConfig.ContactSurfaceLayer = 0.05f;
+		config.simConfig.Elasticity = 0.3f;
+		config.simConfig.LinearDrag = 0.01f;
+		config.simConfig.AngularDrag = 0.01f;
+		config.simConfig.Friction = 200.0f;
+		config.governor.Enabled = true;
+		config.governor.TargetFrameTime = 0.016f / MaxPlayers;		// all four instances share one frame
+
+		AuthorityInstance * instance = new AuthorityInstance( config );
+
+		if ( snapshot && instance->LoadSnapshot( &(*snapshot)[0], snapshot->size() ) )
+		{
+			JoinAuthorityPlayers( instance, localPlayer );
+			return instance;
+		}
+
+		instance->InitializeBegin();
+
+		instance->AddPlane( math::Vector(0,0,1), 0 );
+
+		AddAuthorityCube( instance, 1.5f, math::Vector(-5,+5,10), math::Vector(0,0,0), math::Vector(0,0,0) );
+		AddAuthorityCube( instance, 1.5f, math::Vector(+5,+5,10), math::Vector(0,0,0), math::Vector(0,0,0) );
+		AddAuthorityCube( instance, 1.5f, math::Vector(-5,-5,10), math::Vector(0,0,0), math::Vector(0,0,0) );
+		AddAuthorityCube( instance, 1.5f, math::Vector(+5,-5,10), math::Vector(0,0,0), math::Vector(0,0,0) );
+
+		srand( 21 );
+
+		float y = -GridSize / 2 * CellSize;
+		for ( int iy = 0; iy < GridSize; ++iy )
+		{
+			float x = -GridSize / 2 * CellSize;
+			for ( int ix = 0; ix < GridSize; ++ix )
+			{
+				for ( int j = 0; j < CubeDensity; ++j )
+				{
+					math::Vector position( math::random_float( x, x + CellSize ), math::random_float( y, y + CellSize ), math::random_float( 1.0f, 5.0f ) );
+					math::Vector linearVelocity( math::random_float( -2.0f, +2.0f ), math::random_float( -2.0f, +2.0f ), math::random_float( -2.0f, +2.0f ) );
+					math::Vector angularVelocity( math::random_float( -2.0f, +2.0f ), math::random_float( -2.0f, +2.0f ), math::random_float( -2.0f, +2.0f ) );
+					const float scale = math::random_float( MinScale, MaxScale );
+
+					AddAuthorityCube( instance, scale, position, linearVelocity, angularVelocity );
+				}
+				x += CellSize;
+			}
+			y += CellSize;
+		}
+
+		instance->InitializeEnd();
+
+		JoinAuthorityPlayers( instance, localPlayer );
+
+		return instance;
+	}
+
+	// the world is built once, the other instances load a snapshot of it
+
+	inline void CreateAuthorityInstances( AuthorityInstance ** instances, int count )
+	{
+		std::vector<uint8_t> snapshot;
+		for ( int i = 0; i < count; ++i )
+		{
+			instances[i] = CreateAuthorityInstance( i, i > 0 ? &snapshot : NULL );
+			if ( i == 0 && count > 1 )
+				instances[0]->SaveSnapshot( snapshot );
+		}
+	}
+
+	inline void UpdateAuthorityFlags( AuthorityInstance * instance, SyncMode syncMode )
+	{
+		if ( syncMode == SYNC_PlayerAuthority || syncMode == SYNC_TieBreakAuthority )
+			instance->SetFlag( FLAG_DisableInteractionAuthority );
+		else
+			instance->ClearFlag( FLAG_DisableInteractionAuthority );
+	}
+
+	// hack: some authority tricks for exotic sync modes, done by the sender before packets are built
+
+	inline void PrepareAuthoritySend( AuthorityInstance * instance, int from, SyncMode syncMode )
+	{
+		const int objectCount = instance->GetActiveObjectCount();
+		for ( int i = 0; i < objectCount; ++i )
+		{
+			const cubes::ActiveObject & activeObject = instance->GetPriorityObject( 0, i );
+			if ( syncMode == SYNC_Naive )
+			{
+				instance->SetObjectAuthority( activeObject.id, from, true );
+			}
+			else if ( syncMode == SYNC_PlayerAuthority || syncMode == SYNC_TieBreakAuthority )
+			{
+				if ( activeObject.id >= MaxPlayers )
+					instance->ClearObjectAuthority( activeObject.id );
+			}
+		}
+	}
+
+	// maxObjects limits the packet size for sending over a real network
+
+	inline void BuildAuthorityPacket( AuthorityInstance * instance, int from, int to, SyncMode syncMode, AuthorityPacket & packet, int maxObjects = MaxObjectsInAuthorityPacket )
+	{
+		assert( maxObjects >= 0 );
+		assert( maxObjects <= MaxObjectsInAuthorityPacket );
+
+		packet.frame = instance->GetPlayerFrame( from );
+		instance->GetPlayerInput( from, packet.input );
+
+		packet.objectCount = maxObjects;
+		if ( packet.objectCount > instance->GetActiveObjectCount() )
+			packet.objectCount = instance->GetActiveObjectCount();
+
+		for ( int i = 0; i < packet.objectCount; ++i )
+		{
+			const cubes::ActiveObject & activeObject = instance->GetPriorityObject( to, i );
+			instance->ResetObjectPriority( to, i );
+			packet.object[i].id = activeObject.id;
+			if ( syncMode == SYNC_Naive )
+				packet.object[i].authority = from;
+			else
+				packet.object[i].authority = instance->GetObjectAuthority( packet.object[i].id );
+			packet.object[i].enabled = activeObject.enabled;
+			packet.object[i].position = activeObject.position;
+			packet.object[i].orientation = activeObject.orientation;
+			packet.object[i].linearVelocity = activeObject.linearVelocity;
+			packet.object[i].angularVelocity = activeObject.angularVelocity;
+		}
+	}
+
+	inline void ApplyAuthorityPacket( AuthorityInstance * instance, int from, int to, const AuthorityPacket & packet, SyncMode syncMode )
+	{
+		instance->SetPlayerInput( from, packet.input );
+		instance->SetPlayerFrame( from, packet.frame );
+
+		for ( int i = 0; i < packet.objectCount; ++i )
+		{
+			cubes::ActiveObject activeObject;
+			instance->GetObjectState( packet.object[i].id, activeObject );
+			activeObject.enabled = packet.object[i].enabled;
+			activeObject.position = packet.object[i].position;
+			activeObject.orientation = packet.object[i].orientation;
+			activeObject.linearVelocity = packet.object[i].linearVelocity;
+			activeObject.angularVelocity = packet.object[i].angularVelocity;
+
+			if ( syncMode == SYNC_Naive )
+			{
+				instance->SetObjectState( activeObject.id, activeObject );
+			}
+			else if ( syncMode == SYNC_PlayerAuthority )
+			{
+				if ( activeObject.id == (ObjectId) (from + 1) )
+				{
+					instance->SetObjectState( activeObject.id, activeObject );
+					instance->SetObjectAuthority( packet.object[i].id, from );
+				}
+				else if ( activeObject.id > MaxPlayers )
+					instance->SetObjectState( activeObject.id, activeObject );
+			}
+			else if ( syncMode == SYNC_TieBreakAuthority || syncMode == SYNC_InteractionAuthority )
+			{
+				if ( activeObject.id == (ObjectId) (from + 1) )
+				{
+					// player authority
+					instance->SetObjectState( activeObject.id, activeObject );
+					instance->SetObjectAuthority( packet.object[i].id, from, true );
+				}
+				else
+				{
+					int remoteAuthority = packet.object[i].authority;
+					int localAuthority = instance->GetObjectAuthority( activeObject.id );
+					if ( remoteAuthority == from )
+					{
+						if ( remoteAuthority <= localAuthority )
+						{
+							// interaction authority: rewind to the frame it was sent and replay
+							instance->CorrectObjectState( activeObject.id, activeObject, packet.frame );
+							instance->SetObjectAuthority( activeObject.id, remoteAuthority );
+						}
+					}
+					else if ( remoteAuthority == MaxPlayers )
+					{
+						bool active = instance->IsObjectActive( activeObject.id );
+						if ( !active )
+						{
+							// object is not active on this machine
+							instance->SetObjectState( activeObject.id, activeObject );
+						}
+						else if ( active && localAuthority == MaxPlayers && from < to )
+						{
+							// object is active: tie break authority - lower player id wins
+							instance->SetObjectState( activeObject.id, activeObject );
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+#endif
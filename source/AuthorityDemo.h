@@ -4,14 +4,14 @@
 	http://www.gafferongames.com/fiedlers-cubes
 */
 
-#include "Cubes.h"
+#include "Authority.h"
+#include "Recorder.h"
 
 class AuthorityDemo : public Demo
 {
 protected:
 	
 	enum { MaxPlayers = 4 };
-	enum { MaxObjectsInPacket = 256 };
 	
 	enum Output
 	{
@@ -29,15 +29,6 @@ protected:
 		VIS_NumVisualizations
 	};
 	
-	enum SyncMode
-	{
-		SYNC_Disabled,
-		SYNC_Naive,
-		SYNC_PlayerAuthority,
-		SYNC_TieBreakAuthority,
-		SYNC_InteractionAuthority
-	};
-	
 	Output output;
 	SyncMode syncMode;
 	Visualization vis;
@@ -54,6 +45,7 @@ protected:
 	bool enterDownLastFrame;
 	bool tabDownLastFrame;
 	float lag;
+	Recorder recorder;
 
 public:
 
@@ -80,95 +72,27 @@ public:
 	
 	void Initialize()
 	{
-		const float MinScale = 0.2f;
-		const float MaxScale = 0.8f;
-		const float CubeDensity = 5.0;
-		const float CellSize = 4.0f;
-		const float GridSize = 200;
+		AuthorityInstance * instances[MaxPlayers];
+		CreateAuthorityInstances( instances, MaxPlayers );
 
 		for ( int i = 0; i < MaxPlayers; ++i )
 		{
-			game::Config config;
-			config.maxObjects = GridSize * GridSize * CubeDensity + MaxPlayers + 1;
-			config.deactivationTime = 0.5f;
-			config.cellSize = CellSize;
-			config.cellWidth = GridSize + 2;
-			config.cellHeight = GridSize + 2;
-			config.activationDistance = 5.0f;
-			config.simConfig.QuickStep = false;
-			config.simConfig.ERP = 0.1f;
-			config.simConfig.CFM = 0.001f;
-			config.simConfig.MaxIterations = 12;
-			config.simConfig.MaximumCorrectingVelocity = 100.0f;
-			config.simConfig.ContactSurfaceLayer = 0.05f;
-			config.simConfig.Elasticity = 0.3f;
-			config.simConfig.LinearDrag = 0.01f;
-			config.simConfig.AngularDrag = 0.01f;
-			config.simConfig.Friction = 200.0f;
-			
-			game::Instance<cubes::DatabaseObject, cubes::ActiveObject> * instance = 
-				new game::Instance<cubes::DatabaseObject, cubes::ActiveObject> ( config );
-			
-			gameInstance[i] = instance;
-			
+			gameInstance[i] = instances[i];
 			origin[i] = math::Vector(0,0,0);
+		}
 
-			instance->InitializeBegin();
-
-			instance->AddPlane( math::Vector(0,0,1), 0 );
-
-			AddCube( instance, 1.5f, math::Vector(-5,+5,10), math::Vector(0,0,0), math::Vector(0,0,0) );
-			AddCube( instance, 1.5f, math::Vector(+5,+5,10), math::Vector(0,0,0), math::Vector(0,0,0) );
-			AddCube( instance, 1.5f, math::Vector(-5,-5,10), math::Vector(0,0,0), math::Vector(0,0,0) );
-			AddCube( instance, 1.5f, math::Vector(+5,-5,10), math::Vector(0,0,0), math::Vector(0,0,0) );
-		
-			srand( 21 );
-		
-			float y = -GridSize / 2 * CellSize;
-			for ( int iy = 0; iy < GridSize; ++iy )
-			{
-				float x = -GridSize / 2 * CellSize;
-				for ( int ix = 0; ix < GridSize; ++ix )
-				{
-					for ( int j = 0; j < CubeDensity; ++j )
-					{
-						math::Vector position( math::random_float( x, x + CellSize ), math::random_float( y, y + CellSize ), math::random_float( 1.0f, 5.0f ) );
-						math::Vector linearVelocity( math::random_float( -2.0f, +2.0f ), math::random_float( -2.0f, +2.0f ), math::random_float( -2.0f, +2.0f ) );
-						math::Vector angularVelocity( math::random_float( -2.0f, +2.0f ), math::random_float( -2.0f, +2.0f ), math::random_float( -2.0f, +2.0f ) );
-						const float scale = math::random_float( MinScale, MaxScale );
-
-						AddCube( instance, scale, position, linearVelocity, angularVelocity );
-					}
-					x += CellSize;
-				}
-				y += CellSize;
-			}
-			
-			instance->InitializeEnd();
+		// set CUBES_RECORD to record the session for headless replay
 
-			for ( int j = 0; j < MaxPlayers; ++j )
-			{
-				instance->OnPlayerJoined( j );
-				instance->SetPlayerFocus( j, j + 1 );
-			}
-
-			instance->SetLocalPlayer( i );
+		const char * recordFile = getenv( "CUBES_RECORD" );
+		if ( recordFile )
+		{
+			if ( recorder.Open( recordFile, MaxPlayers ) )
+				printf( "recording to \"%s\"\n", recordFile );
+			else
+				printf( "failed to open \"%s\" for recording\n", recordFile );
 		}
 	}
 
-	void AddCube( game::Instance<cubes::DatabaseObject, cubes::ActiveObject> * gameInstance, float scale, const math::Vector & position, const math::Vector & linearVelocity = math::Vector(0,0,0), const math::Vector & angularVelocity = math::Vector(0,0,0) )
-	{
-		cubes::DatabaseObject object;
-		object.position = position;
-		object.orientation = math::Quaternion(1,0,0,0);
-		object.scale = scale;
-		object.linearVelocity = linearVelocity;
-		object.angularVelocity = angularVelocity;
-		object.enabled = 1;
-		object.activated = 0;
-		gameInstance->AddObject( object, position.x, position.y );
-	}
-
 	void ProcessInput( const platform::Input & input )
 	{
 		// special controls
@@ -292,26 +216,13 @@ public:
 	{
 		// fake some networking
 
-		struct TempObject
-		{
-			ObjectId id;
-			uint32_t enabled : 1;
-			uint32_t authority : 3;				// [0,MaxPlayers]
-			math::Quaternion orientation;
-			math::Vector position;
-			math::Vector linearVelocity;
-			math::Vector angularVelocity;
-		};
-
-		struct TempPacket
+		int sendRate = 1;
+		for ( int i = 0; i < MaxPlayers; ++i )
 		{
-			uint32_t frame;
-			game::Input input;
-			int objectCount;
-			TempObject object[MaxObjectsInPacket];
-		};
-		
-		const int sendRate = 1;
+			AuthorityInstance * instance = static_cast<AuthorityInstance*>( gameInstance[i] );
+			if ( instance->GetSendInterval() > sendRate )
+				sendRate = instance->GetSendInterval();
+		}
 
 		static engine::PacketQueue packetQueue;
 		packetQueue.SetDelay( lag );
@@ -319,15 +230,12 @@ public:
 		// update flags
 		
 		for ( int i = 0; i < MaxPlayers; ++i )
-		{
-			if ( syncMode == SYNC_PlayerAuthority || syncMode == SYNC_TieBreakAuthority )
-				gameInstance[i]->SetFlag( game::FLAG_DisableInteractionAuthority );
-			else
-				gameInstance[i]->ClearFlag( game::FLAG_DisableInteractionAuthority );
-		}
+			UpdateAuthorityFlags( static_cast<AuthorityInstance*>( gameInstance[i] ), syncMode );
 
 		// send packets
 
+		bool send = false;
+
 		if ( syncMode != SYNC_Disabled )
 		{
 			static int accumulator = 0;
@@ -335,26 +243,13 @@ public:
 
 			if ( sendRate > 0 && accumulator >= sendRate )
 			{
+				send = true;
+
 				for ( int from = 0; from < MaxPlayers; ++from )
 				{
-					game::Instance<cubes::DatabaseObject, cubes::ActiveObject> * instance = 
-						static_cast< game::Instance<cubes::DatabaseObject, cubes::ActiveObject>* > ( gameInstance[from] );
+					AuthorityInstance * instance = static_cast<AuthorityInstance*>( gameInstance[from] );
 
-					// hack: some authority tricks for exotic sync modes
-					const int objectCount = instance->GetActiveObjectCount();
-					for ( int i = 0; i < objectCount; ++i )
-					{
-						const cubes::ActiveObject & activeObject = instance->GetPriorityObject( 0, i );
-						if ( syncMode == SYNC_Naive )
-						{
-							instance->SetObjectAuthority( activeObject.id, from, true );
-						}
-						else if ( syncMode == SYNC_PlayerAuthority || syncMode == SYNC_TieBreakAuthority )
-						{
-							if ( activeObject.id >= MaxPlayers )
-								instance->ClearObjectAuthority( activeObject.id );
-						}
-					}
+					PrepareAuthoritySend( instance, from, syncMode );
 
 					// construct the packet: from -> to
 					for ( int to = 0; to < MaxPlayers; ++to )
@@ -362,32 +257,9 @@ public:
 						if ( to == from )
 							continue;
 							
-						TempPacket packet;
-					
-						packet.frame = instance->GetPlayerFrame( from );
-						instance->GetPlayerInput( from, packet.input );
-					
-						packet.objectCount = MaxObjectsInPacket;
-						if ( packet.objectCount > instance->GetActiveObjectCount() )
-							packet.objectCount = instance->GetActiveObjectCount();
-					
-						for ( int i = 0; i < packet.objectCount; ++i )
-						{
-							const cubes::ActiveObject & activeObject = instance->GetPriorityObject( to, i );
-							instance->ResetObjectPriority( to, i );
-							packet.object[i].id = activeObject.id;
-							if ( syncMode == SYNC_Naive )
-								packet.object[i].authority = from;
-							else
-								packet.object[i].authority = instance->GetObjectAuthority( packet.object[i].id );
-							packet.object[i].enabled = activeObject.enabled;
-							packet.object[i].position = activeObject.position;
-							packet.object[i].orientation = activeObject.orientation;
-							packet.object[i].linearVelocity = activeObject.linearVelocity;
-							packet.object[i].angularVelocity = activeObject.angularVelocity;
-						}
-
-						packetQueue.QueuePacket( from, to, (unsigned char*)&packet, sizeof(TempPacket) );
+						AuthorityPacket packet;
+						BuildAuthorityPacket( instance, from, to, syncMode, packet );
+						packetQueue.QueuePacket( from, to, (unsigned char*)&packet, packet.GetBytes() );
 					}
 				}
 				
@@ -395,93 +267,44 @@ public:
 			}
 		}
 
+		// record this frame's input. packets are recorded as they are delivered
+
+		if ( recorder.IsOpen() )
+		{
+			recorder.BeginFrame( deltaTime, syncMode, send ? RECORDER_Send : 0 );
+			for ( int i = 0; i < MaxPlayers; ++i )
+			{
+				AuthorityInstance * instance = static_cast<AuthorityInstance*>( gameInstance[i] );
+				for ( int j = 0; j < MaxPlayers; ++j )
+				{
+					game::Input input;
+					instance->GetPlayerInput( j, input );
+					recorder.RecordInput( i, j, input );
+				}
+			}
+		}
+
 		// receive packets
 		{
 			packetQueue.Update( deltaTime );
 
 			while ( engine::PacketQueue::Packet * pkt = packetQueue.PacketReadyToSend() )
 			{
-				TempPacket * packet = (TempPacket*) &pkt->data[0];
 				if ( syncMode != SYNC_Disabled )
 				{
-					int from = pkt->sourceNodeId;
-					int to = pkt->destinationNodeId;
-					
-					game::Instance<cubes::DatabaseObject, cubes::ActiveObject> * instance = 
-						static_cast< game::Instance<cubes::DatabaseObject, cubes::ActiveObject>* > ( gameInstance[to] );
-					
-					instance->SetPlayerInput( from, packet->input );
-					instance->SetPlayerFrame( from, packet->frame );
-					
-					if ( packet->objectCount > 0 )
-					{
-						for ( int i = 0; i < packet->objectCount; ++i )
-						{
-							cubes::ActiveObject activeObject;
-							instance->GetObjectState( packet->object[i].id, activeObject );
-							activeObject.enabled = packet->object[i].enabled;
-							activeObject.position = packet->object[i].position;
-							activeObject.orientation = packet->object[i].orientation;
-							activeObject.linearVelocity = packet->object[i].linearVelocity;
-							activeObject.angularVelocity = packet->object[i].angularVelocity;
-							
-							if ( syncMode == SYNC_Naive )
-							{
-								instance->SetObjectState( activeObject.id, activeObject );
-							}
-							else if ( syncMode == SYNC_PlayerAuthority )
-							{
-								if ( activeObject.id == (ObjectId) (from + 1) )
-								{
-									instance->SetObjectState( activeObject.id, activeObject );
-									instance->SetObjectAuthority( packet->object[i].id, from );
-								}
-								else if ( activeObject.id > MaxPlayers )
-									instance->SetObjectState( activeObject.id, activeObject );
-							}
-							else if ( syncMode == SYNC_TieBreakAuthority || syncMode == SYNC_InteractionAuthority )
-							{
-								if ( activeObject.id == (ObjectId) (from + 1) )
-								{
-									// player authority
-									instance->SetObjectState( activeObject.id, activeObject );
-									instance->SetObjectAuthority( packet->object[i].id, from, true );
-								}
-								else
-								{
-									int remoteAuthority = packet->object[i].authority;
-									int localAuthority = instance->GetObjectAuthority( activeObject.id );
-									if ( remoteAuthority == from )
-									{
-										if ( remoteAuthority <= localAuthority )
-										{
-											// interaction authority
-											instance->SetObjectState( activeObject.id, activeObject );
-											instance->SetObjectAuthority( activeObject.id, remoteAuthority );
-										}
-									}
-									else if ( remoteAuthority == MaxPlayers )
-									{
-										bool active = instance->IsObjectActive( activeObject.id );
-										if ( !active )
-										{
-											// object is not active on this machine
-											instance->SetObjectState( activeObject.id, activeObject );
-										}
-										else if ( active && localAuthority == MaxPlayers && from < to )
-										{
-											// object is active: tie break authority - lower player id wins
-											instance->SetObjectState( activeObject.id, activeObject );
-										}
-									}
-								}
-							}
-						}
-					}
+					const int from = pkt->sourceNodeId;
+					const int to = pkt->destinationNodeId;
+					const AuthorityPacket * packet = (const AuthorityPacket*) &pkt->data[0];
+					ApplyAuthorityPacket( static_cast<AuthorityInstance*>( gameInstance[to] ), from, to, *packet, syncMode );
+					if ( recorder.IsOpen() )
+						recorder.RecordPacket( from, to, &pkt->data[0], pkt->data.size() );
 				}
 				delete pkt;
 			}
 		}
+
+		if ( recorder.IsOpen() )
+			recorder.EndFrame();
 		
 		// grab the view packets & start the worker threads...
 		for ( int i = 0; i < MaxPlayers; ++i )
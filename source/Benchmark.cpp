@@ -0,0 +1,1204 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+// broadphase timings read the collide zone, so compile the profile scopes in. they record nothing without a profiler
+
+#define PROFILE
+
+#include "Config.h"
+#include "Mathematics.h"
+#include "Platform.h"
+#include "Simulation.h"
+#include "Game.h"
+#include "Cubes.h"
+#include "Network.h"
+#include "Authority.h"
+
+using namespace engine;
+
+const float DeltaTime = 1.0f / 60.0f;
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Shared benchmark scene.
+	Drops a number of small cubes into loose piles on the ground plane,
+	roughly matching the density inside the activation circle of the demos.
+	Objects are seeded so every run (and every backend) sees identical work.
+*/
+
+void CreateBenchmarkScene( Simulation & simulation, int cubes, float scale = 0.4f )
+{
+	simulation.AddPlane( math::Vector(0,0,1), 0 );
+
+	math::init_random( 21 );
+
+	const float size = math::sqrt( (float) cubes ) * scale * 1.5f;
+
+	for ( int i = 0; i < cubes; ++i )
+	{
+		SimulationObjectState object;
+		object.scale = scale;
+		object.position = math::Vector( math::random_float( -size * 0.5f, size * 0.5f ),
+										math::random_float( -size * 0.5f, size * 0.5f ),
+										math::random_float( scale * 0.5f, scale * 4.0f ) );
+		object.linearVelocity = math::Vector( math::random_float( -1.0f, +1.0f ), math::random_float( -1.0f, +1.0f ), 0.0f );
+		simulation.AddObject( object );
+	}
+}
+
+// ----------------------------------------------------------------------------------------
+
+const char * GetBroadphaseName( BroadphaseType broadphase )
+{
+	switch ( broadphase )
+	{
+		case BROADPHASE_Hash:				return "hash";
+		case BROADPHASE_SweepAndPrune:		return "sap";
+		case BROADPHASE_Grid:				return "grid";
+	}
+	return "???";
+}
+
+void BenchmarkBroadphase()
+{
+	printf( "-----------------------------------------------------\n" );
+	printf( "broadphase (ms per step / collide only, %d warmup + %d timed steps)\n", 60, 120 );
+	printf( "-----------------------------------------------------\n" );
+
+	const BroadphaseType broadphases[] = { BROADPHASE_Hash, BROADPHASE_SweepAndPrune, BROADPHASE_Grid };
+	const int numBroadphases = sizeof( broadphases ) / sizeof( broadphases[0] );
+
+	for ( int cubes = 256; cubes <= 4096; cubes *= 2 )
+	{
+		printf( "%5d cubes:", cubes );
+
+		for ( int i = 0; i < numBroadphases; ++i )
+		{
+			SimulationConfig config;
+			config.Broadphase = broadphases[i];
+
+			Simulation simulation;
+			simulation.Initialize( config );
+
+			CreateBenchmarkScene( simulation, cubes );
+
+			for ( int j = 0; j < 60; ++j )
+				simulation.Update( DeltaTime );
+
+			profile::Profiler profiler;
+			simulation.SetProfiler( &profiler );
+
+			platform::Timer timer;
+
+			for ( int j = 0; j < 120; ++j )
+				simulation.Update( DeltaTime );
+
+			const float time = timer.time();
+			const float collideTime = (float) profiler.GetHistogram( profile::ZONE_Collide ).GetTotal();
+
+			simulation.SetProfiler( NULL );
+
+			printf( "  %s %7.3f / %7.3f", GetBroadphaseName( broadphases[i] ), time / 120 * 1000.0f, collideTime / 120 * 1000.0f );
+
+			simulation.Reset();
+		}
+
+		printf( "\n" );
+	}
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Cube narrowphase validation.
+	Records cube states from a settling scene every few steps, rebuilds each
+	recorded frame as standalone geoms, then runs every overlapping pair through
+	both dCollide and the cube collider. Reports disagreements, depth and normal
+	error, and the narrowphase time per recorded step for each collider.
+*/
+
+struct RecordedFrame
+{
+	std::vector<SimulationObjectState> objects;
+};
+
+void RecordScene( int cubes, int frames, int interval, std::vector<RecordedFrame> & recording )
+{
+	Simulation simulation;
+	simulation.Initialize();
+
+	CreateBenchmarkScene( simulation, cubes );
+
+	for ( int i = 0; i < frames; ++i )
+	{
+		simulation.Update( DeltaTime );
+
+		if ( ( i % interval ) != 0 )
+			continue;
+
+		recording.resize( recording.size() + 1 );
+		RecordedFrame & frame = recording.back();
+		frame.objects.resize( cubes );
+		for ( int j = 0; j < cubes; ++j )
+			simulation.GetObjectState( j, frame.objects[j] );
+	}
+
+	simulation.Reset();
+}
+
+struct ColliderResult
+{
+	int contacts;
+	float maxDepth;
+	math::Vector normal;
+};
+
+static ColliderResult SummarizeContacts( const dContactGeom * contacts, int count )
+{
+	ColliderResult result;
+	result.contacts = count;
+	result.maxDepth = 0.0f;
+	result.normal = math::Vector(0,0,0);
+	for ( int i = 0; i < count; ++i )
+	{
+		result.maxDepth = math::maximum( result.maxDepth, contacts[i].depth );
+		result.normal += math::Vector( contacts[i].normal[0], contacts[i].normal[1], contacts[i].normal[2] );
+	}
+	result.normal.normalize();
+	return result;
+}
+
+void ValidateCubeCollider()
+{
+	printf( "-----------------------------------------------------\n" );
+	printf( "cube narrowphase vs. dCollide (recorded scenes)\n" );
+	printf( "-----------------------------------------------------\n" );
+
+	const float scale = 0.4f;
+	const int MaxPairContacts = 8;
+
+	for ( int cubes = 256; cubes <= 1024; cubes *= 2 )
+	{
+		std::vector<RecordedFrame> recording;
+		RecordScene( cubes, 240, 20, recording );
+
+		OdeSimulation simulation;							// note: keeps ode initialized while we own raw geoms
+
+		std::vector<dGeomID> geoms( cubes );
+		for ( int i = 0; i < cubes; ++i )
+			geoms[i] = dCreateBox( 0, scale, scale, scale );
+		dGeomID plane = dCreatePlane( 0, 0, 0, 1, 0 );
+
+		int pairs = 0;
+		int mismatches = 0;
+		int odeContacts = 0;
+		int cubeContacts = 0;
+		float depthError = 0.0f;
+		float normalError = 0.0f;
+		int compared = 0;
+		double odeTime = 0.0;
+		double cubeTime = 0.0;
+
+		dContactGeom odeOutput[MaxPairContacts];
+		dContactGeom cubeOutput[MaxPairContacts];
+
+		std::vector<dGeomID> pairA, pairB;
+
+		for ( int f = 0; f < (int) recording.size(); ++f )
+		{
+			const RecordedFrame & frame = recording[f];
+
+			for ( int i = 0; i < cubes; ++i )
+			{
+				const SimulationObjectState & object = frame.objects[i];
+				dQuaternion quaternion = { object.orientation.w, object.orientation.x, object.orientation.y, object.orientation.z };
+				dGeomSetPosition( geoms[i], object.position.x, object.position.y, object.position.z );
+				dGeomSetQuaternion( geoms[i], quaternion );
+			}
+
+			// brute force bounding sphere pairs, plus every cube against the plane
+
+			pairA.clear();
+			pairB.clear();
+			const float radiusSquared = scale * scale * 3.0f;
+			for ( int i = 0; i < cubes; ++i )
+			{
+				for ( int j = i + 1; j < cubes; ++j )
+				{
+					if ( ( frame.objects[i].position - frame.objects[j].position ).lengthSquared() < radiusSquared )
+					{
+						pairA.push_back( geoms[i] );
+						pairB.push_back( geoms[j] );
+					}
+				}
+				pairA.push_back( geoms[i] );
+				pairB.push_back( plane );
+			}
+
+			const int numPairs = pairA.size();
+			pairs += numPairs;
+
+			// time each collider over the whole frame
+
+			platform::Timer timer;
+			for ( int i = 0; i < numPairs; ++i )
+				odeContacts += dCollide( pairA[i], pairB[i], MaxPairContacts, odeOutput, sizeof( dContactGeom ) );
+			odeTime += timer.time();
+
+			timer.reset();
+			for ( int i = 0; i < numPairs; ++i )
+				cubeContacts += CollideCubes( pairA[i], pairB[i], MaxPairContacts, cubeOutput, sizeof( dContactGeom ) );
+			cubeTime += timer.time();
+
+			// compare results pair by pair
+
+			for ( int i = 0; i < numPairs; ++i )
+			{
+				const ColliderResult ode = SummarizeContacts( odeOutput, dCollide( pairA[i], pairB[i], MaxPairContacts, odeOutput, sizeof( dContactGeom ) ) );
+				const ColliderResult cube = SummarizeContacts( cubeOutput, CollideCubes( pairA[i], pairB[i], MaxPairContacts, cubeOutput, sizeof( dContactGeom ) ) );
+
+				// note: grazing contacts may legitimately differ, so only count clear disagreements
+
+				if ( ( ode.contacts == 0 ) != ( cube.contacts == 0 ) )
+				{
+					if ( math::maximum( ode.maxDepth, cube.maxDepth ) > 0.005f )
+						mismatches++;
+					continue;
+				}
+
+				if ( ode.contacts == 0 )
+					continue;
+
+				depthError += math::abs( ode.maxDepth - cube.maxDepth );
+				normalError += 1.0f - ode.normal.dot( cube.normal );
+				compared++;
+			}
+		}
+
+		for ( int i = 0; i < cubes; ++i )
+			dGeomDestroy( geoms[i] );
+		dGeomDestroy( plane );
+
+		const int steps = recording.size();
+
+		printf( "%5d cubes: %d pairs/step, %d colliding, %d mismatches\n", cubes, pairs / steps, compared / steps, mismatches );
+		printf( "             dCollide %6.3f ms/step %6.1f contacts/step\n", odeTime / steps * 1000.0, odeContacts / (float) steps );
+		printf( "             cubes    %6.3f ms/step %6.1f contacts/step\n", cubeTime / steps * 1000.0, cubeContacts / (float) steps );
+		printf( "             avg depth error %.5f, avg normal error %.5f\n", compared ? depthError / compared : 0.0f, compared ? normalError / compared : 0.0f );
+	}
+}
+
+void BenchmarkCubeCollider()
+{
+	printf( "-----------------------------------------------------\n" );
+	printf( "simulation step with cube narrowphase (ms per step)\n" );
+	printf( "-----------------------------------------------------\n" );
+
+	for ( int cubes = 256; cubes <= 4096; cubes *= 2 )
+	{
+		printf( "%5d cubes:", cubes );
+
+		for ( int i = 0; i < 2; ++i )
+		{
+			SimulationConfig config;
+			config.CubeCollider = i == 1;
+
+			Simulation simulation;
+			simulation.Initialize( config );
+
+			CreateBenchmarkScene( simulation, cubes );
+
+			for ( int j = 0; j < 60; ++j )
+				simulation.Update( DeltaTime );
+
+			int contacts = 0;
+
+			platform::Timer timer;
+
+			for ( int j = 0; j < 120; ++j )
+			{
+				simulation.Update( DeltaTime );
+				contacts += simulation.GetStats().contacts;
+			}
+
+			const float time = timer.time();
+
+			printf( "  %s %7.3f (%5d contacts)", config.CubeCollider ? "cubes" : "ode", time / 120 * 1000.0f, contacts / 120 );
+
+			simulation.Reset();
+		}
+
+		printf( "\n" );
+	}
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Island parallel stepping.
+	Steps the same scene split over a fixed number of island worlds with an
+	increasing number of threads. The checksum over final object positions
+	should match for every thread count. Uses quickstep like the game, which
+	only steps worlds in parallel when ode is built without its constraint
+	shuffle (see the makefile), so the threads actually stepping are shown.
+*/
+
+int GetNumCores()
+{
+	#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+	const int cores = (int) sysconf( _SC_NPROCESSORS_ONLN );
+	return cores > 0 ? cores : 1;
+	#else
+	return 1;
+	#endif
+}
+
+uint32_t ChecksumSimulation( Simulation & simulation, int cubes )
+{
+	uint32_t checksum = 0;
+	for ( int i = 0; i < cubes; ++i )
+	{
+		SimulationObjectState state;
+		simulation.GetObjectState( i, state );
+		const float values[] = { state.position.x, state.position.y, state.position.z };
+		for ( int j = 0; j < 3; ++j )
+		{
+			uint32_t bits;
+			memcpy( &bits, &values[j], 4 );
+			checksum = ( checksum * 31 ) ^ bits;
+		}
+	}
+	return checksum;
+}
+
+void BenchmarkIslands()
+{
+	const int IslandWorlds = 8;
+	const int cores = GetNumCores();
+
+	printf( "-----------------------------------------------------\n" );
+	printf( "island worlds (%d worlds, %d cores, steps per second)\n", IslandWorlds, cores );
+	printf( "-----------------------------------------------------\n" );
+
+	for ( int cubes = 1024; cubes <= 4096; cubes *= 2 )
+	{
+		printf( "%5d cubes:\n", cubes );
+
+		for ( int threads = 1; threads <= cores; threads *= 2 )
+		{
+			SimulationConfig config;
+			config.IslandWorlds = IslandWorlds;
+			config.IslandThreads = threads - 1;
+
+			Simulation simulation;
+			simulation.Initialize( config );
+
+			CreateBenchmarkScene( simulation, cubes );
+
+			for ( int j = 0; j < 60; ++j )
+				simulation.Update( DeltaTime );
+
+			platform::Timer timer;
+
+			for ( int j = 0; j < 120; ++j )
+				simulation.Update( DeltaTime );
+
+			const float time = timer.time();
+
+			printf( "    %2d threads: %8.1f steps/sec, %d stepping (checksum %08x)\n", threads, 120 / time, simulation.GetNumThreads(), ChecksumSimulation( simulation, cubes ) );
+
+			simulation.Reset();
+		}
+	}
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Island sleep.
+	Lets a large scene settle and reports step time against the number of
+	awake objects. Once piles go to sleep the step cost should follow the
+	awake count, not the total object count, with either broadphase.
+*/
+
+void BenchmarkSleep( BroadphaseType broadphase )
+{
+	const int cubes = 4096;
+
+	printf( "-----------------------------------------------------\n" );
+	printf( "island sleep (%d cubes, %s broadphase, ms per step over 60 steps)\n", cubes, GetBroadphaseName( broadphase ) );
+	printf( "-----------------------------------------------------\n" );
+
+	SimulationConfig config;
+	config.Broadphase = broadphase;
+
+	Simulation simulation;
+	simulation.Initialize( config );
+
+	CreateBenchmarkScene( simulation, cubes );
+
+	for ( int i = 0; i < 10; ++i )
+	{
+		int awake = 0;
+
+		platform::Timer timer;
+
+		for ( int j = 0; j < 60; ++j )
+		{
+			simulation.Update( DeltaTime );
+			awake += simulation.GetNumAwakeObjects();
+		}
+
+		const float time = timer.time();
+
+		printf( "  second %2d: %5d awake %7.3f ms\n", i + 1, awake / 60, time / 60 * 1000.0f );
+	}
+
+	simulation.Reset();
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Batched state exchange.
+	Compares reading and writing all object states one id at a time against
+	the batched structure of arrays calls.
+*/
+
+void BenchmarkBatchedState()
+{
+	printf( "-----------------------------------------------------\n" );
+	printf( "state exchange (us per full get + set pass)\n" );
+	printf( "-----------------------------------------------------\n" );
+
+	const int Passes = 100;
+
+	for ( int cubes = 1024; cubes <= 16384; cubes *= 4 )
+	{
+		Simulation simulation;
+		simulation.Initialize();
+
+		CreateBenchmarkScene( simulation, cubes );
+
+		// note: shuffled ids, callers rarely walk objects in creation order
+
+		std::vector<int> ids( cubes );
+		for ( int i = 0; i < cubes; ++i )
+			ids[i] = i;
+		for ( int i = cubes - 1; i > 0; --i )
+		{
+			const int j = rand() % ( i + 1 );
+			const int tmp = ids[i];
+			ids[i] = ids[j];
+			ids[j] = tmp;
+		}
+
+		std::vector<SimulationObjectState> single( cubes );
+
+		platform::Timer timer;
+
+		for ( int pass = 0; pass < Passes; ++pass )
+		{
+			for ( int i = 0; i < cubes; ++i )
+				simulation.GetObjectState( ids[i], single[i] );
+			for ( int i = 0; i < cubes; ++i )
+				simulation.SetObjectState( ids[i], single[i], true );
+		}
+
+		const float singleTime = timer.time();
+
+		SimulationObjectStates states;
+
+		timer.reset();
+
+		for ( int pass = 0; pass < Passes; ++pass )
+		{
+			simulation.GetObjectStates( &ids[0], cubes, states );
+			simulation.SetObjectStates( &ids[0], cubes, states );
+		}
+
+		const float batchedTime = timer.time();
+
+		printf( "%6d cubes: single %8.1f batched %8.1f\n", cubes, singleTime / Passes * 1000000.0f, batchedTime / Passes * 1000000.0f );
+
+		simulation.Reset();
+	}
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Backend comparison.
+	Steps the same scene with the ode backend and the cube backend, with
+	sleep disabled so every body is simulated each step, and reports the time
+	per step along with the average height of the cubes as a sanity check.
+*/
+
+const char * GetBackendName( SimulationBackendType backend )
+{
+	switch ( backend )
+	{
+		case BACKEND_ODE:			return "ode";
+		case BACKEND_Cubes:			return "cubes";
+	}
+	return "???";
+}
+
+void BenchmarkBackends()
+{
+	printf( "-----------------------------------------------------\n" );
+	printf( "backends (ms per step, %d warmup + %d timed steps)\n", 60, 120 );
+	printf( "-----------------------------------------------------\n" );
+
+	const SimulationBackendType backends[] = { BACKEND_ODE, BACKEND_Cubes };
+	const int numBackends = sizeof( backends ) / sizeof( backends[0] );
+
+	for ( int cubes = 256; cubes <= 4096; cubes *= 2 )
+	{
+		printf( "%5d cubes:", cubes );
+
+		for ( int i = 0; i < numBackends; ++i )
+		{
+			SimulationConfig config;
+			config.Backend = backends[i];
+			config.Broadphase = BROADPHASE_Grid;
+			config.CubeCollider = true;
+			config.RestTime = 1000000.0f;
+
+			Simulation simulation;
+			simulation.Initialize( config );
+
+			CreateBenchmarkScene( simulation, cubes );
+
+			for ( int j = 0; j < 60; ++j )
+				simulation.Update( DeltaTime );
+
+			platform::Timer timer;
+
+			for ( int j = 0; j < 120; ++j )
+				simulation.Update( DeltaTime );
+
+			const float time = timer.time();
+
+			float height = 0.0f;
+			for ( int j = 0; j < cubes; ++j )
+			{
+				SimulationObjectState state;
+				simulation.GetObjectState( j, state );
+				height += state.position.z;
+			}
+
+			printf( "  %s %7.3f (z %.3f)", GetBackendName( backends[i] ), time / 120 * 1000.0f, height / cubes );
+
+			simulation.Reset();
+		}
+
+		printf( "\n" );
+	}
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	World startup.
+	Builds a one million object world the way the demos do, through AddObject,
+	then saves it as a snapshot and loads the snapshot into a fresh instance.
+*/
+
+typedef game::Instance<cubes::DatabaseObject, cubes::ActiveObject> SnapshotInstance;
+
+SnapshotInstance * CreateSnapshotInstance( int steps )
+{
+	game::Config config;
+	config.maxObjects = steps * steps + MaxPlayers + 1;
+	config.cellSize = 4.0f;
+	config.cellWidth = steps / config.cellSize + 2;
+	config.cellHeight = config.cellWidth;
+	config.simConfig.Backend = BACKEND_Cubes;
+	return new SnapshotInstance( config );
+}
+
+void BenchmarkSnapshot()
+{
+	printf( "-----------------------------------------------------\n" );
+	printf( "world startup (seconds)\n" );
+	printf( "-----------------------------------------------------\n" );
+
+	const int steps = 1024;
+	const int border = 10;
+	const int count = steps - border * 2;
+	const float origin = -steps / 2 + border;
+
+	math::init_random( 21 );
+
+	std::vector<cubes::DatabaseObject> objects( count * count );
+	std::vector<float> objectX( count * count ), objectY( count * count );
+	for ( int y = 0; y < count; ++y )
+	{
+		for ( int x = 0; x < count; ++x )
+		{
+			cubes::DatabaseObject & object = objects[x+y*count];
+			object.position = math::Vector( x + origin, y + origin, math::random_float( 0.5f, 1.0f ) );
+			object.orientation = math::Quaternion(1,0,0,0);
+			object.scale = math::random_float( 0.2f, 0.8f );
+			object.linearVelocity = math::Vector(0,0,0);
+			object.angularVelocity = math::Vector(0,0,0);
+			object.enabled = 1;
+			object.activated = 0;
+			objectX[x+y*count] = object.position.x;
+			objectY[x+y*count] = object.position.y;
+		}
+	}
+
+	platform::Timer timer;
+
+	SnapshotInstance * built = CreateSnapshotInstance( steps );
+	built->InitializeBegin();
+	built->AddPlane( math::Vector(0,0,1), 0 );
+	for ( int i = 0; i < count * count; ++i )
+		built->AddObject( objects[i], objectX[i], objectY[i] );
+	built->InitializeEnd();
+
+	const double buildTime = timer.delta();
+
+	// bulk construction, on the calling thread and across four threads
+
+	double bulkTime[2];
+	for ( int i = 0; i < 2; ++i )
+	{
+		SnapshotInstance * bulk = CreateSnapshotInstance( steps );
+		timer.delta();
+		bulk->InitializeBegin();
+		bulk->AddPlane( math::Vector(0,0,1), 0 );
+		bulk->AddObjects( &objects[0], &objectX[0], &objectY[0], count * count, i == 0 ? 0 : 3 );
+		bulk->InitializeEnd();
+		bulkTime[i] = timer.delta();
+		delete bulk;
+	}
+
+	timer.delta();
+
+	std::vector<uint8_t> buffer;
+	built->SaveSnapshot( buffer );
+
+	const double saveTime = timer.delta();
+
+	SnapshotInstance * loaded = CreateSnapshotInstance( steps );
+
+	timer.delta();
+
+	const bool result = loaded->LoadSnapshot( &buffer[0], buffer.size() );
+
+	const double loadTime = timer.delta();
+
+	int mismatches = 0;
+	for ( int i = 1; i <= count * count; i += 997 )
+	{
+		cubes::ActiveObject a, b;
+		built->GetObjectState( i, a );
+		loaded->GetObjectState( i, b );
+		if ( a.position.x != b.position.x || a.position.y != b.position.y || a.position.z != b.position.z || a.scale != b.scale )
+			mismatches++;
+	}
+
+	printf( "%d objects, %.1fMB snapshot\n", count * count, buffer.size() / ( 1000.0f * 1000.0f ) );
+	printf( "  build %.3f, bulk %.3f, bulk x4 %.3f, save %.3f, load %.3f%s\n", buildTime, bulkTime[0], bulkTime[1], saveTime, loadTime, result && mismatches == 0 ? "" : " (load failed!)" );
+
+	delete loaded;
+	delete built;
+}
+
+// ----------------------------------------------------------------------------------------
+
+// loopback throughput of the reliable connection: plain arrays, packet buffers one at a time, and batches of packet buffers
+
+enum PacketMode
+{
+	PACKETS_Arrays,
+	PACKETS_Buffers,
+	PACKETS_Batched
+};
+
+struct PacketResult
+{
+	double packetsPerSecond;
+	double syscallsPer10k;
+	double cpuPer10k;					// milliseconds
+};
+
+PacketResult MeasurePackets( PacketMode mode, int packets, int payload )
+{
+	const int ServerPort = 30010;
+	const int ClientPort = 30011;
+	const int ProtocolId = 0x11112222;
+	const int Burst = 32;
+
+	PacketResult result;
+	memset( &result, 0, sizeof( result ) );
+
+	net::ReliableConnection client( ProtocolId, 10.0f );
+	net::ReliableConnection server( ProtocolId, 10.0f );
+	if ( !client.Start( ClientPort ) || !server.Start( ServerPort ) )
+		return result;
+	client.Connect( net::Address( 127,0,0,1, ServerPort ) );
+	server.Listen();
+
+	unsigned char data[1024];
+	memset( data, 0xAB, sizeof( data ) );
+
+	std::vector<net::PacketBuffer> buffers( Burst );
+
+	platform::Timer timer;
+	const clock_t cpuStart = clock();
+
+	int sent = 0;
+	int received = 0;
+	while ( sent < packets )
+	{
+		if ( mode == PACKETS_Batched )
+		{
+			for ( int i = 0; i < Burst; ++i )
+			{
+				buffers[i].Reset();
+				memcpy( buffers[i].Append( payload ), data, payload );
+			}
+			client.SendPackets( &buffers[0], Burst );
+			sent += Burst;
+
+			while ( true )
+			{
+				const int count = server.ReceivePackets( &buffers[0], Burst );
+				for ( int i = 0; i < count; ++i )
+					if ( buffers[i].GetSize() > 0 )
+						received++;
+				if ( count < Burst )
+					break;
+			}
+		}
+		else
+		{
+			for ( int i = 0; i < Burst; ++i, ++sent )
+			{
+				if ( mode == PACKETS_Buffers )
+				{
+					buffers[0].Reset();
+					memcpy( buffers[0].Append( payload ), data, payload );
+					client.SendPacket( buffers[0] );
+				}
+				else
+					client.SendPacket( data, payload );
+			}
+
+			while ( true )
+			{
+				const int bytes = mode == PACKETS_Buffers ? server.ReceivePacket( buffers[0] ) : server.ReceivePacket( data, sizeof( data ) );
+				if ( bytes == 0 )
+					break;
+				received++;
+			}
+		}
+
+		// acks go back once per burst, which also keeps the client connected
+
+		server.SendPacket( data, 16 );
+		while ( client.ReceivePacket( data, sizeof( data ) ) )
+			;
+
+		client.Update( 1.0f / 60.0f );
+		server.Update( 1.0f / 60.0f );
+	}
+
+	const double time = timer.delta();
+	const double cpu = ( clock() - cpuStart ) / (double) CLOCKS_PER_SEC;
+
+	const net::SocketStats & clientStats = client.GetSocketStats();
+	const net::SocketStats & serverStats = server.GetSocketStats();
+	const double syscalls = clientStats.sendCalls + clientStats.receiveCalls + serverStats.sendCalls + serverStats.receiveCalls;
+
+	if ( received > 0 && time > 0.0 )
+	{
+		result.packetsPerSecond = received / time;
+		result.syscallsPer10k = syscalls / received * 10000.0;
+		result.cpuPer10k = cpu / received * 10000.0 * 1000.0;
+	}
+
+	client.Stop();
+	server.Stop();
+
+	return result;
+}
+
+void BenchmarkPackets()
+{
+	printf( "-----------------------------------------------------\n" );
+	printf( "loopback packets (per second, syscalls and cpu ms per 10k)\n" );
+	printf( "-----------------------------------------------------\n" );
+
+	if ( !net::InitializeSockets() )
+		return;
+
+	const int packets = 200000;
+	const int payloads[] = { 64, 256, 1024 };
+	const char * modeNames[] = { "arrays", "buffers", "batched" };
+
+	for ( int i = 0; i < (int) ( sizeof( payloads ) / sizeof( payloads[0] ) ); ++i )
+	{
+		for ( int mode = PACKETS_Arrays; mode <= PACKETS_Batched; ++mode )
+		{
+			const PacketResult result = MeasurePackets( (PacketMode) mode, packets, payloads[i] );
+			printf( "%4d bytes %-8s %8.0f packets/sec, %6.0f syscalls, %6.2fms cpu\n", payloads[i], modeNames[mode], result.packetsPerSecond, result.syscallsPer10k, result.cpuPer10k );
+		}
+	}
+
+	net::ShutdownSockets();
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Server endpoint.
+	Simulated clients on loopback each send the server an input every tick
+	and the server answers all of them from its one socket, receiving and
+	sending in batches. Reports the server's time and syscalls per tick.
+*/
+
+void BenchmarkServerEndpoint()
+{
+	const int ServerPort = 30020;
+	const int ClientPort = 30021;
+	const int ProtocolId = 0x11112222;
+	const int Ticks = 600;
+	const int InputSize = 64;
+	const int ReplySize = 512;
+
+	printf( "-----------------------------------------------------\n" );
+	printf( "server endpoint (%d ticks, %d byte inputs, %d byte replies)\n", Ticks, InputSize, ReplySize );
+	printf( "-----------------------------------------------------\n" );
+
+	if ( !net::InitializeSockets() )
+		return;
+
+	unsigned char data[1024];
+	memset( data, 0xAB, sizeof( data ) );
+
+	for ( int numClients = 16; numClients <= 256; numClients *= 4 )
+	{
+		net::ServerEndpoint server( ProtocolId, 10.0f, numClients );
+		if ( !server.Start( ServerPort ) )
+			break;
+
+		std::vector<net::ReliableConnection*> clients( numClients );
+		for ( int i = 0; i < numClients; ++i )
+		{
+			clients[i] = new net::ReliableConnection( ProtocolId, 10.0f );
+			clients[i]->Start( ClientPort + i );
+			clients[i]->Connect( net::Address( 127,0,0,1, ServerPort ) );
+		}
+
+		std::vector<net::PacketBuffer> receiveBuffers( net::Socket::MaxBatchSize );
+		std::vector<int> receiveIndex( net::Socket::MaxBatchSize );
+		std::vector<net::PacketBuffer> sendBuffers( numClients );
+		std::vector<int> sendIndex( numClients );
+
+		double serverTime = 0.0;
+		int inputs = 0;
+		unsigned int syscalls = 0;
+
+		// the first ticks connect everybody and are not timed
+
+		const int Warmup = 10;
+
+		for ( int tick = 0; tick < Warmup + Ticks; ++tick )
+		{
+			if ( tick == Warmup )
+			{
+				serverTime = 0.0;
+				inputs = 0;
+				syscalls = server.GetSocketStats().sendCalls + server.GetSocketStats().receiveCalls;
+			}
+
+			for ( int i = 0; i < numClients; ++i )
+				clients[i]->SendPacket( data, InputSize );
+
+			platform::Timer timer;
+
+			while ( true )
+			{
+				const int count = server.ReceivePackets( &receiveBuffers[0], &receiveIndex[0], net::Socket::MaxBatchSize );
+				for ( int i = 0; i < count; ++i )
+					if ( receiveBuffers[i].GetSize() > 0 )
+						inputs++;
+				if ( count < net::Socket::MaxBatchSize )
+					break;
+			}
+
+			int replies = 0;
+			for ( int i = 0; i < numClients; ++i )
+			{
+				if ( !server.IsClientConnected( i ) )
+					continue;
+				sendBuffers[replies].Reset();
+				memcpy( sendBuffers[replies].Append( ReplySize ), data, ReplySize );
+				sendIndex[replies] = i;
+				replies++;
+			}
+			server.SendPackets( &sendBuffers[0], &sendIndex[0], replies );
+
+			server.Update( DeltaTime );
+
+			serverTime += timer.time();
+
+			for ( int i = 0; i < numClients; ++i )
+			{
+				while ( clients[i]->ReceivePacket( data, sizeof( data ) ) )
+					;
+				clients[i]->Update( DeltaTime );
+			}
+		}
+
+		syscalls = server.GetSocketStats().sendCalls + server.GetSocketStats().receiveCalls - syscalls;
+
+		int connected = 0;
+		unsigned int lost = 0;
+		for ( int i = 0; i < numClients; ++i )
+		{
+			if ( clients[i]->IsConnected() )
+				connected++;
+			lost += clients[i]->GetReliabilitySystem().GetLostPackets();
+		}
+
+		printf( "%5d clients: %8.1f us/tick, %6.1f syscalls/tick, %d/%d inputs received, %d connected, %u lost\n",
+			numClients, serverTime / Ticks * 1000000.0, syscalls / (float) Ticks, inputs, numClients * Ticks, connected, lost );
+
+		for ( int i = 0; i < numClients; ++i )
+			delete clients[i];
+	}
+
+	net::ShutdownSockets();
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Bitpacker.
+	Writes and reads 1k packets full of the field widths the unit tests
+	use, and reports throughput in MB/s of packed data. Full snapshot
+	packets are the bit packed row of the range coder benchmark.
+*/
+
+void BenchmarkBitPacker()
+{
+	const int PacketSize = 1024;
+	const int Packets = 100000;
+
+	printf( "-----------------------------------------------------\n" );
+	printf( "bitpacker (%d packets of %d bytes)\n", Packets, PacketSize );
+	printf( "-----------------------------------------------------\n" );
+
+	const int aligned[] = { 32, 16, 8 };
+	const int odd[] = { 9, 1, 11, 6, 5 };
+	const int mixed[] = { 7, 1, 14, 16, 20, 6, 6, 7 };
+
+	struct Pattern
+	{
+		const char * name;
+		const int * bits;
+		int count;
+	};
+
+	const Pattern patterns[] = 
+	{
+		{ "32/16/8", aligned, 3 },
+		{ "odd", odd, 5 },
+		{ "mixed", mixed, 8 }
+	};
+
+	std::vector<unsigned char> buffer( PacketSize );
+
+	for ( int i = 0; i < (int) ( sizeof( patterns ) / sizeof( patterns[0] ) ); ++i )
+	{
+		const Pattern & pattern = patterns[i];
+
+		platform::Timer timer;
+
+		unsigned int value = 0x12345678;
+		for ( int j = 0; j < Packets; ++j )
+		{
+			net::BitPacker writer( net::BitPacker::Write, &buffer[0], PacketSize );
+			int k = 0;
+			while ( writer.BitsRemaining() >= 32 )
+			{
+				writer.WriteBits( value, pattern.bits[k] );
+				value = value * 1664525 + 1013904223;
+				if ( ++k == pattern.count )
+					k = 0;
+			}
+		}
+
+		const double writeTime = timer.delta();
+
+		unsigned int checksum = 0;
+		for ( int j = 0; j < Packets; ++j )
+		{
+			net::BitPacker reader( net::BitPacker::Read, &buffer[0], PacketSize );
+			int k = 0;
+			while ( reader.BitsRemaining() >= 32 )
+			{
+				unsigned int result;
+				reader.ReadBits( result, pattern.bits[k] );
+				checksum += result;
+				if ( ++k == pattern.count )
+					k = 0;
+			}
+		}
+
+		const double readTime = timer.delta();
+
+		const double megabytes = (double) Packets * PacketSize / ( 1000.0 * 1000.0 );
+
+		printf( "%-8s write %7.1f MB/s, read %7.1f MB/s (%08x)\n", pattern.name, megabytes / writeTime, megabytes / readTime, checksum );
+	}
+}
+
+// ----------------------------------------------------------------------------------------
+
+/*
+	Range coder.
+	Records the authority packets a server sends a client while the
+	server's cube rolls through the world, then serializes every object in
+	them bit packed and range coded. Reports bits per object, with the raw
+	struct for scale, and encode and decode speed in MB/s of object data.
+*/
+
+void BenchmarkRangeCoder()
+{
+	const int Ticks = 600;
+	const int ObjectsPerPacket = 16;
+	const int MaxPacketSize = 1024;
+	const int Passes = 20;
+
+	printf( "-----------------------------------------------------\n" );
+	printf( "range coder (%d ticks of authority packets, %d objects each)\n", Ticks, ObjectsPerPacket );
+	printf( "-----------------------------------------------------\n" );
+
+	game::AuthorityInstance * instance = game::CreateAuthorityInstance( 0 );
+
+	std::vector<game::AuthorityObject> objects;
+	game::AuthorityPacket packet;
+	for ( int tick = 0; tick < Ticks; ++tick )
+	{
+		game::Input input;
+		input.up = 1.0f;
+		input.left = ( tick / 120 ) % 2 ? 1.0f : 0.0f;
+		input.push = tick % 60 < 30 ? 1.0f : 0.0f;
+		instance->SetPlayerInput( 0, input );
+		instance->Update( DeltaTime );
+		game::BuildAuthorityPacket( instance, 0, 1, game::SYNC_InteractionAuthority, packet, ObjectsPerPacket );
+		if ( packet.objectCount == ObjectsPerPacket )
+			objects.insert( objects.end(), packet.object, packet.object + ObjectsPerPacket );
+	}
+
+	delete instance;
+
+	const int packets = objects.size() / ObjectsPerPacket;
+	if ( packets == 0 )
+		return;
+
+	std::vector<unsigned char> data( packets * MaxPacketSize );
+	std::vector<int> dataBytes( packets );
+
+	const double objectBytes = (double) objects.size() * sizeof( game::AuthorityObject ) * Passes;
+
+	printf( "%d packets, raw %d bits/object\n", packets, (int) sizeof( game::AuthorityObject ) * 8 );
+
+	const char * backendNames[] = { "bit packed", "range coded" };
+
+	for ( int backend = net::Stream::BitPacked; backend <= net::Stream::RangeCoded; ++backend )
+	{
+		platform::Timer timer;
+		double encodeTime = 0.0;
+		double decodeTime = 0.0;
+		int bytes = 0;
+		int mismatches = 0;
+		bool result = true;
+
+		for ( int pass = 0; pass < Passes; ++pass )
+		{
+			timer.delta();
+
+			bytes = 0;
+			for ( int i = 0; i < packets; ++i )
+			{
+				net::Stream stream( net::Stream::Write, (net::Stream::Backend) backend, &data[i*MaxPacketSize], MaxPacketSize );
+				game::AuthorityModels models;
+				for ( int j = 0; j < ObjectsPerPacket; ++j )
+				{
+					game::AuthorityObject object = objects[i*ObjectsPerPacket+j];
+					result &= game::SerializeAuthorityObject( stream, object, models );
+				}
+				result &= stream.Finish();
+				dataBytes[i] = stream.GetDataBytes();
+				bytes += dataBytes[i];
+			}
+
+			encodeTime += timer.delta();
+
+			for ( int i = 0; i < packets; ++i )
+			{
+				net::Stream stream( net::Stream::Read, (net::Stream::Backend) backend, &data[i*MaxPacketSize], dataBytes[i] );
+				game::AuthorityModels models;
+				for ( int j = 0; j < ObjectsPerPacket; ++j )
+				{
+					game::AuthorityObject object = game::AuthorityObject();
+					result &= game::SerializeAuthorityObject( stream, object, models );
+					if ( pass == 0 )
+					{
+						const game::AuthorityObject & original = objects[i*ObjectsPerPacket+j];
+						if ( object.id != original.id || object.enabled != original.enabled || object.authority != original.authority || 
+							 math::abs( object.position.x - original.position.x ) > 0.01f || 
+							 math::abs( object.linearVelocity.x - original.linearVelocity.x ) > 0.01f )
+							mismatches++;
+					}
+				}
+			}
+
+			decodeTime += timer.delta();
+		}
+
+		printf( "%-12s %6.1f bits/object, %6.1f bytes/packet, encode %6.1f MB/s, decode %6.1f MB/s%s\n",
+			backendNames[backend], bytes * 8.0f / objects.size(), bytes / (float) packets,
+			objectBytes / encodeTime / 1000000.0, objectBytes / decodeTime / 1000000.0,
+			result && mismatches == 0 ? "" : " (mismatch!)" );
+	}
+}
+
+// ----------------------------------------------------------------------------------------
+
+int main( int argc, char * argv[] )
+{
+	BenchmarkBroadphase();
+	ValidateCubeCollider();
+	BenchmarkCubeCollider();
+	BenchmarkIslands();
+	BenchmarkSleep( BROADPHASE_Hash );
+	BenchmarkSleep( BROADPHASE_Grid );
+	BenchmarkBatchedState();
+	BenchmarkBackends();
+	BenchmarkSnapshot();
+	BenchmarkPackets();
+	BenchmarkServerEndpoint();
+	BenchmarkBitPacker();
+	BenchmarkRangeCoder();
+
+	return 0;
+}
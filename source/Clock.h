@@ -0,0 +1,44 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "Config.h"
+
+#if PLATFORM == PLATFORM_MAC
+#include <mach/mach_time.h>
+#elif PLATFORM == PLATFORM_WINDOWS
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace platform
+{
+	// high resolution time in seconds, from an arbitrary base
+
+	inline double GetTime()
+	{
+		#if PLATFORM == PLATFORM_MAC
+		static mach_timebase_info_data_t timebase;
+		if ( timebase.denom == 0 )
+			mach_timebase_info( &timebase );
+		return mach_absolute_time() * ( (double) timebase.numer / timebase.denom ) * 1.0e-9;
+		#elif PLATFORM == PLATFORM_WINDOWS
+		LARGE_INTEGER frequency, counter;
+		QueryPerformanceFrequency( &frequency );
+		QueryPerformanceCounter( &counter );
+		return (double) counter.QuadPart / (double) frequency.QuadPart;
+		#else
+		timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+		#endif
+	}
+}
+
+#endif
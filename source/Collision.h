@@ -0,0 +1,515 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef COLLISION_H
+#define COLLISION_H
+
+#include "Config.h"
+#include "Mathematics.h"
+
+#if defined(__SSE__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 1 )
+#define COLLISION_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace collision
+{
+	/*
+		Specialized narrowphase for cubes.
+		Every body in the game is an axis-scaled box resting on a ground
+		plane, so instead of the generic collider we do a separating axis
+		test with the 15 box-box axes evaluated four at a time, and generate
+		a reduced contact manifold of at most four points per pair.
+	*/
+
+	struct Box
+	{
+		math::Vector position;
+		math::Vector axis[3];			// unit length box axes in world space
+		float extents[3];				// half side lengths along each axis
+	};
+
+	struct Contact
+	{
+		math::Vector point;
+		math::Vector normal;			// points from the second shape into the first
+		float depth;
+	};
+
+	enum { MaxContacts = 4 };
+
+	// four wide float ops (sse with a scalar fallback)
+
+	struct Float4
+	{
+		#ifdef COLLISION_SSE
+
+		__m128 v;
+
+		Float4() {}
+		Float4( __m128 v ) : v( v ) {}
+		Float4( float a, float b, float c, float d ) { v = _mm_setr_ps( a, b, c, d ); }
+		explicit Float4( float s ) { v = _mm_set1_ps( s ); }
+
+		friend Float4 operator + ( const Float4 & a, const Float4 & b ) { return _mm_add_ps( a.v, b.v ); }
+		friend Float4 operator - ( const Float4 & a, const Float4 & b ) { return _mm_sub_ps( a.v, b.v ); }
+		friend Float4 operator * ( const Float4 & a, const Float4 & b ) { return _mm_mul_ps( a.v, b.v ); }
+		friend Float4 abs( const Float4 & a ) { return _mm_andnot_ps( _mm_set1_ps( -0.0f ), a.v ); }
+
+		// bit n is set if lane n of a is less than lane n of b
+		friend int less( const Float4 & a, const Float4 & b ) { return _mm_movemask_ps( _mm_cmplt_ps( a.v, b.v ) ); }
+
+		void store( float * output ) const { _mm_storeu_ps( output, v ); }
+
+		#else
+
+		float v[4];
+
+		Float4() {}
+		Float4( float a, float b, float c, float d ) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+		explicit Float4( float s ) { v[0] = v[1] = v[2] = v[3] = s; }
+
+		friend Float4 operator + ( const Float4 & a, const Float4 & b ) { return Float4( a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3] ); }
+		friend Float4 operator - ( const Float4 & a, const Float4 & b ) { return Float4( a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3] ); }
+		friend Float4 operator * ( const Float4 & a, const Float4 & b ) { return Float4( a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3] ); }
+		friend Float4 abs( const Float4 & a ) { return Float4( fabsf( a.v[0] ), fabsf( a.v[1] ), fabsf( a.v[2] ), fabsf( a.v[3] ) ); }
+
+		friend int less( const Float4 & a, const Float4 & b )
+		{
+			return ( a.v[0] < b.v[0] ? 1 : 0 ) | ( a.v[1] < b.v[1] ? 2 : 0 ) | ( a.v[2] < b.v[2] ? 4 : 0 ) | ( a.v[3] < b.v[3] ? 8 : 0 );
+		}
+
+		void store( float * output ) const { output[0] = v[0]; output[1] = v[1]; output[2] = v[2]; output[3] = v[3]; }
+
+		#endif
+	};
+
+	// reduce a contact manifold to the deepest point plus the points that best spread the patch
+
+	inline int ReduceContacts( Contact * contacts, int count, int maxContacts )
+	{
+		if ( count <= maxContacts )
+			return count;
+
+		int deepest = 0;
+		for ( int i = 1; i < count; ++i )
+		{
+			if ( contacts[i].depth > contacts[deepest].depth )
+				deepest = i;
+		}
+
+		Contact selected[8];
+		bool used[8] = { false, false, false, false, false, false, false, false };
+		selected[0] = contacts[deepest];
+		used[deepest] = true;
+
+		for ( int n = 1; n < maxContacts; ++n )
+		{
+			int best = -1;
+			float bestDistance = -1.0f;
+			for ( int i = 0; i < count; ++i )
+			{
+				if ( used[i] )
+					continue;
+				float distance = FLT_MAX;
+				for ( int j = 0; j < n; ++j )
+					distance = math::minimum( distance, ( contacts[i].point - selected[j].point ).lengthSquared() );
+				if ( distance > bestDistance )
+				{
+					best = i;
+					bestDistance = distance;
+				}
+			}
+			assert( best >= 0 );
+			selected[n] = contacts[best];
+			used[best] = true;
+		}
+
+		for ( int i = 0; i < maxContacts; ++i )
+			contacts[i] = selected[i];
+
+		return maxContacts;
+	}
+
+	/*
+		Box vs. plane.
+		The plane is dot(normal,p) = d. All eight vertex distances are
+		evaluated in two four wide batches, and vertices under the plane
+		become contacts with the plane normal.
+	*/
+
+	inline int CollideBoxPlane( const Box & box, const math::Vector & normal, float d, Contact * contacts, int maxContacts = MaxContacts )
+	{
+		assert( maxContacts >= 1 );
+		assert( maxContacts <= 8 );
+
+		const float base = normal.dot( box.position ) - d;
+		const float p0 = normal.dot( box.axis[0] ) * box.extents[0];
+		const float p1 = normal.dot( box.axis[1] ) * box.extents[1];
+		const float p2 = normal.dot( box.axis[2] ) * box.extents[2];
+
+		// quick reject: the deepest vertex is still above the plane
+
+		if ( base - math::abs( p0 ) - math::abs( p1 ) - math::abs( p2 ) >= 0.0f )
+			return 0;
+
+		// vertex i has sign bit k set when it is on the negative side of axis k
+
+		const Float4 xy( p0 + p1, -p0 + p1, p0 - p1, -p0 - p1 );
+		const Float4 lower = xy + Float4( base + p2 );
+		const Float4 upper = xy + Float4( base - p2 );
+
+		const Float4 zero( 0.0f );
+		const int mask = less( lower, zero ) | ( less( upper, zero ) << 4 );
+		if ( !mask )
+			return 0;
+
+		float distance[8];
+		lower.store( distance );
+		upper.store( distance + 4 );
+
+		int count = 0;
+		Contact candidates[8];
+		for ( int i = 0; i < 8; ++i )
+		{
+			if ( ( mask & ( 1 << i ) ) == 0 )
+				continue;
+			const float s0 = ( i & 1 ) ? -box.extents[0] : box.extents[0];
+			const float s1 = ( i & 2 ) ? -box.extents[1] : box.extents[1];
+			const float s2 = ( i & 4 ) ? -box.extents[2] : box.extents[2];
+			Contact & contact = candidates[count++];
+			contact.point = box.position + box.axis[0] * s0 + box.axis[1] * s1 + box.axis[2] * s2;
+			contact.normal = normal;
+			contact.depth = -distance[i];
+		}
+
+		count = ReduceContacts( candidates, count, maxContacts );
+		for ( int i = 0; i < count; ++i )
+			contacts[i] = candidates[i];
+		return count;
+	}
+
+	// clip a convex polygon against the plane dot(normal,p) <= d
+
+	inline int ClipPolygon( const math::Vector * input, int count, const math::Vector & normal, float d, math::Vector * output )
+	{
+		int outputCount = 0;
+		for ( int i = 0; i < count; ++i )
+		{
+			const math::Vector & a = input[i];
+			const math::Vector & b = input[(i+1)%count];
+			const float da = normal.dot( a ) - d;
+			const float db = normal.dot( b ) - d;
+			if ( da <= 0.0f )
+				output[outputCount++] = a;
+			if ( ( da < 0.0f && db > 0.0f ) || ( da > 0.0f && db < 0.0f ) )
+				output[outputCount++] = a + ( b - a ) * ( da / ( da - db ) );
+		}
+		return outputCount;
+	}
+
+	/*
+		Face contact: clip the incident face of the other box against
+		the side planes of the reference face, keeping points underneath it.
+		The reference direction points from the reference box to the incident box.
+	*/
+
+	inline int FaceContacts( const Box & reference, int referenceAxis, const Box & incident, const math::Vector & direction,
+	                         const math::Vector & normal, float penetration, Contact * contacts, int maxContacts )
+	{
+		// reference face
+
+		const float referenceSign = reference.axis[referenceAxis].dot( direction ) > 0.0f ? 1.0f : -1.0f;
+		const math::Vector referenceNormal = reference.axis[referenceAxis] * referenceSign;
+		const math::Vector referenceCenter = reference.position + referenceNormal * reference.extents[referenceAxis];
+		const int u = ( referenceAxis + 1 ) % 3;
+		const int v = ( referenceAxis + 2 ) % 3;
+
+		// incident face is the face most anti-parallel to the reference normal
+
+		int incidentAxis = 0;
+		float incidentDot = incident.axis[0].dot( referenceNormal );
+		for ( int i = 1; i < 3; ++i )
+		{
+			const float dot = incident.axis[i].dot( referenceNormal );
+			if ( math::abs( dot ) > math::abs( incidentDot ) )
+			{
+				incidentAxis = i;
+				incidentDot = dot;
+			}
+		}
+
+		const float incidentSign = incidentDot > 0.0f ? -1.0f : 1.0f;
+		const math::Vector incidentCenter = incident.position + incident.axis[incidentAxis] * ( incidentSign * incident.extents[incidentAxis] );
+		const int iu = ( incidentAxis + 1 ) % 3;
+		const int iv = ( incidentAxis + 2 ) % 3;
+		const math::Vector eu = incident.axis[iu] * incident.extents[iu];
+		const math::Vector ev = incident.axis[iv] * incident.extents[iv];
+
+		math::Vector polygon[16];
+		polygon[0] = incidentCenter + eu + ev;
+		polygon[1] = incidentCenter - eu + ev;
+		polygon[2] = incidentCenter - eu - ev;
+		polygon[3] = incidentCenter + eu - ev;
+		int count = 4;
+
+		// clip against the four side planes of the reference face
+
+		math::Vector clipped[16];
+		const math::Vector & au = reference.axis[u];
+		const math::Vector & av = reference.axis[v];
+		const float cu = au.dot( reference.position );
+		const float cv = av.dot( reference.position );
+
+		count = ClipPolygon( polygon, count, au, cu + reference.extents[u], clipped );
+		count = ClipPolygon( clipped, count, -au, -cu + reference.extents[u], polygon );
+		count = ClipPolygon( polygon, count, av, cv + reference.extents[v], clipped );
+		count = ClipPolygon( clipped, count, -av, -cv + reference.extents[v], polygon );
+
+		// keep points below the reference face
+
+		Contact candidates[16];
+		int numCandidates = 0;
+		for ( int i = 0; i < count && numCandidates < 16; ++i )
+		{
+			const float depth = -referenceNormal.dot( polygon[i] - referenceCenter );
+			if ( depth < 0.0f )
+				continue;
+			Contact & contact = candidates[numCandidates++];
+			contact.point = polygon[i];
+			contact.normal = normal;
+			contact.depth = depth;
+		}
+
+		if ( numCandidates == 0 )
+		{
+			// numerical corner case: fall back to a single point at the incident face center
+			contacts[0].point = incidentCenter;
+			contacts[0].normal = normal;
+			contacts[0].depth = penetration;
+			return 1;
+		}
+
+		numCandidates = ReduceContacts( candidates, numCandidates, maxContacts );
+		for ( int i = 0; i < numCandidates; ++i )
+			contacts[i] = candidates[i];
+		return numCandidates;
+	}
+
+	/*
+		Box vs. box.
+		Separating axis test over the 3 + 3 face axes and 9 edge cross products,
+		computed in the frame of box a with four axes per batch. The axis of
+		minimum penetration (biased toward face axes for stable stacking)
+		selects face clipping or a single edge-edge contact.
+	*/
+
+	inline int CollideBoxBox( const Box & a, const Box & b, Contact * contacts, int maxContacts = MaxContacts )
+	{
+		assert( maxContacts >= 1 );
+		assert( maxContacts <= 8 );
+
+		// rotation of b in a's frame and translation in a's frame
+
+		float R[3][3];
+		float AbsR[3][3];
+		for ( int i = 0; i < 3; ++i )
+		{
+			for ( int j = 0; j < 3; ++j )
+			{
+				R[i][j] = a.axis[i].dot( b.axis[j] );
+				AbsR[i][j] = math::abs( R[i][j] ) + 1.0e-6f;
+			}
+		}
+
+		const math::Vector translation = b.position - a.position;
+		const float T[3] = { translation.dot( a.axis[0] ), translation.dot( a.axis[1] ), translation.dot( a.axis[2] ) };
+
+		const float * ea = a.extents;
+		const float * eb = b.extents;
+
+		/*
+			Axis layout (padded to 16 for batches of four):
+				0..2   face axes of a
+				3..5   face axes of b
+				6..14  edge axes a[i] x b[j] at 6 + i*3 + j
+		*/
+
+		float distance[16];
+		float radius[16];
+		float length[16];
+
+		// face axes of a (lanes are a's axes)
+		{
+			const Float4 t = abs( Float4( T[0], T[1], T[2], 0.0f ) );
+			const Float4 r = Float4( ea[0], ea[1], ea[2], 0.0f ) +
+			                 Float4( eb[0] ) * Float4( AbsR[0][0], AbsR[1][0], AbsR[2][0], 0.0f ) +
+			                 Float4( eb[1] ) * Float4( AbsR[0][1], AbsR[1][1], AbsR[2][1], 0.0f ) +
+			                 Float4( eb[2] ) * Float4( AbsR[0][2], AbsR[1][2], AbsR[2][2], 0.0f );
+			t.store( distance );
+			r.store( radius );
+		}
+
+		// face axes of b (lanes are b's axes)
+		{
+			const Float4 t = abs( Float4( T[0] ) * Float4( R[0][0], R[0][1], R[0][2], 0.0f ) +
+			                      Float4( T[1] ) * Float4( R[1][0], R[1][1], R[1][2], 0.0f ) +
+			                      Float4( T[2] ) * Float4( R[2][0], R[2][1], R[2][2], 0.0f ) );
+			const Float4 r = Float4( eb[0], eb[1], eb[2], 0.0f ) +
+			                 Float4( ea[0] ) * Float4( AbsR[0][0], AbsR[0][1], AbsR[0][2], 0.0f ) +
+			                 Float4( ea[1] ) * Float4( AbsR[1][0], AbsR[1][1], AbsR[1][2], 0.0f ) +
+			                 Float4( ea[2] ) * Float4( AbsR[2][0], AbsR[2][1], AbsR[2][2], 0.0f );
+			float t4[4], r4[4];
+			t.store( t4 );
+			r.store( r4 );
+			for ( int j = 0; j < 3; ++j )
+			{
+				distance[3+j] = t4[j];
+				radius[3+j] = r4[j];
+			}
+		}
+
+		// edge axes a[i] x b[j] (lanes are b's axes)
+
+		for ( int i = 0; i < 3; ++i )
+		{
+			const int i1 = ( i + 1 ) % 3;
+			const int i2 = ( i + 2 ) % 3;
+			const Float4 t = abs( Float4( T[i2] ) * Float4( R[i1][0], R[i1][1], R[i1][2], 0.0f ) -
+			                      Float4( T[i1] ) * Float4( R[i2][0], R[i2][1], R[i2][2], 0.0f ) );
+			const Float4 r = Float4( ea[i1] ) * Float4( AbsR[i2][0], AbsR[i2][1], AbsR[i2][2], 0.0f ) +
+			                 Float4( ea[i2] ) * Float4( AbsR[i1][0], AbsR[i1][1], AbsR[i1][2], 0.0f ) +
+			                 Float4( eb[1], eb[0], eb[0], 0.0f ) * Float4( AbsR[i][2], AbsR[i][2], AbsR[i][1], 0.0f ) +
+			                 Float4( eb[2], eb[2], eb[1], 0.0f ) * Float4( AbsR[i][1], AbsR[i][0], AbsR[i][0], 0.0f );
+			float t4[4], r4[4];
+			t.store( t4 );
+			r.store( r4 );
+			for ( int j = 0; j < 3; ++j )
+			{
+				distance[6+i*3+j] = t4[j];
+				radius[6+i*3+j] = r4[j];
+			}
+		}
+
+		distance[15] = 0.0f;
+		radius[15] = 1.0f;
+
+		// axis lengths: face axes are unit, |a[i] x b[j]| = sqrt( 1 - R[i][j]^2 )
+
+		for ( int k = 0; k < 6; ++k )
+			length[k] = 1.0f;
+		for ( int i = 0; i < 3; ++i )
+			for ( int j = 0; j < 3; ++j )
+				length[6+i*3+j] = math::sqrt( math::maximum( 1.0f - R[i][j] * R[i][j], 0.0f ) );
+		length[15] = 1.0f;
+
+		// early out if any axis separates, four axes at a time
+
+		for ( int k = 0; k < 16; k += 4 )
+		{
+			const Float4 d( distance[k], distance[k+1], distance[k+2], distance[k+3] );
+			const Float4 r( radius[k], radius[k+1], radius[k+2], radius[k+3] );
+			if ( less( r, d ) )
+				return 0;
+		}
+
+		// find the axis of minimum penetration
+
+		int bestFace = 0;
+		float bestFacePenetration = FLT_MAX;
+		for ( int k = 0; k < 6; ++k )
+		{
+			const float penetration = radius[k] - distance[k];
+			if ( penetration < bestFacePenetration )
+			{
+				bestFacePenetration = penetration;
+				bestFace = k;
+			}
+		}
+
+		int bestEdge = -1;
+		float bestEdgePenetration = FLT_MAX;
+		for ( int k = 6; k < 15; ++k )
+		{
+			if ( length[k] < 1.0e-4f )
+				continue;							// note: parallel edges, axis is degenerate
+			const float penetration = ( radius[k] - distance[k] ) / length[k];
+			if ( penetration < bestEdgePenetration )
+			{
+				bestEdgePenetration = penetration;
+				bestEdge = k;
+			}
+		}
+
+		const bool useEdge = bestEdge >= 0 && bestEdgePenetration * 1.05f + 0.001f < bestFacePenetration;
+
+		if ( !useEdge )
+		{
+			// face contact. normal points from b into a
+
+			if ( bestFace < 3 )
+			{
+				const math::Vector axis = a.axis[bestFace];
+				const math::Vector direction = axis.dot( translation ) > 0.0f ? axis : -axis;			// a -> b
+				return FaceContacts( a, bestFace, b, direction, -direction, bestFacePenetration, contacts, maxContacts );
+			}
+			else
+			{
+				const math::Vector axis = b.axis[bestFace-3];
+				const math::Vector direction = axis.dot( translation ) < 0.0f ? axis : -axis;			// b -> a
+				return FaceContacts( b, bestFace - 3, a, direction, direction, bestFacePenetration, contacts, maxContacts );
+			}
+		}
+
+		// edge-edge contact: closest points between the two supporting edges
+
+		const int i = ( bestEdge - 6 ) / 3;
+		const int j = ( bestEdge - 6 ) % 3;
+
+		math::Vector axis = a.axis[i].cross( b.axis[j] );
+		axis.normalize();
+		if ( axis.dot( translation ) < 0.0f )
+			axis = -axis;											// a -> b
+
+		math::Vector pointA = a.position;
+		for ( int k = 0; k < 3; ++k )
+		{
+			if ( k == i )
+				continue;
+			pointA += a.axis[k] * ( a.axis[k].dot( axis ) > 0.0f ? ea[k] : -ea[k] );
+		}
+
+		math::Vector pointB = b.position;
+		for ( int k = 0; k < 3; ++k )
+		{
+			if ( k == j )
+				continue;
+			pointB += b.axis[k] * ( b.axis[k].dot( axis ) < 0.0f ? eb[k] : -eb[k] );
+		}
+
+		const math::Vector & da = a.axis[i];
+		const math::Vector & db = b.axis[j];
+		const math::Vector r = pointA - pointB;
+		const float daDotDb = da.dot( db );
+		const float denominator = 1.0f - daDotDb * daDotDb;
+		float sa = 0.0f;
+		float sb = 0.0f;
+		if ( denominator > 1.0e-6f )
+		{
+			const float c = da.dot( r );
+			const float f = db.dot( r );
+			sa = math::clamp( ( daDotDb * f - c ) / denominator, -ea[i], ea[i] );
+			sb = math::clamp( ( daDotDb * sa + f ), -eb[j], eb[j] );
+		}
+
+		contacts[0].point = ( pointA + da * sa + pointB + db * sb ) * 0.5f;
+		contacts[0].normal = -axis;
+		contacts[0].depth = bestEdgePenetration;
+		return 1;
+	}
+}
+
+#endif
@@ -33,6 +33,7 @@
 //#define FRUSTUM_CULLING
 //#define USE_SECONDARY_DISPLAY_IF_EXISTS
 //#define DISCOVER_KEY_CODES
+//#define PROFILE
 
 const int MaxPlayers = 4;
 
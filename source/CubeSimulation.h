@@ -0,0 +1,1156 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef CUBE_SIMULATION_H
+#define CUBE_SIMULATION_H
+
+#include "Config.h"
+#include "Collision.h"
+#include "SimulationBackend.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace engine
+{
+	/*
+		Cube simulation backend.
+		A small rigid body solver that only knows about cubes and planes, which
+		is all the game ever simulates. Bodies live in flat arrays indexed by
+		object id with no per-body allocation. Contacts come from the cube
+		narrowphase in Collision.h, and are solved with sequential impulses
+		warm started from the matching contacts of the previous frame.
+		A cube has the same inertia about every axis, so world space inverse
+		inertia is a single float per body.
+		Sleep follows the ode backend: resting contact islands are taken out
+		of the awake list and woken as a whole on contact, force or removal.
+	*/
+
+	class CubeSimulation : public SimulationBackend
+	{
+	public:
+
+		CubeSimulation()
+		{
+			maxScale = 0.0f;
+			gridCellSize = 0.0f;
+			gridColliding = false;
+		}
+
+		void Initialize( const SimulationConfig & config = SimulationConfig() )
+		{
+			this->config = config;
+			interactionPairs.reserve( 32 );
+		}
+
+		void Update( float deltaTime )
+		{
+			assert( deltaTime > 0.0f );
+
+			interactionPairs.clear();
+
+			stats = SimulationStats();
+
+			manifolds.clear();
+			contacts.clear();
+
+			/*
+				Collision is driven from the awake list. The first pass takes pairs
+				with a body awake at the start of the frame. Islands woken by those
+				contacts are appended to the awake list, and a second pass collides
+				them against other sleeping or static geometry, like the ode backend.
+			*/
+
+			{
+				PROFILE_SCOPE( profiler, profile::ZONE_Collide );
+
+				BuildGrid();
+
+				// objects woken during collision stay in the sleeping grid until both passes are done, so the second pass finds them there
+
+				gridColliding = true;
+
+				const int numAwakeAtStart = awakeObjects.size();
+
+				CollideAwake( 0, numAwakeAtStart );
+
+				const int numAwakeAfterFirstPass = awakeObjects.size();
+				if ( numAwakeAfterFirstPass > numAwakeAtStart )
+					CollideAwake( numAwakeAtStart, numAwakeAfterFirstPass );
+
+				gridColliding = false;
+
+				for ( int i = 0; i < (int) wokenInCollide.size(); ++i )
+					RemoveSleepingObject( wokenInCollide[i] );
+
+				wokenInCollide.clear();
+
+				// order manifolds by pair so solving and warm starting do not depend on the awake order
+
+				std::sort( manifolds.begin(), manifolds.end() );
+			}
+
+			{
+				PROFILE_SCOPE( profiler, profile::ZONE_Step );
+
+				IntegrateVelocities( deltaTime );
+
+				PrepareContacts( deltaTime );
+
+				WarmStartContacts();
+
+				for ( int i = 0; i < config.MaxIterations; ++i )
+					SolveContacts();
+
+				IntegratePositions( deltaTime );
+
+				manifolds.swap( previousManifolds );
+				contacts.swap( previousContacts );
+			}
+
+			{
+				PROFILE_SCOPE( profiler, profile::ZONE_Rest );
+
+				// rest checks only look at awake bodies
+
+				updatedObjects = awakeObjects;
+
+				for ( int i = 0; i < (int) awakeObjects.size(); ++i )
+				{
+					const int id = awakeObjects[i];
+					if ( linearVelocity[id].lengthSquared() < config.LinearRestThresholdSquared && angularVelocity[id].lengthSquared() < config.AngularRestThresholdSquared )
+						timeAtRest[id] += deltaTime;
+					else
+						timeAtRest[id] = 0.0f;
+				}
+
+				SleepRestingIslands();
+			}
+		}
+
+		int AddObject( const SimulationObjectState & initialObjectState )
+		{
+			int id;
+			if ( !freeObjects.empty() )
+			{
+				id = freeObjects.back();
+				freeObjects.pop_back();
+			}
+			else
+			{
+				id = exists.size();
+				Resize( id + 1 );
+			}
+
+			const float scale = initialObjectState.scale;
+
+			exists[id] = 1;
+			halfSize[id] = scale * 0.5f;
+			mass[id] = initialObjectState.density * scale * scale * scale;
+			inverseMass[id] = 1.0f / mass[id];
+			inverseInertia[id] = 6.0f / ( mass[id] * scale * scale );
+			force[id] = math::Vector(0,0,0);
+			torque[id] = math::Vector(0,0,0);
+			timeAtRest[id] = 0.0f;
+
+			if ( scale > maxScale )
+				maxScale = scale;
+
+			// new objects start awake in their own island
+
+			nextInIsland[id] = id;
+			awakeIndex[id] = awakeObjects.size();
+			awakeObjects.push_back( id );
+
+			SetObjectState( id, initialObjectState );
+
+			return id;
+		}
+
+		bool ObjectExists( int id )
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			return exists[id] != 0;
+		}
+
+		float GetObjectMass( int id )
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			assert( exists[id] );
+			return mass[id];
+		}
+
+		void RemoveObject( int id )
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			assert( exists[id] );
+
+			// wake the island the object was resting in, since it may have been holding it up
+
+			WakeObject( id );
+			RemoveAwakeObject( id );
+
+			exists[id] = 0;
+			freeObjects.push_back( id );
+
+			// note: the id will be reused, so drop cached manifolds that refer to it. their contacts are simply left unreferenced
+
+			int numManifolds = 0;
+			for ( int i = 0; i < (int) previousManifolds.size(); ++i )
+			{
+				if ( previousManifolds[i].a != id && previousManifolds[i].b != id )
+					previousManifolds[numManifolds++] = previousManifolds[i];
+			}
+			previousManifolds.resize( numManifolds );
+		}
+
+		void GetObjectState( int id, SimulationObjectState & objectState )
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			assert( exists[id] );
+
+			objectState.position = position[id];
+			objectState.orientation = orientation[id];
+			objectState.linearVelocity = linearVelocity[id];
+			objectState.angularVelocity = angularVelocity[id];
+			objectState.enabled = timeAtRest[id] < config.RestTime;
+		}
+
+		void SetObjectState( int id, const SimulationObjectState & objectState, bool ignoreEnabledFlag = false )
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			assert( exists[id] );
+
+			position[id] = objectState.position;
+			orientation[id] = objectState.orientation;
+			linearVelocity[id] = objectState.linearVelocity;
+			angularVelocity[id] = objectState.angularVelocity;
+
+			if ( !ignoreEnabledFlag )
+			{
+				if ( objectState.enabled )
+				{
+					WakeObject( id );
+					timeAtRest[id] = 0.0f;
+				}
+				else if ( awakeIndex[id] >= 0 )
+				{
+					// note: put to sleep on its own, the next contact with an awake body wakes it
+					RemoveAwakeObject( id );
+					timeAtRest[id] = config.RestTime;
+					nextInIsland[id] = id;
+				}
+			}
+
+			if ( awakeIndex[id] < 0 )
+				MoveSleepingObject( id );
+		}
+
+		void GetObjectStates( const int * ids, int count, SimulationObjectStates & states )
+		{
+			ValidateObjectIds( ids, count );
+
+			states.Resize( count );
+
+			for ( int i = 0; i < count; ++i )
+			{
+				const int id = ids[i];
+				states.position[i] = position[id];
+				states.orientation[i] = orientation[id];
+				states.linearVelocity[i] = linearVelocity[id];
+				states.angularVelocity[i] = angularVelocity[id];
+				states.enabled[i] = timeAtRest[id] < config.RestTime;
+			}
+		}
+
+		void SetObjectStates( const int * ids, int count, const SimulationObjectStates & states )
+		{
+			ValidateObjectIds( ids, count );
+
+			assert( states.GetCount() >= count );
+
+			for ( int i = 0; i < count; ++i )
+			{
+				const int id = ids[i];
+				position[id] = states.position[i];
+				orientation[id] = states.orientation[i];
+				linearVelocity[id] = states.linearVelocity[i];
+				angularVelocity[id] = states.angularVelocity[i];
+				if ( awakeIndex[id] < 0 )
+					MoveSleepingObject( id );
+			}
+		}
+
+		const SimulationStats & GetStats() const
+		{
+			return stats;
+		}
+
+		const InteractionPair * GetInteractionPairs() const
+		{
+			return interactionPairs.empty() ? NULL : &interactionPairs[0];
+		}
+
+		int GetNumInteractionPairs() const
+		{
+			return interactionPairs.size();
+		}
+
+		void ApplyForce( int id, const math::Vector & force )
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			assert( exists[id] );
+			if ( force.length() > 0.001f )
+			{
+				WakeObject( id );
+				this->force[id] += force;
+			}
+		}
+
+		void ApplyTorque( int id, const math::Vector & torque )
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			assert( exists[id] );
+			if ( torque.length() > 0.001f )
+			{
+				WakeObject( id );
+				this->torque[id] += torque;
+			}
+		}
+
+		void AddPlane( const math::Vector & normal, float d )
+		{
+			Plane plane;
+			plane.normal = normal;
+			plane.d = d;
+			planes.push_back( plane );
+		}
+
+		void Reset()
+		{
+			for ( int i = 0; i < (int) exists.size(); ++i )
+			{
+				if ( exists[i] )
+					RemoveObject( i );
+			}
+
+			planes.clear();
+
+			awakeObjects.clear();
+			updatedObjects.clear();
+
+			maxScale = 0.0f;
+		}
+
+		int GetNumThreads() const
+		{
+			return 1;
+		}
+
+		void SetMaxIterations( int iterations )
+		{
+			assert( iterations > 0 );
+			config.MaxIterations = iterations;
+		}
+
+		int GetMaxIterations() const
+		{
+			return config.MaxIterations;
+		}
+
+		bool IsObjectAwake( int id ) const
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			return awakeIndex[id] >= 0;
+		}
+
+		int GetNumAwakeObjects() const
+		{
+			return awakeObjects.size();
+		}
+
+		const int * GetAwakeObjects() const
+		{
+			return awakeObjects.empty() ? NULL : &awakeObjects[0];
+		}
+
+		// objects that were awake during the last update, including any that fell asleep at the end of it
+
+		const int * GetUpdatedObjects() const
+		{
+			return updatedObjects.empty() ? NULL : &updatedObjects[0];
+		}
+
+		int GetNumUpdatedObjects() const
+		{
+			return updatedObjects.size();
+		}
+
+		void WakeObject( int id )
+		{
+			assert( id >= 0 && id < (int) exists.size() );
+			assert( exists[id] );
+
+			if ( awakeIndex[id] >= 0 )
+				return;
+
+			// walk the sleeping island and wake every body in it
+
+			int current = id;
+			do
+			{
+				const int next = nextInIsland[current];
+				nextInIsland[current] = current;
+				timeAtRest[current] = 0.0f;
+				awakeIndex[current] = awakeObjects.size();
+				awakeObjects.push_back( current );
+				if ( gridColliding )
+					wokenInCollide.push_back( current );
+				else
+					RemoveSleepingObject( current );
+				current = next;
+			}
+			while ( current != id );
+		}
+
+	private:
+
+		struct Plane
+		{
+			math::Vector normal;
+			float d;
+		};
+
+		struct GridCell
+		{
+			int ix,iy;
+			uint32_t bucket;
+		};
+
+		struct ContactPoint
+		{
+			math::Vector point;
+			math::Vector normal;			// from b into a
+			float depth;
+			math::Vector ra, rb;			// contact point relative to each body
+			float normalMass;
+			float bias;
+			float normalImpulse;			// accumulated, carried over to the next frame
+		};
+
+		struct Manifold
+		{
+			uint64_t key;					// a in the high bits, b in the low bits
+			int a, b;						// a < b, b is -1 - plane index for planes
+			int firstContact;
+			int numContacts;
+
+			// friction is solved once per manifold at the center of its contacts
+
+			math::Vector normal;
+			math::Vector ra, rb;
+			math::Vector tangent[2];
+			float tangentMass[2];
+			float twistMass;
+			float maxFriction;
+			float maxTwist;
+			float tangentImpulse[2];		// accumulated, carried over to the next frame
+			float twistImpulse;
+
+			bool operator < ( const Manifold & other ) const
+			{
+				return key < other.key;
+			}
+		};
+
+		void Resize( int count )
+		{
+			position.resize( count );
+			orientation.resize( count );
+			linearVelocity.resize( count );
+			angularVelocity.resize( count );
+			force.resize( count );
+			torque.resize( count );
+			boxes.resize( count );
+			halfSize.resize( count );
+			mass.resize( count );
+			inverseMass.resize( count );
+			inverseInertia.resize( count );
+			timeAtRest.resize( count );
+			awakeIndex.resize( count, -1 );
+			nextInIsland.resize( count, -1 );
+			gridCell.resize( count );
+			sleepingCell.resize( count );
+			sleepingSlot.resize( count, -1 );
+			exists.resize( count, 0 );
+		}
+
+		void ValidateObjectIds( const int * ids, int count ) const
+		{
+			#ifdef DEBUG
+			for ( int i = 0; i < count; ++i )
+			{
+				assert( ids[i] >= 0 );
+				assert( ids[i] < (int) exists.size() );
+				assert( exists[ids[i]] );
+			}
+			#endif
+		}
+
+		void RemoveAwakeObject( int id )
+		{
+			const int index = awakeIndex[id];
+			assert( index >= 0 );
+			const int last = awakeObjects.back();
+			awakeObjects[index] = last;
+			awakeIndex[last] = index;
+			awakeObjects.pop_back();
+			awakeIndex[id] = -1;
+		}
+
+		// collision
+
+		static uint32_t GridHash( int ix, int iy )
+		{
+			return ( (uint32_t) ix * 73856093u ) ^ ( (uint32_t) iy * 19349663u );
+		}
+
+		/*
+			Awake objects are counting sorted into a hashed 2D grid each frame,
+			with cells as wide as the largest cube diagonal, so any pair that can
+			touch lies in neighboring cells. Sleeping objects do not move, so they
+			sit in a persistent grid with the same cells and are only inserted and
+			removed as they fall asleep and wake up. The collision box of an awake
+			object is built here once per frame from its orientation, a sleeping
+			object keeps the box it had when it went to sleep.
+		*/
+
+		void BuildGrid()
+		{
+			float cellSize = math::maximum( config.GridCellSize, maxScale * 1.7320508f );
+			if ( cellSize <= 0.0f )
+				cellSize = 1.0f;
+
+			if ( cellSize != gridCellSize || sleepingGrid.size() < exists.size() * 2 )
+				RebuildSleepingGrid( cellSize );
+
+			const float inverseCellSize = 1.0f / cellSize;
+
+			const int numObjects = awakeObjects.size();
+
+			int numBuckets = 64;
+			while ( numBuckets < numObjects * 2 )
+				numBuckets *= 2;
+			gridBucketMask = numBuckets - 1;
+
+			gridBucketStart.resize( numBuckets + 1 );
+			for ( int i = 0; i <= numBuckets; ++i )
+				gridBucketStart[i] = 0;
+
+			for ( int i = 0; i < numObjects; ++i )
+			{
+				const int id = awakeObjects[i];
+
+				BuildBox( id, boxes[id] );
+
+				GridCell & cell = gridCell[id];
+				cell.ix = (int) math::floor( position[id].x * inverseCellSize );
+				cell.iy = (int) math::floor( position[id].y * inverseCellSize );
+				cell.bucket = GridHash( cell.ix, cell.iy ) & gridBucketMask;
+				gridBucketStart[cell.bucket+1]++;
+			}
+
+			for ( int i = 0; i < numBuckets; ++i )
+				gridBucketStart[i+1] += gridBucketStart[i];
+
+			gridSorted.resize( numObjects );
+			gridBucketFill.assign( gridBucketStart.begin(), gridBucketStart.end() - 1 );
+			for ( int i = 0; i < numObjects; ++i )
+				gridSorted[gridBucketFill[gridCell[awakeObjects[i]].bucket]++] = awakeObjects[i];
+		}
+
+		// sleeping grid. the box is built on insert, since the object does not move until it wakes
+
+		void InsertSleepingObject( int id )
+		{
+			if ( sleepingGrid.empty() )
+				return;
+
+			assert( sleepingSlot[id] < 0 );
+
+			BuildBox( id, boxes[id] );
+
+			const float inverseCellSize = 1.0f / gridCellSize;
+			GridCell & cell = sleepingCell[id];
+			cell.ix = (int) math::floor( position[id].x * inverseCellSize );
+			cell.iy = (int) math::floor( position[id].y * inverseCellSize );
+			cell.bucket = GridHash( cell.ix, cell.iy ) & ( sleepingGrid.size() - 1 );
+
+			std::vector<int> & bucket = sleepingGrid[cell.bucket];
+			sleepingSlot[id] = bucket.size();
+			bucket.push_back( id );
+		}
+
+		void RemoveSleepingObject( int id )
+		{
+			const int slot = sleepingSlot[id];
+			if ( slot < 0 )
+				return;
+
+			std::vector<int> & bucket = sleepingGrid[sleepingCell[id].bucket];
+			const int last = bucket.back();
+			bucket[slot] = last;
+			sleepingSlot[last] = slot;
+			bucket.pop_back();
+			sleepingSlot[id] = -1;
+		}
+
+		void MoveSleepingObject( int id )
+		{
+			RemoveSleepingObject( id );
+			InsertSleepingObject( id );
+		}
+
+		// only when the largest cube grows or the object count doubles, so it does not show up per frame
+
+		void RebuildSleepingGrid( float cellSize )
+		{
+			int numBuckets = 64;
+			while ( numBuckets < (int) exists.size() * 2 )
+				numBuckets *= 2;
+
+			for ( int i = 0; i < (int) sleepingGrid.size(); ++i )
+				sleepingGrid[i].clear();
+			sleepingGrid.resize( numBuckets );
+			gridCellSize = cellSize;
+
+			for ( int i = 0; i < (int) exists.size(); ++i )
+			{
+				sleepingSlot[i] = -1;
+				if ( exists[i] && awakeIndex[i] < 0 )
+					InsertSleepingObject( i );
+			}
+		}
+
+		void BuildBox( int id, collision::Box & box ) const
+		{
+			const math::Quaternion & q = orientation[id];
+
+			const float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+			const float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+			const float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+			box.position = position[id];
+			box.axis[0] = math::Vector( 1.0f - 2.0f * ( yy + zz ), 2.0f * ( xy + wz ), 2.0f * ( xz - wy ) );
+			box.axis[1] = math::Vector( 2.0f * ( xy - wz ), 1.0f - 2.0f * ( xx + zz ), 2.0f * ( yz + wx ) );
+			box.axis[2] = math::Vector( 2.0f * ( xz + wy ), 2.0f * ( yz - wx ), 1.0f - 2.0f * ( xx + yy ) );
+			box.extents[0] = box.extents[1] = box.extents[2] = halfSize[id];
+		}
+
+		/*
+			Collide the awake objects in [begin,end) of the awake list against
+			their neighbors in both grids and the planes. Pairs with an object
+			from an earlier pass were already tested, and pairs of objects both
+			in this range are only tested from the lower id. The awake grid only
+			holds the first pass, objects woken since are in the sleeping grid.
+		*/
+
+		void CollideAwake( int begin, int end )
+		{
+			for ( int k = begin; k < end; ++k )
+			{
+				const int a = awakeObjects[k];
+				const GridCell & cell = sleepingSlot[a] >= 0 ? sleepingCell[a] : gridCell[a];
+
+				for ( int dy = -1; dy <= 1; ++dy )
+				{
+					for ( int dx = -1; dx <= 1; ++dx )
+					{
+						const int ix = cell.ix + dx;
+						const int iy = cell.iy + dy;
+
+						if ( begin == 0 )
+						{
+							const uint32_t bucket = GridHash( ix, iy ) & gridBucketMask;
+							for ( int m = gridBucketStart[bucket]; m < gridBucketStart[bucket+1]; ++m )
+							{
+								const int b = gridSorted[m];
+								if ( b > a && gridCell[b].ix == ix && gridCell[b].iy == iy )
+									CollideNear( a, b );
+							}
+						}
+
+						const std::vector<int> & bucket = sleepingGrid[ GridHash( ix, iy ) & ( sleepingGrid.size() - 1 ) ];
+						for ( int m = 0; m < (int) bucket.size(); ++m )
+						{
+							const int b = bucket[m];
+
+							// note: different cells may hash to the same bucket
+							if ( b == a || sleepingCell[b].ix != ix || sleepingCell[b].iy != iy )
+								continue;
+
+							const int index = awakeIndex[b];
+							if ( index >= 0 && index < begin )
+								continue;
+							if ( index >= begin && index < end && b < a )
+								continue;
+
+							CollideNear( a < b ? a : b, a < b ? b : a );
+						}
+					}
+				}
+
+				for ( int i = 0; i < (int) planes.size(); ++i )
+					CollidePlane( a, i );
+			}
+		}
+
+		void CollideNear( int a, int b )
+		{
+			const float radius = ( halfSize[a] + halfSize[b] ) * 1.7320508f;
+			if ( ( position[a] - position[b] ).lengthSquared() > radius * radius )
+				return;
+
+			CollidePair( a, b );
+		}
+
+		void CollidePair( int a, int b )
+		{
+			collision::Contact manifoldContacts[collision::MaxContacts];
+			const int count = collision::CollideBoxBox( boxes[a], boxes[b], manifoldContacts );
+
+			stats.pairs++;
+
+			if ( count == 0 )
+				return;
+
+			// contact with an awake body wakes a sleeping island
+
+			if ( awakeIndex[a] < 0 )
+				WakeObject( a );
+			if ( awakeIndex[b] < 0 )
+				WakeObject( b );
+
+			AddManifold( a, b, manifoldContacts, count );
+
+			InteractionPair pair;
+			pair.a = a;
+			pair.b = b;
+			interactionPairs.push_back( pair );
+		}
+
+		void CollidePlane( int a, int planeIndex )
+		{
+			const Plane & plane = planes[planeIndex];
+
+			collision::Contact manifoldContacts[collision::MaxContacts];
+			const int count = collision::CollideBoxPlane( boxes[a], plane.normal, plane.d, manifoldContacts );
+
+			stats.pairs++;
+
+			if ( count > 0 )
+				AddManifold( a, -1 - planeIndex, manifoldContacts, count );
+		}
+
+		void AddManifold( int a, int b, const collision::Contact * manifoldContacts, int count )
+		{
+			stats.collidingPairs++;
+			stats.contacts += count;
+
+			Manifold manifold;
+			manifold.key = ( (uint64_t) (uint32_t) a << 32 ) | (uint32_t) b;
+			manifold.a = a;
+			manifold.b = b;
+			manifold.firstContact = contacts.size();
+			manifold.numContacts = count;
+			manifolds.push_back( manifold );
+
+			for ( int i = 0; i < count; ++i )
+			{
+				ContactPoint contact;
+				contact.point = manifoldContacts[i].point;
+				contact.normal = manifoldContacts[i].normal;
+				contact.depth = manifoldContacts[i].depth;
+				contacts.push_back( contact );
+			}
+		}
+
+		// solver
+
+		void IntegrateVelocities( float deltaTime )
+		{
+			const math::Vector gravity( 0, 0, -config.Gravity );
+			const float damping = 1.0f - 0.01f;
+
+			for ( int i = 0; i < (int) awakeObjects.size(); ++i )
+			{
+				const int id = awakeObjects[i];
+				linearVelocity[id] += ( gravity + force[id] * inverseMass[id] ) * deltaTime;
+				angularVelocity[id] += torque[id] * ( inverseInertia[id] * deltaTime );
+				linearVelocity[id] *= damping;
+				angularVelocity[id] *= damping;
+				force[id] = math::Vector(0,0,0);
+				torque[id] = math::Vector(0,0,0);
+			}
+		}
+
+		/*
+			Work out effective masses and bias velocities for each contact.
+			Penetration beyond the contact surface layer is corrected with a bias
+			velocity of ERP/dt per unit depth, capped to the maximum correcting
+			velocity, and contacts hitting faster than the restitution threshold
+			bounce with the configured elasticity.
+			Friction is two tangent impulses and a twist impulse at the center of
+			the manifold rather than per contact, which keeps the redundant contacts
+			of a resting face from fighting each other. Like ode without
+			dContactApprox1, Friction is a fixed force limit for each contact.
+		*/
+
+		void PrepareContacts( float deltaTime )
+		{
+			const float RestitutionVelocity = 1.0f;
+
+			for ( int i = 0; i < (int) manifolds.size(); ++i )
+			{
+				Manifold & manifold = manifolds[i];
+
+				const int a = manifold.a;
+				const int b = manifold.b;
+
+				const float inverseMassSum = inverseMass[a] + ( b >= 0 ? inverseMass[b] : 0.0f );
+				const float inverseInertiaA = inverseInertia[a];
+				const float inverseInertiaB = b >= 0 ? inverseInertia[b] : 0.0f;
+
+				math::Vector center( 0, 0, 0 );
+				math::Vector normal( 0, 0, 0 );
+
+				for ( int j = 0; j < manifold.numContacts; ++j )
+				{
+					ContactPoint & contact = contacts[manifold.firstContact+j];
+
+					center += contact.point;
+					normal += contact.normal;
+
+					contact.ra = contact.point - position[a];
+					contact.rb = b >= 0 ? contact.point - position[b] : math::Vector(0,0,0);
+
+					contact.normalMass = EffectiveMass( contact.ra, contact.rb, contact.normal, inverseMassSum, inverseInertiaA, inverseInertiaB );
+
+					const float normalVelocity = RelativeVelocity( a, b, contact.ra, contact.rb ).dot( contact.normal );
+
+					contact.bias = math::minimum( config.ERP / deltaTime * math::maximum( contact.depth - config.ContactSurfaceLayer, 0.0f ), config.MaximumCorrectingVelocity );
+					if ( normalVelocity < -RestitutionVelocity )
+						contact.bias = math::maximum( contact.bias, -config.Elasticity * normalVelocity );
+
+					contact.normalImpulse = 0.0f;
+				}
+
+				// friction anchor and tangent basis
+
+				center /= (float) manifold.numContacts;
+				normal.normalize();
+
+				float radius = 0.0f;
+				for ( int j = 0; j < manifold.numContacts; ++j )
+					radius += ( contacts[manifold.firstContact+j].point - center ).length();
+				radius /= (float) manifold.numContacts;
+
+				manifold.normal = normal;
+				manifold.ra = center - position[a];
+				manifold.rb = b >= 0 ? center - position[b] : math::Vector(0,0,0);
+
+				if ( math::abs( normal.x ) >= 0.57735f )
+					manifold.tangent[0] = math::Vector( normal.y, -normal.x, 0.0f );
+				else
+					manifold.tangent[0] = math::Vector( 0.0f, normal.z, -normal.y );
+				manifold.tangent[0].normalize();
+				manifold.tangent[1] = normal.cross( manifold.tangent[0] );
+
+				manifold.tangentMass[0] = EffectiveMass( manifold.ra, manifold.rb, manifold.tangent[0], inverseMassSum, inverseInertiaA, inverseInertiaB );
+				manifold.tangentMass[1] = EffectiveMass( manifold.ra, manifold.rb, manifold.tangent[1], inverseMassSum, inverseInertiaA, inverseInertiaB );
+				manifold.twistMass = 1.0f / ( inverseInertiaA + inverseInertiaB );
+
+				manifold.maxFriction = config.Friction * deltaTime * manifold.numContacts;
+				manifold.maxTwist = manifold.maxFriction * radius;
+
+				manifold.tangentImpulse[0] = 0.0f;
+				manifold.tangentImpulse[1] = 0.0f;
+				manifold.twistImpulse = 0.0f;
+			}
+		}
+
+		// note: only once every bias velocity is known, since warm starting changes velocities
+
+		void WarmStartContacts()
+		{
+			const float WarmStartDistanceSquared = 0.05f * 0.05f;
+
+			for ( int i = 0; i < (int) manifolds.size(); ++i )
+			{
+				Manifold & manifold = manifolds[i];
+
+				std::vector<Manifold>::const_iterator itor = std::lower_bound( previousManifolds.begin(), previousManifolds.end(), manifold );
+				if ( itor == previousManifolds.end() || itor->key != manifold.key )
+					continue;
+
+				const Manifold & previous = *itor;
+
+				const int a = manifold.a;
+				const int b = manifold.b;
+
+				for ( int j = 0; j < manifold.numContacts; ++j )
+				{
+					ContactPoint & contact = contacts[manifold.firstContact+j];
+					for ( int k = 0; k < previous.numContacts; ++k )
+					{
+						const ContactPoint & previousContact = previousContacts[previous.firstContact+k];
+						if ( ( previousContact.point - contact.point ).lengthSquared() < WarmStartDistanceSquared )
+						{
+							contact.normalImpulse = previousContact.normalImpulse;
+							ApplyImpulse( a, b, contact.ra, contact.rb, contact.normal * contact.normalImpulse );
+							break;
+						}
+					}
+				}
+
+				if ( previous.normal.dot( manifold.normal ) > 0.95f )
+				{
+					manifold.tangentImpulse[0] = Clamp( previous.tangentImpulse[0], manifold.maxFriction );
+					manifold.tangentImpulse[1] = Clamp( previous.tangentImpulse[1], manifold.maxFriction );
+					manifold.twistImpulse = Clamp( previous.twistImpulse, manifold.maxTwist );
+					ApplyImpulse( a, b, manifold.ra, manifold.rb, manifold.tangent[0] * manifold.tangentImpulse[0] + manifold.tangent[1] * manifold.tangentImpulse[1] );
+					ApplyTwist( a, b, manifold.normal * manifold.twistImpulse );
+				}
+			}
+		}
+
+		void SolveContacts()
+		{
+			for ( int i = 0; i < (int) manifolds.size(); ++i )
+			{
+				Manifold & manifold = manifolds[i];
+
+				const int a = manifold.a;
+				const int b = manifold.b;
+
+				// friction first, then normal impulses which are kept non-negative
+
+				for ( int k = 0; k < 2; ++k )
+				{
+					const math::Vector & tangent = manifold.tangent[k];
+					const float tangentVelocity = RelativeVelocity( a, b, manifold.ra, manifold.rb ).dot( tangent );
+					const float previousImpulse = manifold.tangentImpulse[k];
+					manifold.tangentImpulse[k] = Clamp( previousImpulse - tangentVelocity * manifold.tangentMass[k], manifold.maxFriction );
+					ApplyImpulse( a, b, manifold.ra, manifold.rb, tangent * ( manifold.tangentImpulse[k] - previousImpulse ) );
+				}
+
+				const float twistVelocity = ( angularVelocity[a] - ( b >= 0 ? angularVelocity[b] : math::Vector(0,0,0) ) ).dot( manifold.normal );
+				const float previousTwist = manifold.twistImpulse;
+				manifold.twistImpulse = Clamp( previousTwist - twistVelocity * manifold.twistMass, manifold.maxTwist );
+				ApplyTwist( a, b, manifold.normal * ( manifold.twistImpulse - previousTwist ) );
+
+				for ( int j = 0; j < manifold.numContacts; ++j )
+				{
+					ContactPoint & contact = contacts[manifold.firstContact+j];
+					const float normalVelocity = RelativeVelocity( a, b, contact.ra, contact.rb ).dot( contact.normal );
+					const float previousImpulse = contact.normalImpulse;
+					contact.normalImpulse = math::maximum( previousImpulse + ( contact.bias - normalVelocity ) * contact.normalMass, 0.0f );
+					ApplyImpulse( a, b, contact.ra, contact.rb, contact.normal * ( contact.normalImpulse - previousImpulse ) );
+				}
+			}
+		}
+
+		void IntegratePositions( float deltaTime )
+		{
+			for ( int i = 0; i < (int) awakeObjects.size(); ++i )
+			{
+				const int id = awakeObjects[i];
+
+				position[id] += linearVelocity[id] * deltaTime;
+
+				const math::Vector & w = angularVelocity[id];
+				math::Quaternion & q = orientation[id];
+				q += math::Quaternion( 0.0f, w.x, w.y, w.z ) * q * ( 0.5f * deltaTime );
+				q.normalize();
+			}
+		}
+
+		float EffectiveMass( const math::Vector & ra, const math::Vector & rb, const math::Vector & direction, float inverseMassSum, float inverseInertiaA, float inverseInertiaB ) const
+		{
+			const float k = inverseMassSum + inverseInertiaA * ra.cross( direction ).lengthSquared() + inverseInertiaB * rb.cross( direction ).lengthSquared();
+			return k > 0.0f ? 1.0f / k : 0.0f;
+		}
+
+		static float Clamp( float value, float limit )
+		{
+			return value < -limit ? -limit : ( value > limit ? limit : value );
+		}
+
+		// velocity of a point on a relative to b. planes do not move
+
+		math::Vector RelativeVelocity( int a, int b, const math::Vector & ra, const math::Vector & rb ) const
+		{
+			math::Vector velocity = linearVelocity[a] + angularVelocity[a].cross( ra );
+			if ( b >= 0 )
+				velocity -= linearVelocity[b] + angularVelocity[b].cross( rb );
+			return velocity;
+		}
+
+		// apply an impulse to a and the opposite impulse to b (contact normals point from b into a)
+
+		void ApplyImpulse( int a, int b, const math::Vector & ra, const math::Vector & rb, const math::Vector & impulse )
+		{
+			linearVelocity[a] += impulse * inverseMass[a];
+			angularVelocity[a] += ra.cross( impulse ) * inverseInertia[a];
+			if ( b >= 0 )
+			{
+				linearVelocity[b] -= impulse * inverseMass[b];
+				angularVelocity[b] -= rb.cross( impulse ) * inverseInertia[b];
+			}
+		}
+
+		void ApplyTwist( int a, int b, const math::Vector & angularImpulse )
+		{
+			angularVelocity[a] += angularImpulse * inverseInertia[a];
+			if ( b >= 0 )
+				angularVelocity[b] -= angularImpulse * inverseInertia[b];
+		}
+
+		// island sleep, see OdeSimulation::SleepRestingIslands
+
+		int FindIsland( int id )
+		{
+			while ( islandParent[id] != id )
+			{
+				islandParent[id] = islandParent[islandParent[id]];
+				id = islandParent[id];
+			}
+			return id;
+		}
+
+		void SleepRestingIslands()
+		{
+			int numAwake = awakeObjects.size();
+			if ( numAwake == 0 )
+				return;
+
+			if ( islandParent.size() < exists.size() )
+			{
+				islandParent.resize( exists.size() );
+				islandMoving.resize( exists.size() );
+				islandHead.resize( exists.size() );
+			}
+
+			for ( int i = 0; i < numAwake; ++i )
+			{
+				const int id = awakeObjects[i];
+				islandParent[id] = id;
+				islandMoving[id] = 0;
+				islandHead[id] = -1;
+			}
+
+			for ( int i = 0; i < (int) interactionPairs.size(); ++i )
+			{
+				const int a = interactionPairs[i].a;
+				const int b = interactionPairs[i].b;
+				const int rootA = FindIsland( a );
+				const int rootB = FindIsland( b );
+				if ( rootA != rootB )
+					islandParent[ rootA < rootB ? rootB : rootA ] = rootA < rootB ? rootA : rootB;
+			}
+
+			for ( int i = 0; i < numAwake; ++i )
+			{
+				const int id = awakeObjects[i];
+				if ( timeAtRest[id] < config.RestTime )
+					islandMoving[ FindIsland( id ) ] = 1;
+			}
+
+			for ( int i = 0; i < numAwake; )
+			{
+				const int id = awakeObjects[i];
+				const int root = FindIsland( id );
+				if ( islandMoving[root] )
+				{
+					++i;
+					continue;
+				}
+
+				if ( islandHead[root] < 0 )
+				{
+					islandHead[root] = id;
+					nextInIsland[id] = id;
+				}
+				else
+				{
+					const int head = islandHead[root];
+					nextInIsland[id] = nextInIsland[head];
+					nextInIsland[head] = id;
+				}
+
+				timeAtRest[id] = config.RestTime;
+				linearVelocity[id] = math::Vector(0,0,0);
+				angularVelocity[id] = math::Vector(0,0,0);
+				RemoveAwakeObject( id );				// note: swaps the last awake object into slot i
+				InsertSleepingObject( id );
+				numAwake--;
+			}
+		}
+
+		SimulationConfig config;
+		SimulationStats stats;
+
+		// bodies, structure of arrays indexed by object id
+
+		std::vector<math::Vector> position;
+		std::vector<math::Quaternion> orientation;
+		std::vector<math::Vector> linearVelocity;
+		std::vector<math::Vector> angularVelocity;
+		std::vector<math::Vector> force;
+		std::vector<math::Vector> torque;
+		std::vector<collision::Box> boxes;
+		std::vector<float> halfSize;
+		std::vector<float> mass;
+		std::vector<float> inverseMass;
+		std::vector<float> inverseInertia;
+		std::vector<float> timeAtRest;
+		std::vector<int> awakeIndex;			// index in the awake list, -1 while sleeping
+		std::vector<int> nextInIsland;			// circular list of a sleeping island
+		std::vector<uint8_t> exists;
+		std::vector<int> freeObjects;
+		float maxScale;
+
+		std::vector<Plane> planes;
+
+		std::vector<int> awakeObjects;
+		std::vector<int> updatedObjects;
+		std::vector<int> islandParent;
+		std::vector<char> islandMoving;
+		std::vector<int> islandHead;
+
+		std::vector<GridCell> gridCell;
+		std::vector<int> gridBucketStart;
+		std::vector<int> gridBucketFill;
+		std::vector<int> gridSorted;
+		uint32_t gridBucketMask;
+		float gridCellSize;
+
+		std::vector< std::vector<int> > sleepingGrid;
+		std::vector<GridCell> sleepingCell;
+		std::vector<int> sleepingSlot;			// index in the sleeping grid bucket, -1 while awake
+		std::vector<int> wokenInCollide;
+		bool gridColliding;
+
+		std::vector<Manifold> manifolds;
+		std::vector<ContactPoint> contacts;
+		std::vector<Manifold> previousManifolds;
+		std::vector<ContactPoint> previousContacts;
+
+		std::vector<InteractionPair> interactionPairs;
+	};
+}
+
+#endif
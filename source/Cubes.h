@@ -22,7 +22,6 @@ namespace cubes
  		ActiveId activeId;
  		uint32_t enabled : 1;
  		uint32_t activated : 1;
-		uint32_t framesSinceLastUpdate : 8;
 		math::Vector position;
 		math::Quaternion orientation;
 		math::Vector linearVelocity;
@@ -60,7 +59,7 @@ namespace cubes
 			enabled = simulationObject.enabled;
 		}
 		
-		void ActiveToView( view::ObjectState & viewObjectState, int authority, bool pendingDeactivation, int framesSinceLastUpdate )
+		void ActiveToView( view::ObjectState & viewObjectState, int authority, bool pendingDeactivation, uint32_t lastUpdateFrame )
 		{
 			viewObjectState.id = id;
 			viewObjectState.authority = authority;
@@ -71,7 +70,7 @@ namespace cubes
 			viewObjectState.angularVelocity = angularVelocity;
 			viewObjectState.scale = scale;
 			viewObjectState.pendingDeactivation = pendingDeactivation;
-			viewObjectState.framesSinceLastUpdate = framesSinceLastUpdate;
+			viewObjectState.lastUpdateFrame = lastUpdateFrame;
 		}
 		
 		void Clamp( float bound_x, float bound_y )
@@ -112,7 +111,6 @@ namespace cubes
 		
 		void DatabaseToActive( ActiveObject & activeObject )
 		{
-			activeObject.framesSinceLastUpdate = 0;
 			activeObject.enabled = enabled;
 			activeObject.activated = activated;
 			activeObject.position = position;
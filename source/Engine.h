@@ -11,9 +11,13 @@
 #include "Mathematics.h"
 #include "Activation.h"
 #include "Simulation.h"
+#include "Profiler.h"
+#include "Clock.h"
 
 #include <list>
+#include <map>
 #include <algorithm>
+#include <functional>
 #include <vector>
 
 namespace engine
@@ -125,8 +129,24 @@ namespace engine
 			return entries.size();
 		}
 
+		const AuthorityEntry & GetEntry( int index ) const
+		{
+			assert( index >= 0 );
+			assert( index < (int) entries.size() );
+			return entries[index];
+		}
+
+		// used when loading a snapshot: restores an entry exactly, including its timeout
+
+		void RestoreEntry( const AuthorityEntry & entry )
+		{
+			assert( entry.authority >= 0 );
+			assert( entry.authority < MaxPlayers );
+			entries.push_back( entry );
+		}
+
 	private:
-	
+
 		std::vector<AuthorityEntry> entries;
 	};
 
@@ -318,6 +338,14 @@ namespace engine
 		Used to track n most important active objects to send,
 		so we know which objects to include in each packet while
 		distributing fairly according to priority and last time sent.
+
+		Each object's priority grows at its own rate as the set advances.
+		Objects are grouped by rate and each group is sorted by priority
+		less rate times elapsed time, which stays fixed as time advances,
+		so only objects whose rate or priority changed are touched each
+		frame. The order is merged from the groups lazily, only as far as
+		it is read. Priorities set by index take effect at the next sort,
+		so the order holds while a packet is being built from it.
 	*/
 
 	class PrioritySet
@@ -326,91 +354,533 @@ namespace engine
 		
 		PrioritySet()
 		{
+			time = 0.0;
+			count = 0;
+			numRates = 0;
 		}
 		
 		void Clear()
 		{
-			entries.clear();
+			for ( int i = 0; i < numRates; ++i )
+				rates[i].keys.clear();
+			numRates = 0;
+			slots.clear();
+			order.clear();
+			pending.clear();
+			time = 0.0;
+			count = 0;
 		}
 		
 		bool ObjectExists( ObjectId objectId ) const
 		{
-			for ( int i = 0; i < (int) entries.size(); ++i )
-			{
-				if ( entries[i].objectId == objectId )
-					return true;
-			}
-			return false;
+			return objectId < slots.size() && slots[objectId].rate >= 0;
 		}
 
-		void AddObject( ObjectId objectId )
+		void AddObject( ObjectId objectId, float rate = 1.0f )
 		{
 			assert( !ObjectExists( objectId ) );
-			const int size = entries.size();
-			entries.resize( size + 1 );
-			entries[size].objectId = objectId;
-			entries[size].priority = 0.0f;
+			if ( objectId >= slots.size() )
+				slots.resize( objectId + 1 );
+			Insert( objectId, FindRate( rate ), 0.0f );
+			count++;
 		}
 		
 		void RemoveObject( ObjectId objectId )
 		{
-			const int count = entries.size();
 			assert( count > 0 );
-			for ( int i = 0; i < count; ++i )
-			{
-				if ( entries[i].objectId == objectId )
-				{
-					entries[i].objectId = entries[count-1].objectId;
-					entries[i].priority = entries[count-1].priority;
-					entries.resize( count - 1 );
-					return;
-				}
-			}
+			if ( !ObjectExists( objectId ) )
+				return;
+			Remove( objectId );
+			slots[objectId].rate = -1;
+			count--;
 		}
 
-		float GetPriorityAtIndex( int index ) const
+		// rate is priority gained per second. changing it keeps the current priority
+
+		void SetObjectRate( ObjectId objectId, float rate )
 		{
-			assert( index >= 0 );
-			assert( index < (int) entries.size() );
-			return entries[index].priority;
+			assert( ObjectExists( objectId ) );
+			const int index = FindRate( rate );
+			if ( index == slots[objectId].rate )
+				return;
+			const float priority = GetPriority( objectId );
+			Remove( objectId );
+			Insert( objectId, index, priority );
+		}
+
+		void SetObjectPriority( ObjectId objectId, float priority )
+		{
+			assert( ObjectExists( objectId ) );
+			const int index = slots[objectId].rate;
+			if ( slots[objectId].key->first == priority - rates[index].rate * time )
+				return;
+			Remove( objectId );
+			Insert( objectId, index, priority );
+		}
+
+		float GetPriority( ObjectId objectId ) const
+		{
+			assert( ObjectExists( objectId ) );
+			const Slot & slot = slots[objectId];
+			return (float) ( slot.key->first + rates[slot.rate].rate * time );
+		}
+
+		void Advance( float deltaTime )
+		{
+			time += deltaTime;
+			order.clear();
+		}
+
+		float GetPriorityAtIndex( int index )
+		{
+			Merge( index );
+			return order[index].priority;
 		}
 		
 		void SetPriorityAtIndex( int index, float priority )
 		{
-			assert( index >= 0 );
-			assert( index < (int) entries.size() );
-			entries[index].priority = priority;
+			Merge( index );
+			order[index].priority = priority;
+			pending.push_back( order[index] );
 		}
 
 		void SortObjects()
 		{
-			std::sort( entries.begin(), entries.end() );
+			for ( int i = 0; i < (int) pending.size(); ++i )
+			{
+				if ( ObjectExists( pending[i].objectId ) )
+					SetObjectPriority( pending[i].objectId, pending[i].priority );
+			}
+			pending.clear();
+			order.clear();
 		}
 		
-		ObjectId GetPriorityObject( int index ) const
+		ObjectId GetPriorityObject( int index )
 		{
-			return entries[index].objectId;
+			Merge( index );
+			return order[index].objectId;
 		}
 		
 		int GetObjectCount() const
 		{
-			return entries.size();
+			return count;
 		}
 		
 	private:
-		
+
+		typedef std::multimap< double, ObjectId, std::greater<double> > Keys;
+
+		struct Rate
+		{
+			float rate;
+			Keys keys;					// priority less rate * time, highest first
+			Keys::iterator next;		// next entry to merge into the order
+		};
+
+		struct Slot
+		{
+			int rate;
+			Keys::iterator key;
+
+			Slot()
+			{
+				rate = -1;
+			}
+		};
+
 		struct ObjectEntry
 		{
-			// todo: we could probably crunch these guys down into 32 bits...
-			ActiveId objectId;
+			ObjectId objectId;
 			float priority;
-			bool operator < ( const ObjectEntry & other ) const
+		};
+
+		enum { MaxRates = 8 };
+
+		int FindRate( float rate )
+		{
+			for ( int i = 0; i < numRates; ++i )
 			{
-				return priority > other.priority;
+				if ( rates[i].rate == rate )
+					return i;
 			}
-		};
+			assert( numRates < MaxRates );
+			rates[numRates].rate = rate;
+			return numRates++;
+		}
+
+		void Insert( ObjectId objectId, int index, float priority )
+		{
+			Rate & rate = rates[index];
+			slots[objectId].rate = index;
+			slots[objectId].key = rate.keys.insert( Keys::value_type( priority - rate.rate * time, objectId ) );
+			order.clear();
+		}
+
+		// note: the last entry of equal priority takes the removed entry's place, as swap removal always did
+
+		void Remove( ObjectId objectId )
+		{
+			Rate & rate = rates[ slots[objectId].rate ];
+			Keys::iterator entry = slots[objectId].key;
+			Keys::iterator last = rate.keys.upper_bound( entry->first );
+			--last;
+			if ( last != entry )
+			{
+				entry->second = last->second;
+				slots[entry->second].key = entry;
+				entry = last;
+			}
+			rate.keys.erase( entry );
+			order.clear();
+		}
+
+		void Merge( int index )
+		{
+			assert( index >= 0 );
+			assert( index < count );
+			if ( order.empty() )
+			{
+				for ( int i = 0; i < numRates; ++i )
+					rates[i].next = rates[i].keys.begin();
+			}
+			while ( (int) order.size() <= index )
+			{
+				int best = -1;
+				double bestPriority = 0.0;
+				for ( int i = 0; i < numRates; ++i )
+				{
+					if ( rates[i].next == rates[i].keys.end() )
+						continue;
+					const double priority = rates[i].next->first + rates[i].rate * time;
+					if ( best < 0 || priority > bestPriority )
+					{
+						best = i;
+						bestPriority = priority;
+					}
+				}
+				assert( best >= 0 );
+				ObjectEntry entry;
+				entry.objectId = rates[best].next->second;
+				entry.priority = (float) bestPriority;
+				order.push_back( entry );
+				++rates[best].next;
+			}
+		}
+
+		double time;
+		int count;
+		int numRates;
+		Rate rates[MaxRates];
+		std::vector<Slot> slots;				// indexed by object id
+		std::vector<ObjectEntry> order;			// merged so far
+		std::vector<ObjectEntry> pending;		// set by index, applied at the next sort
+	};
+
+	/*
+		Frame governor.
+		Watches the per-phase timings of each game update and trades quality
+		for time when the frame goes over budget: solver iterations first when
+		the simulation dominates, then send interval, then activation radius.
+		Knobs are restored in the reverse order once the frame has stayed well
+		under budget for a while. The gap between the high and low water marks,
+		plus a cooldown after each adjustment, keeps levels from oscillating.
+	*/
+
+	using platform::GetTime;
+
+	// note: phases line up with the first profile zones, see Profiler.h
+
+	enum FramePhase
+	{
+		PHASE_Input,
+		PHASE_Activation,
+		PHASE_Priority,
+		PHASE_Simulation,
+		PHASE_Authority,
+		PHASE_View,
+		PHASE_Count
+	};
+
+	struct FrameTimings
+	{
+		float phase[PHASE_Count];			// seconds spent in each phase of the update
+		float total;
+
+		FrameTimings()
+		{
+			for ( int i = 0; i < PHASE_Count; ++i )
+				phase[i] = 0.0f;
+			total = 0.0f;
+		}
+	};
+
+	enum GovernorKnob
+	{
+		KNOB_Iterations,
+		KNOB_SendInterval,
+		KNOB_ActivationDistance
+	};
+
+	struct GovernorConfig
+	{
+		bool Enabled;
+		float TargetFrameTime;				// budget for one game update (seconds)
+		float HighWater;					// degrade when the average goes above this fraction of budget
+		float LowWater;						// restore when the average stays below this fraction of budget
+		float Smoothing;					// weight of the newest sample in the moving average
+		int DegradeFrames;					// frames over budget before degrading
+		int RestoreFrames;					// frames under budget before restoring
+		int Cooldown;						// frames to ignore after any adjustment
+		int MinIterations;
+		int MaxIterations;
+		int IterationStep;
+		int MaxSendInterval;				// send every n frames at most
+		float MinActivationDistance;
+		float MaxActivationDistance;
+		float ActivationDistanceStep;
+
+		GovernorConfig()
+		{
+			Enabled = false;
+			TargetFrameTime = 0.016f;
+			HighWater = 1.0f;
+			LowWater = 0.7f;
+			Smoothing = 0.1f;
+			DegradeFrames = 10;
+			RestoreFrames = 60;
+			Cooldown = 30;
+			MinIterations = 4;
+			MaxIterations = 10;
+			IterationStep = 2;
+			MaxSendInterval = 4;
+			MinActivationDistance = 3.0f;
+			MaxActivationDistance = 5.0f;
+			ActivationDistanceStep = 0.5f;
+		}
+	};
+
+	struct GovernorAdjustment
+	{
+		uint32_t frame;
+		GovernorKnob knob;
+		float oldValue;
+		float newValue;
+		float averageFrameTime;
+	};
+
+	struct GovernorStats
+	{
+		int iterations;
+		int sendInterval;
+		float activationDistance;
+		float averageFrameTime;
+		int degrades;
+		int restores;
+		FrameTimings lastFrame;
+	};
+
+	class FrameGovernor
+	{
+	public:
+
+		enum { MaxAdjustments = 32 };
+
+		FrameGovernor( const GovernorConfig & config = GovernorConfig() )
+		{
+			Initialize( config );
+		}
+
+		void Initialize( const GovernorConfig & config )
+		{
+			assert( config.MinIterations > 0 );
+			assert( config.MinIterations <= config.MaxIterations );
+			assert( config.MinActivationDistance <= config.MaxActivationDistance );
+			assert( config.MaxSendInterval >= 1 );
+			assert( config.LowWater < config.HighWater );
+			this->config = config;
+			frame = 0;
+			overFrames = 0;
+			underFrames = 0;
+			cooldown = 0;
+			numAdjustments = 0;
+			stats.iterations = config.MaxIterations;
+			stats.sendInterval = 1;
+			stats.activationDistance = config.MaxActivationDistance;
+			stats.averageFrameTime = 0.0f;
+			stats.degrades = 0;
+			stats.restores = 0;
+			stats.lastFrame = FrameTimings();
+		}
+
+		// returns true if any knob changed this frame
+
+		bool Update( const FrameTimings & timings )
+		{
+			frame++;
+			stats.lastFrame = timings;
+			stats.averageFrameTime += ( timings.total - stats.averageFrameTime ) * config.Smoothing;
+
+			if ( !config.Enabled )
+				return false;
+
+			if ( cooldown > 0 )
+			{
+				cooldown--;
+				return false;
+			}
+
+			if ( stats.averageFrameTime > config.TargetFrameTime * config.HighWater )
+			{
+				underFrames = 0;
+				if ( ++overFrames >= config.DegradeFrames )
+				{
+					overFrames = 0;
+					return Degrade( timings );
+				}
+			}
+			else if ( stats.averageFrameTime < config.TargetFrameTime * config.LowWater )
+			{
+				overFrames = 0;
+				if ( ++underFrames >= config.RestoreFrames )
+				{
+					underFrames = 0;
+					return Restore();
+				}
+			}
+			else
+			{
+				overFrames = 0;
+				underFrames = 0;
+			}
+
+			return false;
+		}
+
+		int GetIterations() const
+		{
+			return stats.iterations;
+		}
+
+		int GetSendInterval() const
+		{
+			return stats.sendInterval;
+		}
+
+		float GetActivationDistance() const
+		{
+			return stats.activationDistance;
+		}
+
+		const GovernorStats & GetStats() const
+		{
+			return stats;
+		}
+
+		const GovernorConfig & GetConfig() const
+		{
+			return config;
+		}
+
+		// total number of adjustments made. the most recent MaxAdjustments are kept
+
+		int GetNumAdjustments() const
+		{
+			return numAdjustments;
+		}
+
+		const GovernorAdjustment & GetAdjustment( int index ) const
+		{
+			assert( index >= 0 );
+			assert( index < numAdjustments );
+			assert( index >= numAdjustments - MaxAdjustments );
+			return adjustments[index % MaxAdjustments];
+		}
+
+	protected:
+
+		bool Degrade( const FrameTimings & timings )
+		{
+			const bool simulationBound = timings.phase[PHASE_Simulation] * 2 > timings.total;
+
+			if ( simulationBound && stats.iterations > config.MinIterations )
+				SetIterations( stats.iterations - config.IterationStep );
+			else if ( stats.sendInterval < config.MaxSendInterval )
+				SetSendInterval( stats.sendInterval + 1 );
+			else if ( stats.activationDistance > config.MinActivationDistance )
+				SetActivationDistance( stats.activationDistance - config.ActivationDistanceStep );
+			else if ( stats.iterations > config.MinIterations )
+				SetIterations( stats.iterations - config.IterationStep );
+			else
+				return false;
+
+			stats.degrades++;
+			cooldown = config.Cooldown;
+			return true;
+		}
+
+		bool Restore()
+		{
+			if ( stats.activationDistance < config.MaxActivationDistance )
+				SetActivationDistance( stats.activationDistance + config.ActivationDistanceStep );
+			else if ( stats.sendInterval > 1 )
+				SetSendInterval( stats.sendInterval - 1 );
+			else if ( stats.iterations < config.MaxIterations )
+				SetIterations( stats.iterations + config.IterationStep );
+			else
+				return false;
+
+			stats.restores++;
+			cooldown = config.Cooldown;
+			return true;
+		}
+
+		void SetIterations( int iterations )
+		{
+			if ( iterations < config.MinIterations )
+				iterations = config.MinIterations;
+			if ( iterations > config.MaxIterations )
+				iterations = config.MaxIterations;
+			RecordAdjustment( KNOB_Iterations, (float) stats.iterations, (float) iterations );
+			stats.iterations = iterations;
+		}
+
+		void SetSendInterval( int sendInterval )
+		{
+			RecordAdjustment( KNOB_SendInterval, (float) stats.sendInterval, (float) sendInterval );
+			stats.sendInterval = sendInterval;
+		}
+
+		void SetActivationDistance( float activationDistance )
+		{
+			if ( activationDistance < config.MinActivationDistance )
+				activationDistance = config.MinActivationDistance;
+			if ( activationDistance > config.MaxActivationDistance )
+				activationDistance = config.MaxActivationDistance;
+			RecordAdjustment( KNOB_ActivationDistance, stats.activationDistance, activationDistance );
+			stats.activationDistance = activationDistance;
+		}
+
+		void RecordAdjustment( GovernorKnob knob, float oldValue, float newValue )
+		{
+			GovernorAdjustment & adjustment = adjustments[numAdjustments % MaxAdjustments];
+			adjustment.frame = frame;
+			adjustment.knob = knob;
+			adjustment.oldValue = oldValue;
+			adjustment.newValue = newValue;
+			adjustment.averageFrameTime = stats.averageFrameTime;
+			numAdjustments++;
+		}
+
+	private:
 
-		std::vector<ObjectEntry> entries;
+		GovernorConfig config;
+		GovernorStats stats;
+		uint32_t frame;
+		int overFrames;
+		int underFrames;
+		int cooldown;
+		int numAdjustments;
+		GovernorAdjustment adjustments[MaxAdjustments];
 	};
 	
 	// helper functions for compression
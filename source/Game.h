@@ -14,6 +14,7 @@
 
 #include "Activation.h"
 #include "Engine.h"
+#include "Snapshot.h"
 #include "Network.h"
 #include "ViewObject.h"
 
@@ -81,7 +82,14 @@ namespace game
  		int cellWidth;
 		int cellHeight;
 		float authorityTimeout;
+		bool tieredUpdates;						// outer objects update priority and resync with the simulation less often
+		float halfRateRadius;					// fraction of the activation radius beyond which objects update every 2nd frame
+		float quarterRateRadius;				// fraction of the activation radius beyond which objects update every 4th frame
+		int rollbackFrames;						// frames of history kept for rewinding corrections. 0 disables rollback
+		int rollbackMaxObjects;					// corrections touching larger islands are applied without rewinding
+		float rollbackBudget;					// seconds per frame to spend resimulating corrections
 		SimulationConfig simConfig;
+		GovernorConfig governor;				// iteration and activation limits are taken from simConfig and activationDistance
 		int maxObjects;
 		int initialObjectsPerCell;
 		int initialActiveObjects;
@@ -94,6 +102,12 @@ namespace game
 			cellWidth = 16;
 			cellHeight = 16;
 			authorityTimeout = 0.1f;
+			tieredUpdates = false;
+			halfRateRadius = 0.5f;
+			quarterRateRadius = 0.75f;
+			rollbackFrames = 0;
+			rollbackMaxObjects = 256;
+			rollbackBudget = 0.004f;
 			maxObjects = 1024;
 			initialObjectsPerCell = 32;
 			initialActiveObjects = 256;
@@ -109,6 +123,117 @@ namespace game
 		FLAG_DisableInteractionAuthority
 	};
 
+	/*
+		Rollback buffer.
+		Ring of recent frames for client side prediction: player input, the
+		simulation state of every active object at the start of the step, the
+		forces applied during the frame and the interaction pairs it produced.
+		Frames are keyed by the local player frame, so a correction stamped with
+		frame n finds the state to rewind to and everything needed to replay.
+	*/
+
+	struct RollbackForce
+	{
+		int id;									// simulation id
+		math::Vector force;
+		math::Vector torque;
+	};
+
+	struct RollbackFrame
+	{
+		uint32_t frame;
+		bool valid;
+		float deltaTime;
+		Input input[MaxPlayers];
+		std::vector<int> ids;					// simulation ids, sorted
+		std::vector<ObjectId> objectIds;		// object id for each simulation id above
+		SimulationObjectStates states;
+		std::vector<RollbackForce> forces;
+		std::vector<InteractionPair> pairs;
+
+		RollbackFrame()
+		{
+			frame = 0;
+			valid = false;
+			deltaTime = 0.0f;
+		}
+
+		int FindObject( int id ) const
+		{
+			std::vector<int>::const_iterator itor = std::lower_bound( ids.begin(), ids.end(), id );
+			return ( itor != ids.end() && *itor == id ) ? (int) ( itor - ids.begin() ) : -1;
+		}
+	};
+
+	class RollbackBuffer
+	{
+	public:
+
+		void Allocate( int size )
+		{
+			frames.resize( size );
+			Clear();
+		}
+
+		void Clear()
+		{
+			for ( int i = 0; i < (int) frames.size(); ++i )
+				frames[i].valid = false;
+		}
+
+		int GetSize() const
+		{
+			return frames.size();
+		}
+
+		RollbackFrame & BeginFrame( uint32_t frame )
+		{
+			assert( !frames.empty() );
+			RollbackFrame & record = frames[ frame % frames.size() ];
+			record.frame = frame;
+			record.valid = true;
+			record.ids.clear();
+			record.objectIds.clear();
+			record.forces.clear();
+			record.pairs.clear();
+			return record;
+		}
+
+		RollbackFrame * FindFrame( uint32_t frame )
+		{
+			if ( frames.empty() )
+				return NULL;
+			RollbackFrame & record = frames[ frame % frames.size() ];
+			return ( record.valid && record.frame == frame ) ? &record : NULL;
+		}
+
+	private:
+
+		std::vector<RollbackFrame> frames;
+	};
+
+	struct RollbackStats
+	{
+		int corrections;						// corrections rewound and resimulated
+		int snapped;							// corrections applied at the present frame instead
+		int lastFrames;							// frames resimulated by the last correction
+		int lastObjects;						// objects in the island rewound by the last correction
+		float lastTime;							// seconds spent on the last correction
+		float maxTime;
+		float totalTime;
+
+		RollbackStats()
+		{
+			corrections = 0;
+			snapped = 0;
+			lastFrames = 0;
+			lastObjects = 0;
+			lastTime = 0.0f;
+			maxTime = 0.0f;
+			totalTime = 0.0f;
+		}
+	};
+
 	class Interface
 	{
 	public:
@@ -150,6 +275,11 @@ namespace game
 			activationSystem = new ActivationSystem( config.maxObjects, config.activationDistance, config.cellWidth, config.cellHeight, config.cellSize, config.initialObjectsPerCell, config.initialActiveObjects, config.deactivationTime );
 			simulation = new Simulation();
 			simulation->Initialize( config.simConfig );
+			simulation->SetProfiler( &profiler );
+			rollbackSimulation = NULL;
+			rollbackTime = 0.0f;
+			if ( config.rollbackFrames > 0 )
+				rollbackBuffer.Allocate( config.rollbackFrames );
 			objects = new DatabaseObject[config.maxObjects];
 			objectCount = 0;
 			localPlayerId = -1;
@@ -162,6 +292,27 @@ namespace game
 				playerFocus[i] = 0;
 			}
 			activeObjects.Allocate( config.initialActiveObjects );
+			activeIndex.resize( config.maxObjects, -1 );
+			objectTier.resize( config.maxObjects, 0 );
+			objectStale.resize( config.maxObjects, 0 );
+			objectUpdateFrame.resize( config.maxObjects, 0 );
+			objectDirty.resize( config.maxObjects, 0 );
+			priorityFocus = 0;
+			viewFocusIndex = -1;
+			viewRebuild = true;
+			tierFrame = 0;
+			for ( int i = 0; i < NumTiers; ++i )
+				tierCount[i] = 0;
+			tierOrigin = math::Vector(0,0,0);
+			tierRadius = 0.0f;
+			GovernorConfig governorConfig = config.governor;
+			governorConfig.MaxIterations = config.simConfig.MaxIterations;
+			governorConfig.MaxActivationDistance = config.activationDistance;
+			if ( governorConfig.MinIterations > governorConfig.MaxIterations )
+				governorConfig.MinIterations = governorConfig.MaxIterations;
+			if ( governorConfig.MinActivationDistance > governorConfig.MaxActivationDistance )
+				governorConfig.MinActivationDistance = governorConfig.MaxActivationDistance;
+			governor.Initialize( governorConfig );
 		}
 		
 		~Instance()
@@ -169,6 +320,7 @@ namespace game
 			if ( initialized )
 				Shutdown();
 			delete [] objects;
+			delete rollbackSimulation;
 			delete simulation;
 			delete activationSystem;
 		}
@@ -195,10 +347,37 @@ namespace game
 			objectCount++;
 		}
 
+		/*
+			Add many objects at once. Ids are assigned in order, exactly as calling
+			AddObject for each. The database copy and the activation grid binning
+			are split across extra worker threads if asked for.
+		*/
+
+		void AddObjects( const DatabaseObject * objects, const float * x, const float * y, int count, int threads = 0 )
+		{
+			assert( count >= 0 );
+			assert( objectCount + count < config.maxObjects );
+			platform::WorkerPool pool;
+			if ( threads > 0 )
+				pool.Start( threads );
+			BulkCopy copy;
+			copy.destination = &this->objects[objectCount+1];
+			copy.source = objects;
+			copy.count = count;
+			copy.chunkSize = ( count + pool.GetNumThreads() - 1 ) / pool.GetNumThreads();
+			pool.Run( CopyObjectsTask, &copy, pool.GetNumThreads() );
+			activationSystem->InsertObjects( objectCount + 1, x, y, count, threads > 0 ? &pool : NULL );
+			objectCount += count;
+		}
+
 		void AddPlane( const math::Vector & normal, float d )
 		{
 			assert( initializing );
 			simulation->AddPlane( normal, d );
+			Plane plane;
+			plane.normal = normal;
+			plane.d = d;
+			planes.push_back( plane );
 		}
 
 		void InitializeEnd()
@@ -237,9 +416,25 @@ namespace game
 			assert( initialized );
 			objectCount = 0;
 			activeObjects.Clear();
+			activeIndex.assign( config.maxObjects, -1 );
+			objectTier.assign( config.maxObjects, 0 );
+			for ( int i = 0; i < NumTiers; ++i )
+				tierCount[i] = 0;
+			tierRadius = 0.0f;
+			objectStale.assign( config.maxObjects, 0 );
+			objectDirty.assign( config.maxObjects, 0 );
+			priorityDirty.clear();
+			viewDirty.clear();
+			authorityIds.clear();
+			priorityFocus = 0;
+			viewRebuild = true;
+			activationSystem->ClearPendingChanges();
+			activeObjectIds.clear();
 			authorityManager.Clear();
 			interactionManager.ClearInteractions();
 			simulation->Reset();
+			planes.clear();
+			rollbackBuffer.Clear();
 			initialized = false;
 			for ( int i = 0; i < MaxPlayers; ++i )
 			{
@@ -250,6 +445,231 @@ namespace game
 			}
 		}
 		
+		/*
+			Save the world to a snapshot: the object database with active objects
+			written back into it, the contents of every activation cell, object
+			authority and the frame counters. Players, input and the simulation
+			are session state and are not saved.
+		*/
+
+		void SaveSnapshot( std::vector<uint8_t> & buffer )
+		{
+			assert( initialized );
+
+			SnapshotWriter writer( buffer );
+
+			uint32_t databaseOffset;
+			DatabaseObject * database = writer.Append<DatabaseObject>( objectCount, databaseOffset );
+			if ( objectCount > 0 )
+				memcpy( database, &objects[1], sizeof( DatabaseObject ) * objectCount );
+			for ( int i = 0; i < activeObjects.GetCount(); ++i )
+			{
+				ActiveObject activeObject = activeObjects.GetObject( i );
+				if ( objectStale[activeObject.id] )
+				{
+					SimulationObjectState objectState;
+					simulation->GetObjectState( activeObject.activeId, objectState );
+					activeObject.SimulationToActive( objectState );
+				}
+				database[activeObject.id-1].ActiveToDatabase( activeObject );
+			}
+
+			const int width = activationSystem->GetWidth();
+			const int height = activationSystem->GetHeight();
+			const int numCells = width * height;
+			uint32_t cellCountOffset;
+			uint32_t * cellCounts = writer.Append<uint32_t>( numCells, cellCountOffset );
+			uint32_t cellObjectCount = 0;
+			for ( int iy = 0; iy < height; ++iy )
+			{
+				for ( int ix = 0; ix < width; ++ix )
+				{
+					const int count = activationSystem->GetCellAtIndex( ix, iy )->GetObjectCount();
+					cellCounts[ix+iy*width] = count;
+					cellObjectCount += count;
+				}
+			}
+
+			uint32_t cellObjectOffset;
+			SnapshotCellObject * cellObjects = writer.Append<SnapshotCellObject>( cellObjectCount, cellObjectOffset );
+			for ( int iy = 0; iy < height; ++iy )
+			{
+				for ( int ix = 0; ix < width; ++ix )
+				{
+					activation::Cell * cell = activationSystem->GetCellAtIndex( ix, iy );
+					for ( int i = 0; i < cell->GetObjectCount(); ++i )
+					{
+						const activation::CellObject & cellObject = cell->GetObject( i );
+						cellObjects->id = cellObject.id;
+						cellObjects->x = cellObject.x;
+						cellObjects->y = cellObject.y;
+						cellObjects++;
+					}
+				}
+			}
+
+			const int authorityCount = authorityManager.GetEntryCount();
+			uint32_t authorityOffset;
+			SnapshotAuthority * authority = writer.Append<SnapshotAuthority>( authorityCount, authorityOffset );
+			for ( int i = 0; i < authorityCount; ++i )
+			{
+				const AuthorityEntry & entry = authorityManager.GetEntry( i );
+				authority[i].id = entry.id;
+				authority[i].authority = entry.authority;
+				authority[i].forced = entry.forced;
+				authority[i].time = entry.time;
+			}
+
+			uint32_t planeOffset;
+			SnapshotPlane * plane = writer.Append<SnapshotPlane>( planes.size(), planeOffset );
+			for ( int i = 0; i < (int) planes.size(); ++i )
+			{
+				plane[i].normal[0] = planes[i].normal.x;
+				plane[i].normal[1] = planes[i].normal.y;
+				plane[i].normal[2] = planes[i].normal.z;
+				plane[i].d = planes[i].d;
+			}
+
+			SnapshotHeader & header = writer.GetHeader();
+			header.databaseObjectBytes = sizeof( DatabaseObject );
+			header.objectCount = objectCount;
+			header.cellWidth = width;
+			header.cellHeight = height;
+			header.cellSize = activationSystem->GetCellSize();
+			header.cellObjectCount = cellObjectCount;
+			header.authorityCount = authorityCount;
+			header.planeCount = planes.size();
+			header.flags = flags;
+			header.tierFrame = tierFrame;
+			for ( int i = 0; i < MaxPlayers; ++i )
+				header.frame[i] = frame[i];
+			header.databaseOffset = databaseOffset;
+			header.cellCountOffset = cellCountOffset;
+			header.cellObjectOffset = cellObjectOffset;
+			header.authorityOffset = authorityOffset;
+			header.planeOffset = planeOffset;
+
+			writer.Finish();
+		}
+
+		bool SaveSnapshot( const char * filename )
+		{
+			std::vector<uint8_t> buffer;
+			SaveSnapshot( buffer );
+			return WriteSnapshotFile( filename, buffer );
+		}
+
+		/*
+			Load a snapshot in place of InitializeBegin/AddObject/InitializeEnd.
+			The instance must be freshly constructed with the same grid layout.
+			Returns false, leaving the instance untouched, if the snapshot is
+			corrupt, from another version or does not fit this instance.
+		*/
+
+		bool LoadSnapshot( const uint8_t * data, uint32_t bytes )
+		{
+			assert( !initialized );
+			assert( objectCount == 0 );
+
+			const SnapshotHeader * header = ValidateSnapshot( data, bytes );
+			if ( !header )
+				return false;
+
+			if ( header->databaseObjectBytes != sizeof( DatabaseObject ) ||
+				 (int) header->objectCount >= config.maxObjects ||
+				 (int) header->cellWidth != activationSystem->GetWidth() ||
+				 (int) header->cellHeight != activationSystem->GetHeight() ||
+				 header->cellSize != activationSystem->GetCellSize() ||
+				 header->cellObjectCount != header->objectCount )
+				return false;
+
+			const int numCells = header->cellWidth * header->cellHeight;
+			if ( !ValidateSnapshotSection( *header, header->databaseOffset, header->objectCount, sizeof( DatabaseObject ) ) ||
+				 !ValidateSnapshotSection( *header, header->cellCountOffset, numCells, sizeof( uint32_t ) ) ||
+				 !ValidateSnapshotSection( *header, header->cellObjectOffset, header->cellObjectCount, sizeof( SnapshotCellObject ) ) ||
+				 !ValidateSnapshotSection( *header, header->authorityOffset, header->authorityCount, sizeof( SnapshotAuthority ) ) ||
+				 !ValidateSnapshotSection( *header, header->planeOffset, header->planeCount, sizeof( SnapshotPlane ) ) )
+				return false;
+
+			// every object must appear once, on the grid, in the cell it was saved under
+
+			const uint32_t * cellCounts = (const uint32_t*) ( data + header->cellCountOffset );
+			const SnapshotCellObject * cellObjects = (const SnapshotCellObject*) ( data + header->cellObjectOffset );
+			std::vector<uint8_t> seen( header->objectCount + 1, 0 );
+			uint32_t cellObjectCount = 0;
+			for ( int i = 0; i < numCells; ++i )
+			{
+				if ( cellCounts[i] > header->cellObjectCount - cellObjectCount )
+					return false;
+				for ( uint32_t j = cellObjectCount; j < cellObjectCount + cellCounts[i]; ++j )
+				{
+					const SnapshotCellObject & cellObject = cellObjects[j];
+					if ( cellObject.id == 0 || cellObject.id > header->objectCount || seen[cellObject.id] )
+						return false;
+					if ( !activationSystem->IsInBounds( cellObject.x, cellObject.y ) ||
+						 activationSystem->GetCellIndex( cellObject.x, cellObject.y ) != i )
+						return false;
+					seen[cellObject.id] = 1;
+				}
+				cellObjectCount += cellCounts[i];
+			}
+			if ( cellObjectCount != header->cellObjectCount )
+				return false;
+
+			// the snapshot is good: copy the database and fill each cell in one go
+
+			objectCount = header->objectCount;
+			if ( objectCount > 0 )
+				memcpy( &objects[1], data + header->databaseOffset, sizeof( DatabaseObject ) * objectCount );
+
+			cellObjectCount = 0;
+			for ( int i = 0; i < numCells; ++i )
+			{
+				activationSystem->InsertCellObjects( i, cellObjects + cellObjectCount, cellCounts[i] );
+				cellObjectCount += cellCounts[i];
+			}
+			activationSystem->Validate();
+
+			const SnapshotAuthority * authority = (const SnapshotAuthority*) ( data + header->authorityOffset );
+			for ( uint32_t i = 0; i < header->authorityCount; ++i )
+			{
+				AuthorityEntry entry;
+				entry.id = authority[i].id;
+				entry.authority = authority[i].authority;
+				entry.forced = authority[i].forced != 0;
+				entry.time = authority[i].time;
+				authorityManager.RestoreEntry( entry );
+			}
+
+			const SnapshotPlane * plane = (const SnapshotPlane*) ( data + header->planeOffset );
+			for ( uint32_t i = 0; i < header->planeCount; ++i )
+			{
+				const math::Vector normal( plane[i].normal[0], plane[i].normal[1], plane[i].normal[2] );
+				simulation->AddPlane( normal, plane[i].d );
+				Plane entry;
+				entry.normal = normal;
+				entry.d = plane[i].d;
+				planes.push_back( entry );
+			}
+
+			flags = header->flags;
+			tierFrame = header->tierFrame;
+			for ( int i = 0; i < MaxPlayers; ++i )
+				frame[i] = header->frame[i];
+
+			initialized = true;
+
+			return true;
+		}
+
+		bool LoadSnapshot( const char * filename )
+		{
+			std::vector<uint8_t> buffer;
+			if ( !ReadSnapshotFile( filename, buffer ) )
+				return false;
+			return LoadSnapshot( &buffer[0], buffer.size() );
+		}
+
 		void OnPlayerJoined( int playerId )
 		{
 			assert( playerId >= 0 );
@@ -341,6 +761,17 @@ namespace game
 
 		void Update( float deltaTime = 1.0f / 60.0f )
 		{
+			const double frameStart = GetTime();
+			double phaseStart = frameStart;
+
+			#ifdef PROFILE
+			profile::CounterValues frameCounters;
+			profiler.ReadCounters( frameCounters );
+			phaseCounters = frameCounters;
+			#endif
+
+			rollbackForces.clear();
+
 			for ( int i = 0; i < MaxPlayers; ++i )
 				ProcessPlayerInput( i, deltaTime );
 
@@ -348,20 +779,84 @@ namespace game
 
 			MoveOriginPoint();
 
+			EndPhase( PHASE_Input, phaseStart );
+
 			UpdateActivation( deltaTime );
+
+			UpdateTiers();
+
+			EndPhase( PHASE_Activation, phaseStart );
 			
 			UpdatePriority( deltaTime );
+
+			EndPhase( PHASE_Priority, phaseStart );
 			
 			UpdateSimulation( deltaTime );
+
+			EndPhase( PHASE_Simulation, phaseStart );
 			
 			UpdateAuthority( deltaTime );
 
+			EndPhase( PHASE_Authority, phaseStart );
+
 			ConstructViewPacket();
 
 			Validate();
 
+			EndPhase( PHASE_View, phaseStart );
+
 			for ( int i = 0; i < MaxPlayers; ++i )
 				frame[i]++;
+
+			tierFrame++;
+
+			rollbackTime = 0.0f;
+
+			const double frameEnd = GetTime();
+
+			timings.total = (float) ( frameEnd - frameStart );
+
+			#ifdef PROFILE
+			profiler.Record( profile::ZONE_Frame, frameStart, frameEnd, frameCounters, phaseCounters );
+			#endif
+
+			if ( governor.Update( timings ) )
+				ApplyGovernor();
+		}
+
+		const FrameTimings & GetFrameTimings() const
+		{
+			return timings;
+		}
+
+		// per-phase histograms and a trace of recent frames. empty unless built with PROFILE
+
+		profile::Profiler & GetProfiler()
+		{
+			return profiler;
+		}
+
+		const FrameGovernor & GetGovernor() const
+		{
+			return governor;
+		}
+
+		enum { NumTiers = 3 };
+
+		// number of active objects in each update tier as of the last update. tier n updates every 2^n frames
+
+		int GetTierCount( int tier ) const
+		{
+			assert( tier >= 0 );
+			assert( tier < NumTiers );
+			return tierCount[tier];
+		}
+
+		// send state every n frames. raised by the governor when frames run over budget
+
+		int GetSendInterval() const
+		{
+			return governor.GetSendInterval();
 		}
 
 		void GetViewPacket( view::Packet & viewPacket )
@@ -419,16 +914,11 @@ namespace game
 			assert( id > 0 );
 			assert( id <= (ObjectId) objectCount );
 			// active object
-			int count = activeObjects.GetCount();
-			for ( int i = 0; i < count; ++i )
+			const ActiveObject * activeObject = FindActiveObject( id );
+			if ( activeObject )
 			{
-				ActiveObject * activeObject = &activeObjects.GetObject( i );
-				assert( activeObject );
-				if ( activeObject->id == id )
-				{
-					object = *activeObject;
-					return;
-				}
+				object = *activeObject;
+				return;
 			}
 			// inactive object
 			objects[id].DatabaseToActive( object );
@@ -441,26 +931,229 @@ namespace game
 			assert( id > 0 );
 			assert( id <= (ObjectId) objectCount );
 			// active object
-			int count = activeObjects.GetCount();
-			for ( int i = 0; i < count; ++i )
+			ActiveObject * activeObject = FindActiveObject( id );
+			if ( activeObject )
 			{
-				ActiveObject & activeObject = activeObjects.GetObject( i );
-				if ( activeObject.id == id )
-				{
-					ActiveId activeId = activeObject.activeId;
-					const bool warp = ( activeObject.position - object.position ).lengthSquared() > 25.0f;
-					activeObject = object;
-					activeObject.activeId = activeId;
-					activeObject.framesSinceLastUpdate = 0;
-					activationSystem->MoveObject( id, activeObject.position.x, activeObject.position.y, warp );
-					return;
-				}
+				ActiveId activeId = activeObject->activeId;
+				const bool warp = ( activeObject->position - object.position ).lengthSquared() > 25.0f;
+				*activeObject = object;
+				activeObject->activeId = activeId;
+				objectUpdateFrame[id] = tierFrame;
+				MarkObjectDirty( id );
+				activationSystem->MoveObject( id, activeObject->position.x, activeObject->position.y, warp );
+
+				// note: sleeping and outer tier objects are not pushed to the simulation each frame, so push now
+				SimulationObjectState objectState;
+				activeObject->ActiveToSimulation( objectState );
+				simulation->SetObjectState( activeId, objectState, true );
+				objectStale[id] = 0;
+				return;
 			}
 			// inactive object
 			objects[id].ActiveToDatabase( object );
 			activationSystem->MoveObject( id, object.position.x, object.position.y );
 		}
 		
+		/*
+			Apply a correction to an object as it was at the start of the given
+			local player frame. The island of objects that interacted with it since
+			then is rewound to that frame in a scratch simulation, replayed with the
+			recorded forces back up to the present and written back. Corrections
+			outside the rollback window, touching too large an island, or arriving
+			once the per-frame budget is spent are applied at the present frame.
+			Returns true if the correction was resimulated.
+		*/
+
+		bool CorrectObjectState( ObjectId id, const ActiveObject & object, uint32_t correctionFrame )
+		{
+			assert( id > 0 );
+			assert( id <= (ObjectId) objectCount );
+
+			ActiveObject * activeObject = FindActiveObject( id );
+
+			RollbackFrame * start = NULL;
+			if ( activeObject && InGame() && rollbackTime < config.rollbackBudget && correctionFrame < frame[localPlayerId] )
+				start = rollbackBuffer.FindFrame( correctionFrame );
+
+			if ( !start || start->FindObject( activeObject->activeId ) < 0 )
+			{
+				SetObjectState( id, object );
+				rollbackStats.snapped++;
+				return false;
+			}
+
+			const uint32_t currentFrame = frame[localPlayerId];
+			for ( uint32_t i = correctionFrame; i < currentFrame; ++i )
+			{
+				if ( !rollbackBuffer.FindFrame( i ) )
+				{
+					SetObjectState( id, object );
+					rollbackStats.snapped++;
+					return false;
+				}
+			}
+
+			const double startTime = GetTime();
+
+			// find the island: everything connected to the corrected object through interactions since the correction frame.
+			// simulation ids are reused on activation, so only objects still holding the same id are rewound
+
+			const int numIds = activeObjectIds.size();
+			rollbackParent.resize( numIds );
+			for ( int i = 0; i < numIds; ++i )
+				rollbackParent[i] = i;
+			for ( uint32_t i = correctionFrame; i < currentFrame; ++i )
+			{
+				const RollbackFrame * record = rollbackBuffer.FindFrame( i );
+				for ( int j = 0; j < (int) record->pairs.size(); ++j )
+				{
+					const int a = FindRollbackRoot( record->pairs[j].a );
+					const int b = FindRollbackRoot( record->pairs[j].b );
+					if ( a != b )
+						rollbackParent[a] = b;
+				}
+			}
+
+			const int root = FindRollbackRoot( activeObject->activeId );
+			rollbackIsland.clear();
+			for ( int i = 0; i < (int) start->ids.size(); ++i )
+			{
+				const int simulationId = start->ids[i];
+				if ( simulationId < numIds && FindRollbackRoot( simulationId ) == root && activeObjectIds[simulationId] == start->objectIds[i] )
+					rollbackIsland.push_back( simulationId );
+			}
+
+			if ( (int) rollbackIsland.size() > config.rollbackMaxObjects )
+			{
+				SetObjectState( id, object );
+				rollbackStats.snapped++;
+				return false;
+			}
+
+			// rewind the island into the scratch simulation
+
+			if ( !rollbackSimulation )
+			{
+				SimulationConfig simConfig = config.simConfig;
+				simConfig.IslandWorlds = 1;
+				simConfig.IslandThreads = 0;
+				rollbackSimulation = new Simulation();
+				rollbackSimulation->Initialize( simConfig );
+			}
+
+			rollbackSimulation->Reset();
+			rollbackSimulation->SetMaxIterations( simulation->GetMaxIterations() );
+			for ( int i = 0; i < (int) planes.size(); ++i )
+				rollbackSimulation->AddPlane( planes[i].normal, planes[i].d );
+
+			rollbackIndex.assign( numIds, -1 );
+			rollbackScratchIds.resize( rollbackIsland.size() );
+			for ( int i = 0; i < (int) rollbackIsland.size(); ++i )
+			{
+				const int simulationId = rollbackIsland[i];
+				SimulationObjectState objectState;
+				if ( simulationId == (int) activeObject->activeId )
+				{
+					ActiveObject corrected = object;
+					corrected.ActiveToSimulation( objectState );
+				}
+				else
+					start->states.Get( start->FindObject( simulationId ), objectState );
+				rollbackScratchIds[i] = rollbackSimulation->AddObject( objectState );
+				rollbackIndex[simulationId] = i;
+			}
+
+			// replay to the present. later frames in the buffer are patched so further corrections build on this one
+
+			for ( uint32_t i = correctionFrame; i < currentFrame; ++i )
+			{
+				const RollbackFrame * record = rollbackBuffer.FindFrame( i );
+				for ( int j = 0; j < (int) record->forces.size(); ++j )
+				{
+					const RollbackForce & force = record->forces[j];
+					const int index = force.id < numIds ? rollbackIndex[force.id] : -1;
+					if ( index < 0 )
+						continue;
+					if ( force.force.lengthSquared() > 0.0f )
+						rollbackSimulation->ApplyForce( rollbackScratchIds[index], force.force );
+					if ( force.torque.lengthSquared() > 0.0f )
+						rollbackSimulation->ApplyTorque( rollbackScratchIds[index], force.torque );
+				}
+
+				rollbackSimulation->Update( record->deltaTime );
+
+				RollbackFrame * next = rollbackBuffer.FindFrame( i + 1 );
+				if ( !next )
+					continue;
+
+				rollbackSimulation->GetObjectStates( &rollbackScratchIds[0], rollbackScratchIds.size(), rollbackStates );
+				for ( int j = 0; j < (int) rollbackIsland.size(); ++j )
+				{
+					const int index = next->FindObject( rollbackIsland[j] );
+					if ( index < 0 )
+						continue;
+					SimulationObjectState objectState;
+					rollbackStates.Get( j, objectState );
+					next->states.Set( index, objectState );
+				}
+			}
+
+			// write the resimulated island back
+
+			rollbackSimulation->GetObjectStates( &rollbackScratchIds[0], rollbackScratchIds.size(), rollbackStates );
+
+			const float bound_x = activationSystem->GetBoundX();
+			const float bound_y = activationSystem->GetBoundY();
+
+			for ( int i = 0; i < (int) rollbackIsland.size(); ++i )
+			{
+				const int simulationId = rollbackIsland[i];
+				ActiveObject * islandObject = FindActiveObject( activeObjectIds[simulationId] );
+				assert( islandObject );
+				SimulationObjectState objectState;
+				rollbackStates.Get( i, objectState );
+				islandObject->SimulationToActive( objectState );
+				islandObject->Clamp( bound_x, bound_y );
+				islandObject->ActiveToSimulation( objectState );
+				simulation->SetObjectState( simulationId, objectState );
+				objectStale[islandObject->id] = 0;
+				MarkObjectDirty( islandObject->id );
+				float x,y;
+				islandObject->GetPositionXY( x, y );
+				activationSystem->MoveObject( islandObject->id, x, y );
+			}
+
+			const float time = (float) ( GetTime() - startTime );
+			rollbackTime += time;
+			rollbackStats.corrections++;
+			rollbackStats.lastFrames = currentFrame - correctionFrame;
+			rollbackStats.lastObjects = rollbackIsland.size();
+			rollbackStats.lastTime = time;
+			rollbackStats.totalTime += time;
+			if ( time > rollbackStats.maxTime )
+				rollbackStats.maxTime = time;
+
+			return true;
+		}
+
+		const RollbackStats & GetRollbackStats() const
+		{
+			return rollbackStats;
+		}
+
+		// input recorded for a player at a past local frame, if still in the rollback window
+
+		bool GetRollbackInput( uint32_t frame, int playerId, Input & input )
+		{
+			assert( playerId >= 0 );
+			assert( playerId < MaxPlayers );
+			const RollbackFrame * record = rollbackBuffer.FindFrame( frame );
+			if ( !record )
+				return false;
+			input = record->input[playerId];
+			return true;
+		}
+		
 		const ActiveObject & GetPriorityObject( int playerId, int index )
 		{
 			assert( playerId >= 0 );
@@ -468,7 +1161,7 @@ namespace game
 			assert( index >= 0 );
 			assert( index < activeObjects.GetCount() );
 			ObjectId id = prioritySet[playerId].GetPriorityObject( index );
-			const ActiveObject * activeObject = activeObjects.FindObject( id );
+			const ActiveObject * activeObject = FindActiveObject( id );
 			assert( activeObject );
 			return *activeObject;
 		}
@@ -496,7 +1189,7 @@ namespace game
 
 			int playerObjectId = playerFocus[playerId];
 
-			ActiveObject * activePlayerObject = activeObjects.FindObject( playerObjectId );
+			ActiveObject * activePlayerObject = FindActiveObject( playerObjectId );
 
 			if ( activePlayerObject )
 			{			
@@ -515,7 +1208,7 @@ namespace game
 
  				ActiveId playerActiveId = activePlayerObject->activeId;
 
-				simulation->ApplyForce( playerActiveId, force[playerId] );
+				ApplyObjectForce( playerActiveId, force[playerId] );
 
 				if ( input[playerId].push > 0.0f && GetFlag( FLAG_Hover ) )
 				{
@@ -552,7 +1245,7 @@ namespace game
 							int authority = authorityManager.GetAuthority( activeObject->id );
 							if ( playerId <= authority )
 							{
-								simulation->ApplyForce( activeObject->activeId, force * mass );
+								ApplyObjectForce( activeObject->activeId, force * mass );
 								authorityManager.SetAuthority( activeObject->id, playerId );
 							}
 						}
@@ -563,7 +1256,7 @@ namespace game
 						float wobble_y = sin(frame[playerId]*0.1+2) + sin(frame[playerId]*0.05f+4) + sin(frame[playerId]+11);
 						float wobble_z = sin(frame[playerId]*0.1+3) + sin(frame[playerId]*0.05f+5) + sin(frame[playerId]+12);
 						math::Vector force = math::Vector( wobble_x, wobble_y, wobble_z ) * 2.0f;
-						simulation->ApplyForce( activePlayerObject->activeId, force );
+						ApplyObjectForce( activePlayerObject->activeId, force );
 					}
 					// bobbing torque
 					{
@@ -571,7 +1264,7 @@ namespace game
 						float wobble_y = sin(frame[playerId]*0.09+5) + sin(frame[playerId]*0.045f+16) + sin(frame[playerId]);
 						float wobble_z = sin(frame[playerId]*0.11+4) + sin(frame[playerId]*0.055f+9) + sin(frame[playerId]);
 						math::Vector torque = math::Vector( wobble_x, wobble_y, wobble_z ) * 1.5f;
-						simulation->ApplyTorque( activePlayerObject->activeId, torque );
+						ApplyObjectTorque( activePlayerObject->activeId, torque );
 					}
 					// calculate velocity tilt
 					math::Vector targetUp(0,0,1);
@@ -597,7 +1290,7 @@ namespace game
 						if ( angle > 0.5f )
 							angle = 0.5f;
 						math::Vector torque = - 100 * axis * angle;
-						simulation->ApplyTorque( activePlayerObject->activeId, torque );
+						ApplyObjectTorque( activePlayerObject->activeId, torque );
 					}
 					// apply damping
 					{
@@ -635,7 +1328,7 @@ namespace game
 								int authority = authorityManager.GetAuthority( activeObject->id );
 								if ( authority == playerId || authority == MaxPlayers )
 								{
-									simulation->ApplyForce( activeObject->activeId, force * mass );
+									ApplyObjectForce( activeObject->activeId, force * mass );
 									authorityManager.SetAuthority( activeObject->id, playerId );
 								}
 							}
@@ -665,7 +1358,7 @@ namespace game
 								int authority = authorityManager.GetAuthority( activeObject->id );
 								if ( authority == playerId || authority == MaxPlayers )
 								{
-									simulation->ApplyForce( activeObject->activeId, force * mass );
+									ApplyObjectForce( activeObject->activeId, force * mass );
 									authorityManager.SetAuthority( activeObject->id, playerId );
 								}
 							}
@@ -681,7 +1374,7 @@ namespace game
 			{
 				int playerObjectId = playerFocus[localPlayerId];
 
-				ActiveObject * activePlayerObject = activeObjects.FindObject( playerObjectId );
+				ActiveObject * activePlayerObject = FindActiveObject( playerObjectId );
 
 				if ( activePlayerObject )
 					activePlayerObject->GetPosition( origin );
@@ -711,7 +1404,10 @@ namespace game
 		{
 			activationSystem->SetEnabled( InGame() );
 			activationSystem->MoveActivationPoint( origin.x, origin.y );
-			activationSystem->Update( deltaTime );
+			{
+				PROFILE_SCOPE( &profiler, profile::ZONE_Sweep );
+				activationSystem->Update( deltaTime );
+			}
 
 			int eventCount = activationSystem->GetEventCount();
 
@@ -722,6 +1418,11 @@ namespace game
 				{
 					ActiveObject * activeObject = &activeObjects.InsertObject( event.id );
 					assert( activeObject );
+					activeIndex[event.id] = activeObjects.GetCount() - 1;
+					objectTier[event.id] = 0;
+					tierCount[0]++;
+					objectStale[event.id] = 0;
+					objectUpdateFrame[event.id] = tierFrame;
 					objects[event.id].activated = true;
 					objects[event.id].DatabaseToActive( *activeObject );
 
@@ -729,96 +1430,288 @@ namespace game
 					activeObject->ActiveToSimulation( simInitialState );
 					activeObject->id = event.id;
 					activeObject->activeId = simulation->AddObject( simInitialState );
+					if ( (int) activeObjectIds.size() <= (int) activeObject->activeId )
+						activeObjectIds.resize( activeObject->activeId + 1, 0 );
+					activeObjectIds[activeObject->activeId] = event.id;
 
 					for ( int i = 0; i < MaxPlayers; ++i )
 						prioritySet[i].AddObject( activeObject->id );
+
+					MarkObjectDirty( event.id );
 				}
 				else
 				{
-					ActiveObject * activeObject = activeObjects.FindObject( event.id );
+					ActiveObject * activeObject = FindActiveObject( event.id );
 					assert( activeObject );
+					if ( objectStale[event.id] )
+					{
+						SimulationObjectState objectState;
+						simulation->GetObjectState( activeObject->activeId, objectState );
+						activeObject->SimulationToActive( objectState );
+						objectStale[event.id] = 0;
+					}
 					objects[event.id].ActiveToDatabase( *activeObject );
 					for ( int i = 0; i < MaxPlayers; ++i )
 						prioritySet[i].RemoveObject( activeObject->id );
 					authorityManager.RemoveAuthority( activeObject->id );
+					tierCount[ objectTier[event.id] ]--;
+					objectTier[event.id] = 0;
 					simulation->RemoveObject( activeObject->activeId );
+					activeObjectIds[activeObject->activeId] = 0;
+					const int index = activeIndex[event.id];
+					activeIndex[event.id] = -1;
 					activeObjects.DeleteObject( *activeObject );
+					if ( index < activeObjects.GetCount() )
+					{
+						activeIndex[ activeObjects.GetObject( index ).id ] = index;
+						MarkObjectDirty( activeObjects.GetObject( index ).id );
+					}
 				}
 			}
 
 			activationSystem->ClearEvents();	
+
+			MarkPendingChanges();
 		}
 		
+		/*
+			Update tiers.
+			Objects in the outer rings of the activation circle only resync with
+			the simulation every 2nd or 4th frame. The simulation still steps
+			them every frame. Each object is offset by its id so that the work
+			for a tier is spread evenly across frames.
+			Tiers are measured from the origin of the last full pass. Between
+			full passes only objects marked dirty since the last priority update
+			(activated, moved or changed) are re-tiered. The full pass is redone
+			once the origin drifts TierSlack of the activation radius or the
+			radius changes. With tiering off every object stays in tier 0.
+		*/
+
+		void UpdateTiers()
+		{
+			if ( !config.tieredUpdates )
+				return;
+
+			const float TierSlack = 0.05f;
+
+			const float activationRadius = activationSystem->GetActivationRadius();
+			const float dx = origin.x - tierOrigin.x;
+			const float dy = origin.y - tierOrigin.y;
+			const float slack = activationRadius * TierSlack;
+
+			if ( activationRadius != tierRadius || dx*dx + dy*dy > slack * slack )
+			{
+				tierOrigin = origin;
+				tierRadius = activationRadius;
+				for ( int i = 0; i < NumTiers; ++i )
+					tierCount[i] = 0;
+				for ( int i = 0; i < activeObjects.GetCount(); ++i )
+				{
+					const ActiveObject & activeObject = activeObjects.GetObject( i );
+					const int tier = GetObjectTier( activeObject );
+					objectTier[activeObject.id] = tier;
+					tierCount[tier]++;
+				}
+				return;
+			}
+
+			for ( int i = 0; i < (int) priorityDirty.size(); ++i )
+			{
+				const ObjectId id = priorityDirty[i];
+				const ActiveObject * activeObject = FindActiveObject( id );
+				if ( !activeObject )
+					continue;
+				const int tier = GetObjectTier( *activeObject );
+				if ( tier != objectTier[id] )
+				{
+					tierCount[ objectTier[id] ]--;
+					tierCount[tier]++;
+					objectTier[id] = tier;
+				}
+			}
+		}
+
+		int GetObjectTier( const ActiveObject & activeObject ) const
+		{
+			if ( activeObject.IsPlayer() )
+				return 0;
+			const float halfRateRadius = tierRadius * config.halfRateRadius;
+			const float quarterRateRadius = tierRadius * config.quarterRateRadius;
+			const float dx = activeObject.position.x - tierOrigin.x;
+			const float dy = activeObject.position.y - tierOrigin.y;
+			const float distanceSquared = dx*dx + dy*dy;
+			if ( distanceSquared > quarterRateRadius * quarterRateRadius )
+				return 2;
+			else if ( distanceSquared > halfRateRadius * halfRateRadius )
+				return 1;
+			return 0;
+		}
+
+		bool IsObjectDue( ObjectId id ) const
+		{
+			const uint32_t mask = ( 1 << objectTier[id] ) - 1;
+			return ( ( tierFrame + id ) & mask ) == 0;
+		}
+
+		/*
+			Update priority.
+			Priority grows at deltaTime per frame, twice that for objects the
+			local player has authority over and a quarter of it for objects at
+			rest. The focus object is pinned at the top, objects pending
+			deactivation are held at zero. Growth itself is left to the
+			priority sets, so only objects whose rate could have changed
+			since the last frame are visited here.
+		*/
+
 		void UpdatePriority( float deltaTime )
 		{
-			int numActiveObjects = activeObjects.GetCount();
+			MarkAuthorityChanges();
+
+			const ObjectId focus = localPlayerId >= 0 ? playerFocus[localPlayerId] : 0;
+			if ( focus != priorityFocus )
+			{
+				MarkObjectDirty( priorityFocus );
+				priorityFocus = focus;
+			}
+
+			// priorities reset by sends since the last update apply first
+
 			for ( int playerId = 0; playerId < MaxPlayers; ++playerId )
+				prioritySet[playerId].SortObjects();
+
+			for ( int i = 0; i < (int) priorityDirty.size(); ++i )
 			{
-				for ( int i = 0; i < numActiveObjects; ++i )
+				const ObjectId id = priorityDirty[i];
+				objectDirty[id] &= ~DirtyPriority;
+
+				const ActiveObject * activeObject = FindActiveObject( id );
+				if ( !activeObject || id == focus )
+					continue;
+
+				const bool pendingDeactivation = activationSystem->IsPendingDeactivation( id );
+
+				float rate = 0.0f;
+				if ( !pendingDeactivation )
 				{
-					float scale = 1.0f;
-				
-					ObjectId id = prioritySet[playerId].GetPriorityObject( i );
-					const ActiveObject * activeObject = activeObjects.FindObject( id );
-					assert( activeObject );
-				
+					rate = 1.0f;
 					if ( authorityManager.GetAuthority( id ) == localPlayerId )
-						scale *= 2.0f;
-					
+						rate *= 2.0f;
 					if ( !activeObject->enabled )
-						scale *= 0.25f;
-				
-					float priority = prioritySet[playerId].GetPriorityAtIndex( i );
-				
-					priority += deltaTime * scale;
+						rate *= 0.25f;
+				}
 
-					if ( activeObject->id == playerFocus[localPlayerId] )
-						priority = 1000000.0f;
-					
-					const float distanceSquared = ( activeObject->position - origin ).lengthSquared();
-					if ( distanceSquared > config.activationDistance * config.activationDistance )
-						priority = 0.0f;
+				for ( int playerId = 0; playerId < MaxPlayers; ++playerId )
+				{
+					prioritySet[playerId].SetObjectRate( id, rate );
+					if ( pendingDeactivation )
+						prioritySet[playerId].SetObjectPriority( id, 0.0f );
+				}
+			}
 
-					prioritySet[playerId].SetPriorityAtIndex( i, priority );
+			priorityDirty.clear();
+
+			if ( FindActiveObject( focus ) )
+			{
+				for ( int playerId = 0; playerId < MaxPlayers; ++playerId )
+				{
+					prioritySet[playerId].SetObjectRate( focus, 0.0f );
+					prioritySet[playerId].SetObjectPriority( focus, 1000000.0f );
 				}
-				prioritySet[playerId].SortObjects();
 			}
+
+			for ( int playerId = 0; playerId < MaxPlayers; ++playerId )
+				prioritySet[playerId].Advance( deltaTime );
 		}
 		
 		void UpdateSimulation( float deltaTime )
 		{
-			int numActiveObjects = activeObjects.GetCount();
+			// only awake objects are pushed. sleeping islands are left alone until something wakes them.
+			// outer tier objects are only pushed on frames they are due, and only if not stale
 
-			for ( int i = 0; i < numActiveObjects; ++i )
+			const int numAwakeObjects = simulation->GetNumAwakeObjects();
+			const int * awakeObjects = simulation->GetAwakeObjects();
+
+			simulationIds.clear();
+			simulationStates.Resize( numAwakeObjects );
+
+			for ( int i = 0; i < numAwakeObjects; ++i )
 			{
-				ActiveObject * activeObject = &activeObjects.GetObject( i );
+				const ObjectId id = activeObjectIds[ awakeObjects[i] ];
+				if ( objectStale[id] || !IsObjectDue( id ) )
+					continue;
+				ActiveObject * activeObject = FindActiveObject( id );
 				assert( activeObject );
-				if ( activeObject->framesSinceLastUpdate < 255 )
-					activeObject->framesSinceLastUpdate++;
 				SimulationObjectState objectState;
 				activeObject->ActiveToSimulation( objectState );
-				simulation->SetObjectState( activeObject->activeId, objectState, true );
+				simulationStates.Set( simulationIds.size(), objectState );
+				simulationIds.push_back( awakeObjects[i] );
 			}
+
+			if ( !simulationIds.empty() )
+				simulation->SetObjectStates( &simulationIds[0], simulationIds.size(), simulationStates );
 			
 			if ( GetFlag( FLAG_Pause ) )
 				return;
+
+			RollbackFrame * record = RecordRollbackFrame( deltaTime );
 				
 			simulation->Update( deltaTime );
 
-			for ( int i = 0; i < numActiveObjects; ++i )
+			if ( record )
 			{
-				ActiveObject * activeObject = &activeObjects.GetObject( i );
+				const int numInteractionPairs = simulation->GetNumInteractionPairs();
+				if ( numInteractionPairs > 0 )
+					record->pairs.assign( simulation->GetInteractionPairs(), simulation->GetInteractionPairs() + numInteractionPairs );
+			}
+
+			// pull back objects the simulation actually moved. outer tier objects that are not
+			// due this frame are marked stale instead, unless they just fell asleep
+
+			const int numUpdatedObjects = simulation->GetNumUpdatedObjects();
+			const int * updatedObjects = simulation->GetUpdatedObjects();
+
+			simulationIds.clear();
+			for ( int i = 0; i < numUpdatedObjects; ++i )
+			{
+				const ObjectId id = activeObjectIds[ updatedObjects[i] ];
+				if ( IsObjectDue( id ) || !simulation->IsObjectAwake( updatedObjects[i] ) )
+				{
+					objectStale[id] = 0;
+					simulationIds.push_back( updatedObjects[i] );
+				}
+				else
+					objectStale[id] = 1;
+			}
+
+			const int numPulledObjects = simulationIds.size();
+
+			if ( numPulledObjects > 0 )
+				simulation->GetObjectStates( &simulationIds[0], numPulledObjects, simulationStates );
+
+			for ( int i = 0; i < numPulledObjects; ++i )
+			{
+				ActiveObject * activeObject = FindActiveObject( activeObjectIds[ simulationIds[i] ] );
 				assert( activeObject );
 				
 				SimulationObjectState simObjectState;
-				simulation->GetObjectState( activeObject->activeId, simObjectState );
+				simulationStates.Get( i, simObjectState );
 				
 				activeObject->SimulationToActive( simObjectState );
 
+				MarkObjectDirty( activeObject->id );
+
 				// clamp state
 				const float bound_x = activationSystem->GetBoundX();
 				const float bound_y = activationSystem->GetBoundY();
 				activeObject->Clamp( bound_x, bound_y );
+
+				if ( !simulation->IsObjectAwake( activeObject->activeId ) )
+				{
+					// fell asleep this frame: make sure the clamped state is what it sleeps with
+					SimulationObjectState objectState;
+					activeObject->ActiveToSimulation( objectState );
+					simulation->SetObjectState( activeObject->activeId, objectState, true );
+				}
 				
 				// todo: quantize state
 				
@@ -842,36 +1735,129 @@ namespace game
 			}
 		}
 		
+		/*
+			Construct view packet.
+			The packet persists from frame to frame with an entry per active
+			object, in active object order except that the local player's
+			object is swapped to the front. Only entries for objects that
+			moved, changed authority or activation state, or changed index
+			are rewritten.
+		*/
+
 		void ConstructViewPacket()
 		{
-			ActiveObject * localPlayerActiveObject = activeObjects.FindObject( playerFocus[localPlayerId] );
-			if ( localPlayerActiveObject )
+			ActiveObject * localPlayerActiveObject = localPlayerId >= 0 ? FindActiveObject( playerFocus[localPlayerId] ) : NULL;
+			if ( !localPlayerActiveObject )
 			{
-				viewPacket.origin = origin;
-				viewPacket.objectCount = 1;
-
-				localPlayerActiveObject->ActiveToView( viewPacket.object[0], localPlayerId, activationSystem->IsPendingDeactivation( localPlayerActiveObject->id ), localPlayerActiveObject->framesSinceLastUpdate );
-
-				int index = 1;
-				for ( int i = 0; i < activeObjects.GetCount() && index < MaxViewObjects; ++i )
+				for ( int i = 0; i < (int) viewDirty.size(); ++i )
+					objectDirty[ viewDirty[i] ] &= ~DirtyView;
+				viewDirty.clear();
+				if ( !viewRebuild )
 				{
-					ActiveObject * activeObject = &activeObjects.GetObject( i );
-					assert( activeObject );
-					if ( activeObject == localPlayerActiveObject )
-						continue;
-					activeObject->ActiveToView( viewPacket.object[index], authorityManager.GetAuthority( activeObject->id ), activationSystem->IsPendingDeactivation( activeObject->id ), activeObject->framesSinceLastUpdate );
-					index++;
+					viewPacket = view::Packet();
+					viewRebuild = true;
 				}
+				return;
+			}
+
+			MarkAuthorityChanges();
+			MarkPendingChanges();
+
+			const int numActiveObjects = activeObjects.GetCount();
+			const int focusIndex = activeIndex[ localPlayerActiveObject->id ];
 
-				viewPacket.objectCount = index;
-				assert( viewPacket.objectCount >= 0 );
-				assert( viewPacket.objectCount <= MaxViewObjects );
+			if ( viewRebuild )
+			{
+				for ( int i = 0; i < numActiveObjects; ++i )
+					WriteViewObject( i, focusIndex );
+				viewRebuild = false;
 			}
-			else
+			else if ( focusIndex != viewFocusIndex )
+			{
+				WriteViewObject( 0, focusIndex );
+				WriteViewObject( focusIndex, focusIndex );
+				if ( viewFocusIndex >= 0 && viewFocusIndex < numActiveObjects )
+					WriteViewObject( viewFocusIndex, focusIndex );
+			}
+
+			for ( int i = 0; i < (int) viewDirty.size(); ++i )
 			{
-				viewPacket = view::Packet();
+				const ObjectId id = viewDirty[i];
+				objectDirty[id] &= ~DirtyView;
+				if ( activeIndex[id] >= 0 )
+					WriteViewObject( activeIndex[id], focusIndex );
+			}
+
+			viewDirty.clear();
+
+			viewFocusIndex = focusIndex;
+			viewPacket.origin = origin;
+			viewPacket.frame = tierFrame;
+			viewPacket.objectCount = numActiveObjects < MaxViewObjects ? numActiveObjects : MaxViewObjects;
+		}
+
+		void WriteViewObject( int index, int focusIndex )
+		{
+			int slot = index;
+			if ( index == focusIndex )
+				slot = 0;
+			else if ( index == 0 )
+				slot = focusIndex;
+			if ( slot >= MaxViewObjects )
+				return;
+			ActiveObject & activeObject = activeObjects.GetObject( index );
+			const int authority = index == focusIndex ? localPlayerId : authorityManager.GetAuthority( activeObject.id );
+			activeObject.ActiveToView( viewPacket.object[slot], authority, activationSystem->IsPendingDeactivation( activeObject.id ), objectUpdateFrame[activeObject.id] );
+		}
+
+		/*
+			Dirty objects.
+			Anything that changes an active object's state, authority, activation
+			or index marks it, so priority and the view packet only revisit
+			objects that changed. Each keeps its own list and clears its flag.
+		*/
+
+		enum { DirtyPriority = 1, DirtyView = 2 };
+
+		void MarkObjectDirty( ObjectId id )
+		{
+			if ( id == 0 || activeIndex[id] < 0 )
+				return;
+			if ( !( objectDirty[id] & DirtyPriority ) )
+			{
+				objectDirty[id] |= DirtyPriority;
+				priorityDirty.push_back( id );
+			}
+			if ( !( objectDirty[id] & DirtyView ) )
+			{
+				objectDirty[id] |= DirtyView;
+				viewDirty.push_back( id );
 			}
 		}
+
+		// authority can only have changed for objects that had an entry at the last call, or have one now
+
+		void MarkAuthorityChanges()
+		{
+			for ( int i = 0; i < (int) authorityIds.size(); ++i )
+				MarkObjectDirty( authorityIds[i] );
+			authorityIds.clear();
+			const int count = authorityManager.GetEntryCount();
+			for ( int i = 0; i < count; ++i )
+			{
+				const ObjectId id = authorityManager.GetEntry( i ).id;
+				authorityIds.push_back( id );
+				MarkObjectDirty( id );
+			}
+		}
+
+		void MarkPendingChanges()
+		{
+			const int count = activationSystem->GetPendingChangeCount();
+			for ( int i = 0; i < count; ++i )
+				MarkObjectDirty( activationSystem->GetPendingChange( i ) );
+			activationSystem->ClearPendingChanges();
+		}
 		
 		void UpdateAuthority( float deltaTime )
 		{
@@ -891,17 +1877,15 @@ namespace game
 				authorityManager.SetAuthority( playerObjectId, i, true );
 			}
 			
-			// make sure enabled objects keep their current authority until at rest
+			// make sure enabled objects keep their current authority until at rest.
+			// only objects with an entry have an authority to keep
 			
-			for ( int i = 0; i < activeObjects.GetCount(); ++i )
+			for ( int i = 0; i < authorityManager.GetEntryCount(); ++i )
 			{
-				ActiveObject & activeObject = activeObjects.GetObject( i );
-				if ( activeObject.enabled )
-				{
-					int authority = authorityManager.GetAuthority( activeObject.id );
-					if ( authority != MaxPlayers )
-						authorityManager.SetAuthority( activeObject.id, authority );
-				}
+				const AuthorityEntry & entry = authorityManager.GetEntry( i );
+				const ActiveObject * activeObject = FindActiveObject( entry.id );
+				if ( activeObject && activeObject->enabled )
+					authorityManager.SetAuthority( entry.id, entry.authority );
 			}
 
 			// interaction based authority for active objects
@@ -1015,7 +1999,7 @@ namespace game
 						if ( playerId == 0 )
 						{
  							int playerObjectId = GetPlayerFocus( playerId );
-							ActiveObject * playerActiveObject = activeObjects.FindObject( playerObjectId );
+							ActiveObject * playerActiveObject = FindActiveObject( playerObjectId );
 							if ( playerActiveObject )
 							{
 								for ( int i = 0; i < activeObjects.GetCount(); ++i )
@@ -1041,8 +2025,115 @@ namespace game
 			}
 		}
 		
+		void ApplyObjectForce( ActiveId activeId, const math::Vector & force )
+		{
+			simulation->ApplyForce( activeId, force );
+			if ( rollbackBuffer.GetSize() > 0 )
+			{
+				RollbackForce record;
+				record.id = activeId;
+				record.force = force;
+				record.torque = math::Vector(0,0,0);
+				rollbackForces.push_back( record );
+			}
+		}
+
+		void ApplyObjectTorque( ActiveId activeId, const math::Vector & torque )
+		{
+			simulation->ApplyTorque( activeId, torque );
+			if ( rollbackBuffer.GetSize() > 0 )
+			{
+				RollbackForce record;
+				record.id = activeId;
+				record.force = math::Vector(0,0,0);
+				record.torque = torque;
+				rollbackForces.push_back( record );
+			}
+		}
+
+		RollbackFrame * RecordRollbackFrame( float deltaTime )
+		{
+			if ( rollbackBuffer.GetSize() == 0 || !InGame() )
+				return NULL;
+
+			RollbackFrame & record = rollbackBuffer.BeginFrame( frame[localPlayerId] );
+			record.deltaTime = deltaTime;
+			for ( int i = 0; i < MaxPlayers; ++i )
+				record.input[i] = input[i];
+
+			const int numActiveObjects = activeObjects.GetCount();
+			for ( int i = 0; i < numActiveObjects; ++i )
+				record.ids.push_back( activeObjects.GetObject( i ).activeId );
+			std::sort( record.ids.begin(), record.ids.end() );
+			record.objectIds.resize( numActiveObjects );
+			for ( int i = 0; i < numActiveObjects; ++i )
+				record.objectIds[i] = activeObjectIds[ record.ids[i] ];
+			if ( numActiveObjects > 0 )
+				simulation->GetObjectStates( &record.ids[0], numActiveObjects, record.states );
+
+			record.forces.swap( rollbackForces );
+			rollbackForces.clear();
+
+			return &record;
+		}
+
+		int FindRollbackRoot( int id )
+		{
+			while ( rollbackParent[id] != id )
+			{
+				rollbackParent[id] = rollbackParent[ rollbackParent[id] ];
+				id = rollbackParent[id];
+			}
+			return id;
+		}
+
+		struct BulkCopy
+		{
+			DatabaseObject * destination;
+			const DatabaseObject * source;
+			int count;
+			int chunkSize;
+		};
+
+		static void CopyObjectsTask( void * data, int chunk )
+		{
+			BulkCopy & copy = *(BulkCopy*) data;
+			const int begin = chunk * copy.chunkSize;
+			const int end = math::min( begin + copy.chunkSize, copy.count );
+			if ( end > begin )
+				memcpy( copy.destination + begin, copy.source + begin, sizeof( DatabaseObject ) * ( end - begin ) );
+		}
+
+		void EndPhase( FramePhase phase, double & phaseStart )
+		{
+			const double time = GetTime();
+			timings.phase[phase] = (float) ( time - phaseStart );
+			#ifdef PROFILE
+			profile::CounterValues counters;
+			profiler.ReadCounters( counters );
+			profiler.Record( (profile::Zone) phase, phaseStart, time, phaseCounters, counters );
+			phaseCounters = counters;
+			#endif
+			phaseStart = time;
+		}
+
+		void ApplyGovernor()
+		{
+			if ( simulation->GetMaxIterations() != governor.GetIterations() )
+				simulation->SetMaxIterations( governor.GetIterations() );
+			if ( activationSystem->GetActivationRadius() != governor.GetActivationDistance() )
+				activationSystem->SetActivationRadius( governor.GetActivationDistance() );
+		}
+
 	private:
-		
+
+		ActiveObject * FindActiveObject( ObjectId id )
+		{
+			assert( id < activeIndex.size() );
+			const int index = activeIndex[id];
+			return index >= 0 ? &activeObjects.GetObject( index ) : NULL;
+		}
+
 		Config config;
 
 		uint32_t flags;
@@ -1065,9 +2156,49 @@ namespace game
 		ActivationSystem * activationSystem;
 		
 		activation::Set<ActiveObject> activeObjects;
+		std::vector<int> activeIndex;					// object id -> index in active objects, -1 if inactive
+		std::vector<ObjectId> activeObjectIds;			// simulation id -> object id
+		std::vector<uint8_t> objectTier;				// object id -> update tier
+		std::vector<uint8_t> objectStale;				// object id -> simulation has moved it since the last pull
+		std::vector<uint32_t> objectUpdateFrame;		// object id -> frame it was activated or last set from the network
+		std::vector<uint8_t> objectDirty;				// object id -> DirtyPriority | DirtyView
+		std::vector<ObjectId> priorityDirty;
+		std::vector<ObjectId> viewDirty;
+		std::vector<ObjectId> authorityIds;				// objects with an authority entry at the last check
+		ObjectId priorityFocus;
+		int viewFocusIndex;
+		bool viewRebuild;
+		uint32_t tierFrame;
+		int tierCount[NumTiers];
+		math::Vector tierOrigin;						// origin and activation radius of the last full tier pass
+		float tierRadius;
+
+		struct Plane
+		{
+			math::Vector normal;
+			float d;
+		};
+
+		std::vector<Plane> planes;
+		Simulation * rollbackSimulation;				// scratch simulation islands are resimulated in
+		RollbackBuffer rollbackBuffer;
+		RollbackStats rollbackStats;
+		float rollbackTime;								// seconds spent resimulating since the last update
+		std::vector<RollbackForce> rollbackForces;		// forces applied so far this frame
+		std::vector<int> rollbackParent;
+		std::vector<int> rollbackIsland;
+		std::vector<int> rollbackIndex;
+		std::vector<int> rollbackScratchIds;
+		SimulationObjectStates rollbackStates;
+		std::vector<int> simulationIds;
+		SimulationObjectStates simulationStates;
 		PrioritySet prioritySet[MaxPlayers];
 		AuthorityManager authorityManager;
 		InteractionManager interactionManager;
+		FrameGovernor governor;
+		FrameTimings timings;
+		profile::Profiler profiler;
+		profile::CounterValues phaseCounters;
 
 		view::Packet viewPacket;
 
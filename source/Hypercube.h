@@ -28,7 +28,6 @@ namespace hypercube
  		uint64_t confirmed : 4;
 		uint64_t corrected : 4;
 		uint64_t player : 1;
-		uint64_t framesSinceLastUpdate : 8;				// note: i don't really like this here, it's a debugging thing...
 		math::Quaternion orientation;
 		math::Vector position;
 		math::Vector linearVelocity;
@@ -64,7 +63,7 @@ namespace hypercube
 			enabled = simulationObject.enabled;
 		}
 		
-		void ActiveToView( view::ObjectState & viewObjectState, int authority, bool pendingDeactivation, int framesSinceLastUpdate )
+		void ActiveToView( view::ObjectState & viewObjectState, int authority, bool pendingDeactivation, uint32_t lastUpdateFrame )
 		{
 			viewObjectState.id = id;
 			viewObjectState.authority = authority;
@@ -75,7 +74,7 @@ namespace hypercube
 			viewObjectState.angularVelocity = angularVelocity;
 			viewObjectState.scale = player ? PlayerCubeSize : NonPlayerCubeSize;
 			viewObjectState.pendingDeactivation = pendingDeactivation;
-			viewObjectState.framesSinceLastUpdate = framesSinceLastUpdate;
+			viewObjectState.lastUpdateFrame = lastUpdateFrame;
 		}
 		
 		void Clamp( float bound_x, float bound_y )
@@ -152,7 +151,6 @@ namespace hypercube
 		
 		void DatabaseToActive( ActiveObject & activeObject )
 		{
-			activeObject.framesSinceLastUpdate = 0;
 			activeObject.enabled = enabled;
 			activeObject.activated = activated;
 			activeObject.confirmed = confirmed;
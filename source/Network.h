@@ -27,6 +27,14 @@
 #error unknown platform!
 #endif
 
+// sendmmsg and recvmmsg move a batch of datagrams per syscall on linux. elsewhere batches fall back to a loop.
+// the reactor waits with epoll on linux and select elsewhere
+
+#if NET_PLATFORM == NET_PLATFORM_UNIX && defined( __linux__ )
+#define NET_BATCHED_IO
+#define NET_EPOLL
+#endif
+
 #if PLATFORM == PLATFORM_WINDOWS
 
 	#include <winsock2.h>
@@ -35,19 +43,28 @@
 #elif PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
 
 	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <sys/select.h>
 	#include <netinet/in.h>
 	#include <fcntl.h>
 
 #endif
 
+#ifdef NET_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "Clock.h"
+
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <vector>
 #include <map>
-#include <stack>
-#include <list>
 #include <algorithm>
 #include <functional>
 
@@ -153,6 +170,41 @@ namespace net
 		#endif
 	}
 
+	// one datagram in a batch send or receive. on receive, size is the capacity going in and the bytes read coming out
+
+	struct Datagram
+	{
+		Address address;
+		unsigned char * data;
+		int size;
+	};
+
+	// syscalls and datagrams through a socket since it was opened
+
+	struct SocketStats
+	{
+		unsigned int sendCalls;
+		unsigned int receiveCalls;
+		unsigned int packetsSent;
+		unsigned int packetsReceived;
+
+		SocketStats()
+		{
+			sendCalls = 0;
+			receiveCalls = 0;
+			packetsSent = 0;
+			packetsReceived = 0;
+		}
+	};
+
+	// os socket handle
+
+	#if NET_PLATFORM == NET_PLATFORM_WINDOWS
+	typedef SOCKET SocketHandle;
+	#else
+	typedef int SocketHandle;
+	#endif
+
 	class Socket
 	{
 	public:
@@ -162,6 +214,8 @@ namespace net
 			NonBlocking = 1,
 			Broadcast = 2
 		};
+
+		enum { MaxBatchSize = 64 };			// datagrams per sendmmsg/recvmmsg call
 	
 		Socket( int options = NonBlocking )
 		{
@@ -192,6 +246,8 @@ namespace net
 				return false;
 			}
 
+			stats = SocketStats();
+
 			// bind to port
 
 			sockaddr_in address;
@@ -263,6 +319,23 @@ namespace net
 			}
 		}
 	
+		// grows the kernel receive queue, eg. for a mesh that hears from thousands of nodes at once.
+		// never shrinks it, and the system may cap it (net.core.rmem_max on linux)
+
+		bool SetReceiveBufferSize( int bytes )
+		{
+			assert( IsOpen() );
+			#if NET_PLATFORM == NET_PLATFORM_WINDOWS
+			typedef int socklen_t;
+			#endif
+			int size = 0;
+			socklen_t length = sizeof( size );
+			if ( getsockopt( socket, SOL_SOCKET, SO_RCVBUF, (char*) &size, &length ) == 0 && size >= bytes )
+				return true;
+			size = bytes;
+			return setsockopt( socket, SOL_SOCKET, SO_RCVBUF, (const char*) &size, sizeof( size ) ) == 0;
+		}
+	
 		bool IsOpen() const
 		{
 			#if NET_PLATFORM == NET_PLATFORM_WINDOWS
@@ -290,7 +363,71 @@ namespace net
 
 			int sent_bytes = sendto( socket, (const char*)data, size, 0, (sockaddr*)&address, sizeof(sockaddr_in) );
 
-			return sent_bytes == size;
+			stats.sendCalls++;
+			if ( sent_bytes != size )
+				return false;
+			stats.packetsSent++;
+			return true;
+		}
+
+		// returns the number of datagrams sent, which stops short at the first failure
+
+		int SendBatch( const Datagram * datagrams, int count )
+		{
+			assert( datagrams );
+			assert( count >= 0 );
+
+			if ( !IsOpen() )
+				return 0;
+
+			#ifdef NET_BATCHED_IO
+
+			int sent = 0;
+			while ( sent < count )
+			{
+				const int n = count - sent < MaxBatchSize ? count - sent : MaxBatchSize;
+				mmsghdr messages[MaxBatchSize];
+				iovec vectors[MaxBatchSize];
+				sockaddr_in addresses[MaxBatchSize];
+				memset( messages, 0, sizeof( mmsghdr ) * n );
+				for ( int i = 0; i < n; ++i )
+				{
+					const Datagram & datagram = datagrams[sent+i];
+					assert( datagram.data );
+					assert( datagram.size > 0 );
+					assert( datagram.address.GetAddress() != 0 );
+					assert( datagram.address.GetPort() != 0 );
+					addresses[i].sin_family = AF_INET;
+					addresses[i].sin_addr.s_addr = htonl( datagram.address.GetAddress() );
+					addresses[i].sin_port = htons( (unsigned short) datagram.address.GetPort() );
+					vectors[i].iov_base = datagram.data;
+					vectors[i].iov_len = datagram.size;
+					messages[i].msg_hdr.msg_name = &addresses[i];
+					messages[i].msg_hdr.msg_namelen = sizeof( sockaddr_in );
+					messages[i].msg_hdr.msg_iov = &vectors[i];
+					messages[i].msg_hdr.msg_iovlen = 1;
+				}
+				const int result = sendmmsg( socket, messages, n, 0 );
+				stats.sendCalls++;
+				if ( result <= 0 )
+					break;
+				sent += result;
+				stats.packetsSent += result;
+				if ( result < n )
+					break;
+			}
+			return sent;
+
+			#else
+
+			for ( int i = 0; i < count; ++i )
+			{
+				if ( !Send( datagrams[i].address, datagrams[i].data, datagrams[i].size ) )
+					return i;
+			}
+			return count;
+
+			#endif
 		}
 	
 		int Receive( Address & sender, void * data, int size )
@@ -310,9 +447,13 @@ namespace net
 
 			int received_bytes = recvfrom( socket, (char*)data, size, 0, (sockaddr*)&from, &fromLength );
 
+			stats.receiveCalls++;
+
 			if ( received_bytes <= 0 )
 				return 0;
 
+			stats.packetsReceived++;
+
 			unsigned int address = ntohl( from.sin_addr.s_addr );
 			unsigned short port = ntohs( from.sin_port );
 
@@ -320,6 +461,79 @@ namespace net
 
 			return received_bytes;
 		}
+
+		// returns the number of datagrams read, fewer than count when the socket runs dry
+
+		int ReceiveBatch( Datagram * datagrams, int count )
+		{
+			assert( datagrams );
+			assert( count >= 0 );
+
+			if ( !IsOpen() )
+				return 0;
+
+			#ifdef NET_BATCHED_IO
+
+			int received = 0;
+			while ( received < count )
+			{
+				const int n = count - received < MaxBatchSize ? count - received : MaxBatchSize;
+				mmsghdr messages[MaxBatchSize];
+				iovec vectors[MaxBatchSize];
+				sockaddr_in addresses[MaxBatchSize];
+				memset( messages, 0, sizeof( mmsghdr ) * n );
+				for ( int i = 0; i < n; ++i )
+				{
+					Datagram & datagram = datagrams[received+i];
+					assert( datagram.data );
+					assert( datagram.size > 0 );
+					vectors[i].iov_base = datagram.data;
+					vectors[i].iov_len = datagram.size;
+					messages[i].msg_hdr.msg_name = &addresses[i];
+					messages[i].msg_hdr.msg_namelen = sizeof( sockaddr_in );
+					messages[i].msg_hdr.msg_iov = &vectors[i];
+					messages[i].msg_hdr.msg_iovlen = 1;
+				}
+				const int result = recvmmsg( socket, messages, n, ( options & NonBlocking ) ? MSG_DONTWAIT : MSG_WAITFORONE, NULL );
+				stats.receiveCalls++;
+				if ( result <= 0 )
+					break;
+				for ( int i = 0; i < result; ++i )
+				{
+					Datagram & datagram = datagrams[received+i];
+					datagram.address = Address( ntohl( addresses[i].sin_addr.s_addr ), ntohs( addresses[i].sin_port ) );
+					datagram.size = messages[i].msg_len;
+				}
+				received += result;
+				stats.packetsReceived += result;
+				if ( result < n )
+					break;
+			}
+			return received;
+
+			#else
+
+			for ( int i = 0; i < count; ++i )
+			{
+				const int bytes = Receive( datagrams[i].address, datagrams[i].data, datagrams[i].size );
+				if ( bytes == 0 )
+					return i;
+				datagrams[i].size = bytes;
+			}
+			return count;
+
+			#endif
+		}
+
+		const SocketStats & GetStats() const
+		{
+			return stats;
+		}
+
+		SocketHandle GetHandle() const
+		{
+			return socket;
+		}
 		
 	private:
 	
@@ -329,859 +543,2288 @@ namespace net
 		int socket;
 		#endif
 		int options;
+		SocketStats stats;
 	};
 	
-	// get host name helper
-	
-	inline bool GetHostName( char * hostname, int size )
-	{
-		gethostname( hostname, size );
-		hostname[size-1] = '\0';
-		return true;
-	}
-
-	// helper functions for reading and writing integer values to packets
-	
-	inline void WriteByte( unsigned char * data, unsigned char value )
-	{
-		*data = value;
-	}
-
-	inline void ReadByte( const unsigned char * data, unsigned char & value )
+	// timer callbacks take the data pointer they were scheduled with
+
+	typedef void (*TimerFunction)( void * data );
+
+	/*
+		Timer wheel.
+		Hashed wheel of NumSlots slots, one tick of resolution seconds each.
+		A timer is linked into the slot for its expiry tick, so scheduling and
+		cancelling are O(1) and advancing only walks the slots passed over.
+		Timers more than one turn out stay put until the wheel comes round to
+		their tick. Cancelled timers are unlinked lazily the next time their
+		slot is walked. Periodic timers add their period to a due time kept in
+		seconds, so they don't drift or round to whole ticks, but skip any
+		periods that were missed entirely rather than firing back to back to
+		catch up. A min-heap of expiry ticks gives the next expiry without
+		looking at every timer. Entries for timers that were cancelled or
+		moved are dropped when they reach the top.
+	*/
+
+	class TimerWheel
 	{
-		value = *data;
-	}
-
-	inline void WriteShort( unsigned char * data, unsigned short value )
-	{
-		data[0] = (unsigned char) ( ( value >> 8 ) & 0xFF );
-		data[1] = (unsigned char) ( value & 0xFF );
-	}
+	public:
 
-	inline void ReadShort( const unsigned char * data, unsigned short & value )
-	{
-		value = ( ( (unsigned int)data[0] << 8 )  | ( (unsigned int)data[1] ) );				
-	}
+		enum { NumSlots = 256 };
+		enum { IndexBits = 16, MaxTimers = 1 << IndexBits };
 
-	inline void WriteInteger( unsigned char * data, unsigned int value )
-	{
-		data[0] = (unsigned char) ( value >> 24 );
-		data[1] = (unsigned char) ( ( value >> 16 ) & 0xFF );
-		data[2] = (unsigned char) ( ( value >> 8 ) & 0xFF );
-		data[3] = (unsigned char) ( value & 0xFF );
-	}
+		TimerWheel( double resolution = 0.001 )
+		{
+			assert( resolution > 0.0 );
+			this->resolution = resolution;
+			for ( int i = 0; i < NumSlots; ++i )
+				slots[i] = -1;
+			freeList = -1;
+			currentTick = 0;
+			targetTick = 0;
+			numTimers = 0;
+		}
 
-	inline void ReadInteger( const unsigned char * data, unsigned int & value )
-	{
-		value = ( ( (unsigned int)data[0] << 24 ) | ( (unsigned int)data[1] << 16 ) | 
-			      ( (unsigned int)data[2] << 8 )  | ( (unsigned int)data[3] ) );				
-	}
-	
-	// packet queue to store information about sent and received packets sorted in sequence order
-	//  + we define ordering using the "sequence_more_recent" function, this works provided there is a large gap when sequence wrap occurs
-	
-	struct PacketData
-	{
-		unsigned int sequence;			// packet sequence number
-		float time;					    // time offset since packet was sent or received (depending on context)
-		int size;						// packet size in bytes
-	};
+		// start the wheel at this time. timers already scheduled keep their absolute expiry
 
-	inline bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
-	{
-		return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
-	}		
-	
-	class PacketQueue : public std::list<PacketData>
-	{
-	public:
-		
-		bool exists( unsigned int sequence )
+		void Reset( double time )
 		{
-			for ( iterator itor = begin(); itor != end(); ++itor )
-				if ( itor->sequence == sequence )
-					return true;
-			return false;
+			currentTick = (int64_t) floor( time / resolution );
+			targetTick = currentTick;
 		}
-		
-		void insert_sorted( const PacketData & p, unsigned int max_sequence )
+
+		// times are absolute seconds. a period of zero makes a one shot timer. returns an id for Cancel, never zero
+
+		int Schedule( double time, float period, TimerFunction function, void * data )
 		{
-			if ( empty() )
+			assert( function );
+			assert( period >= 0.0f );
+			int index = freeList;
+			if ( index >= 0 )
+				freeList = timers[index].next;
+			else
 			{
-				push_back( p );
+				index = (int) timers.size();
+				assert( index < MaxTimers );
+				timers.push_back( Timer() );
 			}
-			else
+			Timer & timer = timers[index];
+			timer.time = time;
+			timer.period = period;
+			timer.tick = GetTick( time );
+			timer.function = function;
+			timer.data = data;
+			timer.active = true;
+			timer.generation = ( timer.generation + 1 ) & 0x7FFF;
+			if ( timer.generation == 0 )
+				timer.generation = 1;
+			Link( index );
+			PushExpiry( index );
+			numTimers++;
+			return ( timer.generation << IndexBits ) | index;
+		}
+
+		void Cancel( int id )
+		{
+			const int index = id & ( MaxTimers - 1 );
+			if ( id <= 0 || index >= (int) timers.size() )
+				return;
+			Timer & timer = timers[index];
+			if ( !timer.active || timer.generation != ( id >> IndexBits ) )
+				return;
+			timer.active = false;
+			numTimers--;
+		}
+
+		// fires every timer due up to and including this time. returns the number fired
+
+		int Advance( double time )
+		{
+			targetTick = (int64_t) floor( time / resolution );
+			int fired = 0;
+			while ( currentTick < targetTick )
 			{
-				if ( !sequence_more_recent( p.sequence, front().sequence, max_sequence ) )
+				if ( numTimers == 0 )
 				{
-					push_front( p );
-				}
-				else if ( sequence_more_recent( p.sequence, back().sequence, max_sequence ) )
-				{
-					push_back( p );
+					currentTick = targetTick;
+					break;
 				}
-				else
+				currentTick++;
+				const int slot = (int) ( currentTick & ( NumSlots - 1 ) );
+				int index = slots[slot];
+				slots[slot] = -1;
+				while ( index >= 0 )
 				{
-					for ( PacketQueue::iterator itor = begin(); itor != end(); itor++ )
+					const int next = timers[index].next;
+					if ( !timers[index].active )
+						Free( index );
+					else if ( timers[index].tick > currentTick )
+						Link( index );
+					else
 					{
-						assert( itor->sequence != p.sequence );
-						if ( sequence_more_recent( itor->sequence, p.sequence, max_sequence ) )
+						// copy out before the call, the callback may schedule and grow the timer array
+						TimerFunction function = timers[index].function;
+						void * data = timers[index].data;
+						if ( timers[index].period > 0.0 )
+						{
+							Timer & timer = timers[index];
+							timer.time += timer.period;
+							if ( GetTick( timer.time ) < targetTick )
+								timer.time = targetTick * resolution + timer.period;
+							timer.tick = GetTick( timer.time );
+							Link( index );
+							PushExpiry( index );
+						}
+						else
 						{
-							insert( itor, p );
-							break;
+							timers[index].active = false;
+							numTimers--;
+							Free( index );
 						}
+						function( data );
+						fired++;
 					}
+					index = next;
 				}
 			}
+			return fired;
 		}
-		
-		void verify_sorted( unsigned int max_sequence )
+
+		// absolute time the next timer is due, false if there are none
+
+		bool GetNextExpiry( double & time )
 		{
-			PacketQueue::iterator prev = end();
-			for ( PacketQueue::iterator itor = begin(); itor != end(); itor++ )
+			while ( !expiries.empty() && !IsCurrent( expiries[0] ) )
 			{
-				assert( itor->sequence <= max_sequence );
-				if ( prev != end() )
-				{
-					assert( sequence_more_recent( itor->sequence, prev->sequence, max_sequence ) );
-					prev = itor;
-				}
+				std::pop_heap( expiries.begin(), expiries.end(), std::greater<Expiry>() );
+				expiries.pop_back();
 			}
+			if ( expiries.empty() )
+				return false;
+			time = expiries[0].tick * resolution;
+			return true;
 		}
-	};
 
-	// reliability system to support reliable connection
-	//  + manages sent, received, pending ack and acked packet queues
-	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
-	
-	class ReliabilitySystem
-	{
-	public:
-		
-		ReliabilitySystem( unsigned int max_sequence = 0xFFFFFFFF )
+		int GetNumTimers() const
 		{
-			this->rtt_maximum = rtt_maximum;
-			this->max_sequence = max_sequence;
-			Reset();
+			return numTimers;
 		}
-		
-		void Reset()
+
+		double GetResolution() const
 		{
-			local_sequence = 0;
-			remote_sequence = 0;
-			sentQueue.clear();
-			receivedQueue.clear();
-			pendingAckQueue.clear();
-			ackedQueue.clear();
-			sent_packets = 0;
-			recv_packets = 0;
-			lost_packets = 0;
-			acked_packets = 0;
-			sent_bandwidth = 0.0f;
-			acked_bandwidth = 0.0f;
-			rtt = 0.0f;
-			rtt_maximum = 1.0f;
+			return resolution;
 		}
-		
-		void PacketSent( int size )
+
+	private:
+
+		struct Timer
 		{
-			if ( sentQueue.exists( local_sequence ) )
+			int64_t tick;
+			double time;
+			double period;			// zero for one shot
+			TimerFunction function;
+			void * data;
+			int next;
+			int generation;
+			bool active;
+
+			Timer()
 			{
-				printf( "local sequence %d exists\n", local_sequence );				
-				for ( PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor )
-					printf( " + %d\n", itor->sequence );
+				tick = 0;
+				time = 0.0;
+				period = 0.0;
+				function = NULL;
+				data = NULL;
+				next = -1;
+				generation = 0;
+				active = false;
 			}
-			assert( !sentQueue.exists( local_sequence ) );
-			assert( !pendingAckQueue.exists( local_sequence ) );
-			PacketData data;
-			data.sequence = local_sequence;
-			data.time = 0.0f;
-			data.size = size;
-			sentQueue.push_back( data );
-			pendingAckQueue.push_back( data );
-			sent_packets++;
-			local_sequence++;
-			if ( local_sequence > max_sequence )
-				local_sequence = 0;
-		}
-		
-		void PacketReceived( unsigned int sequence, int size )
+		};
+
+		struct Expiry
 		{
-			recv_packets++;
-			if ( receivedQueue.exists( sequence ) )
-				return;
-			PacketData data;
-			data.sequence = sequence;
-			data.time = 0.0f;
-			data.size = size;
-			receivedQueue.push_back( data );
-			if ( sequence_more_recent( sequence, remote_sequence, max_sequence ) )
-				remote_sequence = sequence;
+			int64_t tick;
+			int index;
+			int generation;
+
+			bool operator > ( const Expiry & other ) const
+			{
+				return tick > other.tick;
+			}
+		};
+
+		// the tick a timer due at this time fires on, never the current tick or earlier
+
+		int64_t GetTick( double time ) const
+		{
+			const int64_t tick = (int64_t) ceil( time / resolution );
+			return tick > currentTick ? tick : currentTick + 1;
 		}
 
-		unsigned int GenerateAckBits()
+		void Link( int index )
 		{
-			return generate_ack_bits( GetRemoteSequence(), receivedQueue, max_sequence );
+			const int slot = (int) ( timers[index].tick & ( NumSlots - 1 ) );
+			timers[index].next = slots[slot];
+			slots[slot] = index;
 		}
-		
-		void ProcessAck( unsigned int ack, unsigned int ack_bits )
+
+		void Free( int index )
 		{
-			process_ack( ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, max_sequence );
+			timers[index].next = freeList;
+			freeList = index;
 		}
-				
-		void Update( float deltaTime )
+
+		// stale entries only leave the heap from the top, so rebuild it once they outnumber the timers
+
+		void PushExpiry( int index )
 		{
-			acks.clear();
-			AdvanceQueueTime( deltaTime );
-			UpdateQueues();
-			UpdateStats();
-			#ifdef NET_UNIT_TEST
-			Validate();
-			#endif
+			if ( (int) expiries.size() >= numTimers * 2 + 64 )
+			{
+				int count = 0;
+				for ( int i = 0; i < (int) expiries.size(); ++i )
+				{
+					if ( IsCurrent( expiries[i] ) )
+						expiries[count++] = expiries[i];
+				}
+				expiries.resize( count );
+				std::make_heap( expiries.begin(), expiries.end(), std::greater<Expiry>() );
+			}
+			Expiry expiry;
+			expiry.tick = timers[index].tick;
+			expiry.index = index;
+			expiry.generation = timers[index].generation;
+			expiries.push_back( expiry );
+			std::push_heap( expiries.begin(), expiries.end(), std::greater<Expiry>() );
 		}
-		
-		void Validate()
+
+		bool IsCurrent( const Expiry & expiry ) const
 		{
-			sentQueue.verify_sorted( max_sequence );
-			receivedQueue.verify_sorted( max_sequence );
-			pendingAckQueue.verify_sorted( max_sequence );
-			ackedQueue.verify_sorted( max_sequence );
+			const Timer & timer = timers[expiry.index];
+			return timer.active && timer.generation == expiry.generation && timer.tick == expiry.tick;
 		}
 
-		// utility functions
+		double resolution;
+		int slots[NumSlots];
+		std::vector<Timer> timers;
+		std::vector<Expiry> expiries;
+		int freeList;
+		int64_t currentTick;
+		int64_t targetTick;
+		int numTimers;
+	};
 
-		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
+	// wakeups and callbacks made by a reactor
+
+	struct ReactorStats
+	{
+		unsigned int wakeups;
+		unsigned int socketEvents;
+		unsigned int timersFired;
+
+		ReactorStats()
 		{
-			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
+			wakeups = 0;
+			socketEvents = 0;
+			timersFired = 0;
 		}
-		
-		static int bit_index_for_sequence( unsigned int sequence, unsigned int ack, unsigned int max_sequence )
+	};
+
+	/*
+		Reactor event.
+		Lets another thread wake a reactor. Signal makes the handle readable
+		until Clear, so a reactor waiting on it calls the function added for
+		it, and any signals before the Clear collapse into one call. An
+		eventfd on linux and a pipe elsewhere on unix. Not available on
+		windows, where Open fails.
+	*/
+
+	class ReactorEvent
+	{
+	public:
+
+		ReactorEvent()
 		{
-			assert( sequence != ack );
-			assert( !sequence_more_recent( sequence, ack, max_sequence ) );
-			if ( sequence > ack )
-			{
-				assert( ack < 33 );
-				assert( max_sequence >= sequence );
- 				return ack + ( max_sequence - sequence );
-			}
-			else
-			{
-				assert( ack >= 1 );
-				assert( sequence <= ack - 1 );
- 				return ack - 1 - sequence;
-			}
+			handle = -1;
+			writeHandle = -1;
 		}
-		
-		static unsigned int generate_ack_bits( unsigned int ack, const PacketQueue & received_queue, unsigned int max_sequence )
+
+		~ReactorEvent()
 		{
-			unsigned int ack_bits = 0;
-			for ( PacketQueue::const_iterator itor = received_queue.begin(); itor != received_queue.end(); itor++ )
+			Close();
+		}
+
+		bool Open()
+		{
+			assert( !IsOpen() );
+			#if defined( NET_EPOLL )
+			handle = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+			writeHandle = handle;
+			return handle >= 0;
+			#elif NET_PLATFORM == NET_PLATFORM_MAC || NET_PLATFORM == NET_PLATFORM_UNIX
+			int pipeHandles[2];
+			if ( pipe( pipeHandles ) != 0 )
+				return false;
+			fcntl( pipeHandles[0], F_SETFL, O_NONBLOCK );
+			fcntl( pipeHandles[1], F_SETFL, O_NONBLOCK );
+			handle = pipeHandles[0];
+			writeHandle = pipeHandles[1];
+			return true;
+			#else
+			return false;
+			#endif
+		}
+
+		void Close()
+		{
+			#if NET_PLATFORM == NET_PLATFORM_MAC || NET_PLATFORM == NET_PLATFORM_UNIX
+			if ( writeHandle >= 0 && writeHandle != handle )
+				close( writeHandle );
+			if ( handle >= 0 )
+				close( handle );
+			#endif
+			handle = -1;
+			writeHandle = -1;
+		}
+
+		// any thread
+
+		void Signal()
+		{
+			assert( IsOpen() );
+			#if defined( NET_EPOLL )
+			const uint64_t one = 1;
+			if ( write( writeHandle, &one, sizeof( one ) ) < 0 )
+				return;						// note: only fails once the count is about to overflow, and it is readable then anyway
+			#elif NET_PLATFORM == NET_PLATFORM_MAC || NET_PLATFORM == NET_PLATFORM_UNIX
+			const char one = 1;
+			if ( write( writeHandle, &one, 1 ) < 0 )
+				return;						// note: a full pipe is already readable
+			#endif
+		}
+
+		// the waiting thread, from the function added for it
+
+		void Clear()
+		{
+			#if NET_PLATFORM == NET_PLATFORM_MAC || NET_PLATFORM == NET_PLATFORM_UNIX
+			unsigned char buffer[64];
+			while ( read( handle, buffer, sizeof( buffer ) ) > 0 );
+			#endif
+		}
+
+		bool IsOpen() const
+		{
+			return handle >= 0;
+		}
+
+		int GetHandle() const
+		{
+			return handle;
+		}
+
+	private:
+
+		ReactorEvent( const ReactorEvent & other );
+		ReactorEvent & operator = ( const ReactorEvent & other );
+
+		int handle;
+		int writeHandle;
+	};
+
+	/*
+		Reactor.
+		Owns one wait across any number of sockets. When a socket has packets
+		to read its ready function is called, and timers on a wheel drive the
+		keepalives, timeouts and ticks that would otherwise be polled from an
+		Update every frame. Poll sleeps in a single syscall until a socket is
+		readable, the next timer is due or the wait runs out, so a process with
+		nothing to do uses next to no cpu. Readiness is level triggered: a
+		ready function that leaves packets on the socket is called again on
+		the next poll. Events wake it the same way from other threads. Uses
+		epoll on linux and select elsewhere.
+	*/
+
+	class Reactor
+	{
+	public:
+
+		typedef void (*ReadyFunction)( void * data );
+
+		enum { MaxEvents = 64 };
+
+		Reactor( double resolution = 0.001 )
+			: timers( resolution )
+		{
+			#ifdef NET_EPOLL
+			epoll = epoll_create1( EPOLL_CLOEXEC );
+			assert( epoll >= 0 );
+			#endif
+			timers.Reset( platform::GetTime() );
+		}
+
+		~Reactor()
+		{
+			#ifdef NET_EPOLL
+			if ( epoll >= 0 )
+				close( epoll );
+			#endif
+		}
+
+		bool Add( const Socket & socket, ReadyFunction function, void * data )
+		{
+			assert( socket.IsOpen() );
+			return AddHandle( socket.GetHandle(), function, data );
+		}
+
+		void Remove( const Socket & socket )
+		{
+			RemoveHandle( socket.GetHandle() );
+		}
+
+		bool Add( const ReactorEvent & event, ReadyFunction function, void * data )
+		{
+			assert( event.IsOpen() );
+			return AddHandle( (SocketHandle) event.GetHandle(), function, data );
+		}
+
+		void Remove( const ReactorEvent & event )
+		{
+			RemoveHandle( (SocketHandle) event.GetHandle() );
+		}
+
+		// first call after delay seconds, then every period seconds if the period is non-zero
+
+		int AddTimer( float delay, float period, TimerFunction function, void * data )
+		{
+			return timers.Schedule( platform::GetTime() + delay, period, function, data );
+		}
+
+		void CancelTimer( int id )
+		{
+			timers.Cancel( id );
+		}
+
+		// waits up to maxWait seconds for work and does it. returns the number of callbacks made
+
+		int Poll( float maxWait )
+		{
+			assert( maxWait >= 0.0f );
+
+			double time = platform::GetTime();
+			int fired = timers.Advance( time );
+
+			double wait = fired > 0 ? 0.0 : maxWait;
+			double expiry;
+			if ( timers.GetNextExpiry( expiry ) && expiry - time < wait )
+				wait = expiry - time > 0.0 ? expiry - time : 0.0;
+			const int timeout = (int) ceil( wait * 1000.0 );
+
+			int events = 0;
+
+			#ifdef NET_EPOLL
+
+			epoll_event ready[MaxEvents];
+			const int count = epoll_wait( epoll, ready, MaxEvents, timeout );
+			stats.wakeups++;
+			for ( int i = 0; i < count; ++i )
+			{
+				const int index = (int) ready[i].data.u32;
+				if ( index < (int) handlers.size() && handlers[index].function )
+				{
+					handlers[index].function( handlers[index].data );
+					events++;
+				}
+			}
+
+			#else
+
+			fd_set readable;
+			FD_ZERO( &readable );
+			SocketHandle maxHandle = 0;
+			int numHandles = 0;
+			for ( int i = 0; i < (int) handlers.size(); ++i )
+			{
+				if ( handlers[i].function )
+				{
+					FD_SET( handlers[i].handle, &readable );
+					if ( handlers[i].handle > maxHandle )
+						maxHandle = handlers[i].handle;
+					numHandles++;
+				}
+			}
+			#if NET_PLATFORM == NET_PLATFORM_WINDOWS
+			if ( numHandles == 0 )
+			{
+				Sleep( timeout );		// select with no sockets fails straight away on windows
+				FD_ZERO( &readable );
+			}
+			else
+			#endif
+			{
+				timeval tv;
+				tv.tv_sec = timeout / 1000;
+				tv.tv_usec = ( timeout % 1000 ) * 1000;
+				if ( select( (int) maxHandle + 1, &readable, NULL, NULL, &tv ) <= 0 )
+					FD_ZERO( &readable );
+			}
+			stats.wakeups++;
+			const int numHandlers = (int) handlers.size();
+			for ( int i = 0; i < numHandlers; ++i )
+			{
+				if ( handlers[i].function && FD_ISSET( handlers[i].handle, &readable ) )
+				{
+					handlers[i].function( handlers[i].data );
+					events++;
+				}
+			}
+
+			#endif
+
+			fired += timers.Advance( platform::GetTime() );
+
+			stats.socketEvents += events;
+			stats.timersFired += fired;
+
+			return events + fired;
+		}
+
+		int GetNumSockets() const
+		{
+			int count = 0;
+			for ( int i = 0; i < (int) handlers.size(); ++i )
+				if ( handlers[i].function )
+					count++;
+			return count;
+		}
+
+		int GetNumTimers() const
+		{
+			return timers.GetNumTimers();
+		}
+
+		const ReactorStats & GetStats() const
+		{
+			return stats;
+		}
+
+	private:
+
+		Reactor( const Reactor & other );
+		Reactor & operator = ( const Reactor & other );
+
+		struct Handler
+		{
+			SocketHandle handle;
+			ReadyFunction function;
+			void * data;
+
+			Handler()
+			{
+				handle = InvalidHandle();
+				function = NULL;
+				data = NULL;
+			}
+		};
+
+		static SocketHandle InvalidHandle()
+		{
+			#if NET_PLATFORM == NET_PLATFORM_WINDOWS
+			return INVALID_SOCKET;
+			#else
+			return -1;
+			#endif
+		}
+
+		bool AddHandle( SocketHandle handle, ReadyFunction function, void * data )
+		{
+			assert( function );
+			assert( FindHandler( handle ) < 0 );
+			int index = FindHandler( InvalidHandle() );
+			if ( index < 0 )
+			{
+				index = (int) handlers.size();
+				handlers.push_back( Handler() );
+			}
+			#ifdef NET_EPOLL
+			epoll_event event;
+			memset( &event, 0, sizeof( event ) );
+			event.events = EPOLLIN;
+			event.data.u32 = index;
+			if ( epoll_ctl( epoll, EPOLL_CTL_ADD, handle, &event ) != 0 )
+				return false;
+			#endif
+			handlers[index].handle = handle;
+			handlers[index].function = function;
+			handlers[index].data = data;
+			return true;
+		}
+
+		void RemoveHandle( SocketHandle handle )
+		{
+			const int index = FindHandler( handle );
+			if ( index < 0 )
+				return;
+			#ifdef NET_EPOLL
+			epoll_event event;
+			epoll_ctl( epoll, EPOLL_CTL_DEL, handle, &event );
+			#endif
+			handlers[index] = Handler();
+		}
+
+		int FindHandler( SocketHandle handle ) const
+		{
+			for ( int i = 0; i < (int) handlers.size(); ++i )
+				if ( handlers[i].handle == handle )
+					return i;
+			return -1;
+		}
+
+		#ifdef NET_EPOLL
+		int epoll;
+		#endif
+		std::vector<Handler> handlers;
+		TimerWheel timers;
+		ReactorStats stats;
+	};
+	
+	// get host name helper
+	
+	inline bool GetHostName( char * hostname, int size )
+	{
+		gethostname( hostname, size );
+		hostname[size-1] = '\0';
+		return true;
+	}
+
+	// helper functions for reading and writing integer values to packets
+	
+	inline void WriteByte( unsigned char * data, unsigned char value )
+	{
+		*data = value;
+	}
+
+	inline void ReadByte( const unsigned char * data, unsigned char & value )
+	{
+		value = *data;
+	}
+
+	inline void WriteShort( unsigned char * data, unsigned short value )
+	{
+		data[0] = (unsigned char) ( ( value >> 8 ) & 0xFF );
+		data[1] = (unsigned char) ( value & 0xFF );
+	}
+
+	inline void ReadShort( const unsigned char * data, unsigned short & value )
+	{
+		value = ( ( (unsigned int)data[0] << 8 )  | ( (unsigned int)data[1] ) );				
+	}
+
+	inline void WriteInteger( unsigned char * data, unsigned int value )
+	{
+		data[0] = (unsigned char) ( value >> 24 );
+		data[1] = (unsigned char) ( ( value >> 16 ) & 0xFF );
+		data[2] = (unsigned char) ( ( value >> 8 ) & 0xFF );
+		data[3] = (unsigned char) ( value & 0xFF );
+	}
+
+	inline void ReadInteger( const unsigned char * data, unsigned int & value )
+	{
+		value = ( ( (unsigned int)data[0] << 24 ) | ( (unsigned int)data[1] << 16 ) | 
+			      ( (unsigned int)data[2] << 8 )  | ( (unsigned int)data[3] ) );				
+	}
+	
+	/*
+		Packet buffer.
+		One datagram with room reserved in front of the payload. On send, each
+		layer prepends its header in place, so the payload is written once and
+		goes out from the same memory. On receive the datagram lands at the
+		start and each layer consumes its header from the front, leaving the
+		payload as a view (GetData, GetSize) into the same buffer.
+	*/
+
+	class PacketBuffer
+	{
+	public:
+
+		enum { Capacity = 2048, Headroom = 64 };
+
+		PacketBuffer()
+		{
+			Reset();
+		}
+
+		// empty, with the payload starting after headroom bytes
+
+		void Reset( int headroom = Headroom )
+		{
+			assert( headroom >= 0 );
+			assert( headroom <= Capacity );
+			begin = headroom;
+			end = headroom;
+		}
+
+		unsigned char * GetData()
+		{
+			return data + begin;
+		}
+
+		const unsigned char * GetData() const
+		{
+			return data + begin;
+		}
+
+		int GetSize() const
+		{
+			return end - begin;
+		}
+
+		int GetHeadroom() const
+		{
+			return begin;
+		}
+
+		int GetTailroom() const
+		{
+			return Capacity - end;
+		}
+
+		// grow at the back for payload, at the front for a header. returns where to write
+
+		unsigned char * Append( int bytes )
+		{
+			assert( bytes >= 0 );
+			assert( bytes <= GetTailroom() );
+			unsigned char * p = data + end;
+			end += bytes;
+			return p;
+		}
+
+		unsigned char * Prepend( int bytes )
+		{
+			assert( bytes >= 0 );
+			assert( bytes <= begin );
+			begin -= bytes;
+			return data + begin;
+		}
+
+		// strip a header from the front. returns the header, or NULL if the packet is too short
+
+		const unsigned char * Consume( int bytes )
+		{
+			assert( bytes >= 0 );
+			if ( bytes > GetSize() )
+				return NULL;
+			const unsigned char * p = data + begin;
+			begin += bytes;
+			return p;
+		}
+
+		// receive straight into the buffer: Reset( 0 ), then SetSize with the bytes read
+
+		unsigned char * GetBuffer()
+		{
+			return data;
+		}
+
+		void SetSize( int bytes )
+		{
+			assert( bytes >= 0 );
+			assert( begin + bytes <= Capacity );
+			end = begin + bytes;
+		}
+
+	private:
+
+		int begin;
+		int end;
+		unsigned char data[Capacity];
+	};
+
+	/*
+		Sequence buffer.
+		Fixed number of entries indexed by sequence % size. Each slot remembers
+		the sequence it holds, so a lookup for a sequence that has since been
+		overwritten (or was never inserted) finds nothing. Insert, find and
+		remove are all constant time.
+	*/
+
+	template <typename T> class SequenceBuffer
+	{
+	public:
+
+		SequenceBuffer( int size = 1024 )
+		{
+			assert( size > 0 );
+			entries.resize( size );
+			sequences.resize( size );
+			valid.resize( size );
+			Reset();
+		}
+
+		void Reset()
+		{
+			for ( int i = 0; i < (int) valid.size(); ++i )
+				valid[i] = 0;
+		}
+
+		int GetSize() const
+		{
+			return (int) entries.size();
+		}
+
+		// note: replaces whatever held the slot before
+
+		T * Insert( unsigned int sequence )
+		{
+			const int index = sequence % entries.size();
+			sequences[index] = sequence;
+			valid[index] = 1;
+			return &entries[index];
+		}
+
+		T * Find( unsigned int sequence )
+		{
+			const int index = sequence % entries.size();
+			return valid[index] && sequences[index] == sequence ? &entries[index] : NULL;
+		}
+
+		const T * Find( unsigned int sequence ) const
+		{
+			const int index = sequence % entries.size();
+			return valid[index] && sequences[index] == sequence ? &entries[index] : NULL;
+		}
+
+		// the entry in the slot a sequence maps to, whatever sequence it holds
+
+		T * GetSlot( unsigned int sequence, unsigned int & slotSequence )
+		{
+			const int index = sequence % entries.size();
+			if ( !valid[index] )
+				return NULL;
+			slotSequence = sequences[index];
+			return &entries[index];
+		}
+
+		void Remove( unsigned int sequence )
+		{
+			const int index = sequence % entries.size();
+			if ( sequences[index] == sequence )
+				valid[index] = 0;
+		}
+
+	private:
+
+		std::vector<T> entries;
+		std::vector<unsigned int> sequences;
+		std::vector<unsigned char> valid;
+	};
+
+	// reliability system to support reliable connection
+	//  + sent packets live in a sequence buffer stamped with their send time, so acks, losses and stats are constant time per packet
+	//  + received packets are tracked as a bitfield relative to the most recent remote sequence, so ack bits are ready to send
+	//  + acks cover the 64 packets before the ack sequence (less when max sequence is small enough that older would be ambiguous)
+	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
+	
+	class ReliabilitySystem
+	{
+	public:
+
+		enum { AckBits = 64, SentBufferSize = 1024 };
+		
+		ReliabilitySystem( unsigned int max_sequence = 0xFFFFFFFF ) : sentPackets( max_sequence < SentBufferSize ? max_sequence + 1 : SentBufferSize )
+		{
+			this->max_sequence = max_sequence;
+			ack_window = max_sequence / 2 < AckBits ? max_sequence / 2 : AckBits;
+			Reset();
+		}
+		
+		void Reset()
+		{
+			local_sequence = 0;
+			remote_sequence = 0;
+			received_bits = 0;
+			received_any = false;
+			sentPackets.Reset();
+			sent_tail = 0;
+			sent_count = 0;
+			sent_bytes = 0;
+			acked_bytes = 0;
+			time = 0.0;
+			sent_packets = 0;
+			recv_packets = 0;
+			lost_packets = 0;
+			acked_packets = 0;
+			sent_bandwidth = 0.0f;
+			acked_bandwidth = 0.0f;
+			rtt = 0.0f;
+			rtt_maximum = 1.0f;
+			acks.clear();
+		}
+		
+		void PacketSent( int size )
+		{
+			// the buffer holds every packet sent within rtt_maximum. if we send faster than that, the oldest go early
+
+			if ( sent_count == sentPackets.GetSize() )
+				RetireOldest();
+
+			// with a sequence range that does not divide the buffer size a slot can still be in use
+
+			unsigned int slotSequence;
+			SentPacket * slot = sentPackets.GetSlot( local_sequence, slotSequence );
+			if ( slot )
+			{
+				Retire( *slot );
+				sentPackets.Remove( slotSequence );
+			}
+
+			SentPacket * packet = sentPackets.Insert( local_sequence );
+			packet->time = time;
+			packet->size = size;
+			packet->acked = false;
+			sent_bytes += size;
+			sent_count++;
+			sent_packets++;
+			local_sequence++;
+			if ( local_sequence > max_sequence )
+				local_sequence = 0;
+		}
+		
+		void PacketReceived( unsigned int sequence, int size )
+		{
+			recv_packets++;
+			if ( !received_any )
+			{
+				received_any = true;
+				remote_sequence = sequence;
+				received_bits = 0;
+				return;
+			}
+			if ( sequence_more_recent( sequence, remote_sequence, max_sequence ) )
+			{
+				// slide the window forward. the old remote sequence becomes an ack bit
+
+				const unsigned int shift = sequence_difference( sequence, remote_sequence );
+				if ( shift < AckBits )
+					received_bits = ( received_bits << shift ) | ( 1ULL << ( shift - 1 ) );
+				else if ( shift == AckBits )
+					received_bits = 1ULL << ( AckBits - 1 );			// note: only the old remote sequence is left, in the last bit
+				else
+					received_bits = 0;
+				remote_sequence = sequence;
+			}
+			else if ( sequence != remote_sequence )
+			{
+				const unsigned int distance = sequence_difference( remote_sequence, sequence );
+				if ( distance <= AckBits )
+					received_bits |= 1ULL << ( distance - 1 );
+			}
+		}
+
+		// bit n set means remote sequence - 1 - n was received
+
+		uint64_t GenerateAckBits() const
+		{
+			return ack_window < AckBits ? received_bits & ( ( 1ULL << ack_window ) - 1 ) : received_bits;
+		}
+		
+		void ProcessAck( unsigned int ack, uint64_t ack_bits )
+		{
+			// oldest first, like they were sent
+
+			for ( int n = ack_window - 1; n >= 0; --n )
+			{
+				if ( ( ack_bits >> n ) & 1 )
+					Acked( sequence_offset( ack, -n - 1 ) );
+			}
+			Acked( ack );
+		}
+				
+		void Update( float deltaTime )
+		{
+			acks.clear();
+			time += deltaTime;
+			UpdateQueues();
+			UpdateStats();
+			#ifdef NET_UNIT_TEST
+			Validate();
+			#endif
+		}
+		
+		void Validate()
+		{
+			assert( sent_count >= 0 );
+			assert( sent_count <= sentPackets.GetSize() );
+			assert( sent_bytes >= 0 );
+			assert( acked_bytes >= 0 );
+			assert( acked_bytes <= sent_bytes );
+			assert( sequence_offset( sent_tail, sent_count ) == local_sequence );
+		}
+
+		// utility functions
+
+		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
+		{
+			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
+		}
+		
+		// data accessors
+				
+		unsigned int GetLocalSequence() const
+		{
+			return local_sequence;
+		}
+
+		unsigned int GetRemoteSequence() const
+		{
+			return remote_sequence;
+		}
+		
+		unsigned int GetMaxSequence() const
+		{
+			return max_sequence;
+		}
+				
+ 		void GetAcks( unsigned int ** acks, int & count )
+		{
+			*acks = &this->acks[0];
+			count = (int) this->acks.size();
+		}
+		
+		unsigned int GetSentPackets() const
+		{
+			return sent_packets;
+		}
+		
+		unsigned int GetReceivedPackets() const
+		{
+			return recv_packets;
+		}
+
+		unsigned int GetLostPackets() const
+		{
+			return lost_packets;
+		}
+
+		unsigned int GetAckedPackets() const
+		{
+			return acked_packets;
+		}
+
+		float GetSentBandwidth() const
+		{
+			return sent_bandwidth;
+		}
+
+		float GetAckedBandwidth() const
+		{
+			return acked_bandwidth;
+		}
+
+		float GetRoundTripTime() const
+		{
+			return rtt;
+		}
+		
+		int GetHeaderSize() const
+		{
+			return 16;
+		}
+
+	protected:
+
+		struct SentPacket
+		{
+			double time;					// time the packet was sent
+			int size;						// packet size in bytes
+			bool acked;
+		};
+
+		// sequence differences and offsets modulo max_sequence + 1
+
+		unsigned int sequence_difference( unsigned int s1, unsigned int s2 ) const
+		{
+			const uint64_t range = (uint64_t) max_sequence + 1;
+			return (unsigned int) ( ( s1 + range - s2 ) % range );
+		}
+
+		unsigned int sequence_offset( unsigned int sequence, int offset ) const
+		{
+			const uint64_t range = (uint64_t) max_sequence + 1;
+			return (unsigned int) ( ( sequence + range + offset ) % range );
+		}
+
+		void Acked( unsigned int sequence )
+		{
+			SentPacket * packet = sentPackets.Find( sequence );
+			if ( !packet || packet->acked )
+				return;
+			packet->acked = true;
+			rtt += ( (float) ( time - packet->time ) - rtt ) * 0.1f;
+			acks.push_back( sequence );
+			acked_packets++;
+			acked_bytes += packet->size;
+		}
+
+		// take a packet out of the stats. never acked by now means lost
+
+		void Retire( const SentPacket & packet )
+		{
+			sent_bytes -= packet.size;
+			if ( packet.acked )
+				acked_bytes -= packet.size;
+			else
+				lost_packets++;
+		}
+
+		void RetireOldest()
+		{
+			assert( sent_count > 0 );
+			SentPacket * packet = sentPackets.Find( sent_tail );
+			if ( packet )
+			{
+				Retire( *packet );
+				sentPackets.Remove( sent_tail );
+			}
+			sent_tail = sequence_offset( sent_tail, 1 );
+			sent_count--;
+		}
+		
+		void UpdateQueues()
+		{
+			const float epsilon = 0.001f;
+
+			while ( sent_count > 0 )
+			{
+				const SentPacket * packet = sentPackets.Find( sent_tail );
+				if ( packet && time - packet->time <= rtt_maximum + epsilon )
+					break;
+				RetireOldest();
+			}
+		}
+		
+		void UpdateStats()
+		{
+			sent_bandwidth = sent_bytes / rtt_maximum * ( 8 / 1000.0f );
+			acked_bandwidth = acked_bytes / rtt_maximum * ( 8 / 1000.0f );
+		}
+		
+	private:
+		
+		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
+		unsigned int local_sequence;		// local sequence number for most recently sent packet
+		unsigned int remote_sequence;		// remote sequence number for most recently received packet
+		uint64_t received_bits;				// bit n set if remote_sequence - 1 - n was received
+		bool received_any;					// remote_sequence is only meaningful once a packet has arrived
+		int ack_window;						// number of ack bits in use
+		
+		unsigned int sent_packets;			// total number of packets sent
+		unsigned int recv_packets;			// total number of packets received
+		unsigned int lost_packets;			// total number of packets lost
+		unsigned int acked_packets;			// total number of packets acked
+
+		float sent_bandwidth;				// approximate sent bandwidth over the last second
+		float acked_bandwidth;				// approximate acked bandwidth of packets sent over the last second
+		float rtt;							// estimated round trip time
+		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
+
+		double time;						// accumulated update time, packets are stamped with it when sent
+
+		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+
+		SequenceBuffer<SentPacket> sentPackets;		// packets sent within the last rtt_maximum, acked or not
+		unsigned int sent_tail;				// oldest sequence still in the sent buffer
+		int sent_count;						// sequences from sent_tail up to local_sequence
+		int sent_bytes;						// bytes sent within the last rtt_maximum
+		int acked_bytes;					// bytes of those which have been acked
+	};
+
+	// virtual connection over UDP
+	//  + very simple, just for learning purposes do not use in production code
+	
+	class Connection
+	{
+	public:
+		
+		enum Mode
+		{
+			None,	
+			Client,
+			Server
+		};
+		
+		Connection( unsigned int protocolId, float timeout )
+		{
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			mode = None;
+			running = false;
+			reactor = NULL;
+			ClearData();
+		}
+		
+		virtual ~Connection()
+		{
+			if ( IsRunning() )
+				Stop();
+		}
+		
+		bool Start( int port )
+		{
+			assert( !running );
+			printf( "start connection on port %d\n", port );
+			if ( !socket.Open( port ) )
+				return false;
+			running = true;
+			OnStart();
+			return true;
+		}
+		
+		void Stop()
+		{
+			assert( running );
+			printf( "stop connection\n" );
+			Detach();
+			bool connected = IsConnected();
+			ClearData();
+			socket.Close();
+			running = false;
+			if ( connected )
+				OnDisconnect();
+			OnStop();
+		}
+		
+		bool IsRunning() const
+		{
+			return running;
+		}
+		
+		void Listen()
+		{
+			printf( "server listening for connection\n" );
+			bool connected = IsConnected();
+			ClearData();
+			if ( connected )
+				OnDisconnect();
+			mode = Server;
+			state = Listening;
+		}
+		
+		void Connect( const Address & address )
+		{
+			printf( "client connecting to %d.%d.%d.%d:%d\n", 
+				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort() );
+			bool connected = IsConnected();
+			ClearData();
+			if ( connected )
+				OnDisconnect();
+			mode = Client;
+			state = Connecting;
+			this->address = address;
+		}
+		
+		bool IsConnecting() const
+		{
+			return state == Connecting;
+		}
+		
+		bool ConnectFailed() const
+		{
+			return state == ConnectFail;
+		}
+		
+		bool IsConnected() const
+		{
+			return state == Connected;
+		}
+		
+		bool IsListening() const
+		{
+			return state == Listening;
+		}
+		
+		Mode GetMode() const
+		{
+			return mode;
+		}
+		
+		virtual void Update( float deltaTime )
+		{
+			assert( running );
+			timeoutAccumulator += deltaTime;
+			if ( timeoutAccumulator > timeout )
+			{
+				if ( state == Connecting )
+				{
+					printf( "connect timed out\n" );
+					ClearData();
+					state = ConnectFail;
+					OnDisconnect();
+				}
+				else if ( state == Connected )
+				{
+					printf( "connection timed out\n" );
+					ClearData();
+					if ( state == Connecting )
+						state = ConnectFail;
+					OnDisconnect();
+				}
+			}
+		}
+		
+		// copies the payload once into a packet buffer, headers go in front of it in place
+
+		bool SendPacket( const unsigned char data[], int size )
+		{
+			PacketBuffer buffer;
+			if ( size > buffer.GetTailroom() )
+				return false;
+			memcpy( buffer.Append( size ), data, size );
+			return SendPacket( buffer );
+		}
+
+		// payload is copied once out of the packet buffer, truncated to size
+
+		int ReceivePacket( unsigned char data[], int size )
+		{
+			PacketBuffer buffer;
+			int bytes = ReceivePacket( buffer );
+			if ( bytes > size )
+				bytes = size;
+			memcpy( data, buffer.GetData(), bytes );
+			return bytes;
+		}
+
+		bool SendPacket( PacketBuffer & buffer )
+		{
+			return SendPackets( &buffer, 1 ) == 1;
+		}
+
+		// on return the buffer holds just the payload
+
+		int ReceivePacket( PacketBuffer & buffer )
+		{
+			return ReceivePackets( &buffer, 1 ) == 1 ? buffer.GetSize() : 0;
+		}
+
+		// sends a batch with as few syscalls as the platform allows. returns the number sent
+
+		virtual int SendPackets( PacketBuffer * buffers, int count )
+		{
+			assert( running );
+			if ( address.GetAddress() == 0 )
+				return 0;
+			int sent = 0;
+			while ( sent < count )
 			{
-				if ( itor->sequence == ack || sequence_more_recent( itor->sequence, ack, max_sequence ) )
+				const int n = count - sent < Socket::MaxBatchSize ? count - sent : Socket::MaxBatchSize;
+				Datagram datagrams[Socket::MaxBatchSize];
+				for ( int i = 0; i < n; ++i )
+				{
+					PacketBuffer & buffer = buffers[sent+i];
+					WriteInteger( buffer.Prepend( 4 ), protocolId );
+					datagrams[i].address = address;
+					datagrams[i].data = buffer.GetData();
+					datagrams[i].size = buffer.GetSize();
+				}
+				const int result = socket.SendBatch( datagrams, n );
+				sent += result;
+				if ( result < n )
 					break;
-				int bit_index = bit_index_for_sequence( itor->sequence, ack, max_sequence );
-				if ( bit_index <= 31 )
-					ack_bits |= 1 << bit_index;
 			}
-			return ack_bits;
+			return sent;
+		}
+
+		// receives up to count packets with one syscall where the platform allows. returns the number of
+		// buffers filled. packets that are not for this connection come back empty, with size zero
+
+		virtual int ReceivePackets( PacketBuffer * buffers, int count )
+		{
+			assert( running );
+			if ( count > Socket::MaxBatchSize )
+				count = Socket::MaxBatchSize;
+			Datagram datagrams[Socket::MaxBatchSize];
+			for ( int i = 0; i < count; ++i )
+			{
+				buffers[i].Reset( 0 );
+				datagrams[i].data = buffers[i].GetBuffer();
+				datagrams[i].size = PacketBuffer::Capacity;
+			}
+			const int received = socket.ReceiveBatch( datagrams, count );
+			for ( int i = 0; i < received; ++i )
+			{
+				buffers[i].SetSize( datagrams[i].size );
+				if ( !AcceptPacket( datagrams[i].address, buffers[i] ) )
+					buffers[i].SetSize( 0 );
+			}
+			return received;
 		}
 		
-		static void process_ack( unsigned int ack, unsigned int ack_bits, 
-								 PacketQueue & pending_ack_queue, PacketQueue & acked_queue, 
-								 std::vector<unsigned int> & acks, unsigned int & acked_packets, 
-								 float & rtt, unsigned int max_sequence )
+		int GetHeaderSize() const
+		{
+			return 4;
+		}
+
+		const Address & GetAddress() const
+		{
+			return address;
+		}
+
+		const SocketStats & GetSocketStats() const
+		{
+			return socket.GetStats();
+		}
+
+		// calls the ready function when packets arrive. timeouts still advance in Update, which the owner
+		// runs from its tick, since the reliability system measures round trips against that clock
+
+		bool Attach( Reactor & reactor, Reactor::ReadyFunction function, void * data )
+		{
+			assert( running );
+			assert( !this->reactor );
+			if ( !reactor.Add( socket, function, data ) )
+				return false;
+			this->reactor = &reactor;
+			return true;
+		}
+
+		void Detach()
 		{
-			if ( pending_ack_queue.empty() )
+			if ( !reactor )
 				return;
-				
-			PacketQueue::iterator itor = pending_ack_queue.begin();
-			while ( itor != pending_ack_queue.end() )
+			reactor->Remove( socket );
+			reactor = NULL;
+		}
+		
+	protected:
+		
+		virtual void OnStart()		{}
+		virtual void OnStop()		{}
+		virtual void OnConnect()    {}
+		virtual void OnDisconnect() {}
+			
+	private:
+
+		// checks the protocol id and connection state, strips the protocol id
+
+		bool AcceptPacket( const Address & sender, PacketBuffer & buffer )
+		{
+			if ( buffer.GetSize() <= 4 )
+				return false;
+			unsigned int packetProtocolId;
+			ReadInteger( buffer.Consume( 4 ), packetProtocolId );
+			if ( packetProtocolId != protocolId )
 			{
-				bool acked = false;
-				
-				if ( itor->sequence == ack )
-				{
-					acked = true;
-				}
-				else if ( !sequence_more_recent( itor->sequence, ack, max_sequence ) )
-				{
-					int bit_index = bit_index_for_sequence( itor->sequence, ack, max_sequence );
-					if ( bit_index <= 31 )
-						acked = ( ack_bits >> bit_index ) & 1;
-				}
-				
-				if ( acked )
+				printf( "incorrect protocol id: %x vs. %x\n", packetProtocolId, protocolId );
+				return false;
+			}
+			if ( mode == Server && !IsConnected() )
+			{
+				printf( "server accepts connection from client %d.%d.%d.%d:%d\n", 
+					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort() );
+				state = Connected;
+				address = sender;
+				OnConnect();
+			}
+			if ( sender == address )
+			{
+				if ( mode == Client && state == Connecting )
 				{
-					rtt += ( itor->time - rtt ) * 0.1f;
-
-					acked_queue.insert_sorted( *itor, max_sequence );
-					acks.push_back( itor->sequence );
-					acked_packets++;
-					itor = pending_ack_queue.erase( itor );
+					printf( "client completes connection with server\n" );
+					state = Connected;
+					OnConnect();
 				}
-				else
-					++itor;
+				timeoutAccumulator = 0.0f;
+				return true;
 			}
+			return false;
 		}
 		
-		// data accessors
-				
-		unsigned int GetLocalSequence() const
+		void ClearData()
 		{
-			return local_sequence;
+			state = Disconnected;
+			timeoutAccumulator = 0.0f;
+			address = Address();
 		}
+	
+		enum State
+		{
+			Disconnected,
+			Listening,
+			Connecting,
+			ConnectFail,
+			Connected
+		};
 
-		unsigned int GetRemoteSequence() const
+		unsigned int protocolId;
+		float timeout;
+		
+		bool running;
+		Mode mode;
+		State state;
+		Socket socket;
+		Reactor * reactor;
+		float timeoutAccumulator;
+		Address address;
+	};
+	
+	// connection with reliability (seq/ack)
+	//  + just for demonstrating the reliability system
+
+	class ReliableConnection : public Connection
+	{
+	public:
+		
+		ReliableConnection( unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF )
+			: Connection( protocolId, timeout ), reliabilitySystem( max_sequence )
 		{
-			return remote_sequence;
+			ClearData();
+			#ifdef NET_UNIT_TEST
+			packet_loss_mask = 0;
+			#endif
 		}
-		
-		unsigned int GetMaxSequence() const
+	
+		~ReliableConnection()
 		{
-			return max_sequence;
+			if ( IsRunning() )
+				Stop();
 		}
+		
+		// overriden functions from "Connection"
+
+		// note: every packet in the batch is counted as sent, a send that fails part way shows up as loss
 				
- 		void GetAcks( unsigned int ** acks, int & count )
+		int SendPackets( PacketBuffer * buffers, int count )
 		{
-			*acks = &this->acks[0];
-			count = (int) this->acks.size();
+			if ( GetAddress().GetAddress() == 0 )
+				return 0;
+			const int header = 16;
+			const unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			const uint64_t ack_bits = reliabilitySystem.GenerateAckBits();
+			int sent = 0;
+			int first = 0;
+			for ( int i = 0; i < count; ++i )
+			{
+				const int size = buffers[i].GetSize();
+				#ifdef NET_UNIT_TEST
+				if ( reliabilitySystem.GetLocalSequence() & packet_loss_mask )
+				{
+					sent += Connection::SendPackets( buffers + first, i - first );
+					reliabilitySystem.PacketSent( size );
+					sent++;
+					first = i + 1;
+					continue;
+				}
+				#endif
+				WriteHeader( buffers[i].Prepend( header ), reliabilitySystem.GetLocalSequence(), ack, ack_bits );
+				reliabilitySystem.PacketSent( size );
+			}
+			sent += Connection::SendPackets( buffers + first, count - first );
+			return sent;
+		}	
+		
+		int ReceivePackets( PacketBuffer * buffers, int count )
+		{
+			const int header = 16;
+			const int received = Connection::ReceivePackets( buffers, count );
+			for ( int i = 0; i < received; ++i )
+			{
+				PacketBuffer & buffer = buffers[i];
+				if ( buffer.GetSize() <= header )
+				{
+					buffer.SetSize( 0 );
+					continue;
+				}
+				unsigned int packet_sequence = 0;
+				unsigned int packet_ack = 0;
+				uint64_t packet_ack_bits = 0;
+				ReadHeader( buffer.Consume( header ), packet_sequence, packet_ack, packet_ack_bits );
+				reliabilitySystem.PacketReceived( packet_sequence, buffer.GetSize() );
+				reliabilitySystem.ProcessAck( packet_ack, packet_ack_bits );
+			}
+			return received;
 		}
 		
-		unsigned int GetSentPackets() const
+		void Update( float deltaTime )
 		{
-			return sent_packets;
+			Connection::Update( deltaTime );
+			reliabilitySystem.Update( deltaTime );
 		}
 		
-		unsigned int GetReceivedPackets() const
+		int GetHeaderSize() const
 		{
-			return recv_packets;
+			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+		}
+		
+		ReliabilitySystem & GetReliabilitySystem()
+		{
+			return reliabilitySystem;
 		}
 
-		unsigned int GetLostPackets() const
+		// unit test controls
+		
+		#ifdef NET_UNIT_TEST
+		void SetPacketLossMask( unsigned int mask )
 		{
-			return lost_packets;
+			packet_loss_mask = mask;
 		}
+		#endif
+		
+		// the reliability header in front of each payload
 
-		unsigned int GetAckedPackets() const
+		static void WriteHeader( unsigned char * header, unsigned int sequence, unsigned int ack, uint64_t ack_bits )
 		{
-			return acked_packets;
+			WriteInteger( header, sequence );
+			WriteInteger( header + 4, ack );
+			WriteInteger( header + 8, (unsigned int) ( ack_bits >> 32 ) );
+			WriteInteger( header + 12, (unsigned int) ack_bits );
 		}
 
-		float GetSentBandwidth() const
+		static void ReadHeader( const unsigned char * header, unsigned int & sequence, unsigned int & ack, uint64_t & ack_bits )
 		{
-			return sent_bandwidth;
+			unsigned int high, low;
+			ReadInteger( header, sequence );
+			ReadInteger( header + 4, ack );
+			ReadInteger( header + 8, high );
+			ReadInteger( header + 12, low );
+			ack_bits = ( (uint64_t) high << 32 ) | low;
 		}
 
-		float GetAckedBandwidth() const
+	protected:		
+
+		virtual void OnStop()
 		{
-			return acked_bandwidth;
+			ClearData();
+		}
+		
+		virtual void OnDisconnect()
+		{
+			ClearData();
 		}
+		
+	private:
 
-		float GetRoundTripTime() const
+		void ClearData()
 		{
-			return rtt;
+			reliabilitySystem.Reset();
 		}
+
+		#ifdef NET_UNIT_TEST
+		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
+		#endif
 		
-		int GetHeaderSize() const
+		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+	};
+
+	// address hash
+	//  + maps addresses to small integers, eg. node ids
+	//  + open addressed with linear probing, capacity at least twice the entries it was sized for
+	//  + removal shifts later entries back into the hole, so there are no tombstones
+
+	class AddressHash
+	{
+		struct Entry
+		{
+			Address address;
+			int value;				// negative when empty
+			Entry()
+			{
+				value = -1;
+			}
+		};
+
+		std::vector<Entry> entries;
+		int mask;
+		int count;
+
+	public:
+
+		AddressHash( int maxEntries = 0 )
 		{
-			return 12;
+			Resize( maxEntries );
 		}
 
-	protected:
-		
-		void AdvanceQueueTime( float deltaTime )
+		void Resize( int maxEntries )
 		{
-			for ( PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); itor++ )
-				itor->time += deltaTime;
-
-			for ( PacketQueue::iterator itor = receivedQueue.begin(); itor != receivedQueue.end(); itor++ )
-				itor->time += deltaTime;
-
-			for ( PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); itor++ )
-				itor->time += deltaTime;
-
-			for ( PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); itor++ )
-				itor->time += deltaTime;
+			assert( maxEntries >= 0 );
+			int capacity = 16;
+			while ( capacity < maxEntries * 2 )
+				capacity *= 2;
+			entries.resize( capacity );
+			mask = capacity - 1;
+			Clear();
 		}
-		
-		void UpdateQueues()
+
+		void Clear()
 		{
-			const float epsilon = 0.001f;
+			for ( unsigned int i = 0; i < entries.size(); ++i )
+				entries[i] = Entry();
+			count = 0;
+		}
 
-			while ( sentQueue.size() && sentQueue.front().time > rtt_maximum + epsilon )
-				sentQueue.pop_front();
+		// maps address to value, replacing any value it had
 
-			if ( receivedQueue.size() )
+		void Insert( const Address & address, int value )
+		{
+			assert( value >= 0 );
+			int index = Hash( address ) & mask;
+			while ( entries[index].value >= 0 )
 			{
-				const unsigned int latest_sequence = receivedQueue.back().sequence;
-				const unsigned int minimum_sequence = latest_sequence >= 34 ? ( latest_sequence - 34 ) : max_sequence - ( 34 - latest_sequence );
-				while ( receivedQueue.size() && !sequence_more_recent( receivedQueue.front().sequence, minimum_sequence, max_sequence ) )
-					receivedQueue.pop_front();
+				if ( entries[index].address == address )
+				{
+					entries[index].value = value;
+					return;
+				}
+				index = ( index + 1 ) & mask;
 			}
+			assert( count < mask );
+			entries[index].address = address;
+			entries[index].value = value;
+			count++;
+		}
 
-			while ( ackedQueue.size() && ackedQueue.front().time > rtt_maximum * 2 - epsilon )
-				ackedQueue.pop_front();
+		// value for address, or -1 if it has none
 
-			while ( pendingAckQueue.size() && pendingAckQueue.front().time > rtt_maximum + epsilon )
+		int Find( const Address & address ) const
+		{
+			int index = Hash( address ) & mask;
+			while ( entries[index].value >= 0 )
 			{
-				pendingAckQueue.pop_front();
-				lost_packets++;
+				if ( entries[index].address == address )
+					return entries[index].value;
+				index = ( index + 1 ) & mask;
 			}
+			return -1;
 		}
-		
-		void UpdateStats()
+
+		bool Remove( const Address & address )
 		{
-			int sent_bytes_per_second = 0;
-			for ( PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor )
-				sent_bytes_per_second += itor->size;
-			int acked_packets_per_second = 0;
-			int acked_bytes_per_second = 0;
-			for ( PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor )
+			int hole = Hash( address ) & mask;
+			while ( true )
+			{
+				if ( entries[hole].value < 0 )
+					return false;
+				if ( entries[hole].address == address )
+					break;
+				hole = ( hole + 1 ) & mask;
+			}
+			// move back each following entry whose probe sequence passes over the hole
+			int index = hole;
+			while ( true )
 			{
-				if ( itor->time >= rtt_maximum )
+				index = ( index + 1 ) & mask;
+				if ( entries[index].value < 0 )
+					break;
+				const int home = Hash( entries[index].address ) & mask;
+				if ( ( ( index - home ) & mask ) >= ( ( index - hole ) & mask ) )
 				{
-					acked_packets_per_second++;
-					acked_bytes_per_second += itor->size;
+					entries[hole] = entries[index];
+					hole = index;
 				}
 			}
-			sent_bytes_per_second /= rtt_maximum;
-			acked_bytes_per_second /= rtt_maximum;
-			sent_bandwidth = sent_bytes_per_second * ( 8 / 1000.0f );
-			acked_bandwidth = acked_bytes_per_second * ( 8 / 1000.0f );
+			entries[hole] = Entry();
+			count--;
+			return true;
 		}
-		
-	private:
-		
-		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
-		unsigned int local_sequence;		// local sequence number for most recently sent packet
-		unsigned int remote_sequence;		// remote sequence number for most recently received packet
-		
-		unsigned int sent_packets;			// total number of packets sent
-		unsigned int recv_packets;			// total number of packets received
-		unsigned int lost_packets;			// total number of packets lost
-		unsigned int acked_packets;			// total number of packets acked
 
-		float sent_bandwidth;				// approximate sent bandwidth over the last second
-		float acked_bandwidth;				// approximate acked bandwidth over the last second
-		float rtt;							// estimated round trip time
-		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
+		int GetCount() const
+		{
+			return count;
+		}
 
-		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+	private:
 
-		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
-		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
-		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
-		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
+		static unsigned int Hash( const Address & address )
+		{
+			unsigned int hash = address.GetAddress() ^ ( (unsigned int) address.GetPort() * 0x9E3779B1 );
+			hash ^= hash >> 16;
+			hash *= 0x85EBCA6B;
+			hash ^= hash >> 13;
+			return hash;
+		}
 	};
 
-	// virtual connection over UDP
-	//  + very simple, just for learning purposes do not use in production code
-	
-	class Connection
+	// server endpoint
+	//  + many clients on one socket, told apart by their address
+	//  + each client has its own connection state, timeout and reliability system
+	//  + same packets as a reliable connection, so clients are reliable connections in client mode
+	//  + a client connects with its first packet, while there is a free slot for it
+
+	class ServerEndpoint
 	{
-	public:
-		
-		enum Mode
+		struct ClientState
 		{
-			None,	
-			Client,
-			Server
+			bool connected;
+			float timeoutAccumulator;
+			Address address;
+			ReliabilitySystem reliabilitySystem;
+			ClientState( unsigned int max_sequence ) : reliabilitySystem( max_sequence )
+			{
+				connected = false;
+				timeoutAccumulator = 0.0f;
+			}
 		};
-		
-		Connection( unsigned int protocolId, float timeout )
+
+	public:
+
+		ServerEndpoint( unsigned int protocolId, float timeout, int maxClients, unsigned int max_sequence = 0xFFFFFFFF )
+			: addressToClient( maxClients )
 		{
+			assert( maxClients >= 1 );
 			this->protocolId = protocolId;
 			this->timeout = timeout;
-			mode = None;
+			clients.resize( maxClients, ClientState( max_sequence ) );
 			running = false;
+			reactor = NULL;
 			ClearData();
 		}
-		
-		virtual ~Connection()
+
+		virtual ~ServerEndpoint()
 		{
 			if ( IsRunning() )
 				Stop();
 		}
-		
+
 		bool Start( int port )
 		{
 			assert( !running );
-			printf( "start connection on port %d\n", port );
+			printf( "start server endpoint on port %d\n", port );
 			if ( !socket.Open( port ) )
 				return false;
+			// room for a packet from every client between updates
+			socket.SetReceiveBufferSize( (int) clients.size() * 1024 );
 			running = true;
-			OnStart();
 			return true;
 		}
-		
+
 		void Stop()
 		{
 			assert( running );
-			printf( "stop connection\n" );
-			bool connected = IsConnected();
-			ClearData();
+			printf( "stop server endpoint\n" );
+			Detach();
+			for ( int i = 0; i < (int) clients.size(); ++i )
+			{
+				if ( clients[i].connected )
+					DisconnectClient( i );
+			}
 			socket.Close();
+			ClearData();
 			running = false;
-			if ( connected )
-				OnDisconnect();
-			OnStop();
 		}
-		
+
 		bool IsRunning() const
 		{
 			return running;
 		}
-		
-		void Listen()
-		{
-			printf( "server listening for connection\n" );
-			bool connected = IsConnected();
-			ClearData();
-			if ( connected )
-				OnDisconnect();
-			mode = Server;
-			state = Listening;
-		}
-		
-		void Connect( const Address & address )
-		{
-			printf( "client connecting to %d.%d.%d.%d:%d\n", 
-				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort() );
-			bool connected = IsConnected();
-			ClearData();
-			if ( connected )
-				OnDisconnect();
-			mode = Client;
-			state = Connecting;
-			this->address = address;
-		}
-		
-		bool IsConnecting() const
-		{
-			return state == Connecting;
-		}
-		
-		bool ConnectFailed() const
-		{
-			return state == ConnectFail;
-		}
-		
-		bool IsConnected() const
-		{
-			return state == Connected;
-		}
-		
-		bool IsListening() const
-		{
-			return state == Listening;
-		}
-		
-		Mode GetMode() const
-		{
-			return mode;
-		}
-		
-		virtual void Update( float deltaTime )
+
+		// advances every client's reliability system and disconnects the clients that timed out
+
+		void Update( float deltaTime )
 		{
 			assert( running );
-			timeoutAccumulator += deltaTime;
-			if ( timeoutAccumulator > timeout )
+			for ( int i = 0; i < (int) clients.size(); ++i )
 			{
-				if ( state == Connecting )
-				{
-					printf( "connect timed out\n" );
-					ClearData();
-					state = ConnectFail;
-					OnDisconnect();
-				}
-				else if ( state == Connected )
+				ClientState & client = clients[i];
+				if ( !client.connected )
+					continue;
+				client.reliabilitySystem.Update( deltaTime );
+				client.timeoutAccumulator += deltaTime;
+				if ( client.timeoutAccumulator > timeout )
 				{
-					printf( "connection timed out\n" );
-					ClearData();
-					if ( state == Connecting )
-						state = ConnectFail;
-					OnDisconnect();
+					printf( "client %d timed out\n", i );
+					DisconnectClient( i );
 				}
 			}
 		}
-		
-		virtual bool SendPacket( const unsigned char data[], int size )
-		{
-			assert( running );
-			if ( address.GetAddress() == 0 )
-				return false;
-			unsigned char packet[size+4];
-			packet[0] = (unsigned char) ( protocolId >> 24 );
-			packet[1] = (unsigned char) ( ( protocolId >> 16 ) & 0xFF );
-			packet[2] = (unsigned char) ( ( protocolId >> 8 ) & 0xFF );
-			packet[3] = (unsigned char) ( ( protocolId ) & 0xFF );
-			memcpy( &packet[4], data, size );
-			return socket.Send( address, packet, size + 4 );
-		}
-		
-		virtual int ReceivePacket( unsigned char data[], int size )
+
+		void DisconnectClient( int clientIndex )
 		{
-			assert( running );
-			unsigned char packet[size+4];
-			Address sender;
-			int bytes_read = socket.Receive( sender, packet, size + 4 );
-			if ( bytes_read == 0 )
-				return 0;
-			if ( bytes_read <= 4 )
-				return 0;
-			unsigned int packetProtocolId;
-			ReadInteger( packet, packetProtocolId );
-			if ( packetProtocolId != protocolId )
-			{
-				printf( "incorrect protocol id: %x vs. %x\n", packetProtocolId, protocolId );
-				return 0;
-			}
-			if ( mode == Server && !IsConnected() )
-			{
-				printf( "server accepts connection from client %d.%d.%d.%d:%d\n", 
-					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort() );
-				state = Connected;
-				address = sender;
-				OnConnect();
-			}
-			if ( sender == address )
-			{
-				if ( mode == Client && state == Connecting )
-				{
-					printf( "client completes connection with server\n" );
-					state = Connected;
-					OnConnect();
-				}
-				timeoutAccumulator = 0.0f;
-				memcpy( data, &packet[4], bytes_read - 4 );
-				return bytes_read - 4;
-			}
-			return 0;
+			assert( clientIndex >= 0 );
+			assert( clientIndex < (int) clients.size() );
+			ClientState & client = clients[clientIndex];
+			assert( client.connected );
+			addressToClient.Remove( client.address );
+			client.connected = false;
+			client.timeoutAccumulator = 0.0f;
+			client.address = Address();
+			client.reliabilitySystem.Reset();
+			freeClients.push_back( clientIndex );
+			std::push_heap( freeClients.begin(), freeClients.end(), std::greater<int>() );
+			numClients--;
+			OnClientDisconnect( clientIndex );
 		}
-		
-		int GetHeaderSize() const
+
+		bool SendPacket( int clientIndex, const unsigned char data[], int size )
 		{
-			return 4;
+			PacketBuffer buffer;
+			if ( size > buffer.GetTailroom() )
+				return false;
+			memcpy( buffer.Append( size ), data, size );
+			return SendPacket( clientIndex, buffer );
 		}
-		
-	protected:
-		
-		virtual void OnStart()		{}
-		virtual void OnStop()		{}
-		virtual void OnConnect()    {}
-		virtual void OnDisconnect() {}
-			
-	private:
-		
-		void ClearData()
+
+		bool SendPacket( int clientIndex, PacketBuffer & buffer )
 		{
-			state = Disconnected;
-			timeoutAccumulator = 0.0f;
-			address = Address();
+			return SendPackets( &buffer, &clientIndex, 1 ) == 1;
 		}
-	
-		enum State
-		{
-			Disconnected,
-			Listening,
-			Connecting,
-			ConnectFail,
-			Connected
-		};
 
-		unsigned int protocolId;
-		float timeout;
-		
-		bool running;
-		Mode mode;
-		State state;
-		Socket socket;
-		float timeoutAccumulator;
-		Address address;
-	};
-	
-	// connection with reliability (seq/ack)
-	//  + just for demonstrating the reliability system
+		// sends each buffer to its client, batching across clients. packets for clients that are not
+		// connected are skipped. returns the number sent
 
-	class ReliableConnection : public Connection
-	{
-	public:
-		
-		ReliableConnection( unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF )
-			: Connection( protocolId, timeout ), reliabilitySystem( max_sequence )
+		int SendPackets( PacketBuffer * buffers, const int clientIndex[], int count )
 		{
-			ClearData();
-			#ifdef NET_UNIT_TEST
-			packet_loss_mask = 0;
-			#endif
+			assert( running );
+			const int header = 16;
+			int sent = 0;
+			int i = 0;
+			while ( i < count )
+			{
+				Datagram datagrams[Socket::MaxBatchSize];
+				int n = 0;
+				for ( ; i < count && n < Socket::MaxBatchSize; ++i )
+				{
+					assert( clientIndex[i] >= 0 );
+					assert( clientIndex[i] < (int) clients.size() );
+					ClientState & client = clients[clientIndex[i]];
+					if ( !client.connected )
+						continue;
+					PacketBuffer & buffer = buffers[i];
+					ReliabilitySystem & reliabilitySystem = client.reliabilitySystem;
+					const int size = buffer.GetSize();
+					ReliableConnection::WriteHeader( buffer.Prepend( header ), reliabilitySystem.GetLocalSequence(), reliabilitySystem.GetRemoteSequence(), reliabilitySystem.GenerateAckBits() );
+					WriteInteger( buffer.Prepend( 4 ), protocolId );
+					reliabilitySystem.PacketSent( size );
+					datagrams[n].address = client.address;
+					datagrams[n].data = buffer.GetData();
+					datagrams[n].size = buffer.GetSize();
+					n++;
+				}
+				const int result = n > 0 ? socket.SendBatch( datagrams, n ) : 0;
+				sent += result;
+				if ( result < n )
+					break;
+			}
+			return sent;
 		}
-	
-		~ReliableConnection()
+
+		// next packet from any client, skipping packets that are not from a client. returns the payload size,
+		// zero when there are none left
+
+		int ReceivePacket( int & clientIndex, unsigned char data[], int size )
 		{
-			if ( IsRunning() )
-				Stop();
+			PacketBuffer buffer;
+			while ( ReceivePackets( &buffer, &clientIndex, 1 ) == 1 )
+			{
+				int bytes = buffer.GetSize();
+				if ( bytes == 0 )
+					continue;
+				if ( bytes > size )
+					bytes = size;
+				memcpy( data, buffer.GetData(), bytes );
+				return bytes;
+			}
+			return 0;
 		}
-		
-		// overriden functions from "Connection"
-				
-		bool SendPacket( const unsigned char data[], int size )
+
+		// receives up to count packets with one syscall where the platform allows. returns the number of
+		// buffers filled, each with the index of the client it came from. packets that are not from a
+		// client come back empty with index -1, eg. when every client slot is taken
+
+		int ReceivePackets( PacketBuffer * buffers, int clientIndex[], int count )
 		{
-			#ifdef NET_UNIT_TEST
-			if ( reliabilitySystem.GetLocalSequence() & packet_loss_mask )
+			assert( running );
+			if ( count > Socket::MaxBatchSize )
+				count = Socket::MaxBatchSize;
+			Datagram datagrams[Socket::MaxBatchSize];
+			for ( int i = 0; i < count; ++i )
 			{
-				reliabilitySystem.PacketSent( size );
-				return true;
+				buffers[i].Reset( 0 );
+				datagrams[i].data = buffers[i].GetBuffer();
+				datagrams[i].size = PacketBuffer::Capacity;
 			}
-			#endif
-			const int header = 12;
-			unsigned char packet[header+size];
-			unsigned int seq = reliabilitySystem.GetLocalSequence();
-			unsigned int ack = reliabilitySystem.GetRemoteSequence();
-			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
-			WriteHeader( packet, seq, ack, ack_bits );
-			memcpy( packet + header, data, size );
- 			if ( !Connection::SendPacket( packet, size + header ) )
-				return false;
-			reliabilitySystem.PacketSent( size );
-			return true;
-		}	
-		
-		int ReceivePacket( unsigned char data[], int size )
+			const int received = socket.ReceiveBatch( datagrams, count );
+			for ( int i = 0; i < received; ++i )
+			{
+				buffers[i].SetSize( datagrams[i].size );
+				clientIndex[i] = AcceptPacket( datagrams[i].address, buffers[i] );
+				if ( clientIndex[i] < 0 )
+					buffers[i].SetSize( 0 );
+			}
+			return received;
+		}
+
+		int GetHeaderSize() const
 		{
-			const int header = 12;
-			if ( size <= header )
-				return false;
-			unsigned char packet[header+size];
-			int received_bytes = Connection::ReceivePacket( packet, size + header );
-			if ( received_bytes == 0 )
-				return false;
-			if ( received_bytes <= header )
-				return false;
-			unsigned int packet_sequence = 0;
-			unsigned int packet_ack = 0;
-			unsigned int packet_ack_bits = 0;
-			ReadHeader( packet, packet_sequence, packet_ack, packet_ack_bits );
-			reliabilitySystem.PacketReceived( packet_sequence, received_bytes - header );
-			reliabilitySystem.ProcessAck( packet_ack, packet_ack_bits );
-			memcpy( data, packet + header, received_bytes - header );
-			return received_bytes - header;
+			return 4 + 16;
 		}
-		
-		void Update( float deltaTime )
+
+		int GetMaxClients() const
 		{
-			Connection::Update( deltaTime );
-			reliabilitySystem.Update( deltaTime );
+			return (int) clients.size();
 		}
-		
-		int GetHeaderSize() const
+
+		int GetNumClients() const
 		{
-			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+			return numClients;
 		}
-		
-		ReliabilitySystem & GetReliabilitySystem()
+
+		bool IsClientConnected( int clientIndex ) const
 		{
-			return reliabilitySystem;
+			assert( clientIndex >= 0 );
+			assert( clientIndex < (int) clients.size() );
+			return clients[clientIndex].connected;
 		}
 
-		// unit test controls
-		
-		#ifdef NET_UNIT_TEST
-		void SetPacketLossMask( unsigned int mask )
+		const Address & GetClientAddress( int clientIndex ) const
 		{
-			packet_loss_mask = mask;
+			assert( clientIndex >= 0 );
+			assert( clientIndex < (int) clients.size() );
+			return clients[clientIndex].address;
 		}
-		#endif
-		
-	protected:		
-		
-		void WriteHeader( unsigned char * header, unsigned int sequence, unsigned int ack, unsigned int ack_bits )
+
+		// index of the client at address, or -1
+
+		int FindClient( const Address & address ) const
 		{
-			WriteInteger( header, sequence );
-			WriteInteger( header + 4, ack );
-			WriteInteger( header + 8, ack_bits );
+			return addressToClient.Find( address );
 		}
 
-		void ReadHeader( const unsigned char * header, unsigned int & sequence, unsigned int & ack, unsigned int & ack_bits )
+		ReliabilitySystem & GetReliabilitySystem( int clientIndex )
 		{
-			ReadInteger( header, sequence );
-			ReadInteger( header + 4, ack );
-			ReadInteger( header + 8, ack_bits );
+			assert( clientIndex >= 0 );
+			assert( clientIndex < (int) clients.size() );
+			return clients[clientIndex].reliabilitySystem;
 		}
 
-		virtual void OnStop()
+		const SocketStats & GetSocketStats() const
 		{
-			ClearData();
+			return socket.GetStats();
 		}
-		
-		virtual void OnDisconnect()
+
+		// calls the ready function when packets arrive. timeouts still advance in Update
+
+		bool Attach( Reactor & reactor, Reactor::ReadyFunction function, void * data )
 		{
-			ClearData();
+			assert( running );
+			assert( !this->reactor );
+			if ( !reactor.Add( socket, function, data ) )
+				return false;
+			this->reactor = &reactor;
+			return true;
 		}
-		
+
+		void Detach()
+		{
+			if ( !reactor )
+				return;
+			reactor->Remove( socket );
+			reactor = NULL;
+		}
+
+	protected:
+
+		virtual void OnClientConnect( int )		{}
+		virtual void OnClientDisconnect( int )	{}
+
 	private:
 
+		ServerEndpoint( const ServerEndpoint & other );
+		ServerEndpoint & operator = ( const ServerEndpoint & other );
+
+		// checks the protocol id, finds or connects the sender and strips the headers. returns the client index, or -1
+
+		int AcceptPacket( const Address & sender, PacketBuffer & buffer )
+		{
+			const int header = 16;
+			if ( buffer.GetSize() <= 4 + header )
+				return -1;
+			unsigned int packetProtocolId;
+			ReadInteger( buffer.Consume( 4 ), packetProtocolId );
+			if ( packetProtocolId != protocolId )
+				return -1;
+			int clientIndex = addressToClient.Find( sender );
+			if ( clientIndex < 0 )
+			{
+				if ( freeClients.empty() )
+					return -1;
+				clientIndex = freeClients.front();
+				std::pop_heap( freeClients.begin(), freeClients.end(), std::greater<int>() );
+				freeClients.pop_back();
+				ClientState & client = clients[clientIndex];
+				assert( !client.connected );
+				client.connected = true;
+				client.address = sender;
+				addressToClient.Insert( sender, clientIndex );
+				numClients++;
+				OnClientConnect( clientIndex );
+			}
+			ClientState & client = clients[clientIndex];
+			unsigned int packet_sequence = 0;
+			unsigned int packet_ack = 0;
+			uint64_t packet_ack_bits = 0;
+			ReliableConnection::ReadHeader( buffer.Consume( header ), packet_sequence, packet_ack, packet_ack_bits );
+			client.reliabilitySystem.PacketReceived( packet_sequence, buffer.GetSize() );
+			client.reliabilitySystem.ProcessAck( packet_ack, packet_ack_bits );
+			client.timeoutAccumulator = 0.0f;
+			return clientIndex;
+		}
+
 		void ClearData()
 		{
-			reliabilitySystem.Reset();
+			addressToClient.Clear();
+			freeClients.clear();
+			for ( int i = 0; i < (int) clients.size(); ++i )
+				freeClients.push_back( i );				// note: ascending order is already a min-heap
+			numClients = 0;
 		}
 
-		#ifdef NET_UNIT_TEST
-		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
-		#endif
-		
-		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		unsigned int protocolId;
+		float timeout;
+
+		bool running;
+		Socket socket;
+		Reactor * reactor;
+		std::vector<ClientState> clients;
+		std::vector<int> freeClients;			// free client slots, min-heap so the lowest is reused first
+		AddressHash addressToClient;
+		int numClients;
 	};
 
 	// node mesh
 	//  + manages node connect and disconnect
-	//  + updates each node with set of currently connected nodes
+	//  + keeps every node's copy of the set of connected nodes up to date
+
+	/*
+		Membership updates.
+		Each node joining or leaving the mesh is an event with a sequence
+		number. A node's keepalives carry the last sequence it has applied
+		and every sendRate the mesh sends it only the events since then, so
+		a quiet mesh costs each node a few bytes per update however many
+		nodes there are. A node that is new, or too far behind to catch up in
+		one packet, is sent the whole table instead as a resync, split over
+		packets of at most MaxPacketSize bytes. Every node is also resynced
+		each resyncInterval seconds in case anything went astray.
+
+		from the mesh:
+			connection accepted		[protocol id][0][node id:16][max nodes:16]
+			update					[protocol id][1][base sequence:32][count:16] then count x [node id:16][address:32][port:16]
+			resync					[protocol id][2][sequence:32][begin:16][end:16][count:16] then count x [node id:16][address:32][port:16]
+
+		from a node:
+			connect request			[protocol id][0]
+			keepalive				[protocol id][1][applied sequence:32]
+
+		An update entry with a zero address is a node leaving. A resync packet
+		lists the nodes connected in the id range [begin,end), a node applies
+		the ranges in order and has the table once it reaches max nodes.
+	*/
+
+	// what the mesh sends, for bandwidth per node
+
+	struct MeshStats
+	{
+		uint64_t packetsSent;
+		uint64_t bytesSent;
+		uint64_t updatePackets;
+		uint64_t resyncPackets;
+		double nodeSeconds;		// sum over updates of connected nodes x seconds
+
+		MeshStats()
+		{
+			packetsSent = 0;
+			bytesSent = 0;
+			updatePackets = 0;
+			resyncPackets = 0;
+			nodeSeconds = 0.0;
+		}
+
+		float GetBytesPerNodePerSecond() const
+		{
+			return nodeSeconds > 0.0 ? (float) ( bytesSent / nodeSeconds ) : 0.0f;
+		}
+	};
 	
 	class Mesh
 	{
+	public:
+
+		enum { MaxNodes = 65535 };				// node ids are 16 bits on the wire
+		enum { MaxPacketSize = 1024 };			// largest packet the mesh sends. node packets should be at least this big
+		enum { EventLogSize = 1024 };
+
+	private:
+
+		enum { UpdateHeaderSize = 11, ResyncHeaderSize = 15, EntrySize = 8 };
+		enum { MaxUpdateEntries = ( MaxPacketSize - UpdateHeaderSize ) / EntrySize };
+		enum { MaxResyncEntries = ( MaxPacketSize - ResyncHeaderSize ) / EntrySize };
+
 		struct NodeState
 		{
 			enum Mode { Disconnected, ConnectionAccept, Connected };
 			Mode mode;
 			float timeoutAccumulator;
+			float resyncAccumulator;
 			Address address;
 			int nodeId;
 			bool reserved;
+			unsigned int ackedSequence;			// last membership sequence the node applied, zero for none
 			NodeState()
 			{
 				mode = Disconnected;
 				address = Address();
 				nodeId = -1;
 				timeoutAccumulator = 0.0f;
+				resyncAccumulator = 0.0f;
 				reserved = false;
+				ackedSequence = 0;
 			}
 		};
+
+		struct MembershipEvent
+		{
+			int nodeId;
+			Address address;					// zero when the node left
+		};
 		
 		unsigned int protocolId;
 		float sendRate;
 		float timeout;
+		float resyncInterval;
+		float resyncRetry;
 
 		Socket socket;
 		std::vector<NodeState> nodes;
-		typedef std::map<int,NodeState*> IdToNode;
-		typedef std::map<Address,NodeState*> AddrToNode;
-		IdToNode id2node;
-		AddrToNode addr2node;
+		std::vector<int> freeNodes;				// disconnected node ids, min-heap so the lowest is reused first
+		AddressHash addressToNode;
+		std::vector<MembershipEvent> events;	// the last EventLogSize events, indexed by sequence
+		unsigned int sequence;					// sequence of the latest event
 		bool running;
 		float sendAccumulator;
+		std::vector<unsigned char> sendData;
+		std::vector<Datagram> sendBatch;
+		std::vector<int> sendOffsets;
+		MeshStats stats;
+		Reactor * reactor;
+		int reactorTimer;
 				
 	public:
 
-		Mesh( unsigned int protocolId, int maxNodes = 255, float sendRate = 0.25f, float timeout = 10.0f )
+		Mesh( unsigned int protocolId, int maxNodes = 255, float sendRate = 0.25f, float timeout = 10.0f, float resyncInterval = 10.0f )
+			: addressToNode( maxNodes )
 		{
 			assert( maxNodes >= 1 );
-			assert( maxNodes <= 255 );
+			assert( maxNodes <= MaxNodes );
 			this->protocolId = protocolId;
 			this->sendRate = sendRate;
 			this->timeout = timeout;
+			this->resyncInterval = resyncInterval;
+			resyncRetry = sendRate * 4;
 			nodes.resize( maxNodes );
+			events.resize( EventLogSize );
 			running = false;
 			sendAccumulator = 0.0f;
+			reactor = NULL;
+			reactorTimer = 0;
+			ClearNodes();
 		}
 		
 		~Mesh()
@@ -1196,6 +2839,8 @@ namespace net
 			printf( "start mesh on port %d\n", port );
 			if ( !socket.Open( port ) )
 				return false;
+			// room for a keepalive from every node between updates
+			socket.SetReceiveBufferSize( (int) nodes.size() * 1024 );
 			running = true;
 			return true;
 		}
@@ -1204,11 +2849,9 @@ namespace net
 		{
 			assert( running );
 			printf( "stop mesh\n" );
+			Detach();
 			socket.Close();
-			id2node.clear();
-			addr2node.clear();
-			for ( unsigned int i = 0; i < nodes.size(); ++i )
-				nodes[i] = NodeState();
+			ClearNodes();
 			running = false;
 			sendAccumulator = 0.0f;
 		}	
@@ -1220,6 +2863,29 @@ namespace net
 			SendPackets( deltaTime );
 			CheckForTimeouts( deltaTime );
 		}
+
+		// reactor driven instead of Update: packets are read as they arrive, keepalives and timeouts run every sendRate
+
+		bool Attach( Reactor & reactor )
+		{
+			assert( running );
+			assert( !this->reactor );
+			if ( !reactor.Add( socket, OnReadable, this ) )
+				return false;
+			this->reactor = &reactor;
+			reactorTimer = reactor.AddTimer( sendRate, sendRate, OnTimer, this );
+			return true;
+		}
+
+		void Detach()
+		{
+			if ( !reactor )
+				return;
+			reactor->Remove( socket );
+			reactor->CancelTimer( reactorTimer );
+			reactor = NULL;
+			reactorTimer = 0;
+		}
 		
 	    bool IsNodeConnected( int nodeId )
 		{
@@ -1237,35 +2903,71 @@ namespace net
 
 	    int GetMaxNodes() const
 		{
-			assert( nodes.size() <= 255 );
+			assert( nodes.size() <= MaxNodes );
 			return (int) nodes.size();
 		}
+
+		const SocketStats & GetSocketStats() const
+		{
+			return socket.GetStats();
+		}
 		
+		const MeshStats & GetStats() const
+		{
+			return stats;
+		}
+
+		unsigned int GetMembershipSequence() const
+		{
+			return sequence;
+		}
+
 		void Reserve( int nodeId, const Address & address )
 		{
 			assert( nodeId >= 0 );
 			assert( nodeId < (int) nodes.size() );
 			printf( "mesh reserves node id %d for %d.%d.%d.%d:%d\n", 
 				nodeId, address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort() );
-			nodes[nodeId].mode = NodeState::ConnectionAccept;
-			nodes[nodeId].nodeId = nodeId;
-			nodes[nodeId].address = address;
-			nodes[nodeId].reserved = true;
-			addr2node.insert( std::make_pair( address, &nodes[nodeId] ) );
+			NodeState & node = nodes[nodeId];
+			if ( node.mode == NodeState::Disconnected )
+			{
+				freeNodes.erase( std::find( freeNodes.begin(), freeNodes.end(), nodeId ) );
+				std::make_heap( freeNodes.begin(), freeNodes.end(), std::greater<int>() );
+			}
+			else if ( addressToNode.Find( node.address ) == nodeId )
+				addressToNode.Remove( node.address );
+			node = NodeState();
+			node.mode = NodeState::ConnectionAccept;
+			node.nodeId = nodeId;
+			node.address = address;
+			node.reserved = true;
+			node.resyncAccumulator = resyncRetry;
+			addressToNode.Insert( address, nodeId );
+			AddEvent( nodeId, address );
 		}
 		
 	protected:
 		
 		void ReceivePackets()
 		{
+			const int BatchSize = 32;
+			unsigned char data[BatchSize][256];
+			Datagram datagrams[BatchSize];
 			while ( true )
 			{
-				Address sender;
-				unsigned char data[256];
-				int size = socket.Receive( sender, data, sizeof(data) );
-				if ( !size )
+				for ( int i = 0; i < BatchSize; ++i )
+				{
+					datagrams[i].data = data[i];
+					datagrams[i].size = sizeof( data[i] );
+				}
+				const int received = socket.ReceiveBatch( datagrams, BatchSize );
+				for ( int i = 0; i < received; ++i )
+				{
+					if ( datagrams[i].size > 0 )
+						ProcessPacket( datagrams[i].address, datagrams[i].data, datagrams[i].size );
+				}
+				if ( received < BatchSize )
 					break;
-				ProcessPacket( sender, data, size );
 			}
 		}
 
@@ -1275,8 +2977,10 @@ namespace net
 			assert( size > 0 );
 			assert( data );
 			// ignore packets that dont have the correct protocol id
-			unsigned int firstIntegerInPacket = ( unsigned(data[0]) << 24 ) | ( unsigned(data[1]) << 16 ) |
-			                                    ( unsigned(data[2]) << 8 )  | unsigned(data[3]);
+			if ( size < 5 )
+				return;
+			unsigned int firstIntegerInPacket;
+			ReadInteger( data, firstIntegerInPacket );
 			if ( firstIntegerInPacket != protocolId )
 				return;
 			// determine packet type
@@ -1284,61 +2988,62 @@ namespace net
 			PacketType packetType;
 			if ( data[4] == 0 )
 				packetType = ConnectRequest;
-			else if ( data[4] == 1 )
+			else if ( data[4] == 1 && size == 9 )
 				packetType = KeepAlive;
 			else
 				return;
 			// process packet type
+			const int nodeId = addressToNode.Find( sender );
 			switch ( packetType )
 			{
 				case ConnectRequest:
 				{
 					// is address already connecting or connected?
-					AddrToNode::iterator itor = addr2node.find( sender );
-					if ( itor == addr2node.end() )
+					if ( nodeId < 0 )
 					{
 						// no entry for address, start connect process...
-						int freeSlot = -1;
-						for ( unsigned int i = 0; i < nodes.size(); ++i )
-						{
-							if ( nodes[i].mode == NodeState::Disconnected )
-							{
-								freeSlot = (int) i;
-								break;
-							}
-						}
-						if ( freeSlot >= 0 )
+						if ( !freeNodes.empty() )
 						{
+							const int freeSlot = freeNodes.front();
+							std::pop_heap( freeNodes.begin(), freeNodes.end(), std::greater<int>() );
+							freeNodes.pop_back();
 							printf( "mesh accepts %d.%d.%d.%d:%d as node %d\n", 
 								sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort(), freeSlot );
-							assert( nodes[freeSlot].mode == NodeState::Disconnected );
-							nodes[freeSlot].mode = NodeState::ConnectionAccept;
-							nodes[freeSlot].nodeId = freeSlot;
-							nodes[freeSlot].address = sender;
-							addr2node.insert( std::make_pair( sender, &nodes[freeSlot] ) );
+							NodeState & node = nodes[freeSlot];
+							assert( node.mode == NodeState::Disconnected );
+							node.mode = NodeState::ConnectionAccept;
+							node.nodeId = freeSlot;
+							node.address = sender;
+							node.resyncAccumulator = resyncRetry;
+							addressToNode.Insert( sender, freeSlot );
+							AddEvent( freeSlot, sender );
 						}
 					}
-					else if ( itor->second->mode == NodeState::ConnectionAccept )
+					else if ( nodes[nodeId].mode == NodeState::ConnectionAccept )
 					{
 						// reset timeout accumulator, but only while connecting
-						itor->second->timeoutAccumulator = 0.0f;
+						nodes[nodeId].timeoutAccumulator = 0.0f;
 					}
 				}
 				break;
 				case KeepAlive:
 				{
-					AddrToNode::iterator itor = addr2node.find( sender );
-					if ( itor != addr2node.end() )
+					if ( nodeId >= 0 )
 					{
+						NodeState & node = nodes[nodeId];
 						// progress from "connection accept" to "connected"
-						if ( itor->second->mode == NodeState::ConnectionAccept )
+						if ( node.mode == NodeState::ConnectionAccept )
 						{
-							itor->second->mode = NodeState::Connected;
-							itor->second->reserved = false;
-							printf( "mesh completes connection of node %d\n", itor->second->nodeId );
+							node.mode = NodeState::Connected;
+							node.reserved = false;
+							printf( "mesh completes connection of node %d\n", nodeId );
 						}
+						// the node is up to date as of this sequence. anything newer than ours is not from this mesh
+						unsigned int applied;
+						ReadInteger( data + 5, applied );
+						node.ackedSequence = applied <= sequence ? applied : 0;
 						// reset timeout accumulator for node
-						itor->second->timeoutAccumulator = 0.0f;
+						node.timeoutAccumulator = 0.0f;
 					}
 				}
 				break;
@@ -1350,47 +3055,148 @@ namespace net
 			sendAccumulator += deltaTime;
 			while ( sendAccumulator > sendRate )
 			{
+				// every node's packets for this update go out in one batch
+
+				sendData.clear();
+				sendBatch.clear();
+				sendOffsets.clear();
+
+				int connected = 0;
 				for ( unsigned int i = 0; i < nodes.size(); ++i )
 				{
-					if ( nodes[i].mode == NodeState::ConnectionAccept )
+					NodeState & node = nodes[i];
+					if ( node.mode == NodeState::ConnectionAccept )
 					{
 						// node is negotiating connect: send "connection accepted" packets
-						unsigned char packet[7];
-						packet[0] = (unsigned char) ( ( protocolId >> 24 ) & 0xFF );
-						packet[1] = (unsigned char) ( ( protocolId >> 16 ) & 0xFF );
-						packet[2] = (unsigned char) ( ( protocolId >> 8 ) & 0xFF );
-						packet[3] = (unsigned char) ( ( protocolId ) & 0xFF );
+						unsigned char packet[9];
+						WriteInteger( packet, protocolId );
 						packet[4] = 0;
-						packet[5] = (unsigned char) i;
-						packet[6] = (unsigned char) nodes.size();
-						socket.Send( nodes[i].address, packet, sizeof(packet) );
+						WriteShort( packet + 5, (unsigned short) i );
+						WriteShort( packet + 7, (unsigned short) nodes.size() );
+						QueuePacket( node.address, packet, sizeof( packet ) );
 					}
-					else if ( nodes[i].mode == NodeState::Connected )
+					else if ( node.mode == NodeState::Connected )
 					{
-						// node is connected: send "update" packets
-						unsigned char packet[5+6*nodes.size()];
-						packet[0] = (unsigned char) ( ( protocolId >> 24 ) & 0xFF );
-						packet[1] = (unsigned char) ( ( protocolId >> 16 ) & 0xFF );
-						packet[2] = (unsigned char) ( ( protocolId >> 8 ) & 0xFF );
-						packet[3] = (unsigned char) ( ( protocolId ) & 0xFF );
-						packet[4] = 1;
-						unsigned char * ptr = &packet[5];
-						for ( unsigned int j = 0; j < nodes.size(); ++j )
+						// node is connected: send the events it has not applied, or the whole table if it is too far behind.
+						// while a resync is on its way the node still gets an empty update, which keeps it alive
+						connected++;
+						node.resyncAccumulator += sendRate;
+						const bool behind = node.ackedSequence == 0 || sequence - node.ackedSequence > MaxUpdateEntries;
+						if ( ( behind && node.resyncAccumulator >= resyncRetry ) || ( resyncInterval > 0.0f && node.resyncAccumulator >= resyncInterval ) )
 						{
-							ptr[0] = (unsigned char) nodes[j].address.GetA();
-							ptr[1] = (unsigned char) nodes[j].address.GetB();
-							ptr[2] = (unsigned char) nodes[j].address.GetC();
-							ptr[3] = (unsigned char) nodes[j].address.GetD();
-							ptr[4] = (unsigned char) ( ( nodes[j].address.GetPort() >> 8 ) & 0xFF );
-							ptr[5] = (unsigned char) ( ( nodes[j].address.GetPort() ) & 0xFF );
-							ptr += 6;
+							SendResync( node.address );
+							node.resyncAccumulator = 0.0f;
 						}
-						socket.Send( nodes[i].address, packet, sizeof(packet) );
+						else
+							SendUpdate( node.address, behind ? sequence : node.ackedSequence );
 					}
 				}
+
+				for ( unsigned int i = 0; i < sendBatch.size(); ++i )
+					sendBatch[i].data = &sendData[sendOffsets[i]];
+				if ( sendBatch.size() > 0 )
+					socket.SendBatch( &sendBatch[0], (int) sendBatch.size() );
+
+				stats.packetsSent += sendBatch.size();
+				stats.bytesSent += sendData.size();
+				stats.nodeSeconds += connected * sendRate;
+
 				sendAccumulator -= sendRate;
 			}
 		}
+
+		void SendUpdate( const Address & address, unsigned int base )
+		{
+			unsigned char packet[MaxPacketSize];
+			WriteInteger( packet, protocolId );
+			packet[4] = 1;
+			WriteInteger( packet + 5, base );
+			const int count = (int) ( sequence - base );
+			assert( count >= 0 && count <= MaxUpdateEntries );
+			WriteShort( packet + 9, (unsigned short) count );
+			unsigned char * ptr = packet + UpdateHeaderSize;
+			for ( unsigned int s = base + 1; s <= sequence; ++s )
+			{
+				const MembershipEvent & event = events[s % EventLogSize];
+				WriteEntry( ptr, event.nodeId, event.address );
+				ptr += EntrySize;
+			}
+			QueuePacket( address, packet, (int) ( ptr - packet ) );
+			stats.updatePackets++;
+		}
+
+		void SendResync( const Address & address )
+		{
+			unsigned char packet[MaxPacketSize];
+			int begin = 0;
+			while ( true )
+			{
+				WriteInteger( packet, protocolId );
+				packet[4] = 2;
+				WriteInteger( packet + 5, sequence );
+				unsigned char * ptr = packet + ResyncHeaderSize;
+				int count = 0;
+				int end = begin;
+				while ( end < (int) nodes.size() && count < MaxResyncEntries )
+				{
+					if ( nodes[end].address != Address() )
+					{
+						WriteEntry( ptr, end, nodes[end].address );
+						ptr += EntrySize;
+						count++;
+					}
+					end++;
+				}
+				WriteShort( packet + 9, (unsigned short) begin );
+				WriteShort( packet + 11, (unsigned short) end );
+				WriteShort( packet + 13, (unsigned short) count );
+				QueuePacket( address, packet, (int) ( ptr - packet ) );
+				stats.resyncPackets++;
+				if ( end == (int) nodes.size() )
+					break;
+				begin = end;
+			}
+		}
+
+		static void WriteEntry( unsigned char * ptr, int nodeId, const Address & address )
+		{
+			WriteShort( ptr, (unsigned short) nodeId );
+			WriteInteger( ptr + 2, address.GetAddress() );
+			WriteShort( ptr + 6, address.GetPort() );
+		}
+
+		// packets are copied into one buffer and pointed at once it stops growing
+
+		void QueuePacket( const Address & address, const unsigned char * packet, int size )
+		{
+			Datagram datagram;
+			datagram.address = address;
+			datagram.data = NULL;
+			datagram.size = size;
+			sendOffsets.push_back( (int) sendData.size() );
+			sendBatch.push_back( datagram );
+			sendData.insert( sendData.end(), packet, packet + size );
+		}
+
+		void AddEvent( int nodeId, const Address & address )
+		{
+			sequence++;
+			MembershipEvent & event = events[sequence % EventLogSize];
+			event.nodeId = nodeId;
+			event.address = address;
+		}
+		
+		static void OnReadable( void * data )
+		{
+			( (Mesh*) data )->ReceivePackets();
+		}
+
+		static void OnTimer( void * data )
+		{
+			Mesh * mesh = (Mesh*) data;
+			mesh->SendPackets( mesh->sendRate );
+			mesh->CheckForTimeouts( mesh->sendRate );
+		}
 		
 		void CheckForTimeouts( float deltaTime )
 		{
@@ -1402,14 +3208,29 @@ namespace net
 					if ( nodes[i].timeoutAccumulator > timeout && !nodes[i].reserved )
 					{
 						printf( "mesh timed out node %d\n", i );
-						AddrToNode::iterator addr_itor = addr2node.find( nodes[i].address );
-						assert( addr_itor != addr2node.end() );
-						addr2node.erase( addr_itor );
+						const bool removed = addressToNode.Remove( nodes[i].address );
+						assert( removed );
+						(void) removed;
 						nodes[i] = NodeState();
+						freeNodes.push_back( i );
+						std::push_heap( freeNodes.begin(), freeNodes.end(), std::greater<int>() );
+						AddEvent( i, Address() );
 					}
 				}
 			}
 		}
+
+		void ClearNodes()
+		{
+			addressToNode.Clear();
+			freeNodes.clear();
+			for ( int i = 0; i < (int) nodes.size(); ++i )
+			{
+				nodes[i] = NodeState();
+				freeNodes.push_back( i );			// note: ascending order is already a min-heap
+			}
+			sequence = 1;
+		}
 	};
 
 	// node
@@ -1427,25 +3248,33 @@ namespace net
 			}
 		};
 		
+		// packets from other nodes wait in a ring of preallocated slots, maxPacketSize bytes each,
+		// and are handed out in arrival order. when the ring is full new packets are dropped
+
 		struct BufferedPacket
 		{
 			int nodeId;
-			std::vector<unsigned char> data;
+			int size;
 		};
-		
-		typedef std::stack<BufferedPacket*> PacketBuffer;
-		PacketBuffer receivedPackets;
+
+		std::vector<BufferedPacket> receivedPackets;
+		std::vector<unsigned char> receivedData;
+		int receiveHead;
+		int receiveCount;
+		unsigned int receiveOverflow;
 
 		unsigned int protocolId;
 		float sendRate;
 		float timeout;
 		int maxPacketSize;
+		int receiveSize;					// big enough for packets from nodes and from the mesh
 
 		Socket socket;
 		std::vector<NodeState> nodes;
-		typedef std::map<int,NodeState*> IdToNode;
-		typedef std::map<Address,NodeState*> AddrToNode;
-		AddrToNode addr2node;
+		AddressHash addressToNode;
+		unsigned int membershipSequence;	// last membership sequence applied, zero before the first resync
+		unsigned int resyncSequence;		// resync being applied and the node id its next packet starts at
+		int resyncNext;
 		bool running;
 		float sendAccumulator;
 		float timeoutAccumulator;
@@ -1459,17 +3288,27 @@ namespace net
 		State state;
 		Address meshAddress;
 		int localNodeId;
+		std::vector<unsigned char> receiveData;
+		Reactor * reactor;
+		int reactorTimer;
 
 	public:
 
-		Node( unsigned int protocolId, float sendRate = 0.25f, float timeout = 2.0f, int maxPacketSize = 1024 )
+		Node( unsigned int protocolId, float sendRate = 0.25f, float timeout = 2.0f, int maxPacketSize = 1024, int receiveQueueSize = 256 )
 		{
+			assert( receiveQueueSize > 0 );
 			this->protocolId = protocolId;
 			this->sendRate = sendRate;
 			this->timeout = timeout;
 			this->maxPacketSize = maxPacketSize;
+			receiveSize = maxPacketSize > Mesh::MaxPacketSize ? maxPacketSize : Mesh::MaxPacketSize;
+			receivedPackets.resize( receiveQueueSize );
+			receivedData.resize( receiveQueueSize * maxPacketSize );
+			receiveOverflow = 0;
 			state = Disconnected;
 			running = false;
+			reactor = NULL;
+			reactorTimer = 0;
 			ClearData();
 		}
 
@@ -1493,6 +3332,7 @@ namespace net
 		{
 			assert( running );
 			printf( "stop node\n" );
+			Detach();
 			ClearData();
 			socket.Close();
 			running = false;
@@ -1540,6 +3380,29 @@ namespace net
 			CheckForTimeout( deltaTime );
 		}
 
+		// reactor driven instead of Update: packets are buffered as they arrive, keepalives and timeouts run every sendRate
+
+		bool Attach( Reactor & reactor )
+		{
+			assert( running );
+			assert( !this->reactor );
+			if ( !reactor.Add( socket, OnReadable, this ) )
+				return false;
+			this->reactor = &reactor;
+			reactorTimer = reactor.AddTimer( sendRate, sendRate, OnTimer, this );
+			return true;
+		}
+
+		void Detach()
+		{
+			if ( !reactor )
+				return;
+			reactor->Remove( socket );
+			reactor->CancelTimer( reactorTimer );
+			reactor = NULL;
+			reactorTimer = 0;
+		}
+
 	    bool IsNodeConnected( int nodeId )
 		{
 			assert( nodeId >= 0 );
@@ -1556,9 +3419,21 @@ namespace net
 
 	    int GetMaxNodes() const
 		{
-			assert( nodes.size() <= 255 );
+			assert( nodes.size() <= Mesh::MaxNodes );
 			return (int) nodes.size();
 		}
+
+		const SocketStats & GetSocketStats() const
+		{
+			return socket.GetStats();
+		}
+
+		// membership sequence of the mesh this node's table is up to date with, zero until it has one
+
+		unsigned int GetMembershipSequence() const
+		{
+			return membershipSequence;
+		}
 		
 		bool SendPacket( int nodeId, const unsigned char data[], int size )
 		{
@@ -1577,29 +3452,23 @@ namespace net
 			return socket.Send( nodes[nodeId].address, data, size );
 		}
 		
+		// oldest packet first. a packet too big for data is dropped and zero returned
+
 		int ReceivePacket( int & nodeId, unsigned char data[], int size )
 		{
 			assert( running );
-			if ( !receivedPackets.empty() )
+			if ( receiveCount == 0 )
+				return 0;
+			const BufferedPacket & packet = receivedPackets[receiveHead];
+			const int bytes = packet.size;
+			if ( bytes <= size )
 			{
-				BufferedPacket * packet = receivedPackets.top();
-				assert( packet );
-				if ( (int) packet->data.size() <= size )
-				{
-					nodeId = packet->nodeId;
-					size = packet->data.size();
-					memcpy( data, &packet->data[0], size );
-					delete packet;
-					receivedPackets.pop();
-					return size;
-				}
-				else
-				{
-					delete packet;
-					receivedPackets.pop();
-				}
+				nodeId = packet.nodeId;
+				memcpy( data, &receivedData[receiveHead*maxPacketSize], bytes );
 			}
-			return 0;
+			receiveHead = ( receiveHead + 1 ) % (int) receivedPackets.size();
+			receiveCount--;
+			return bytes <= size ? bytes : 0;
 		}
 		
 		unsigned int GetProtocolId() const
@@ -1607,18 +3476,35 @@ namespace net
 			return protocolId;
 		}
 
+		// packets from other nodes dropped because the receive queue was full
+
+		unsigned int GetReceiveOverflow() const
+		{
+			return receiveOverflow;
+		}
+
 	protected:
 
 		void ReceivePackets()
 		{
+			const int BatchSize = 32;
+			receiveData.resize( BatchSize * receiveSize );
+			Datagram datagrams[BatchSize];
 			while ( true )
 			{
-				Address sender;
-				unsigned char data[maxPacketSize];
-				int size = socket.Receive( sender, data, sizeof(data) );
-				if ( !size )
+				for ( int i = 0; i < BatchSize; ++i )
+				{
+					datagrams[i].data = &receiveData[i*receiveSize];
+					datagrams[i].size = receiveSize;
+				}
+				const int received = socket.ReceiveBatch( datagrams, BatchSize );
+				for ( int i = 0; i < received; ++i )
+				{
+					if ( datagrams[i].size > 0 )
+						ProcessPacket( datagrams[i].address, datagrams[i].data, datagrams[i].size );
+				}
+				if ( received < BatchSize )
 					break;
-				ProcessPacket( sender, data, size );
 			}
 		}
 
@@ -1632,17 +3518,21 @@ namespace net
 			{
 				// *** packet sent from the mesh ***
 				// ignore packets that dont have the correct protocol id
-				unsigned int firstIntegerInPacket = ( unsigned(data[0]) << 24 ) | ( unsigned(data[1]) << 16 ) |
-				                                    ( unsigned(data[2]) << 8 )  | unsigned(data[3]);
+				if ( size < 5 )
+					return;
+				unsigned int firstIntegerInPacket;
+				ReadInteger( data, firstIntegerInPacket );
 				if ( firstIntegerInPacket != protocolId )
 					return;
 				// determine packet type
-				enum PacketType { ConnectionAccepted, Update };
+				enum PacketType { ConnectionAccepted, Update, Resync };
 				PacketType packetType;
 				if ( data[4] == 0 )
 					packetType = ConnectionAccepted;
 				else if ( data[4] == 1 )
 					packetType = Update;
+				else if ( data[4] == 2 )
+					packetType = Resync;
 				else
 					return;
 				// handle packet type
@@ -1650,12 +3540,18 @@ namespace net
 				{
 					case ConnectionAccepted:
 					{
-						if ( size != 7 )
+						if ( size != 9 )
 							return;
 						if ( state == Connecting )
 						{
-							localNodeId = data[5];
-							nodes.resize( data[6] );
+							unsigned short nodeId, maxNodes;
+							ReadShort( data + 5, nodeId );
+							ReadShort( data + 7, maxNodes );
+							if ( nodeId >= maxNodes )
+								return;
+							localNodeId = nodeId;
+							nodes.resize( maxNodes );
+							addressToNode.Resize( maxNodes );
 							printf( "node connects as node %d of %d\n", localNodeId, (int) nodes.size() );
 							state = Connected;
 						}
@@ -1664,45 +3560,66 @@ namespace net
 					break;
 					case Update:
 					{
-						if ( size != (int) ( 5 + nodes.size() * 6 ) )
+						if ( size < 11 )
+							return;
+						unsigned int base;
+						unsigned short count;
+						ReadInteger( data + 5, base );
+						ReadShort( data + 9, count );
+						if ( size != 11 + count * 8 )
 							return;
 						if ( state == Connected )
 						{
-							// process update packet
-							unsigned char * ptr = &data[5];
-							for ( unsigned int i = 0; i < nodes.size(); ++i )
+							// apply the events we dont have yet, if we have the ones before them
+							if ( membershipSequence >= base && membershipSequence - base <= (unsigned int) count )
 							{
-								unsigned char a = ptr[0];
-								unsigned char b = ptr[1];
-								unsigned char c = ptr[2];
-								unsigned char d = ptr[3];
-								unsigned short port = (unsigned short)ptr[4] << 8 | (unsigned short)ptr[5];
-								Address address( a, b, c, d, port );
-								if ( address.GetAddress() != 0 )
-								{
-									// node is connected
-									if ( address != nodes[i].address )
-									{
-										printf( "node %d: node %d connected\n", localNodeId, i );
-										nodes[i].connected = true;
-										nodes[i].address = address;
-										addr2node[address] = &nodes[i];
-									}
-								}
-								else
+								for ( int i = membershipSequence - base; i < count; ++i )
+									ApplyEntry( data + 11 + i * 8 );
+								membershipSequence = base + count;
+							}
+						}
+						timeoutAccumulator = 0.0f;
+					}
+					break;
+					case Resync:
+					{
+						if ( size < 15 )
+							return;
+						unsigned int sequence;
+						unsigned short begin, end, count;
+						ReadInteger( data + 5, sequence );
+						ReadShort( data + 9, begin );
+						ReadShort( data + 11, end );
+						ReadShort( data + 13, count );
+						if ( size != 15 + count * 8 || begin > end || end > (int) nodes.size() )
+							return;
+						if ( state == Connected && sequence >= membershipSequence )
+						{
+							// a resync starts at node zero and its packets must be applied in order
+							if ( begin == 0 )
+							{
+								resyncSequence = sequence;
+								resyncNext = 0;
+							}
+							if ( sequence == resyncSequence && begin == resyncNext )
+							{
+								int nodeId = begin;
+								for ( int i = 0; i < count; ++i )
 								{
-									// node is not connected
-									if ( nodes[i].connected )
-									{
-										printf( "node %d: node %d disconnected\n", localNodeId, i );
-										AddrToNode::iterator itor = addr2node.find( nodes[i].address );
-										assert( itor != addr2node.end() );
-										addr2node.erase( itor );
-										nodes[i].connected = false;
-										nodes[i].address = Address();
-									}
+									unsigned short entryId;
+									ReadShort( data + 15 + i * 8, entryId );
+									if ( entryId < nodeId || entryId >= end )
+										break;
+									while ( nodeId < entryId )
+										SetNode( nodeId++, Address() );
+									ApplyEntry( data + 15 + i * 8 );
+									nodeId++;
 								}
-								ptr += 6;
+								while ( nodeId < end )
+									SetNode( nodeId++, Address() );
+								resyncNext = end;
+								if ( end == (int) nodes.size() )
+									membershipSequence = sequence;
 							}
 						}
 						timeoutAccumulator = 0.0f;
@@ -1712,24 +3629,53 @@ namespace net
 			}
 			else
 			{
-				AddrToNode::iterator itor = addr2node.find( sender );
-				if ( itor != addr2node.end() )
+				const int nodeId = addressToNode.Find( sender );
+				if ( nodeId >= 0 && size <= maxPacketSize )
 				{
 					// *** packet sent from another node ***
-					NodeState * node = itor->second;
-					assert( node );
-					int nodeId = (int) ( node - &nodes[0] );
-					assert( nodeId >= 0 );
 					assert( nodeId < (int) nodes.size() );
-					BufferedPacket * packet = new BufferedPacket;
-					packet->nodeId = nodeId;
-					packet->data.resize( size );
-					memcpy( &packet->data[0], data, size );
-					receivedPackets.push( packet );
+					if ( receiveCount == (int) receivedPackets.size() )
+					{
+						receiveOverflow++;
+						return;
+					}
+					const int slot = ( receiveHead + receiveCount ) % (int) receivedPackets.size();
+					receivedPackets[slot].nodeId = nodeId;
+					receivedPackets[slot].size = size;
+					memcpy( &receivedData[slot*maxPacketSize], data, size );
+					receiveCount++;
 				}
 			}
 		}
 
+		void ApplyEntry( const unsigned char * entry )
+		{
+			unsigned short nodeId, port;
+			unsigned int address;
+			ReadShort( entry, nodeId );
+			ReadInteger( entry + 2, address );
+			ReadShort( entry + 6, port );
+			if ( nodeId < (int) nodes.size() )
+				SetNode( nodeId, Address( address, port ) );
+		}
+
+		void SetNode( int nodeId, const Address & address )
+		{
+			NodeState & node = nodes[nodeId];
+			if ( node.address == address )
+				return;
+			if ( node.connected && addressToNode.Find( node.address ) == nodeId )
+				addressToNode.Remove( node.address );
+			if ( address != Address() )
+			{
+				node.connected = true;
+				node.address = address;
+				addressToNode.Insert( address, nodeId );
+			}
+			else
+				node = NodeState();
+		}
+
 		void SendPackets( float deltaTime )
 		{
 			sendAccumulator += deltaTime;
@@ -1739,28 +3685,35 @@ namespace net
 				{
 					// node is connecting: send "connect request" packets
 					unsigned char packet[5];
-					packet[0] = (unsigned char) ( ( protocolId >> 24 ) & 0xFF );
-					packet[1] = (unsigned char) ( ( protocolId >> 16 ) & 0xFF );
-					packet[2] = (unsigned char) ( ( protocolId >> 8 ) & 0xFF );
-					packet[3] = (unsigned char) ( ( protocolId ) & 0xFF );
+					WriteInteger( packet, protocolId );
 					packet[4] = 0;
 					socket.Send( meshAddress, packet, sizeof(packet) );
 				}
 				else if ( state == Connected )
 				{
-					// node is connected: send "keep alive" packets
-					unsigned char packet[5];
-					packet[0] = (unsigned char) ( ( protocolId >> 24 ) & 0xFF );
-					packet[1] = (unsigned char) ( ( protocolId >> 16 ) & 0xFF );
-					packet[2] = (unsigned char) ( ( protocolId >> 8 ) & 0xFF );
-					packet[3] = (unsigned char) ( ( protocolId ) & 0xFF );
+					// node is connected: send "keep alive" packets, with how up to date we are
+					unsigned char packet[9];
+					WriteInteger( packet, protocolId );
 					packet[4] = 1;
+					WriteInteger( packet + 5, membershipSequence );
 					socket.Send( meshAddress, packet, sizeof(packet) );
 				}
 				sendAccumulator -= sendRate;
 			}
 		}
 
+		static void OnReadable( void * data )
+		{
+			( (Node*) data )->ReceivePackets();
+		}
+
+		static void OnTimer( void * data )
+		{
+			Node * node = (Node*) data;
+			node->SendPackets( node->sendRate );
+			node->CheckForTimeout( node->sendRate );
+		}
+
 		void CheckForTimeout( float deltaTime )
 		{
 			if ( state == Connecting || state == Connected )
@@ -1786,13 +3739,12 @@ namespace net
 		void ClearData()
 		{
 			nodes.clear();
-			addr2node.clear();
-			while ( !receivedPackets.empty() )
-			{
-				BufferedPacket * packet = receivedPackets.top();
-				delete packet;
-				receivedPackets.pop();
-			}
+			addressToNode.Clear();
+			membershipSequence = 0;
+			resyncSequence = 0;
+			resyncNext = 0;
+			receiveHead = 0;
+			receiveCount = 0;
 			sendAccumulator = 0.0f;
 			timeoutAccumulator = 0.0f;
 			localNodeId = -1;
@@ -1817,6 +3769,8 @@ namespace net
 			this->listenerPort = listenerPort;
 			this->serverPort = serverPort;
 			running = false;
+			reactor = NULL;
+			reactorTimer = 0;
 		}
 		
 		~Beacon()
@@ -1839,6 +3793,7 @@ namespace net
 		{
 			assert( running );
 			printf( "stop beacon\n" );
+			Detach();
 			socket.Close();
 			running = false;
 		}
@@ -1846,6 +3801,37 @@ namespace net
 		void Update( float deltaTime )
 		{
 			assert( running );
+			SendBroadcast();
+			DrainPackets();
+		}
+
+		// reactor driven instead of Update: broadcasts every sendRate seconds
+
+		bool Attach( Reactor & reactor, float sendRate )
+		{
+			assert( running );
+			assert( !this->reactor );
+			if ( !reactor.Add( socket, OnReadable, this ) )
+				return false;
+			this->reactor = &reactor;
+			reactorTimer = reactor.AddTimer( 0.0f, sendRate, OnTimer, this );
+			return true;
+		}
+
+		void Detach()
+		{
+			if ( !reactor )
+				return;
+			reactor->Remove( socket );
+			reactor->CancelTimer( reactorTimer );
+			reactor = NULL;
+			reactorTimer = 0;
+		}
+		
+	private:
+
+		void SendBroadcast()
+		{
 			unsigned char packet[12+1+64];
 			WriteInteger( packet, 0 );
 			WriteInteger( packet + 4, protocolId );
@@ -1855,11 +3841,24 @@ namespace net
 			memcpy( packet + 13, name, strlen( name ) );
 			if ( !socket.Send( Address(255,255,255,255,listenerPort), packet, 12 + 1 + packet[12] ) )
 				printf( "failed to send broadcast packet\n" );
+		}
+
+		void DrainPackets()
+		{
+			unsigned char packet[256];
 			Address sender;
 			while ( socket.Receive( sender, packet, 256 ) );
 		}
-		
-	private:
+
+		static void OnReadable( void * data )
+		{
+			( (Beacon*) data )->DrainPackets();
+		}
+
+		static void OnTimer( void * data )
+		{
+			( (Beacon*) data )->SendBroadcast();
+		}
 		
 		char name[64+1];
 		unsigned int protocolId;
@@ -1867,6 +3866,8 @@ namespace net
 		unsigned int serverPort;
 		bool running;
 		Socket socket;
+		Reactor * reactor;
+		int reactorTimer;
 	};
 	
 	// listener entry
@@ -1892,6 +3893,9 @@ namespace net
 			this->protocolId = protocolId;
 			this->timeout = timeout;
 			running = false;
+			reactor = NULL;
+			reactorTimer = 0;
+			checkRate = 0.0f;
 			ClearData();
 		}
 		
@@ -1915,6 +3919,7 @@ namespace net
 		{
 			assert( running );
 			printf( "stop listener\n" );
+			Detach();
 			socket.Close();
 			running = false;
 			ClearData();
@@ -1923,6 +3928,50 @@ namespace net
 		void Update( float deltaTime )
 		{
 			assert( running );
+			ReceivePackets();
+			CheckForTimeouts( deltaTime );
+		}
+
+		// reactor driven instead of Update: entries are read as they arrive and timed out every checkRate seconds
+
+		bool Attach( Reactor & reactor, float checkRate = 0.25f )
+		{
+			assert( running );
+			assert( !this->reactor );
+			if ( !reactor.Add( socket, OnReadable, this ) )
+				return false;
+			this->reactor = &reactor;
+			this->checkRate = checkRate;
+			reactorTimer = reactor.AddTimer( checkRate, checkRate, OnTimer, this );
+			return true;
+		}
+
+		void Detach()
+		{
+			if ( !reactor )
+				return;
+			reactor->Remove( socket );
+			reactor->CancelTimer( reactorTimer );
+			reactor = NULL;
+			reactorTimer = 0;
+		}
+		
+		int GetEntryCount() const
+		{
+			return entries.size();
+		}
+		
+		const ListenerEntry & GetEntry( int index ) const
+		{
+			assert( index >= 0 );
+			assert( index < (int) entries.size() );
+			return entries[index];
+		}
+		
+	protected:
+
+		void ReceivePackets()
+		{
 			unsigned char packet[256];
 			while ( true )
 			{
@@ -1959,6 +4008,10 @@ namespace net
 				else
 					entries.push_back( entry );
 			}
+		}
+
+		void CheckForTimeouts( float deltaTime )
+		{
 			std::vector<ListenerEntry>::iterator itor = entries.begin();
 			while ( itor != entries.end() )
 			{
@@ -1969,21 +4022,18 @@ namespace net
 					++itor;
 			}
 		}
-		
-		int GetEntryCount() const
+
+		static void OnReadable( void * data )
 		{
-			return entries.size();
+			( (Listener*) data )->ReceivePackets();
 		}
-		
-		const ListenerEntry & GetEntry( int index ) const
+
+		static void OnTimer( void * data )
 		{
-			assert( index >= 0 );
-			assert( index < (int) entries.size() );
-			return entries[index];
+			Listener * listener = (Listener*) data;
+			listener->CheckForTimeouts( listener->checkRate );
 		}
 		
-	protected:
-		
 		ListenerEntry * FindEntry( const ListenerEntry & entry )
 		{
 			for ( int i = 0; i < (int) entries.size(); ++i )
@@ -2006,10 +4056,17 @@ namespace net
 		float timeout;
 		bool running;
 		Socket socket;
+		Reactor * reactor;
+		int reactorTimer;
+		float checkRate;
 	};
 
 	// bitpacker class
 	//  + read and write non-8 multiples of bits efficiently
+	//  + bits go through a 64 bit scratch register and hit memory a 32 bit word at a time,
+	//    little endian whatever the platform, so bytes come out in the order they always did
+	//  + the word being filled is stored on every write, so the buffer is always up to date
+	//    and never needs clearing first
 	
 	class BitPacker
 	{
@@ -2026,83 +4083,49 @@ namespace net
 			assert( bytes >= 0 );
 			this->mode = mode;
 			this->buffer = (unsigned char*) buffer;
-			this->ptr = (unsigned char*) buffer;
 			this->bytes = bytes;
+			scratch = 0;
+			scratch_bits = 0;
+			word_index = 0;
 			bit_index = 0;
-			if ( mode == Write )
-				memset( buffer, 0, bytes );
 		}
 		
 		void WriteBits( unsigned int value, int bits = 32 )
 		{
-			assert( ptr );
 			assert( buffer );
 			assert( bits > 0 );
 			assert( bits <= 32 );
 			assert( mode == Write );
-			if ( bits < 32 )
+			assert( bit_index + bits <= bytes * 8 );
+			scratch |= (uint64_t) ( value & ( 0xFFFFFFFF >> ( 32 - bits ) ) ) << scratch_bits;
+			scratch_bits += bits;
+			bit_index += bits;
+			StoreWord( (uint32_t) scratch );
+			if ( scratch_bits >= 32 )
 			{
-				const unsigned int mask = ( 1 << bits ) - 1;
-				value &= mask;
+				word_index += 4;
+				scratch >>= 32;
+				scratch_bits -= 32;
+				StoreWord( (uint32_t) scratch );
 			}
-			do
-			{
-				assert( ptr - buffer < bytes );
-				*ptr |= (unsigned char) ( value << bit_index );
-				assert( bit_index < 8 );
-				const int bits_written = std::min( bits, 8 - bit_index );
-				assert( bits_written > 0 );
-				assert( bits_written <= 8 );
-				bit_index += bits_written;
-				if ( bit_index >= 8 )
-				{
-					ptr++;
-					bit_index = 0;
-					value >>= bits_written;
-				}
-				bits -= bits_written;
-				assert( bits >= 0 );
-				assert( bits <= 32 );
-			}
-			while ( bits > 0 );
 		}
 		
  		void ReadBits( unsigned int & value, int bits = 32 )
 		{
-			assert( ptr );
 			assert( buffer );
 			assert( bits > 0 );
 			assert( bits <= 32 );
 			assert( mode == Read );
-			int original_bits = bits;
-			int value_index = 0;
-			value = 0;
-			do
-			{
-				assert( ptr - buffer < bytes );
-				assert( bits >= 0 );
-				assert( bits <= 32 );
-				int bits_to_read = std::min( 8 - bit_index, bits );
-				assert( bits_to_read > 0 );
-				assert( bits_to_read <= 8 );
-				value |= ( *ptr >> bit_index ) << value_index;
-				bits -= bits_to_read;
-				bit_index += bits_to_read;
-				value_index += bits_to_read;
-				assert( value_index >= 0 );
-				assert( value_index <= 32 );
-				if ( bit_index >= 8 )
-				{
-					ptr++;
-					bit_index = 0;
-				}
-			}
-			while ( bits > 0 );
-			if ( original_bits < 32 )
+			assert( bit_index + bits <= bytes * 8 );
+			if ( scratch_bits < bits )
 			{
-				const unsigned int mask = ( 1 << original_bits ) - 1;
-				value &= mask;
+				scratch |= (uint64_t) LoadWord() << scratch_bits;
+				scratch_bits += 32;
 			}
+			value = (unsigned int) scratch & ( 0xFFFFFFFF >> ( 32 - bits ) );
+			scratch >>= bits;
+			scratch_bits -= bits;
+			bit_index += bits;
 		}
 		
 		void * GetData()
@@ -2112,81 +4135,431 @@ namespace net
 		
 		int GetBits() const
 		{
-			return ( ptr - buffer ) * 8 + bit_index;
+			return bit_index;
+		}
+		
+		int GetBytes() const
+		{
+			return ( bit_index + 7 ) >> 3;
+		}
+		
+		int BitsRemaining() const
+		{
+			return bytes * 8 - bit_index;
+		}
+		
+		Mode GetMode() const
+		{
+			return mode;
+		}
+		
+		bool IsValid() const
+		{
+			return buffer != NULL;
+		}
+		
+	private:
+		
+		// the last word can be short: only the bytes that are there are stored or read, the rest read as zero
+		
+		void StoreWord( uint32_t word )
+		{
+			unsigned char * p = buffer + word_index;
+			if ( word_index + 4 <= bytes )
+			{
+				p[0] = (unsigned char) word;
+				p[1] = (unsigned char) ( word >> 8 );
+				p[2] = (unsigned char) ( word >> 16 );
+				p[3] = (unsigned char) ( word >> 24 );
+				return;
+			}
+			for ( int i = 0; i < bytes - word_index; ++i )
+				p[i] = (unsigned char) ( word >> ( i * 8 ) );
+		}
+		
+		uint32_t LoadWord()
+		{
+			const unsigned char * p = buffer + word_index;
+			word_index += 4;
+			if ( word_index <= bytes )
+				return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t) p[3] << 24 );
+			uint32_t word = 0;
+			for ( int i = 0; i < bytes - ( word_index - 4 ); ++i )
+				word |= (uint32_t) p[i] << ( i * 8 );
+			return word;
+		}
+		
+		uint64_t scratch;
+		int scratch_bits;
+		int word_index;
+		int bit_index;
+		unsigned char * buffer;
+		int bytes;
+		Mode mode;
+	};
+	
+	// adaptive probability of a single bit for the arithmetic coder
+	//  + starts at even odds and moves toward whatever it sees
+
+	struct BitModel
+	{
+		enum { Bits = 11, One = 1 << Bits, Rate = 4 };		// adapts quickly: models are fresh for every packet
+
+		unsigned short probability;			// chance of a zero, out of One
+
+		BitModel()
+		{
+			probability = One / 2;
+		}
+	};
+
+	// adaptive model for unsigned integers that are usually small
+	//  + the count of significant bits goes through a tree of bit models,
+	//    the bits under the leading one are sent as is
+
+	struct IntegerModel
+	{
+		enum { LengthBits = 6 };
+
+		BitModel length[1<<LengthBits];
+	};
+
+	/*
+		Arithmetic coder.
+		A binary range coder: 32 bit range, carries propagated through a
+		cached byte, so it writes whole bytes and never needs to renormalize
+		bit by bit. Bits coded against a BitModel cost their information
+		content and adapt the model, bits without a model cost one bit each
+		and go in chunks of up to 16 with one multiply (one divide to read).
+
+		Call Flush once everything is written. It pads the final interval
+		with zero bytes and trims them off, the reader pads them back.
+		Writing past the end of the buffer or reading past the end of the
+		data sets the overflow flag, and reads then return zeros.
+	*/
+
+	class ArithmeticCoder
+	{
+	public:
+
+		enum Mode
+		{
+			Read,
+			Write
+		};
+
+		ArithmeticCoder( Mode mode = Write, void * buffer = NULL, unsigned int size = 0 )
+		{
+			assert( buffer || size == 0 );
+			this->mode = mode;
+			this->buffer = (unsigned char*) buffer;
+			this->size = (int) size;
+			index = 0;
+			range = 0xFFFFFFFF;
+			low = 0;
+			code = 0;
+			cache = 0;
+			cacheSize = 1;
+			overread = 0;
+			overflow = false;
+			flushed = false;
+			started = false;
+			if ( mode == Read && buffer )
+			{
+				for ( int i = 0; i < 4; ++i )
+					code = ( code << 8 ) | ReadByte();
+			}
+		}
+
+		void EncodeBit( BitModel & model, unsigned int bit )
+		{
+			assert( mode == Write );
+			assert( !flushed );
+			const unsigned int bound = ( range >> BitModel::Bits ) * model.probability;
+			if ( bit == 0 )
+			{
+				range = bound;
+				model.probability += ( BitModel::One - model.probability ) >> BitModel::Rate;
+			}
+			else
+			{
+				low += bound;
+				range -= bound;
+				model.probability -= model.probability >> BitModel::Rate;
+			}
+			while ( range < TopValue )
+			{
+				range <<= 8;
+				ShiftLow();
+			}
+		}
+
+		unsigned int DecodeBit( BitModel & model )
+		{
+			assert( mode == Read );
+			const unsigned int bound = ( range >> BitModel::Bits ) * model.probability;
+			unsigned int bit;
+			if ( code < bound )
+			{
+				range = bound;
+				model.probability += ( BitModel::One - model.probability ) >> BitModel::Rate;
+				bit = 0;
+			}
+			else
+			{
+				code -= bound;
+				range -= bound;
+				model.probability -= model.probability >> BitModel::Rate;
+				bit = 1;
+			}
+			while ( range < TopValue )
+			{
+				range <<= 8;
+				code = ( code << 8 ) | ReadByte();
+			}
+			return bit;
+		}
+
+		// bits with even odds, no model
+
+		void EncodeDirectBits( unsigned int value, int bits )
+		{
+			assert( mode == Write );
+			assert( !flushed );
+			assert( bits >= 0 );
+			assert( bits <= 32 );
+			while ( bits > 0 )
+			{
+				const int chunk = bits < 16 ? bits : 16;
+				bits -= chunk;
+				range >>= chunk;
+				low += (uint64_t) range * ( ( value >> bits ) & ( ( 1 << chunk ) - 1 ) );
+				while ( range < TopValue )
+				{
+					range <<= 8;
+					ShiftLow();
+				}
+			}
+		}
+
+		unsigned int DecodeDirectBits( int bits )
+		{
+			assert( mode == Read );
+			assert( bits >= 0 );
+			assert( bits <= 32 );
+			unsigned int value = 0;
+			while ( bits > 0 )
+			{
+				const int chunk = bits < 16 ? bits : 16;
+				bits -= chunk;
+				range >>= chunk;
+				unsigned int digit = code / range;
+				if ( digit >= ( 1U << chunk ) )
+					digit = ( 1U << chunk ) - 1;			// only on corrupt data
+				code -= digit * range;
+				value = ( value << chunk ) | digit;
+				while ( range < TopValue )
+				{
+					range <<= 8;
+					code = ( code << 8 ) | ReadByte();
+				}
+			}
+			return value;
+		}
+
+		// small values cost a few bits, large ones a few bits more than they would raw
+
+		void EncodeInteger( unsigned int value, IntegerModel & model )
+		{
+			int length = 0;
+			while ( length < 32 && ( value >> length ) != 0 )
+				length++;
+			unsigned int node = 1;
+			for ( int i = IntegerModel::LengthBits - 1; i >= 0; --i )
+			{
+				const unsigned int bit = ( length >> i ) & 1;
+				EncodeBit( model.length[node], bit );
+				node = ( node << 1 ) | bit;
+			}
+			if ( length > 1 )
+				EncodeDirectBits( value, length - 1 );
+		}
+
+		unsigned int DecodeInteger( IntegerModel & model )
+		{
+			unsigned int node = 1;
+			for ( int i = 0; i < IntegerModel::LengthBits; ++i )
+				node = ( node << 1 ) | DecodeBit( model.length[node] );
+			const int length = node - ( 1 << IntegerModel::LengthBits );
+			if ( length == 0 )
+				return 0;
+			if ( length > 32 )
+			{
+				overflow = true;					// never written: corrupt data
+				return 0;
+			}
+			return ( 1U << ( length - 1 ) ) | DecodeDirectBits( length - 1 );
+		}
+
+		bool WriteInteger( unsigned int value, unsigned int minimum = 0, unsigned int maximum = 0xFFFFFFFF )
+		{
+			assert( minimum < maximum );
+			assert( value >= minimum );
+			assert( value <= maximum );
+			EncodeDirectBits( value - minimum, BitsRequired( maximum - minimum ) );
+			return !overflow;
+		}
+
+		bool ReadInteger( unsigned int & value, unsigned int minimum = 0, unsigned int maximum = 0xFFFFFFFF )
+		{
+			assert( minimum < maximum );
+			value = DecodeDirectBits( BitsRequired( maximum - minimum ) ) + minimum;
+			return !overflow && value >= minimum && value <= maximum;
+		}
+
+		// writer: pick the value in the final interval with the most trailing zero bytes and drop them
+
+		void Flush()
+		{
+			assert( mode == Write );
+			if ( flushed )
+				return;
+			for ( int zeros = 4; zeros > 0; --zeros )
+			{
+				const uint64_t mask = ( (uint64_t) 1 << ( zeros * 8 ) ) - 1;
+				const uint64_t value = ( low + mask ) & ~mask;
+				if ( value < low + range )
+				{
+					low = value;
+					break;
+				}
+			}
+			for ( int i = 0; i < 5; ++i )
+				ShiftLow();
+			const int end = index;
+			while ( index > end - 4 && index > 0 && index <= size && buffer[index-1] == 0 )
+				index--;
+			flushed = true;
+		}
+
+		// bytes written (after flush), or consumed by the reader so far
+
+		int GetBytes() const
+		{
+			return index < size ? index : size;
+		}
+
+		// writer: bits used so far including the bytes still pending in the coder
+
+		int GetBits() const
+		{
+			if ( mode == Read || flushed )
+				return GetBytes() * 8;
+			int rangeBits = 0;
+			while ( rangeBits < 32 && ( range >> rangeBits ) > 1 )
+				rangeBits++;
+			return ( index + cacheSize - ( started ? 0 : 1 ) ) * 8 + 32 - rangeBits;
+		}
+
+		int BitsRemaining() const
+		{
+			return size * 8 - GetBits();
 		}
-		
-		int GetBytes() const
+
+		void * GetData()
 		{
-			return (int) ( ptr - buffer ) + ( bit_index > 0 ? 1 : 0 );
+			return buffer;
 		}
-		
-		int BitsRemaining() const
+
+		bool IsOverflow() const
 		{
-			return bytes * 8 - ( ( ptr - buffer ) * 8 + bit_index );
+			return overflow;
 		}
-		
+
 		Mode GetMode() const
 		{
 			return mode;
 		}
-		
+
 		bool IsValid() const
 		{
 			return buffer != NULL;
 		}
-		
+
 	private:
-		
-		int bit_index;
-		unsigned char * ptr;
-		unsigned char * buffer;
-		int bytes;
-		Mode mode;
-	};
-	
-	// arithmetic coder (unimplemented)
-	
-	class ArithmeticCoder
-	{
-	public:
-		
-		enum Mode
+
+		enum { TopValue = 1 << 24 };
+
+		static int BitsRequired( unsigned int maximumValue )
 		{
-			Read,
-			Write
-		};
-		
-		ArithmeticCoder( Mode mode, void * buffer, unsigned int size )
+			int bits = 1;
+			while ( bits < 32 && ( maximumValue >> bits ) != 0 )
+				bits++;
+			return bits;
+		}
+
+		// writes the top byte of low once no carry can reach it. the first byte is always zero and is skipped
+
+		void ShiftLow()
 		{
-			assert( buffer );
-			assert( size >= 0 );
-			this->mode = mode;
-			this->buffer = (unsigned char*) buffer;
-			this->size = size;
+			if ( (unsigned int) low < 0xFF000000 || (unsigned int) ( low >> 32 ) != 0 )
+			{
+				const unsigned char carry = (unsigned char) ( low >> 32 );
+				unsigned char temp = cache;
+				do
+				{
+					WriteByte( (unsigned char) ( temp + carry ) );
+					temp = 0xFF;
+				}
+				while ( --cacheSize != 0 );
+				cache = (unsigned char) ( low >> 24 );
+			}
+			cacheSize++;
+			low = ( low & 0x00FFFFFF ) << 8;
 		}
 
-		bool WriteInteger( unsigned int value, unsigned int minimum = 0, unsigned int maximum = 0xFFFFFFFF )
+		void WriteByte( unsigned char value )
 		{
-			// ...
-			return false;
+			if ( started )
+			{
+				if ( index < size )
+					buffer[index] = value;
+				else
+					overflow = true;
+				index++;
+			}
+			started = true;
 		}
-		
-		bool ReadInteger( unsigned int value, unsigned int minimum = 0, unsigned int maximum = 0xFFFFFFFF )
+
+		unsigned char ReadByte()
 		{
-			// ...
-			return false;
+			if ( index < size )
+				return buffer[index++];
+			// the writer trims at most four zero bytes off the end
+			if ( ++overread > 4 )
+				overflow = true;
+			return 0;
 		}
-		
-	private:
-		
+
 		unsigned char * buffer;
 		int size;
+		int index;
 		Mode mode;
+		unsigned int range;
+		uint64_t low;
+		unsigned int code;
+		unsigned char cache;
+		int cacheSize;
+		int overread;
+		bool overflow;
+		bool flushed;
+		bool started;
 	};
-	
+
 	// stream class
 	//  + unifies read and write into a serialize operation
 	//  + provides attribution of stream for debugging purposes
+	//  + bit packed, or range coded so values serialized with a model cost less
 	
 	class Stream
 	{
@@ -2199,10 +4572,27 @@ namespace net
 			Write
 		};
 		
+		enum Backend
+		{
+			BitPacked,
+			RangeCoded
+		};
+		
 		Stream( Mode mode, void * buffer, int bytes, void * journal_buffer = NULL, int journal_bytes = 0 )
 			: bitpacker( mode == Write ? BitPacker::Write : BitPacker::Read, buffer, bytes ), 
 			  journal( mode == Write ? BitPacker::Write : BitPacker::Read, journal_buffer, journal_bytes )
 		{
+			backend = BitPacked;
+		}
+		
+		// a range coded stream must be finished once written, see Finish
+		
+		Stream( Mode mode, Backend backend, void * buffer, int bytes, void * journal_buffer = NULL, int journal_bytes = 0 )
+			: bitpacker( mode == Write ? BitPacker::Write : BitPacker::Read, backend == BitPacked ? buffer : NULL, backend == BitPacked ? bytes : 0 ), 
+			  journal( mode == Write ? BitPacker::Write : BitPacker::Read, journal_buffer, journal_bytes ),
+			  coder( mode == Write ? ArithmeticCoder::Write : ArithmeticCoder::Read, backend == RangeCoded ? buffer : NULL, backend == RangeCoded ? bytes : 0 )
+		{
+			this->backend = backend;
 		}
 		
 		bool SerializeBoolean( bool & value )
@@ -2212,6 +4602,21 @@ namespace net
 			value = (bool) tmp;
 			return result;
 		}
+		
+		// the model is only used when range coded. pass the same models in the same order on both sides
+		
+		bool SerializeBoolean( bool & value, BitModel & model )
+		{
+			if ( backend == BitPacked )
+				return SerializeBoolean( value );
+			if ( !Journal( 1 ) )
+				return false;
+			if ( IsWriting() )
+				coder.EncodeBit( model, value ? 1 : 0 );
+			else
+				value = coder.DecodeBit( model ) != 0;
+			return !coder.IsOverflow();
+		}
 
 		bool SerializeByte( char & value, char min = -127, char max = +128 )
 		{
@@ -2285,6 +4690,46 @@ namespace net
 			return result;
 		}
 		
+		// value - min goes through the model, so values close to min are cheap
+		
+		bool SerializeInteger( unsigned int & value, unsigned int min, unsigned int max, IntegerModel & model )
+		{
+			if ( backend == BitPacked )
+				return SerializeInteger( value, min, max );
+			assert( min < max );
+			if ( !Journal( BitsRequired( min, max ) ) )
+				return false;
+			if ( IsWriting() )
+			{
+				assert( value >= min );
+				assert( value <= max );
+				coder.EncodeInteger( value - min, model );
+				return !coder.IsOverflow();
+			}
+			value = coder.DecodeInteger( model ) + min;
+			if ( value < min || value > max )
+			{
+				printf( "serialize integer out of range (read)\n" );
+				return false;
+			}
+			return !coder.IsOverflow();
+		}
+		
+		// values near zero are cheap when range coded
+		
+		bool SerializeInteger( signed int & value, signed int min, signed int max, IntegerModel & model )
+		{
+			if ( backend == BitPacked )
+				return SerializeInteger( value, min, max );
+			assert( min < max );
+			const signed int zero = min > 0 ? min : ( max < 0 ? max : 0 );
+			unsigned int integerValue = (unsigned int) value - (unsigned int) min;
+			if ( !SerializeZigZag( integerValue, (unsigned int) max - (unsigned int) min, (unsigned int) zero - (unsigned int) min, model ) )
+				return false;
+			value = (signed int) ( integerValue + (unsigned int) min );
+			return true;
+		}
+		
 		bool SerializeFloat( float & value )
 		{
 			union FloatInt
@@ -2310,52 +4755,36 @@ namespace net
 		
 		bool SerializeCompressedFloat( float & value, float minimum, float maximum, float resolution )
 		{
-			// determine number of discrete values required for resolution
-			
-			assert( minimum < maximum );
-			
-			const float delta = maximum - minimum;
-			
-			float values = delta / resolution;
-			
-			assert( values < UINT_MAX );
-			
-			unsigned int maxIntegerValue = (unsigned int) math::ceiling( values );
-			
-			// compress if writing
+			return SerializeQuantizedFloat( value, minimum, maximum, resolution, NULL, 0.0f, NULL );
+		}
+		
+		// values near the prediction are cheap when range coded. predict the same on both sides
+		
+		bool SerializeCompressedFloat( float & value, float minimum, float maximum, float resolution, IntegerModel & model, float prediction = 0.0f )
+		{
+			return SerializeQuantizedFloat( value, minimum, maximum, resolution, &model, prediction, NULL );
+		}
 
-			unsigned int integerValue = 0;
-			
-			if ( IsWriting() )
-			{
-				float normalizedValue = math::clamp( ( value - minimum ) / delta, 0.0f, 1.0f );
-			
-				assert( normalizedValue >= 0.0f );
-				assert( normalizedValue <= 1.0f );
-			
-				integerValue = math::floor( normalizedValue * maxIntegerValue + 0.5f );
-			}
-			
-			// serialize integer value
-			
-			if ( !SerializeInteger( integerValue, 0, maxIntegerValue ) )
-				return false;
-			
-			// decompress if reading
+		// values near the previous one are cheap when range coded. previous is the quantized integer,
+		// not the float, so writer and reader predict from exactly the same value. it is updated here
 
-			if ( IsReading() )
-			{
-				float normalizedValue = integerValue / float( maxIntegerValue );
-			
-				value = normalizedValue * delta + minimum;
-				
-				assert( value >= minimum );
-				assert( value <= maximum );
-			}
-			
-			return true;
+		bool SerializeCompressedFloat( float & value, float minimum, float maximum, float resolution, IntegerModel & model, unsigned int & previous )
+		{
+			return SerializeQuantizedFloat( value, minimum, maximum, resolution, &model, 0.0f, &previous );
 		}
 
+		// the integer a compressed float is sent as
+
+		static unsigned int QuantizeFloat( float value, float minimum, float maximum, float resolution )
+		{
+			assert( minimum < maximum );
+			const float delta = maximum - minimum;
+			assert( delta / resolution < UINT_MAX );
+			const unsigned int maxIntegerValue = (unsigned int) math::ceiling( delta / resolution );
+			const float normalizedValue = math::clamp( ( value - minimum ) / delta, 0.0f, 1.0f );
+			return math::floor( normalizedValue * maxIntegerValue + 0.5f );
+		}
+		
 		bool SerializeCompressedVector( float & x, float & y, float & z, 
 										float min, float max, float resolution )
 		{
@@ -2588,26 +5017,12 @@ namespace net
 		{
 			assert( bits >= 1 );
 			assert( bits <= 32 );
-			if ( bitpacker.BitsRemaining() < bits )
+			if ( backend == BitPacked && bitpacker.BitsRemaining() < bits )
 				return false;
-			if ( journal.IsValid() )
-			{
-				unsigned int token = 2 + bits;		// note: 0 = end, 1 = checkpoint, [2,34] = n - 2 bits written
-				if ( IsWriting() )
-				{
-					journal.WriteBits( token, 6 );
-				}
-				else
-				{
-					journal.ReadBits( token, 6 );
-					int bits_written = token - 2;
-					if ( bits != bits_written )
-					{
-						printf( "desync read/write: attempting to read %d bits when %d bits were written\n", bits, bits_written );
-						return false;
-					}
-				}
-			}
+			if ( !Journal( bits ) )
+				return false;
+			if ( backend == RangeCoded )
+				return CodeBits( value, bits );
 			if ( IsReading() )
 				bitpacker.ReadBits( value, bits );
 			else
@@ -2636,12 +5051,20 @@ namespace net
 			}
 			unsigned int magic = 0x12345678;
 			unsigned int value = magic;
-			if ( bitpacker.BitsRemaining() < 32 )
+			if ( backend == RangeCoded )
+			{
+				if ( !CodeBits( value, 32 ) )
+				{
+					printf( "not enough bits remaining for checkpoint\n" );
+					return false;
+				}
+			}
+			else if ( bitpacker.BitsRemaining() < 32 )
 			{
 				printf( "not enough bits remaining for checkpoint\n" );
 				return false;
 			}
-			if ( IsWriting() )
+			else if ( IsWriting() )
 				bitpacker.WriteBits( value, 32 );
 			else
 				bitpacker.ReadBits( value, 32 );
@@ -2663,14 +5086,32 @@ namespace net
 			return bitpacker.GetMode() == BitPacker::Write;
 		}
 		
+		Backend GetBackend() const
+		{
+			return backend;
+		}
+		
+		// range coded: approximate until finished
+		
 		int GetBitsProcessed() const
 		{
-			return bitpacker.GetBits();
+			return backend == RangeCoded ? coder.GetBits() : bitpacker.GetBits();
 		}
 		
 		int GetBitsRemaining() const
 		{
-			return bitpacker.BitsRemaining();
+			return backend == RangeCoded ? coder.BitsRemaining() : bitpacker.BitsRemaining();
+		}
+		
+		// call after the last serialize. flushes the range coder, false if the data did not fit
+		
+		bool Finish()
+		{
+			if ( backend == BitPacked )
+				return true;
+			if ( IsWriting() )
+				coder.Flush();
+			return !coder.IsOverflow();
 		}
 		
 		static int BitsRequired( unsigned int minimum, unsigned int maximum )
@@ -2697,7 +5138,7 @@ namespace net
 		
 		unsigned char * GetData()
 		{
-			return (unsigned char*) bitpacker.GetData();
+			return (unsigned char*) ( backend == RangeCoded ? coder.GetData() : bitpacker.GetData() );
 		}
 		
 		unsigned char * GetJournal()
@@ -2707,7 +5148,7 @@ namespace net
 		
 		int GetDataBytes() const
 		{
-			return bitpacker.GetBytes();
+			return backend == RangeCoded ? coder.GetBytes() : bitpacker.GetBytes();
 		}
 		
 		int GetJournalBytes() const
@@ -2741,8 +5182,126 @@ namespace net
 		
 	private:
 		
+		// note: 0 = end, 1 = checkpoint, [2,34] = n - 2 bits written
+		
+		bool Journal( int bits )
+		{
+			if ( !journal.IsValid() )
+				return true;
+			unsigned int token = 2 + bits;
+			if ( IsWriting() )
+			{
+				journal.WriteBits( token, 6 );
+			}
+			else
+			{
+				journal.ReadBits( token, 6 );
+				int bits_written = token - 2;
+				if ( bits != bits_written )
+				{
+					printf( "desync read/write: attempting to read %d bits when %d bits were written\n", bits, bits_written );
+					return false;
+				}
+			}
+			return true;
+		}
+		
+		bool CodeBits( unsigned int & value, int bits )
+		{
+			if ( IsReading() )
+				value = coder.DecodeDirectBits( bits );
+			else
+				coder.EncodeDirectBits( value, bits );
+			return !coder.IsOverflow();
+		}
+		
+		bool SerializeQuantizedFloat( float & value, float minimum, float maximum, float resolution, IntegerModel * model, float prediction, unsigned int * previous )
+		{
+			// determine number of discrete values required for resolution
+			
+			assert( minimum < maximum );
+			
+			const float delta = maximum - minimum;
+			
+			float values = delta / resolution;
+			
+			assert( values < UINT_MAX );
+			
+			unsigned int maxIntegerValue = (unsigned int) math::ceiling( values );
+			
+			// compress if writing
+
+			unsigned int integerValue = 0;
+			
+			if ( IsWriting() )
+				integerValue = QuantizeFloat( value, minimum, maximum, resolution );
+			
+			// serialize integer value
+			
+			if ( model && backend == RangeCoded )
+			{
+				unsigned int zeroValue;
+				if ( previous )
+					zeroValue = *previous < maxIntegerValue ? *previous : maxIntegerValue;
+				else
+					zeroValue = QuantizeFloat( prediction, minimum, maximum, resolution );
+				if ( !SerializeZigZag( integerValue, maxIntegerValue, zeroValue, *model ) )
+					return false;
+			}
+			else if ( !SerializeInteger( integerValue, 0, maxIntegerValue ) )
+				return false;
+
+			if ( previous )
+				*previous = integerValue;
+			
+			// decompress if reading
+
+			if ( IsReading() )
+			{
+				float normalizedValue = integerValue / float( maxIntegerValue );
+			
+				value = normalizedValue * delta + minimum;
+				
+				assert( value >= minimum );
+				assert( value <= maximum );
+			}
+			
+			return true;
+		}
+
+		// [0,maxIntegerValue] coded by distance from zeroValue, the side in the low bit
+
+		bool SerializeZigZag( unsigned int & integerValue, unsigned int maxIntegerValue, unsigned int zeroValue, IntegerModel & model )
+		{
+			assert( maxIntegerValue < 0x80000000 );
+			assert( zeroValue <= maxIntegerValue );
+			unsigned int offset = 0;
+			if ( IsWriting() )
+				offset = integerValue >= zeroValue ? ( integerValue - zeroValue ) * 2 : ( zeroValue - integerValue ) * 2 - 1;
+			if ( !SerializeInteger( offset, 0, maxIntegerValue * 2, model ) )
+				return false;
+			if ( IsReading() )
+			{
+				if ( offset & 1 )
+				{
+					if ( ( offset + 1 ) / 2 > zeroValue )
+						return false;
+					integerValue = zeroValue - ( offset + 1 ) / 2;
+				}
+				else
+				{
+					integerValue = zeroValue + offset / 2;
+					if ( integerValue > maxIntegerValue )
+						return false;
+				}
+			}
+			return true;
+		}
+		
 		BitPacker bitpacker;
 		BitPacker journal;
+		ArithmeticCoder coder;
+		Backend backend;
 	};
 	
 	// stream packet
@@ -2765,7 +5324,7 @@ namespace net
 		packetSize = packetBytes;
 	}
 	
- 	bool ReadStreamPacket( Stream & stream, unsigned char * packet, int packetSize, unsigned int protocolId )
+ 	bool ReadStreamPacket( Stream & stream, unsigned char * packet, int packetSize, unsigned int protocolId, Stream::Backend backend = Stream::BitPacked )
 	{
 		unsigned short dataBytes = 0;
 		unsigned short journalBytes = 0;
@@ -2777,7 +5336,7 @@ namespace net
 			printf( "invalid packet data & journal bytes\n" );
 			return false;
 		}
-		stream = Stream( Stream::Read, packet + 8, dataBytes, packet + 8 + dataBytes, journalBytes );
+		stream = Stream( Stream::Read, backend, packet + 8, dataBytes, packet + 8 + dataBytes, journalBytes );
 		return true;
 	}
 }
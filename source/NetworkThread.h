@@ -0,0 +1,403 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef NETWORK_THREAD_H
+#define NETWORK_THREAD_H
+
+#include "Config.h"
+#include "Network.h"
+#include "Thread.h"
+#include "Profiler.h"
+
+namespace net
+{
+	// counters for a network thread. each one is written by a single thread
+
+	struct NetworkThreadStats
+	{
+		unsigned int packetsReceived;		// handed to the game thread
+		unsigned int packetsSent;
+		unsigned int receiveStalls;			// socket reads paused because the game thread left the receive ring full
+		unsigned int sendQueueFull;			// sends refused because the network thread left the send ring full
+		unsigned int sendDropped;			// sends thrown away while the connection was down
+
+		NetworkThreadStats()
+		{
+			packetsReceived = 0;
+			packetsSent = 0;
+			receiveStalls = 0;
+			sendQueueFull = 0;
+			sendDropped = 0;
+		}
+	};
+
+	/*
+		Network thread.
+		Owns a connection and does every send, receive and timeout for it on
+		its own thread, so the game thread never makes a socket call. Packets
+		cross between the threads on two lock free rings, received packets one
+		way and packets to send the other. The ring slots are the packet
+		buffers, so nothing is allocated or copied on the way through.
+
+		Backpressure: when the game thread falls behind and the receive ring
+		fills, the network thread stops reading the socket until there is
+		room, leaving the kernel to queue or drop the excess. When the send
+		ring fills, AcquireSendBuffer returns NULL. Both are counted.
+
+		The game thread records how long each packet waited between coming
+		off the socket and being handed over, see GetHandoffTimes. A game
+		thread that sleeps in its own reactor can attach a receiver, which
+		the network thread wakes through an event whenever it hands over
+		packets or the connection comes up or goes down.
+
+		Sends go out on the next flush, every flushInterval seconds while
+		connected and every idleInterval otherwise. A server connection that
+		drops goes straight back to listening. Built without MULTITHREADED
+		there is no thread: call Pump from the game loop instead.
+	*/
+
+	class NetworkThread : public platform::WorkerThread
+	{
+	public:
+
+		enum { QueueSize = 256 };			// packet buffers each way
+		enum { ReceiveBatchSize = 32 };
+
+		NetworkThread( Connection & connection, float flushInterval = 0.001f, float idleInterval = 0.1f )
+			: connection( connection ), receiveQueue( QueueSize ), sendQueue( QueueSize ), receiveTime( QueueSize )
+		{
+			assert( flushInterval > 0.0f );
+			assert( idleInterval >= flushInterval );
+			this->flushInterval = flushInterval;
+			this->idleInterval = idleInterval;
+			running = false;
+			reading = false;
+			fastFlush = false;
+			flushTimer = 0;
+			lastUpdate = 0.0;
+			connected = 0;
+			quit = 0;
+			handedOff = -1;
+			receiverReactor = NULL;
+			receiverFunction = NULL;
+			receiverData = NULL;
+			receiveEvent.Open();				// note: fails on windows, so there are no receivers there
+		}
+
+		~NetworkThread()
+		{
+			if ( running )
+				Stop();
+		}
+
+		// the connection must be running. from here until Stop only the network thread touches it
+
+		bool Start()
+		{
+			assert( !running );
+			assert( connection.IsRunning() );
+			if ( !connection.Attach( reactor, OnReadable, this ) )
+				return false;
+			reading = true;
+			lastUpdate = profile::GetTime();
+			ScheduleFlush( connection.IsConnected() );
+			platform::StoreRelease( connected, connection.IsConnected() ? 1 : 0 );
+			platform::StoreRelease( quit, 0 );
+			running = true;
+			#ifdef MULTITHREADED
+			if ( !platform::WorkerThread::Start() )
+			{
+				Shutdown();
+				return false;
+			}
+			#endif
+			return true;
+		}
+
+		void Stop()
+		{
+			assert( running );
+			platform::StoreRelease( quit, 1 );
+			#ifdef MULTITHREADED
+			Join();
+			#endif
+			Shutdown();
+			DetachReceiver();
+		}
+
+		// game thread: call function from this reactor when packets are handed over or the connection changes
+
+		bool AttachReceiver( Reactor & reactor, Reactor::ReadyFunction function, void * data )
+		{
+			assert( function );
+			assert( !receiverReactor );
+			if ( !receiveEvent.IsOpen() )
+				return false;
+			receiverFunction = function;
+			receiverData = data;
+			if ( !reactor.Add( receiveEvent, OnReceiveEvent, this ) )
+				return false;
+			receiverReactor = &reactor;
+			return true;
+		}
+
+		void DetachReceiver()
+		{
+			if ( !receiverReactor )
+				return;
+			receiverReactor->Remove( receiveEvent );
+			receiverReactor = NULL;
+		}
+
+		// one pass of the network loop: waits up to maxWait for packets or the next flush
+
+		void Pump( float maxWait )
+		{
+			reactor.Poll( maxWait );
+		}
+
+		// game thread: the next received packet, or NULL. call ReleasePacket once done with it
+
+		PacketBuffer * ReceivePacket()
+		{
+			PacketBuffer * buffer;
+			while ( receiveQueue.Peek( buffer ) > 0 )
+			{
+				if ( buffer->GetSize() > 0 )
+				{
+					const int index = receiveQueue.GetIndex( buffer );
+					if ( index != handedOff )
+					{
+						handoffTimes.Add( (float) ( profile::GetTime() - receiveTime[index] ) );
+						handedOff = index;
+					}
+					return buffer;
+				}
+				receiveQueue.Pop( 1 );
+			}
+			return NULL;
+		}
+
+		void ReleasePacket()
+		{
+			assert( handedOff >= 0 );
+			receiveQueue.Pop( 1 );
+			handedOff = -1;
+		}
+
+		// game thread: an empty buffer with headroom for the headers, or NULL when the send ring is full.
+		// fill it, then call SendPacket
+
+		PacketBuffer * AcquireSendBuffer()
+		{
+			PacketBuffer * buffer;
+			if ( sendQueue.Reserve( buffer ) == 0 )
+			{
+				Count( stats.sendQueueFull, 1 );
+				return NULL;
+			}
+			buffer->Reset();
+			return buffer;
+		}
+
+		void SendPacket()
+		{
+			sendQueue.Push( 1 );
+		}
+
+		// either thread
+
+		bool IsConnected() const
+		{
+			return platform::LoadAcquire( connected ) != 0;
+		}
+
+		NetworkThreadStats GetStats() const
+		{
+			NetworkThreadStats result;
+			result.packetsReceived = platform::LoadAcquire( stats.packetsReceived );
+			result.packetsSent = platform::LoadAcquire( stats.packetsSent );
+			result.receiveStalls = platform::LoadAcquire( stats.receiveStalls );
+			result.sendQueueFull = platform::LoadAcquire( stats.sendQueueFull );
+			result.sendDropped = platform::LoadAcquire( stats.sendDropped );
+			return result;
+		}
+
+		// game thread: seconds from each packet's receive syscall returning to ReceivePacket handing it over
+
+		profile::Histogram & GetHandoffTimes()
+		{
+			return handoffTimes;
+		}
+
+	protected:
+
+		void Run()
+		{
+			while ( !platform::LoadAcquire( quit ) )
+				Pump( idleInterval );
+		}
+
+	private:
+
+		NetworkThread( const NetworkThread & other );
+		NetworkThread & operator = ( const NetworkThread & other );
+
+		static void Count( unsigned int & counter, int count )
+		{
+			platform::StoreRelease( counter, counter + count );
+		}
+
+		static void OnReadable( void * data )
+		{
+			( (NetworkThread*) data )->ReadPackets();
+		}
+
+		static void OnFlush( void * data )
+		{
+			( (NetworkThread*) data )->Flush();
+		}
+
+		static void OnReceiveEvent( void * data )
+		{
+			NetworkThread & self = *(NetworkThread*) data;
+			self.receiveEvent.Clear();
+			self.receiverFunction( self.receiverData );
+		}
+
+		void WakeReceiver()
+		{
+			if ( receiveEvent.IsOpen() )
+				receiveEvent.Signal();
+		}
+
+		void ReadPackets()
+		{
+			const unsigned int packetsBefore = stats.packetsReceived;
+
+			while ( true )
+			{
+				PacketBuffer * buffers;
+				int count = receiveQueue.Reserve( buffers );
+				if ( count == 0 )
+				{
+					// the game thread is behind: leave packets on the socket until it catches up
+					connection.Detach();
+					reading = false;
+					Count( stats.receiveStalls, 1 );
+					break;
+				}
+				if ( count > ReceiveBatchSize )
+					count = ReceiveBatchSize;
+				const int received = connection.ReceivePackets( buffers, count );
+				const double time = profile::GetTime();
+				int packets = 0;
+				for ( int i = 0; i < received; ++i )
+				{
+					receiveTime[receiveQueue.GetIndex( &buffers[i] )] = time;
+					if ( buffers[i].GetSize() > 0 )
+						packets++;
+				}
+				receiveQueue.Push( received );
+				Count( stats.packetsReceived, packets );
+				if ( received < count )
+					break;
+			}
+
+			// a client just connected: start flushing sends at the fast rate
+
+			if ( connection.IsConnected() && !fastFlush )
+			{
+				platform::StoreRelease( connected, 1 );
+				ScheduleFlush( true );
+				WakeReceiver();
+			}
+			else if ( stats.packetsReceived != packetsBefore )
+				WakeReceiver();
+		}
+
+		void Flush()
+		{
+			const double time = profile::GetTime();
+			connection.Update( (float) ( time - lastUpdate ) );
+			lastUpdate = time;
+
+			if ( connection.GetMode() == Connection::Server && !connection.IsConnected() && !connection.IsListening() )
+				connection.Listen();
+
+			PacketBuffer * buffers;
+			int count;
+			while ( ( count = sendQueue.Peek( buffers ) ) > 0 )
+			{
+				const int sent = connection.IsConnected() ? connection.SendPackets( buffers, count ) : 0;
+				Count( stats.packetsSent, sent );
+				Count( stats.sendDropped, count - sent );
+				sendQueue.Pop( count );
+			}
+
+			if ( !reading && receiveQueue.Reserve( buffers ) > 0 )
+			{
+				reading = connection.Attach( reactor, OnReadable, this );
+				if ( reading )
+					ReadPackets();
+			}
+
+			const bool isConnected = connection.IsConnected();
+			platform::StoreRelease( connected, isConnected ? 1 : 0 );
+			if ( isConnected != fastFlush )
+			{
+				ScheduleFlush( isConnected );
+				WakeReceiver();
+			}
+		}
+
+		void ScheduleFlush( bool fast )
+		{
+			if ( flushTimer )
+				reactor.CancelTimer( flushTimer );
+			const float interval = fast ? flushInterval : idleInterval;
+			flushTimer = reactor.AddTimer( interval, interval, OnFlush, this );
+			fastFlush = fast;
+		}
+
+		void Shutdown()
+		{
+			connection.Detach();
+			reactor.CancelTimer( flushTimer );
+			flushTimer = 0;
+			reading = false;
+			running = false;
+		}
+
+		Connection & connection;
+		Reactor reactor;
+		float flushInterval;
+		float idleInterval;
+		bool running;
+		bool reading;
+		bool fastFlush;
+		int flushTimer;
+		double lastUpdate;
+
+		platform::SPSCQueue<PacketBuffer> receiveQueue;
+		platform::SPSCQueue<PacketBuffer> sendQueue;
+		std::vector<double> receiveTime;
+
+		unsigned int connected;
+		unsigned int quit;
+		NetworkThreadStats stats;
+
+		int handedOff;
+		profile::Histogram handoffTimes;
+
+		ReactorEvent receiveEvent;
+		Reactor * receiverReactor;
+		Reactor::ReadyFunction receiverFunction;
+		void * receiverData;
+	};
+}
+
+#endif
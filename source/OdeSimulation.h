@@ -0,0 +1,1417 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef ODE_SIMULATION_H
+#define ODE_SIMULATION_H
+
+#include "Config.h"
+#include "Collision.h"
+#include "Thread.h"
+#include "SimulationBackend.h"
+
+#define dSINGLE
+#include <ode/ode.h>
+#include <string.h>
+#include <vector>
+
+namespace engine
+{	
+	/*
+		Cube narrowphase with the ode collider signature.
+		Handles box-box and box-plane, returns -1 for any other geom class so the
+		caller can fall back to dCollide. Contacts follow the ode convention:
+		the normal points from o2 into o1.
+	*/
+
+	inline bool GetCollisionBox( dGeomID geom, collision::Box & box )
+	{
+		if ( dGeomGetClass( geom ) != dBoxClass )
+			return false;
+		const dReal * position = dGeomGetPosition( geom );
+		const dReal * rotation = dGeomGetRotation( geom );
+		dVector3 lengths;
+		dGeomBoxGetLengths( geom, lengths );
+		box.position = math::Vector( position[0], position[1], position[2] );
+		for ( int i = 0; i < 3; ++i )
+		{
+			box.axis[i] = math::Vector( rotation[i], rotation[4+i], rotation[8+i] );
+			box.extents[i] = lengths[i] * 0.5f;
+		}
+		return true;
+	}
+
+	inline int CollideCubes( dGeomID o1, dGeomID o2, int maxContacts, dContactGeom * output, int skip )
+	{
+		collision::Box a, b;
+		collision::Contact contacts[collision::MaxContacts];
+
+		if ( maxContacts > collision::MaxContacts )
+			maxContacts = collision::MaxContacts;
+
+		int count = 0;
+		bool flip = false;
+		
+		if ( GetCollisionBox( o1, a ) )
+		{
+			if ( GetCollisionBox( o2, b ) )
+				count = collision::CollideBoxBox( a, b, contacts, maxContacts );
+			else if ( dGeomGetClass( o2 ) == dPlaneClass )
+			{
+				dVector4 plane;
+				dGeomPlaneGetParams( o2, plane );
+				count = collision::CollideBoxPlane( a, math::Vector( plane[0], plane[1], plane[2] ), plane[3], contacts, maxContacts );
+			}
+			else
+				return -1;
+		}
+		else if ( dGeomGetClass( o1 ) == dPlaneClass && GetCollisionBox( o2, b ) )
+		{
+			dVector4 plane;
+			dGeomPlaneGetParams( o1, plane );
+			count = collision::CollideBoxPlane( b, math::Vector( plane[0], plane[1], plane[2] ), plane[3], contacts, maxContacts );
+			flip = true;
+		}
+		else
+			return -1;
+
+		for ( int i = 0; i < count; ++i )
+		{
+			dContactGeom * contact = (dContactGeom*) ( ( (uint8_t*) output ) + i * skip );
+			const math::Vector normal = flip ? -contacts[i].normal : contacts[i].normal;
+			contact->pos[0] = contacts[i].point.x;
+			contact->pos[1] = contacts[i].point.y;
+			contact->pos[2] = contacts[i].point.z;
+			contact->normal[0] = normal.x;
+			contact->normal[1] = normal.y;
+			contact->normal[2] = normal.z;
+			contact->depth = contacts[i].depth;
+			contact->g1 = o1;
+			contact->g2 = o2;
+			contact->side1 = -1;
+			contact->side2 = -1;
+		}
+
+		return count;
+	}
+
+	// ode simulation backend with dynamic object allocation
+
+	class OdeSimulation : public SimulationBackend
+	{	
+		static int* GetInitCount()
+		{
+			static int initCount = 0;
+			return &initCount;
+		}
+
+	public:
+
+		OdeSimulation()
+		{
+			int * initCount = GetInitCount();
+			if ( *initCount == 0 )
+				dInitODE();
+			(*initCount)++;
+
+			space = 0;
+			maxScale = 0.0f;
+			stepDeltaTime = 0.0f;
+			stepFrame = 0;
+			stepInOrder = false;
+			collidePass = 1;
+			gridColliding = false;
+			sleepingCellSize = 0.0f;
+			numWokenInCollide = 0;
+		}
+
+		void Initialize( const SimulationConfig & config = SimulationConfig() )
+		{
+			this->config = config;
+
+			// create island worlds
+
+			worlds.resize( config.IslandWorlds > 0 ? config.IslandWorlds : 1 );
+			for ( int i = 0; i < (int) worlds.size(); ++i )
+			{
+				worlds[i].world = dWorldCreate();
+				worlds[i].contacts = dJointGroupCreate( 0 );
+				ConfigureWorld( worlds[i].world );
+			}
+
+			stepInOrder = config.QuickStep && QuickStepUsesRandomSeed();
+
+			if ( worlds.size() > 1 && config.IslandThreads > 0 && !stepInOrder )
+				workerPool.Start( config.IslandThreads, StartWorkerThread, StopWorkerThread );
+
+			// create broadphase. the grid broadphase is our own, so geoms live outside any ode space
+
+			switch ( config.Broadphase )
+			{
+				case BROADPHASE_Hash:			space = dHashSpaceCreate( 0 );							break;
+				case BROADPHASE_SweepAndPrune:	space = dSweepAndPruneSpaceCreate( 0, dSAP_AXES_XYZ );	break;
+				case BROADPHASE_Grid:			space = 0;												break;
+			}
+
+			// setup contacts
+
+		    for ( int i = 0; i < MaxContacts; i++ ) 
+		    {
+				contact[i].surface.mode = dContactBounce;
+				contact[i].surface.mu = config.Friction;
+				contact[i].surface.bounce = config.Elasticity;
+				contact[i].surface.bounce_vel = 0.001f;
+		    }
+		
+			objects.resize( 32 );
+			interactionPairs.reserve( 32 );
+			islandWorldCount.resize( objects.size() * worlds.size(), 0 );
+		}
+
+		~OdeSimulation()
+		{
+			workerPool.Stop();
+			for ( int i = 0; i < (int) worlds.size(); ++i )
+			{
+				dJointGroupDestroy( worlds[i].contacts );
+				dWorldDestroy( worlds[i].world );
+			}
+			if ( space )
+				dSpaceDestroy( space );
+
+			int * initCount = GetInitCount();
+			(*initCount)--;
+			if ( *initCount == 0 )
+				dCloseODE();
+		}
+
+		void Update( float deltaTime )
+		{		
+			interactionPairs.clear();
+
+			stats = SimulationStats();
+
+			for ( int i = 0; i < (int) worlds.size(); ++i )
+				dJointGroupEmpty( worlds[i].contacts );
+
+			pendingContacts.clear();
+
+			/*
+				Sleeping islands are only collided against awake bodies. The first
+				pass takes pairs with a body awake at the start of collision. If that
+				wakes any islands, a second pass picks up the pairs between the newly
+				woken bodies and other sleeping or static geometry, so woken piles
+				keep their resting contacts on the frame they wake.
+			*/
+
+			{
+				PROFILE_SCOPE( profiler, profile::ZONE_Collide );
+
+				for ( int i = 0; i < (int) awakeObjects.size(); ++i )
+					objects[awakeObjects[i]].collideAwake = true;
+
+				collidePass = 1;
+				numWokenInCollide = 0;
+
+				Collide();
+
+				if ( numWokenInCollide > 0 )
+				{
+					collidePass = 2;
+					Collide();
+				}
+			}
+
+			{
+				PROFILE_SCOPE( profiler, profile::ZONE_Step );
+
+				if ( worlds.size() == 1 )
+				{
+					if ( config.QuickStep )
+						dWorldQuickStep( worlds[0].world, deltaTime );
+					else
+						dWorldStep( worlds[0].world, deltaTime );
+				}
+				else
+				{
+					MergeIslands();
+
+					for ( int i = 0; i < (int) pendingContacts.size(); ++i )
+					{
+						const PendingContact & pending = pendingContacts[i];
+						dBodyID b1 = pending.a >= 0 ? objects[pending.a].body : 0;
+						dBodyID b2 = pending.b >= 0 ? objects[pending.b].body : 0;
+						const int world = objects[ pending.a >= 0 ? pending.a : pending.b ].world;
+						dJointID c = dJointCreateContact( worlds[world].world, worlds[world].contacts, &pending.contact );
+						dJointAttach( c, b1, b2 );
+					}
+
+					if ( stepInOrder )
+					{
+						// this ode's quickstep reorders constraints from its global random seed, see MergeIslands
+
+						for ( int i = 0; i < (int) worlds.size(); ++i )
+						{
+							dRandSetSeed( stepFrame * worlds.size() + i );
+							dWorldQuickStep( worlds[i].world, deltaTime );
+						}
+					}
+					else
+					{
+						stepDeltaTime = deltaTime;
+						workerPool.Run( StepWorldTask, this, worlds.size() );
+					}
+
+					stepFrame++;
+				}
+			}
+
+			{
+				PROFILE_SCOPE( profiler, profile::ZONE_Rest );
+
+				// rest checks only look at awake bodies
+
+				updatedObjects = awakeObjects;
+
+				for ( int i = 0; i < (int) awakeObjects.size(); ++i )
+				{
+					ObjectData & object = objects[awakeObjects[i]];
+
+					const dReal * linearVelocity = dBodyGetLinearVel( object.body );
+					const dReal * angularVelocity = dBodyGetAngularVel( object.body );
+
+					const float linearVelocityLengthSquared = linearVelocity[0]*linearVelocity[0] + linearVelocity[1]*linearVelocity[1] + linearVelocity[2]*linearVelocity[2];
+					const float angularVelocityLengthSquared = angularVelocity[0]*angularVelocity[0] + angularVelocity[1]*angularVelocity[1] + angularVelocity[2]*angularVelocity[2];
+
+					if ( linearVelocityLengthSquared < config.LinearRestThresholdSquared && angularVelocityLengthSquared < config.AngularRestThresholdSquared )
+						object.timeAtRest += deltaTime;
+					else
+						object.timeAtRest = 0.0f;
+				}
+
+				SleepRestingIslands();
+			}
+		}
+
+		int AddObject( const SimulationObjectState & initialObjectState )
+		{
+			// find free object slot
+
+			int id = -1;
+			for ( int i = 0; i < (int) objects.size(); ++i )
+			{
+				if ( !objects[i].exists() )
+				{
+					id = i;
+					break;
+				}
+			}
+			if ( id == -1 )
+			{
+				id = objects.size();
+				objects.resize( objects.size() + 1 );
+			}
+
+			// setup object body
+
+			objects[id].world = id % worlds.size();
+			objects[id].body = dBodyCreate( worlds[objects[id].world].world );
+
+			assert( objects[id].body );
+
+			dMass mass;
+			dMassSetBox( &mass, initialObjectState.density, initialObjectState.scale, initialObjectState.scale, initialObjectState.scale );
+			dBodySetMass( objects[id].body, &mass );
+			dBodySetData( objects[id].body, (void*) id );
+
+			// setup geom and attach to body
+
+			objects[id].scale = initialObjectState.scale;
+			if ( initialObjectState.scale > maxScale )
+				maxScale = initialObjectState.scale;
+			objects[id].geom = dCreateBox( space, initialObjectState.scale, initialObjectState.scale, initialObjectState.scale );
+
+			dGeomSetBody( objects[id].geom, objects[id].body );	
+
+			// new objects start awake in their own island
+
+			objects[id].nextInIsland = id;
+			objects[id].collideAwake = false;
+			objects[id].awakeIndex = awakeObjects.size();
+			awakeObjects.push_back( id );
+
+			// set object state
+
+			SetObjectState( id, initialObjectState );
+
+			// success!
+
+			return id;
+		}
+
+		bool ObjectExists( int id )
+		{
+			assert( id >= 0 && id < (int) objects.size() );
+			return objects[id].exists();
+		}
+
+		float GetObjectMass( int id )
+		{
+			assert( id >= 0 && id < (int) objects.size() );
+			assert( objects[id].exists() );
+			dMass mass;
+			dBodyGetMass( objects[id].body, &mass );
+			return mass.mass;
+		}
+
+		void RemoveObject( int id )
+		{
+			assert( id >= 0 && id < (int) objects.size() );
+			assert( objects[id].exists() );
+
+			// wake the island the object was resting in, since it may have been holding it up
+
+			WakeObject( id );
+			RemoveAwakeObject( id );
+
+			dBodyDestroy( objects[id].body );
+			dGeomDestroy( objects[id].geom );
+			objects[id].body = 0;
+			objects[id].geom = 0;
+		}
+
+		void GetObjectState( int id, SimulationObjectState & objectState )
+		{
+			assert( id >= 0 );
+			assert( id < (int) objects.size() );
+
+			assert( objects[id].exists() );
+
+			const dReal * position = dBodyGetPosition( objects[id].body );
+			const dReal * orientation = dBodyGetQuaternion( objects[id].body );
+			const dReal * linearVelocity = dBodyGetLinearVel( objects[id].body );
+			const dReal * angularVelocity = dBodyGetAngularVel( objects[id].body );
+
+			objectState.position = math::Vector( position[0], position[1], position[2] );
+			objectState.orientation = math::Quaternion( orientation[0], orientation[1], orientation[2], orientation[3] );
+			objectState.linearVelocity = math::Vector( linearVelocity[0], linearVelocity[1], linearVelocity[2] );
+			objectState.angularVelocity = math::Vector( angularVelocity[0], angularVelocity[1], angularVelocity[2] );
+
+			objectState.enabled = objects[id].timeAtRest < config.RestTime;
+		}
+
+		void SetObjectState( int id, const SimulationObjectState & objectState, bool ignoreEnabledFlag = false )
+		{
+			assert( id >= 0 );
+			assert( id < (int) objects.size() );
+
+			assert( objects[id].exists() );
+
+			dQuaternion quaternion;
+			quaternion[0] = objectState.orientation.w;
+			quaternion[1] = objectState.orientation.x;
+			quaternion[2] = objectState.orientation.y;
+			quaternion[3] = objectState.orientation.z;
+
+			dBodySetPosition( objects[id].body, objectState.position.x, objectState.position.y, objectState.position.z );
+			dBodySetQuaternion( objects[id].body, quaternion );
+			dBodySetLinearVel( objects[id].body, objectState.linearVelocity.x, objectState.linearVelocity.y, objectState.linearVelocity.z );
+			dBodySetAngularVel( objects[id].body, objectState.angularVelocity.x, objectState.angularVelocity.y, objectState.angularVelocity.z );
+
+			if ( objects[id].sleepingSlot >= 0 )
+			{
+				RemoveSleepingObject( id );
+				InsertSleepingObject( id );
+			}
+
+			if ( !ignoreEnabledFlag )
+			{
+				if ( objectState.enabled )
+				{
+					WakeObject( id );
+					objects[id].timeAtRest = 0.0f;
+				}
+				else if ( objects[id].awakeIndex >= 0 )
+				{
+					// note: put to sleep on its own, the next contact with an awake body wakes it
+					RemoveAwakeObject( id );
+					objects[id].timeAtRest = config.RestTime;
+					objects[id].nextInIsland = id;
+					dBodyDisable( objects[id].body );
+					InsertSleepingObject( id );
+				}
+			}
+		}
+
+		/*
+			Batched state exchange.
+			Reads or writes the state of a list of objects through contiguous buffers
+			in one pass. The ids are validated up front, and object data and ode
+			bodies are prefetched a few objects ahead of the accessor calls.
+			SetObjectStates leaves the sleep state alone, like SetObjectState with
+			ignoreEnabledFlag set.
+		*/
+
+		void GetObjectStates( const int * ids, int count, SimulationObjectStates & states )
+		{
+			ValidateObjectIds( ids, count );
+
+			states.Resize( count );
+
+			for ( int i = 0; i < count; ++i )
+			{
+				PrefetchObjects( ids, count, i );
+
+				const ObjectData & object = objects[ids[i]];
+
+				const dReal * position = dBodyGetPosition( object.body );
+				const dReal * orientation = dBodyGetQuaternion( object.body );
+				const dReal * linearVelocity = dBodyGetLinearVel( object.body );
+				const dReal * angularVelocity = dBodyGetAngularVel( object.body );
+
+				states.position[i] = math::Vector( position[0], position[1], position[2] );
+				states.orientation[i] = math::Quaternion( orientation[0], orientation[1], orientation[2], orientation[3] );
+				states.linearVelocity[i] = math::Vector( linearVelocity[0], linearVelocity[1], linearVelocity[2] );
+				states.angularVelocity[i] = math::Vector( angularVelocity[0], angularVelocity[1], angularVelocity[2] );
+				states.enabled[i] = object.timeAtRest < config.RestTime;
+			}
+		}
+
+		void SetObjectStates( const int * ids, int count, const SimulationObjectStates & states )
+		{
+			ValidateObjectIds( ids, count );
+
+			assert( states.GetCount() >= count );
+
+			for ( int i = 0; i < count; ++i )
+			{
+				PrefetchObjects( ids, count, i );
+
+				dBodyID body = objects[ids[i]].body;
+
+				const math::Vector & position = states.position[i];
+				const math::Quaternion & orientation = states.orientation[i];
+				const math::Vector & linearVelocity = states.linearVelocity[i];
+				const math::Vector & angularVelocity = states.angularVelocity[i];
+
+				dQuaternion quaternion;
+				quaternion[0] = orientation.w;
+				quaternion[1] = orientation.x;
+				quaternion[2] = orientation.y;
+				quaternion[3] = orientation.z;
+
+				dBodySetPosition( body, position.x, position.y, position.z );
+				dBodySetQuaternion( body, quaternion );
+				dBodySetLinearVel( body, linearVelocity.x, linearVelocity.y, linearVelocity.z );
+				dBodySetAngularVel( body, angularVelocity.x, angularVelocity.y, angularVelocity.z );
+
+				if ( objects[ids[i]].sleepingSlot >= 0 )
+				{
+					RemoveSleepingObject( ids[i] );
+					InsertSleepingObject( ids[i] );
+				}
+			}
+		}
+
+		const SimulationStats & GetStats() const
+		{
+			return stats;
+		}
+
+		const InteractionPair * GetInteractionPairs() const
+		{
+			return &interactionPairs[0];
+		}
+
+		int GetNumInteractionPairs() const
+		{
+			return interactionPairs.size();
+		}
+
+		void ApplyForce( int id, const math::Vector & force )
+		{
+			assert( id >= 0 );
+			assert( id < (int) objects.size() );
+			assert( objects[id].exists() );
+			if ( force.length() > 0.001f )
+			{
+				WakeObject( id );
+				dBodyAddForce( objects[id].body, force.x, force.y, force.z );
+			}
+		}
+
+		void ApplyTorque( int id, const math::Vector & torque )
+		{
+			assert( id >= 0 );
+			assert( id < (int) objects.size() );
+			assert( objects[id].exists() );
+			if ( torque.length() > 0.001f )
+			{
+				WakeObject( id );
+				dBodyAddTorque( objects[id].body, torque.x, torque.y, torque.z );
+			}
+		}
+
+		void AddPlane( const math::Vector & normal, float d )
+		{
+			planes.push_back( dCreatePlane( space, normal.x, normal.y, normal.z, d ) );
+		}
+
+		void Reset()
+		{
+			for ( int i = 0; i < (int) objects.size(); ++i )
+			{
+				if ( objects[i].exists() )
+					RemoveObject( i );
+			}
+
+			for ( int i = 0; i < (int) planes.size(); ++i )
+				dGeomDestroy( planes[i] );
+
+			planes.clear();
+
+			awakeObjects.clear();
+			updatedObjects.clear();
+
+			sleepingGrid.clear();
+			sleepingCellSize = 0.0f;
+			maxScale = 0.0f;
+		}
+
+		// 1 when quickstep worlds have to step in order, however many threads were asked for
+
+		int GetNumThreads() const
+		{
+			return workerPool.GetNumThreads();
+		}
+
+		void SetMaxIterations( int iterations )
+		{
+			assert( iterations > 0 );
+			config.MaxIterations = iterations;
+			for ( int i = 0; i < (int) worlds.size(); ++i )
+				dWorldSetQuickStepNumIterations( worlds[i].world, iterations );
+		}
+
+		int GetMaxIterations() const
+		{
+			return config.MaxIterations;
+		}
+
+		bool IsObjectAwake( int id ) const
+		{
+			assert( id >= 0 && id < (int) objects.size() );
+			return objects[id].awakeIndex >= 0;
+		}
+
+		int GetNumAwakeObjects() const
+		{
+			return awakeObjects.size();
+		}
+
+		const int * GetAwakeObjects() const
+		{
+			return awakeObjects.empty() ? NULL : &awakeObjects[0];
+		}
+
+		// objects that were awake during the last update, including any that fell asleep at the end of it
+
+		const int * GetUpdatedObjects() const
+		{
+			return updatedObjects.empty() ? NULL : &updatedObjects[0];
+		}
+
+		int GetNumUpdatedObjects() const
+		{
+			return updatedObjects.size();
+		}
+
+		void WakeObject( int id )
+		{
+			assert( id >= 0 && id < (int) objects.size() );
+			assert( objects[id].exists() );
+
+			if ( objects[id].awakeIndex >= 0 )
+				return;
+
+			// walk the sleeping island and wake every body in it
+
+			int current = id;
+			do
+			{
+				ObjectData & object = objects[current];
+				const int next = object.nextInIsland;
+				object.nextInIsland = current;
+				object.timeAtRest = 0.0f;
+				object.awakeIndex = awakeObjects.size();
+				awakeObjects.push_back( current );
+				dBodyEnable( object.body );
+				numWokenInCollide++;
+				if ( gridColliding )
+					wokenInGridCollide.push_back( current );		// note: the grid is being walked, see GridCollide
+				else
+					RemoveSleepingObject( current );
+				current = next;
+			}
+			while ( current != id );
+		}
+
+	private:
+
+		void ValidateObjectIds( const int * ids, int count ) const
+		{
+			#ifdef DEBUG
+			for ( int i = 0; i < count; ++i )
+			{
+				assert( ids[i] >= 0 );
+				assert( ids[i] < (int) objects.size() );
+				assert( objects[ids[i]].exists() );
+			}
+			#endif
+		}
+
+		// prefetch object data far ahead, and the ode body of an object nearer ahead
+
+		void PrefetchObjects( const int * ids, int count, int index ) const
+		{
+			#ifdef __GNUC__
+			enum { ObjectDistance = 16, BodyDistance = 8 };
+			if ( index + ObjectDistance < count )
+				__builtin_prefetch( &objects[ ids[index+ObjectDistance] ] );
+			if ( index + BodyDistance < count )
+				__builtin_prefetch( objects[ ids[index+BodyDistance] ].body );
+			#endif
+		}
+
+		void Collide()
+		{
+			if ( space )
+				dSpaceCollide( space, this, NearCallback );
+			else
+				GridCollide();
+		}
+
+		void RemoveAwakeObject( int id )
+		{
+			const int index = objects[id].awakeIndex;
+			assert( index >= 0 );
+			const int last = awakeObjects.back();
+			awakeObjects[index] = last;
+			objects[last].awakeIndex = index;
+			awakeObjects.pop_back();
+			objects[id].awakeIndex = -1;
+			objects[id].collideAwake = false;
+		}
+
+		/*
+			Island sleep.
+			Awake bodies are grouped into contact islands with this frame's
+			interaction pairs. An island goes to sleep only when every body in it
+			has been at rest for RestTime, and its bodies are linked into a circular
+			list so any contact with an awake body, applied force or removal wakes
+			the whole pile at once. Sleeping bodies cost nothing per frame.
+		*/
+
+		void SleepRestingIslands()
+		{
+			int numAwake = awakeObjects.size();
+			if ( numAwake == 0 )
+				return;
+
+			// note: MergeIslands grows islandParent on its own, so size each array separately
+
+			if ( (int) islandParent.size() < (int) objects.size() )
+				islandParent.resize( objects.size() );
+			if ( (int) islandMoving.size() < (int) objects.size() )
+				islandMoving.resize( objects.size() );
+			if ( (int) islandHead.size() < (int) objects.size() )
+				islandHead.resize( objects.size() );
+
+			for ( int i = 0; i < numAwake; ++i )
+			{
+				const int id = awakeObjects[i];
+				islandParent[id] = id;
+				islandMoving[id] = 0;
+				islandHead[id] = -1;
+			}
+
+			for ( int i = 0; i < (int) interactionPairs.size(); ++i )
+			{
+				const int a = interactionPairs[i].a;
+				const int b = interactionPairs[i].b;
+				if ( objects[a].awakeIndex < 0 || objects[b].awakeIndex < 0 )
+					continue;
+				const int rootA = FindIsland( a );
+				const int rootB = FindIsland( b );
+				if ( rootA != rootB )
+					islandParent[ rootA < rootB ? rootB : rootA ] = rootA < rootB ? rootA : rootB;
+			}
+
+			for ( int i = 0; i < numAwake; ++i )
+			{
+				const int id = awakeObjects[i];
+				if ( objects[id].timeAtRest < config.RestTime )
+					islandMoving[ FindIsland( id ) ] = 1;
+			}
+
+			for ( int i = 0; i < numAwake; )
+			{
+				const int id = awakeObjects[i];
+				const int root = FindIsland( id );
+				if ( islandMoving[root] )
+				{
+					++i;
+					continue;
+				}
+
+				ObjectData & object = objects[id];
+				if ( islandHead[root] < 0 )
+				{
+					islandHead[root] = id;
+					object.nextInIsland = id;
+				}
+				else
+				{
+					ObjectData & head = objects[ islandHead[root] ];
+					object.nextInIsland = head.nextInIsland;
+					head.nextInIsland = id;
+				}
+
+				object.timeAtRest = config.RestTime;
+				dBodyDisable( object.body );
+				RemoveAwakeObject( id );				// note: swaps the last awake object into slot i
+				InsertSleepingObject( id );
+				numAwake--;
+			}
+		}
+
+		void ConfigureWorld( dWorldID world )
+		{
+			dWorldSetERP( world, config.ERP );
+			dWorldSetCFM( world, config.CFM );
+			dWorldSetQuickStepNumIterations( world, config.MaxIterations );
+			dWorldSetGravity( world, 0, 0, -config.Gravity );
+			dWorldSetContactSurfaceLayer( world, config.ContactSurfaceLayer );
+			dWorldSetContactMaxCorrectingVel( world, config.MaximumCorrectingVelocity );
+			dWorldSetLinearDamping( world, 0.01f );
+			dWorldSetAngularDamping( world, 0.01f );
+		}
+
+		/*
+			Island worlds.
+			Objects are spread over a fixed number of ode worlds, which share nothing
+			and are stepped in parallel on the worker pool. Contacts are buffered during
+			collision, then contact islands are found with union-find, and any island
+			that spans worlds has its bodies moved into the world already holding most of
+			them (lowest world index on ties). Moving a body recreates it in the new world.
+			Every choice depends only on object ids and contacts, never on thread
+			count or timing, so stepping is deterministic regardless of threads.
+			Each pool thread allocates its own ode scratch data when it starts.
+			Stock ode's quickstep shuffles constraints from a single global random
+			seed, which threads would race on. Built without the shuffle (see the
+			makefile) quickstep shares nothing between worlds and runs on the pool
+			like dWorldStep. Otherwise quickstep worlds are stepped in order on the
+			calling thread, each from a seed set by frame and world.
+		*/
+
+		int FindIsland( int id )
+		{
+			while ( islandParent[id] != id )
+			{
+				islandParent[id] = islandParent[islandParent[id]];
+				id = islandParent[id];
+			}
+			return id;
+		}
+
+		void MergeIslands()
+		{
+			const int numObjects = objects.size();
+			const int numWorlds = worlds.size();
+			const int numAwake = awakeObjects.size();
+
+			// note: contacts only ever involve awake bodies
+
+			if ( (int) islandParent.size() < numObjects )
+				islandParent.resize( numObjects );
+			for ( int i = 0; i < numAwake; ++i )
+				islandParent[ awakeObjects[i] ] = awakeObjects[i];
+
+			bool spansWorlds = false;
+			for ( int i = 0; i < (int) pendingContacts.size(); ++i )
+			{
+				const int a = pendingContacts[i].a;
+				const int b = pendingContacts[i].b;
+				if ( a < 0 || b < 0 )
+					continue;
+				const int rootA = FindIsland( a );
+				const int rootB = FindIsland( b );
+				if ( rootA != rootB )
+					islandParent[ rootA < rootB ? rootB : rootA ] = rootA < rootB ? rootA : rootB;
+				if ( objects[a].world != objects[b].world )
+					spansWorlds = true;
+			}
+
+			if ( !spansWorlds )
+				return;
+
+			// count bodies per world in each island, then move bodies into the island's majority world
+			// note: counts are kept zeroed between frames, so only the rows of islands seen here are touched
+
+			if ( (int) islandWorldCount.size() < numObjects * numWorlds )
+				islandWorldCount.resize( numObjects * numWorlds, 0 );
+
+			for ( int i = 0; i < numAwake; ++i )
+			{
+				const int id = awakeObjects[i];
+				islandWorldCount[ FindIsland( id ) * numWorlds + objects[id].world ]++;
+			}
+
+			for ( int i = 0; i < numAwake; ++i )
+			{
+				const int id = awakeObjects[i];
+				const int * count = &islandWorldCount[ FindIsland( id ) * numWorlds ];
+				int world = 0;
+				for ( int j = 1; j < numWorlds; ++j )
+				{
+					if ( count[j] > count[world] )
+						world = j;
+				}
+				if ( world != objects[id].world )
+					MoveObjectToWorld( id, world );
+			}
+
+			for ( int i = 0; i < numAwake; ++i )
+			{
+				int * count = &islandWorldCount[ FindIsland( awakeObjects[i] ) * numWorlds ];
+				for ( int j = 0; j < numWorlds; ++j )
+					count[j] = 0;
+			}
+		}
+
+		void MoveObjectToWorld( int id, int world )
+		{
+			ObjectData & object = objects[id];
+
+			dBodyID body = dBodyCreate( worlds[world].world );
+
+			dMass mass;
+			dBodyGetMass( object.body, &mass );
+			dBodySetMass( body, &mass );
+			dBodySetData( body, (void*) id );
+
+			const dReal * position = dBodyGetPosition( object.body );
+			const dReal * linearVelocity = dBodyGetLinearVel( object.body );
+			const dReal * angularVelocity = dBodyGetAngularVel( object.body );
+			const dReal * force = dBodyGetForce( object.body );
+			const dReal * torque = dBodyGetTorque( object.body );
+
+			dBodySetPosition( body, position[0], position[1], position[2] );
+			dBodySetQuaternion( body, dBodyGetQuaternion( object.body ) );
+			dBodySetLinearVel( body, linearVelocity[0], linearVelocity[1], linearVelocity[2] );
+			dBodySetAngularVel( body, angularVelocity[0], angularVelocity[1], angularVelocity[2] );
+			dBodySetForce( body, force[0], force[1], force[2] );
+			dBodySetTorque( body, torque[0], torque[1], torque[2] );
+
+			if ( !dBodyIsEnabled( object.body ) )
+				dBodyDisable( body );
+
+			dGeomSetBody( object.geom, body );
+			dBodyDestroy( object.body );
+
+			object.body = body;
+			object.world = world;
+		}
+
+		static void StepWorldTask( void * data, int index )
+		{
+			OdeSimulation * simulation = (OdeSimulation*) data;
+			if ( simulation->config.QuickStep )
+				dWorldQuickStep( simulation->worlds[index].world, simulation->stepDeltaTime );
+			else
+				dWorldStep( simulation->worlds[index].world, simulation->stepDeltaTime );
+		}
+
+		// steps a throwaway world holding one contact and watches whether quickstep moved the seed
+
+		static bool QuickStepUsesRandomSeed()
+		{
+			static int usesSeed = -1;
+			if ( usesSeed < 0 )
+			{
+				const unsigned long seed = dRandGetSeed();
+				dWorldID world = dWorldCreate();
+				dJointGroupID contacts = dJointGroupCreate( 0 );
+				dBodyID body = dBodyCreate( world );
+				dContact contact;
+				memset( &contact, 0, sizeof( contact ) );
+				contact.surface.mu = 1;						// note: friction rows too, so there is something to shuffle
+				contact.geom.normal[2] = 1;
+				contact.geom.depth = 0.01f;
+				dJointAttach( dJointCreateContact( world, contacts, &contact ), body, 0 );
+				dRandSetSeed( 0 );
+				dWorldQuickStep( world, 0.01f );
+				usesSeed = dRandGetSeed() != 0;
+				dRandSetSeed( seed );
+				dJointGroupDestroy( contacts );
+				dBodyDestroy( body );
+				dWorldDestroy( world );
+			}
+			return usesSeed != 0;
+		}
+
+		static void StartWorkerThread( void * )
+		{
+			dAllocateODEDataForThread( dAllocateMaskAll );
+		}
+
+		static void StopWorkerThread( void * )
+		{
+			dCleanupODEAllDataForThread();
+		}
+
+		/*
+			Uniform 2D grid broadphase.
+			Our objects are cubes resting on a plane, so we bin each cube by the
+			grid cell containing its center, with cells at least as large as the
+			biggest cube bounding box. Overlapping cubes are then always in the same
+			or adjacent cells, so we only need to look at half of the 3x3 neighborhood.
+			Awake cubes are hashed into a power of two bucket array which is rebuilt
+			each step with a counting sort, so there is no per-geom allocation or
+			re-hashing. Sleeping cubes don't move, so they live in a second hashed
+			grid that is only updated as they fall asleep, wake or are moved, and
+			each awake cube looks up its full 3x3 neighborhood there. The cost of a
+			step follows the number of awake cubes, not the total.
+		*/
+
+		struct GridObject
+		{
+			int id;
+			int ix,iy;
+			uint32_t bucket;
+			dReal aabb[6];
+		};
+
+		static uint32_t GridHash( int ix, int iy )
+		{
+			return ( (uint32_t) ix * 73856093u ) ^ ( (uint32_t) iy * 19349663u );
+		}
+
+		float GetGridCellSize() const
+		{
+			// size cells to the largest cube (the diagonal of a cube bounds its aabb width)
+
+			if ( config.GridCellSize > 0.0f )
+				return config.GridCellSize;
+			return maxScale * 1.7320508f;
+		}
+
+		void GridCollide()
+		{
+			const float cellSize = GetGridCellSize();
+			if ( cellSize <= 0.0f )
+				return;
+			const float inverseCellSize = 1.0f / cellSize;
+
+			if ( cellSize != sleepingCellSize || sleepingGrid.size() < objects.size() * 2 )
+				RebuildSleepingGrid( cellSize );
+
+			// gather awake objects and determine the cell for each one. the second pass only wants the ones woken by the first
+
+			gridObjects.clear();
+			for ( int i = 0; i < (int) awakeObjects.size(); ++i )
+			{
+				const int id = awakeObjects[i];
+				if ( collidePass == 2 && objects[id].collideAwake )
+					continue;
+				GridObject gridObject;
+				gridObject.id = id;
+				dGeomGetAABB( objects[id].geom, gridObject.aabb );
+				const dReal * position = dBodyGetPosition( objects[id].body );
+				gridObject.ix = (int) math::floor( position[0] * inverseCellSize );
+				gridObject.iy = (int) math::floor( position[1] * inverseCellSize );
+				gridObjects.push_back( gridObject );
+			}
+
+			const int numObjects = (int) gridObjects.size();
+
+			// counting sort objects into hash buckets
+
+			int numBuckets = 64;
+			while ( numBuckets < numObjects * 2 )
+				numBuckets *= 2;
+			const uint32_t bucketMask = numBuckets - 1;
+
+			gridBucketStart.resize( numBuckets + 1 );
+			for ( int i = 0; i <= numBuckets; ++i )
+				gridBucketStart[i] = 0;
+			for ( int i = 0; i < numObjects; ++i )
+			{
+				gridObjects[i].bucket = GridHash( gridObjects[i].ix, gridObjects[i].iy ) & bucketMask;
+				gridBucketStart[gridObjects[i].bucket+1]++;
+			}
+			for ( int i = 0; i < numBuckets; ++i )
+				gridBucketStart[i+1] += gridBucketStart[i];
+
+			gridSorted.resize( numObjects );
+			gridBucketFill.assign( gridBucketStart.begin(), gridBucketStart.end() - 1 );
+			for ( int i = 0; i < numObjects; ++i )
+				gridSorted[gridBucketFill[gridObjects[i].bucket]++] = i;
+
+			// waking islands during the walk would reorder the sleeping grid under us, so removals wait until the end
+
+			gridColliding = true;
+
+			// test each object against its own cell and half of the neighboring cells
+
+			const int offsets[5][2] = { {0,0}, {1,0}, {-1,1}, {0,1}, {1,1} };
+
+			for ( int k = 0; k < numObjects; ++k )
+			{
+				const GridObject & a = gridObjects[gridSorted[k]];
+
+				for ( int j = 0; j < 5; ++j )
+				{
+					const int ix = a.ix + offsets[j][0];
+					const int iy = a.iy + offsets[j][1];
+
+					const uint32_t bucket = GridHash( ix, iy ) & bucketMask;
+
+					const int begin = ( j == 0 ) ? k + 1 : gridBucketStart[bucket];
+					const int end = gridBucketStart[bucket+1];
+
+					for ( int m = begin; m < end; ++m )
+					{
+						const GridObject & b = gridObjects[gridSorted[m]];
+
+						// note: different cells may hash to the same bucket
+						if ( b.ix != ix || b.iy != iy )
+							continue;
+
+						if ( !AABBOverlap( a.aabb, b.aabb ) )
+							continue;
+
+						NearCallback( this, objects[a.id].geom, objects[b.id].geom );
+					}
+				}
+			}
+
+			// test each object against sleeping objects in all of the neighboring cells
+
+			const uint32_t sleepingMask = sleepingGrid.size() - 1;
+
+			for ( int k = 0; k < numObjects; ++k )
+			{
+				const GridObject & a = gridObjects[k];
+
+				for ( int iy = a.iy - 1; iy <= a.iy + 1; ++iy )
+				{
+					for ( int ix = a.ix - 1; ix <= a.ix + 1; ++ix )
+					{
+						const std::vector<int> & cell = sleepingGrid[ GridHash( ix, iy ) & sleepingMask ];
+
+						for ( int m = 0; m < (int) cell.size(); ++m )
+						{
+							const ObjectData & b = objects[cell[m]];
+
+							if ( b.sleepingX != ix || b.sleepingY != iy )
+								continue;
+
+							dReal aabb[6];
+							dGeomGetAABB( b.geom, aabb );
+							if ( !AABBOverlap( a.aabb, aabb ) )
+								continue;
+
+							NearCallback( this, objects[a.id].geom, b.geom );
+						}
+					}
+				}
+			}
+
+			// planes are infinite, so every object is tested against each plane
+
+			for ( int i = 0; i < (int) planes.size(); ++i )
+			{
+				for ( int k = 0; k < numObjects; ++k )
+					NearCallback( this, objects[gridObjects[k].id].geom, planes[i] );
+			}
+
+			gridColliding = false;
+
+			for ( int i = 0; i < (int) wokenInGridCollide.size(); ++i )
+				RemoveSleepingObject( wokenInGridCollide[i] );
+
+			wokenInGridCollide.clear();
+		}
+
+		static bool AABBOverlap( const dReal * a, const dReal * b )
+		{
+			return a[0] <= b[1] && a[1] >= b[0] &&
+				   a[2] <= b[3] && a[3] >= b[2] &&
+				   a[4] <= b[5] && a[5] >= b[4];
+		}
+
+		// sleeping grid, only kept for the grid broadphase. it is skipped until the first GridCollide sizes it
+
+		void InsertSleepingObject( int id )
+		{
+			if ( sleepingGrid.empty() )
+				return;
+
+			ObjectData & object = objects[id];
+			assert( object.sleepingSlot < 0 );
+
+			const float inverseCellSize = 1.0f / sleepingCellSize;
+			const dReal * position = dBodyGetPosition( object.body );
+			object.sleepingX = (int) math::floor( position[0] * inverseCellSize );
+			object.sleepingY = (int) math::floor( position[1] * inverseCellSize );
+
+			std::vector<int> & cell = sleepingGrid[ GridHash( object.sleepingX, object.sleepingY ) & ( sleepingGrid.size() - 1 ) ];
+			object.sleepingSlot = cell.size();
+			cell.push_back( id );
+		}
+
+		void RemoveSleepingObject( int id )
+		{
+			ObjectData & object = objects[id];
+			if ( object.sleepingSlot < 0 )
+				return;
+
+			std::vector<int> & cell = sleepingGrid[ GridHash( object.sleepingX, object.sleepingY ) & ( sleepingGrid.size() - 1 ) ];
+			const int last = cell.back();
+			cell[object.sleepingSlot] = last;
+			objects[last].sleepingSlot = object.sleepingSlot;
+			cell.pop_back();
+			object.sleepingSlot = -1;
+		}
+
+		// only when the largest cube grows or the object count doubles, so it does not show up per frame
+
+		void RebuildSleepingGrid( float cellSize )
+		{
+			int numBuckets = 64;
+			while ( numBuckets < (int) objects.size() * 2 )
+				numBuckets *= 2;
+
+			for ( int i = 0; i < (int) sleepingGrid.size(); ++i )
+				sleepingGrid[i].clear();
+			sleepingGrid.resize( numBuckets );
+			sleepingCellSize = cellSize;
+
+			for ( int i = 0; i < (int) objects.size(); ++i )
+			{
+				objects[i].sleepingSlot = -1;
+				if ( objects[i].exists() && objects[i].awakeIndex < 0 )
+					InsertSleepingObject( i );
+			}
+		}
+
+		struct IslandWorld
+		{
+			dWorldID world;
+			dJointGroupID contacts;
+		};
+
+		struct PendingContact
+		{
+			int a,b;						// object ids, -1 for static geometry
+			dContact contact;
+		};
+
+		std::vector<IslandWorld> worlds;
+		dSpaceID space;
+
+		platform::WorkerPool workerPool;
+		std::vector<PendingContact> pendingContacts;
+		std::vector<int> islandParent;
+		std::vector<int> islandWorldCount;
+		float stepDeltaTime;
+		uint32_t stepFrame;
+		bool stepInOrder;							// quickstep with an ode that shuffles from its global seed
+
+		std::vector<int> awakeObjects;
+		std::vector<int> updatedObjects;
+		std::vector<char> islandMoving;
+		std::vector<int> islandHead;
+		int collidePass;
+		int numWokenInCollide;
+
+		struct ObjectData
+		{
+			dBodyID body;
+			dGeomID geom;
+			float scale;
+			float timeAtRest;
+			int world;
+			int awakeIndex;					// index in the awake list, -1 while sleeping
+			int nextInIsland;				// circular list of a sleeping island
+			int sleepingX, sleepingY;		// cell in the sleeping grid
+			int sleepingSlot;				// index in the sleeping grid bucket, -1 when not in it
+			bool collideAwake;				// awake at the start of collision this frame
+
+			ObjectData()
+			{
+				body = 0;
+				geom = 0;
+				scale = 1.0f;
+				timeAtRest = 0.0f;
+				world = 0;
+				awakeIndex = -1;
+				nextInIsland = -1;
+				sleepingX = 0;
+				sleepingY = 0;
+				sleepingSlot = -1;
+				collideAwake = false;
+			}
+
+			bool exists() const
+			{
+				return body != 0 && geom != 0;
+			}
+		};
+
+		SimulationConfig config;
+		std::vector<dGeomID> planes;
+		std::vector<ObjectData> objects;
+		std::vector<InteractionPair> interactionPairs;
+		SimulationStats stats;
+
+		float maxScale;
+		std::vector<GridObject> gridObjects;
+		std::vector<int> gridBucketStart;
+		std::vector<int> gridBucketFill;
+		std::vector<int> gridSorted;
+		std::vector< std::vector<int> > sleepingGrid;
+		std::vector<int> wokenInGridCollide;
+		float sleepingCellSize;
+		bool gridColliding;
+
+	protected:
+
+		enum { MaxContacts = 8 };
+	    dContact contact[MaxContacts];			
+
+		static void NearCallback( void * data, dGeomID o1, dGeomID o2 )
+		{
+			OdeSimulation * simulation = (OdeSimulation*) data;
+
+			assert( simulation );
+
+		    dBodyID b1 = dGeomGetBody( o1 );
+		    dBodyID b2 = dGeomGetBody( o2 );
+
+			// skip sleeping vs. sleeping and sleeping vs. static, see Update for the two passes
+
+			const ObjectData * object1 = b1 ? &simulation->objects[ reinterpret_cast<uint64_t>( dBodyGetData( b1 ) ) ] : NULL;
+			const ObjectData * object2 = b2 ? &simulation->objects[ reinterpret_cast<uint64_t>( dBodyGetData( b2 ) ) ] : NULL;
+
+			const bool collideAwake = ( object1 && object1->collideAwake ) || ( object2 && object2->collideAwake );
+
+			if ( simulation->collidePass == 1 )
+			{
+				if ( !collideAwake )
+					return;
+			}
+			else
+			{
+				const bool awake = ( object1 && object1->awakeIndex >= 0 ) || ( object2 && object2->awakeIndex >= 0 );
+				if ( collideAwake || !awake )
+					return;
+			}
+
+			/*
+				The cube collider is dispatched here rather than through dSetColliderOverride,
+				because collider overrides are global to ode and each simulation chooses its own.
+			*/
+
+			int numc = -1;
+			if ( simulation->config.CubeCollider )
+				numc = CollideCubes( o1, o2, MaxContacts, &simulation->contact[0].geom, sizeof(dContact) );
+			if ( numc < 0 )
+				numc = dCollide( o1, o2, MaxContacts, &simulation->contact[0].geom, sizeof(dContact) );
+
+			simulation->stats.pairs++;
+
+			if ( numc > 0 )
+			{
+				simulation->stats.collidingPairs++;
+				simulation->stats.contacts += numc;
+
+				// contact with an awake body wakes a sleeping island
+
+				if ( object1 && object1->awakeIndex < 0 )
+					simulation->WakeObject( object1 - &simulation->objects[0] );
+				if ( object2 && object2->awakeIndex < 0 )
+					simulation->WakeObject( object2 - &simulation->objects[0] );
+
+				if ( simulation->worlds.size() == 1 )
+				{
+			        for ( int i = 0; i < numc; i++ )
+			        {
+			            dJointID c = dJointCreateContact( simulation->worlds[0].world, simulation->worlds[0].contacts, simulation->contact+i );
+			            dJointAttach( c, b1, b2 );
+			        }
+				}
+				else
+				{
+					// island worlds: joints are created once islands are merged into a single world
+
+					const int a = b1 ? (int) reinterpret_cast<uint64_t>( dBodyGetData( b1 ) ) : -1;
+					const int b = b2 ? (int) reinterpret_cast<uint64_t>( dBodyGetData( b2 ) ) : -1;
+					for ( int i = 0; i < numc; i++ )
+					{
+						PendingContact pending;
+						pending.a = a;
+						pending.b = b;
+						pending.contact = simulation->contact[i];
+						simulation->pendingContacts.push_back( pending );
+					}
+				}
+
+				if ( b1 && b2 )
+				{
+					int64_t objectId1 = reinterpret_cast<uint64_t>( dBodyGetData( b1 ) );
+					int64_t objectId2 = reinterpret_cast<uint64_t>( dBodyGetData( b2 ) );
+
+					assert( objectId1 >= 0 );
+					assert( objectId2 >= 0 );
+					assert( objectId1 < (int) simulation->objects.size() );
+					assert( objectId2 < (int) simulation->objects.size() );
+					assert( objectId1 != objectId2 );
+
+					/* 
+						The simulation may generate multiple contacts
+						between the same object, so here we filter out
+						unique contacts only. We consider a->b the same
+						as b->a so we only want one of these pairs.
+					*/
+
+					bool unique = true;
+					for ( int i = 0; i < (int) simulation->interactionPairs.size(); ++i )
+					{
+						if ( simulation->interactionPairs[i].a == objectId1 &&
+							 simulation->interactionPairs[i].b == objectId2 ||
+							 simulation->interactionPairs[i].a == objectId2 &&
+						     simulation->interactionPairs[i].b == objectId1 )
+						{
+							unique = false;
+							break;
+						}
+					}
+
+					if ( unique )
+					{
+						int size = simulation->interactionPairs.size();
+						simulation->interactionPairs.resize( size + 1 );
+						simulation->interactionPairs[size].a = objectId1;
+						simulation->interactionPairs[size].b = objectId2;
+					}
+				}
+			}
+		}
+	};
+}
+
+#endif
\ No newline at end of file
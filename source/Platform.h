@@ -8,6 +8,7 @@
 #define PLATFORM_H
 
 #include "Config.h"
+#include "Thread.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -37,82 +38,6 @@
 
 namespace platform
 {
-#if PLATFORM == PLATFORM_MAC
-	
-	// worker thread 
-
-	class WorkerThread
-	{
-	public:
-	
-		WorkerThread()
-		{
-			#ifdef MULTITHREADED
-			thread = 0;
-			#endif
-		}
-	
-		virtual ~WorkerThread()
-		{
-			#ifdef MULTITHREADED
-			thread = 0;
-			#endif
-		}
-	
-		bool Start()
-		{
-			#ifdef MULTITHREADED
-
-				pthread_attr_t attr;	
-				pthread_attr_init( &attr );
-				pthread_attr_setstacksize( &attr, 32 * 1024 * 1024 );
-				if ( pthread_create( &thread, &attr, StaticRun, (void*)this ) != 0 )
-				{
-					printf( "error: pthread_create failed\n" );
-					return false;
-				}
-		
-			#else
-		
-				Run();
-			
-			#endif
-		
-			return true;
-		}
-	
-		bool Join()
-		{
-			#ifdef MULTITHREADED
-			if ( pthread_join( thread, NULL ) != 0 )
-			{
-				printf( "error: pthread_join failed\n" );
-				return false;
-			}
-			#endif
-			return true;
-		}
-	
-	protected:
-	
-		static void* StaticRun( void * data )
-		{
-			WorkerThread * self = (WorkerThread*) data;
-			self->Run();
-			return NULL;
-		}
-	
-		virtual void Run() = 0;			// note: override this to implement your thread task
-	
-	private:
-
-		#ifdef MULTITHREADED	
-		pthread_t thread;
-		#endif
-	};
-
-#endif
-	
 	// platform independent wait for n seconds
 
 	#if PLATFORM == PLATFORM_WINDOWS
@@ -0,0 +1,564 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "Config.h"
+#include "Clock.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+
+#if PLATFORM != PLATFORM_MAC && PLATFORM != PLATFORM_WINDOWS
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace profile
+{
+	using platform::GetTime;
+
+	/*
+		Profile zones.
+		The first six match engine::FramePhase, so game instance phases map
+		straight across. Add new zones before ZONE_Count and name them below.
+	*/
+
+	enum Zone
+	{
+		ZONE_Input,
+		ZONE_Activation,
+		ZONE_Priority,
+		ZONE_Simulation,
+		ZONE_Authority,
+		ZONE_View,
+		ZONE_Frame,
+		ZONE_Collide,
+		ZONE_Step,
+		ZONE_Rest,
+		ZONE_Sweep,
+		ZONE_Count
+	};
+
+	inline const char * GetZoneName( Zone zone )
+	{
+		switch ( zone )
+		{
+			case ZONE_Input:			return "input";
+			case ZONE_Activation:		return "activation";
+			case ZONE_Priority:			return "priority";
+			case ZONE_Simulation:		return "simulation";
+			case ZONE_Authority:		return "authority";
+			case ZONE_View:				return "view";
+			case ZONE_Frame:			return "frame";
+			case ZONE_Collide:			return "collide";
+			case ZONE_Step:				return "step";
+			case ZONE_Rest:				return "rest";
+			case ZONE_Sweep:			return "sweep";
+			default:					break;
+		}
+		return "???";
+	}
+
+	/*
+		Log scale histogram of durations.
+		Eight buckets per power of two microseconds, so percentiles are within
+		about 6% of the true value without storing any samples.
+	*/
+
+	class Histogram
+	{
+	public:
+
+		enum { SubBuckets = 8, Octaves = 24, NumBuckets = 1 + SubBuckets * Octaves };
+
+		Histogram()
+		{
+			Clear();
+		}
+
+		void Clear()
+		{
+			for ( int i = 0; i < NumBuckets; ++i )
+				buckets[i] = 0;
+			count = 0;
+			total = 0.0;
+			max = 0.0f;
+		}
+
+		void Add( float seconds )
+		{
+			buckets[ GetBucket( seconds ) ]++;
+			count++;
+			total += seconds;
+			if ( seconds > max )
+				max = seconds;
+		}
+
+		int GetCount() const
+		{
+			return count;
+		}
+
+		double GetTotal() const
+		{
+			return total;
+		}
+
+		float GetAverage() const
+		{
+			return count > 0 ? (float) ( total / count ) : 0.0f;
+		}
+
+		float GetMax() const
+		{
+			return max;
+		}
+
+		// eg. 0.5 for the median, 0.99 for p99
+
+		float GetPercentile( float fraction ) const
+		{
+			assert( fraction >= 0.0f );
+			assert( fraction <= 1.0f );
+			if ( count == 0 )
+				return 0.0f;
+			const int target = (int) ceil( fraction * count );
+			int cumulative = 0;
+			for ( int i = 0; i < NumBuckets; ++i )
+			{
+				cumulative += buckets[i];
+				if ( cumulative >= target && buckets[i] > 0 )
+				{
+					const float value = GetBucketMiddle( i );
+					return value < max ? value : max;
+				}
+			}
+			return max;
+		}
+
+	private:
+
+		static int GetBucket( float seconds )
+		{
+			const float microseconds = seconds * 1000000.0f;
+			if ( microseconds < 1.0f )
+				return 0;
+			int exponent;
+			const float mantissa = frexpf( microseconds, &exponent );		// [0.5,1) * 2^exponent
+			const int sub = (int) ( ( mantissa - 0.5f ) * 2.0f * SubBuckets );
+			const int bucket = 1 + ( exponent - 1 ) * SubBuckets + sub;
+			return bucket < NumBuckets ? bucket : NumBuckets - 1;
+		}
+
+		static float GetBucketMiddle( int bucket )
+		{
+			if ( bucket == 0 )
+				return 0.5f / 1000000.0f;
+			const int octave = ( bucket - 1 ) / SubBuckets;
+			const int sub = ( bucket - 1 ) % SubBuckets;
+			const float low = ldexpf( 1.0f + sub / (float) SubBuckets, octave );
+			const float high = ldexpf( 1.0f + ( sub + 1 ) / (float) SubBuckets, octave );
+			return ( low + high ) * 0.5f / 1000000.0f;
+		}
+
+		int buckets[NumBuckets];
+		int count;
+		double total;
+		float max;
+	};
+
+	/*
+		Hardware counters.
+		Cycles, instructions, last level cache misses and branch misses for the
+		calling thread, opened as one perf_event_open group so all four count
+		over exactly the same interval. Linux only; Open fails elsewhere, or
+		when perf_event_paranoid does not allow user space counting, and the
+		profiler carries on with wall time alone.
+	*/
+
+	struct CounterValues
+	{
+		uint64_t cycles;
+		uint64_t instructions;
+		uint64_t cacheMisses;
+		uint64_t branchMisses;
+
+		CounterValues()
+		{
+			cycles = 0;
+			instructions = 0;
+			cacheMisses = 0;
+			branchMisses = 0;
+		}
+
+		void Add( const CounterValues & begin, const CounterValues & end )
+		{
+			cycles += end.cycles - begin.cycles;
+			instructions += end.instructions - begin.instructions;
+			cacheMisses += end.cacheMisses - begin.cacheMisses;
+			branchMisses += end.branchMisses - begin.branchMisses;
+		}
+	};
+
+	class Counters
+	{
+	public:
+
+		enum { NumCounters = 4 };
+
+		Counters()
+		{
+			for ( int i = 0; i < NumCounters; ++i )
+				fd[i] = -1;
+		}
+
+		~Counters()
+		{
+			Close();
+		}
+
+		bool Open()
+		{
+			if ( IsOpen() )
+				return true;
+			#if PLATFORM == PLATFORM_UNIX
+			const uint32_t type[] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+			const uint64_t config[] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+			for ( int i = 0; i < NumCounters; ++i )
+			{
+				perf_event_attr attr;
+				memset( &attr, 0, sizeof( attr ) );
+				attr.size = sizeof( attr );
+				attr.type = type[i];
+				attr.config = config[i];
+				attr.read_format = PERF_FORMAT_GROUP;
+				attr.disabled = i == 0;				// the group leader starts and stops the lot
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				fd[i] = syscall( __NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fd[0], 0 );
+				if ( fd[i] < 0 )
+				{
+					Close();
+					return false;
+				}
+			}
+			ioctl( fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+			ioctl( fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+			return true;
+			#else
+			return false;
+			#endif
+		}
+
+		void Close()
+		{
+			#if PLATFORM == PLATFORM_UNIX
+			for ( int i = NumCounters - 1; i >= 0; --i )
+			{
+				if ( fd[i] >= 0 )
+					close( fd[i] );
+				fd[i] = -1;
+			}
+			#endif
+		}
+
+		bool IsOpen() const
+		{
+			return fd[0] >= 0;
+		}
+
+		// one read for the whole group: count, then a value per counter
+
+		bool Read( CounterValues & values ) const
+		{
+			#if PLATFORM == PLATFORM_UNIX
+			if ( !IsOpen() )
+				return false;
+			uint64_t data[1+NumCounters];
+			if ( read( fd[0], data, sizeof( data ) ) != (ssize_t) sizeof( data ) || data[0] != NumCounters )
+				return false;
+			values.cycles = data[1];
+			values.instructions = data[2];
+			values.cacheMisses = data[3];
+			values.branchMisses = data[4];
+			return true;
+			#else
+			return false;
+			#endif
+		}
+
+	private:
+
+		Counters( const Counters & other );
+		Counters & operator = ( const Counters & other );
+
+		int fd[NumCounters];
+	};
+
+	struct TraceEvent
+	{
+		double begin;
+		float duration;
+		int zone;
+	};
+
+	/*
+		Profiler.
+		Collects timings for one thread of work, eg. one game instance and its
+		simulation. Every sample goes into the histogram for its zone and into
+		a ring of recent events, which can be written out as a chrome trace
+		(load it in chrome://tracing) when asked for. With counters enabled
+		each zone also totals the hardware counters over its samples, so IPC
+		and misses can be compared instead of noisy wall time.
+	*/
+
+	class Profiler
+	{
+	public:
+
+		Profiler( int maxEvents = 32768 )
+		{
+			assert( maxEvents > 0 );
+			this->maxEvents = maxEvents;
+			nextEvent = 0;
+			threadId = 0;
+			for ( int i = 0; i < ZONE_Count; ++i )
+				counterSamples[i] = 0;
+		}
+
+		void SetThreadId( int threadId )
+		{
+			this->threadId = threadId;
+		}
+
+		int GetThreadId() const
+		{
+			return threadId;
+		}
+
+		// counters are per thread: enable them on the thread that records
+
+		bool EnableCounters()
+		{
+			return counters.Open();
+		}
+
+		bool IsCounting() const
+		{
+			return counters.IsOpen();
+		}
+
+		void ReadCounters( CounterValues & values ) const
+		{
+			counters.Read( values );
+		}
+
+		void Record( Zone zone, double begin, double end )
+		{
+			assert( zone >= 0 );
+			assert( zone < ZONE_Count );
+			const float duration = (float) ( end - begin );
+			histogram[zone].Add( duration );
+			if ( events.empty() )
+				events.reserve( maxEvents );
+			TraceEvent event;
+			event.begin = begin;
+			event.duration = duration;
+			event.zone = zone;
+			if ( (int) events.size() < maxEvents )
+				events.push_back( event );
+			else
+				events[nextEvent] = event;
+			nextEvent = ( nextEvent + 1 ) % maxEvents;
+		}
+
+		void Record( Zone zone, double begin, double end, const CounterValues & beginCounters, const CounterValues & endCounters )
+		{
+			Record( zone, begin, end );
+			if ( counters.IsOpen() )
+			{
+				counterTotals[zone].Add( beginCounters, endCounters );
+				counterSamples[zone]++;
+			}
+		}
+
+		const Histogram & GetHistogram( Zone zone ) const
+		{
+			assert( zone >= 0 );
+			assert( zone < ZONE_Count );
+			return histogram[zone];
+		}
+
+		// counter totals over every sample of a zone recorded while counting
+
+		const CounterValues & GetCounters( Zone zone ) const
+		{
+			assert( zone >= 0 );
+			assert( zone < ZONE_Count );
+			return counterTotals[zone];
+		}
+
+		int GetNumCounterSamples( Zone zone ) const
+		{
+			assert( zone >= 0 );
+			assert( zone < ZONE_Count );
+			return counterSamples[zone];
+		}
+
+		int GetNumEvents() const
+		{
+			return events.size();
+		}
+
+		void Clear()
+		{
+			for ( int i = 0; i < ZONE_Count; ++i )
+			{
+				histogram[i].Clear();
+				counterTotals[i] = CounterValues();
+				counterSamples[i] = 0;
+			}
+			events.clear();
+			nextEvent = 0;
+		}
+
+		// one line per zone that has samples, times in milliseconds. counters are averages per sample
+
+		void Print() const
+		{
+			printf( "%-12s %8s %8s %8s %8s %8s", "zone", "count", "avg", "p50", "p99", "max" );
+			if ( counters.IsOpen() )
+				printf( " %12s %12s %6s %10s %10s", "cycles", "instructions", "ipc", "llc miss", "br miss" );
+			printf( "\n" );
+			for ( int i = 0; i < ZONE_Count; ++i )
+			{
+				const Histogram & h = histogram[i];
+				if ( h.GetCount() == 0 )
+					continue;
+				printf( "%-12s %8d %8.3f %8.3f %8.3f %8.3f", GetZoneName( (Zone) i ), h.GetCount(),
+					h.GetAverage() * 1000.0f, h.GetPercentile( 0.5f ) * 1000.0f, h.GetPercentile( 0.99f ) * 1000.0f, h.GetMax() * 1000.0f );
+				const CounterValues & c = counterTotals[i];
+				const int n = counterSamples[i];
+				if ( n > 0 )
+					printf( " %12.0f %12.0f %6.2f %10.1f %10.1f", (double) c.cycles / n, (double) c.instructions / n,
+						c.cycles > 0 ? (double) c.instructions / c.cycles : 0.0, (double) c.cacheMisses / n, (double) c.branchMisses / n );
+				printf( "\n" );
+			}
+		}
+
+		bool WriteChromeTrace( const char * filename ) const
+		{
+			const Profiler * profiler = this;
+			return WriteChromeTrace( filename, &profiler, 1 );
+		}
+
+		// writes the recent events of several profilers into one trace, one row per thread id
+
+		static bool WriteChromeTrace( const char * filename, const Profiler * const * profilers, int count )
+		{
+			FILE * file = fopen( filename, "w" );
+			if ( !file )
+				return false;
+			double base = 0.0;
+			bool first = true;
+			for ( int i = 0; i < count; ++i )
+			{
+				for ( int j = 0; j < (int) profilers[i]->events.size(); ++j )
+				{
+					if ( first || profilers[i]->events[j].begin < base )
+						base = profilers[i]->events[j].begin;
+					first = false;
+				}
+			}
+			fprintf( file, "{\"traceEvents\":[\n" );
+			first = true;
+			for ( int i = 0; i < count; ++i )
+			{
+				const Profiler & profiler = *profilers[i];
+				for ( int j = 0; j < (int) profiler.events.size(); ++j )
+				{
+					const TraceEvent & event = profiler.events[j];
+					fprintf( file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+						first ? "" : ",\n", GetZoneName( (Zone) event.zone ), profiler.threadId,
+						( event.begin - base ) * 1000000.0, event.duration * 1000000.0 );
+					first = false;
+				}
+			}
+			fprintf( file, "\n]}\n" );
+			const bool result = ferror( file ) == 0;
+			fclose( file );
+			return result;
+		}
+
+	private:
+
+		Profiler( const Profiler & other );
+		Profiler & operator = ( const Profiler & other );
+
+		Histogram histogram[ZONE_Count];
+		Counters counters;
+		CounterValues counterTotals[ZONE_Count];
+		int counterSamples[ZONE_Count];
+		std::vector<TraceEvent> events;
+		int maxEvents;
+		int nextEvent;
+		int threadId;
+	};
+
+	// times the enclosing scope. a null profiler records nothing
+
+	class ScopedTimer
+	{
+	public:
+
+		ScopedTimer( Profiler * profiler, Zone zone )
+		{
+			this->profiler = profiler;
+			this->zone = zone;
+			if ( profiler )
+				profiler->ReadCounters( beginCounters );
+			begin = profiler ? GetTime() : 0.0;
+		}
+
+		~ScopedTimer()
+		{
+			if ( profiler )
+			{
+				const double end = GetTime();
+				CounterValues endCounters;
+				profiler->ReadCounters( endCounters );
+				profiler->Record( zone, begin, end, beginCounters, endCounters );
+			}
+		}
+
+	private:
+
+		Profiler * profiler;
+		Zone zone;
+		double begin;
+		CounterValues beginCounters;
+	};
+}
+
+// scoped timers compile to nothing unless PROFILE is defined in Config.h
+
+#define PROFILE_JOIN2( a, b ) a##b
+#define PROFILE_JOIN( a, b ) PROFILE_JOIN2( a, b )
+
+#ifdef PROFILE
+#define PROFILE_SCOPE( profiler, zone ) profile::ScopedTimer PROFILE_JOIN( scopedTimer, __LINE__ )( profiler, zone )
+#else
+#define PROFILE_SCOPE( profiler, zone )
+#endif
+
+#endif
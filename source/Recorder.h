@@ -0,0 +1,356 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "Config.h"
+#include "Game.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace game
+{
+	/*
+		Session recorder.
+		Captures everything that drives a set of game instances from outside:
+		delta time, sync mode, player input per instance and every packet
+		delivered between instances. Replaying the log into freshly created
+		instances reproduces the session, so frame spikes can be profiled
+		over and over without a display or players.
+
+		Log layout (native byte order):
+
+			header:		"CUBE" | version | instance count | players per instance
+			frame:		delta time | sync mode | flags | input mask | changed inputs
+						| packet count | { from | to | bytes | data }...
+
+		Inputs are only written for the instance/player slots whose input
+		changed since the previous frame, flagged in the input mask.
+	*/
+
+	const uint32_t RecorderMagic = 0x45425543;		// "CUBE"
+	const uint32_t RecorderVersion = 1;
+
+	enum RecorderFlags
+	{
+		RECORDER_Send = 1				// the senders ran their pre-send pass this frame
+	};
+
+	class Recorder
+	{
+	public:
+
+		enum { MaxInstances = 4 };
+
+		Recorder()
+		{
+			file = NULL;
+			numInstances = 0;
+			frames = 0;
+			bytes = 0;
+		}
+
+		~Recorder()
+		{
+			Close();
+		}
+
+		bool Open( const char * filename, int numInstances )
+		{
+			assert( numInstances > 0 );
+			assert( numInstances <= MaxInstances );
+			Close();
+			file = fopen( filename, "wb" );
+			if ( !file )
+				return false;
+			this->numInstances = numInstances;
+			frames = 0;
+			bytes = 0;
+			for ( int i = 0; i < MaxInstances * MaxPlayers; ++i )
+				lastInput[i] = Input();
+			buffer.clear();
+			Write<uint32_t>( RecorderMagic );
+			Write<uint32_t>( RecorderVersion );
+			Write<uint32_t>( numInstances );
+			Write<uint32_t>( MaxPlayers );
+			Flush();
+			return true;
+		}
+
+		void Close()
+		{
+			if ( file )
+			{
+				fclose( file );
+				file = NULL;
+			}
+		}
+
+		bool IsOpen() const
+		{
+			return file != NULL;
+		}
+
+		void BeginFrame( float deltaTime, int syncMode, uint8_t flags )
+		{
+			assert( file );
+			buffer.clear();
+			inputMask = 0;
+			packetCount = 0;
+			packets.clear();
+			for ( int i = 0; i < MaxInstances * MaxPlayers; ++i )
+				frameInput[i] = lastInput[i];
+			Write<float>( deltaTime );
+			Write<uint8_t>( syncMode );
+			Write<uint8_t>( flags );
+		}
+
+		void RecordInput( int instance, int playerId, const Input & input )
+		{
+			assert( instance >= 0 );
+			assert( instance < numInstances );
+			assert( playerId >= 0 );
+			assert( playerId < MaxPlayers );
+			const int slot = instance * MaxPlayers + playerId;
+			frameInput[slot] = input;
+			if ( frameInput[slot] != lastInput[slot] )
+				inputMask |= 1 << slot;
+			else
+				inputMask &= ~( 1 << slot );
+		}
+
+		void RecordPacket( int from, int to, const unsigned char * data, int size )
+		{
+			assert( size >= 0 );
+			const int offset = packets.size();
+			packets.resize( offset + 2 + sizeof( uint32_t ) + size );
+			packets[offset] = (uint8_t) from;
+			packets[offset+1] = (uint8_t) to;
+			const uint32_t packetBytes = size;
+			memcpy( &packets[offset+2], &packetBytes, sizeof( uint32_t ) );
+			if ( size > 0 )
+				memcpy( &packets[offset+2+sizeof(uint32_t)], data, size );
+			packetCount++;
+		}
+
+		void EndFrame()
+		{
+			assert( file );
+			Write<uint16_t>( inputMask );
+			for ( int i = 0; i < MaxInstances * MaxPlayers; ++i )
+			{
+				if ( ( inputMask & ( 1 << i ) ) == 0 )
+					continue;
+				Write<float>( frameInput[i].left );
+				Write<float>( frameInput[i].right );
+				Write<float>( frameInput[i].up );
+				Write<float>( frameInput[i].down );
+				Write<float>( frameInput[i].push );
+				Write<float>( frameInput[i].pull );
+				lastInput[i] = frameInput[i];
+			}
+			Write<uint32_t>( packetCount );
+			buffer.insert( buffer.end(), packets.begin(), packets.end() );
+			Flush();
+			frames++;
+		}
+
+		int GetFrames() const
+		{
+			return frames;
+		}
+
+		uint64_t GetBytes() const
+		{
+			return bytes;
+		}
+
+	private:
+
+		template <typename T> void Write( T value )
+		{
+			const int offset = buffer.size();
+			buffer.resize( offset + sizeof( T ) );
+			memcpy( &buffer[offset], &value, sizeof( T ) );
+		}
+
+		void Flush()
+		{
+			if ( !buffer.empty() )
+				fwrite( &buffer[0], 1, buffer.size(), file );
+			bytes += buffer.size();
+			buffer.clear();
+		}
+
+		FILE * file;
+		int numInstances;
+		int frames;
+		uint64_t bytes;
+		uint16_t inputMask;
+		uint32_t packetCount;
+		Input lastInput[MaxInstances*MaxPlayers];
+		Input frameInput[MaxInstances*MaxPlayers];
+		std::vector<uint8_t> buffer;
+		std::vector<uint8_t> packets;
+	};
+
+	/*
+		Session replay.
+		Reads a log written by the recorder back one frame at a time.
+	*/
+
+	struct ReplayPacket
+	{
+		int from;
+		int to;
+		int bytes;
+		const unsigned char * data;				// points into the frame, valid until the next read
+	};
+
+	struct ReplayFrame
+	{
+		float deltaTime;
+		int syncMode;
+		uint8_t flags;
+		Input input[Recorder::MaxInstances*MaxPlayers];		// indexed by instance * MaxPlayers + player
+		std::vector<ReplayPacket> packets;
+		std::vector<unsigned char> data;
+	};
+
+	class Replay
+	{
+	public:
+
+		Replay()
+		{
+			file = NULL;
+			numInstances = 0;
+			maxPacketBytes = 0;
+			corrupt = false;
+		}
+
+		~Replay()
+		{
+			Close();
+		}
+
+		// packets larger than the receiver can hold mean the log is corrupt
+
+		bool Open( const char * filename, int maxPacketBytes )
+		{
+			assert( maxPacketBytes > 0 );
+			Close();
+			file = fopen( filename, "rb" );
+			if ( !file )
+				return false;
+			uint32_t magic, version, instances, players;
+			if ( !Read( magic ) || !Read( version ) || !Read( instances ) || !Read( players ) ||
+				 magic != RecorderMagic || version != RecorderVersion ||
+				 instances == 0 || instances > Recorder::MaxInstances || players != MaxPlayers )
+			{
+				Close();
+				return false;
+			}
+			numInstances = instances;
+			this->maxPacketBytes = maxPacketBytes;
+			corrupt = false;
+			for ( int i = 0; i < Recorder::MaxInstances * MaxPlayers; ++i )
+				input[i] = Input();
+			return true;
+		}
+
+		void Close()
+		{
+			if ( file )
+			{
+				fclose( file );
+				file = NULL;
+			}
+		}
+
+		int GetNumInstances() const
+		{
+			return numInstances;
+		}
+
+		// returns false at the end of the log, or if the log is truncated or corrupt
+
+		bool ReadFrame( ReplayFrame & frame )
+		{
+			assert( file );
+			uint8_t syncMode;
+			uint16_t inputMask;
+			uint32_t packetCount;
+			if ( !Read( frame.deltaTime ) )
+				return false;
+			corrupt = true;						// until the whole frame has been read
+			if ( !Read( syncMode ) || !Read( frame.flags ) || !Read( inputMask ) )
+				return false;
+			frame.syncMode = syncMode;
+			for ( int i = 0; i < Recorder::MaxInstances * MaxPlayers; ++i )
+			{
+				if ( inputMask & ( 1 << i ) )
+				{
+					if ( !Read( input[i].left ) || !Read( input[i].right ) || !Read( input[i].up ) ||
+						 !Read( input[i].down ) || !Read( input[i].push ) || !Read( input[i].pull ) )
+						return false;
+				}
+				frame.input[i] = input[i];
+			}
+			if ( !Read( packetCount ) )
+				return false;
+			frame.packets.resize( packetCount );
+			frame.data.clear();
+			std::vector<int> offsets( packetCount );
+			for ( int i = 0; i < (int) packetCount; ++i )
+			{
+				uint8_t from, to;
+				uint32_t bytes;
+				if ( !Read( from ) || !Read( to ) || !Read( bytes ) )
+					return false;
+				if ( from >= numInstances || to >= numInstances || bytes > (uint32_t) maxPacketBytes )
+					return false;
+				const int offset = frame.data.size();
+				frame.data.resize( offset + bytes );
+				if ( bytes > 0 && fread( &frame.data[offset], 1, bytes, file ) != bytes )
+					return false;
+				frame.packets[i].from = from;
+				frame.packets[i].to = to;
+				frame.packets[i].bytes = bytes;
+				offsets[i] = offset;
+			}
+			for ( int i = 0; i < (int) packetCount; ++i )
+				frame.packets[i].data = frame.packets[i].bytes > 0 ? &frame.data[ offsets[i] ] : NULL;
+			corrupt = false;
+			return true;
+		}
+
+		// the last read stopped partway through a frame rather than at the end of the log
+
+		bool IsCorrupt() const
+		{
+			return corrupt;
+		}
+
+	private:
+
+		template <typename T> bool Read( T & value )
+		{
+			return fread( &value, sizeof( T ), 1, file ) == 1;
+		}
+
+		FILE * file;
+		int numInstances;
+		int maxPacketBytes;
+		bool corrupt;
+		Input input[Recorder::MaxInstances*MaxPlayers];
+	};
+}
+
+#endif
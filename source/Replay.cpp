@@ -0,0 +1,161 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "Config.h"
+#include "Platform.h"
+#include "Authority.h"
+#include "Recorder.h"
+
+using namespace game;
+
+/*
+	Headless replay.
+	Feeds a session recorded by the authority demo (run it with CUBES_RECORD
+	set) back into freshly created game instances as fast as possible, with
+	no display and no frame pacing. Every run does identical work, so frame
+	spikes can be profiled repeatedly.
+
+	Built with PROFILE, each run prints per-phase p50/p99/max times and, if
+	CUBES_TRACE names a file, writes the recent frames there as a chrome trace.
+	Set CUBES_COUNTERS to add cycles, instructions, ipc, cache and branch
+	misses per phase (linux only).
+*/
+
+int main( int argc, char * argv[] )
+{
+	if ( argc < 2 )
+	{
+		printf( "usage: Replay <session> [repeat]\n" );
+		return 1;
+	}
+
+	const char * filename = argv[1];
+	const int repeat = argc >= 3 ? atoi( argv[2] ) : 1;
+
+	for ( int run = 0; run < repeat; ++run )
+	{
+		Replay replay;
+		if ( !replay.Open( filename, sizeof( AuthorityPacket ) ) )
+		{
+			printf( "failed to open session \"%s\"\n", filename );
+			return 1;
+		}
+
+		const int numInstances = replay.GetNumInstances();
+
+		platform::Timer timer;
+
+		AuthorityInstance * instances[Recorder::MaxInstances];
+		CreateAuthorityInstances( instances, numInstances );
+
+		#ifdef PROFILE
+		if ( getenv( "CUBES_COUNTERS" ) )
+		{
+			for ( int i = 0; i < numInstances; ++i )
+			{
+				if ( !instances[i]->GetProfiler().EnableCounters() )
+				{
+					printf( "hardware counters are not available\n" );
+					break;
+				}
+			}
+		}
+		#endif
+
+		const double startupTime = timer.delta();
+
+		ReplayFrame frame;
+		AuthorityPacket packet;
+		int frames = 0;
+		int packets = 0;
+		int spikes = 0;
+		double maxFrameTime = 0.0;
+		bool corrupt = false;
+
+		while ( replay.ReadFrame( frame ) )
+		{
+			const SyncMode syncMode = (SyncMode) frame.syncMode;
+
+			for ( int i = 0; i < numInstances; ++i )
+				UpdateAuthorityFlags( instances[i], syncMode );
+
+			if ( frame.flags & RECORDER_Send )
+			{
+				for ( int i = 0; i < numInstances; ++i )
+					PrepareAuthoritySend( instances[i], i, syncMode );
+			}
+
+			for ( int i = 0; i < numInstances; ++i )
+				for ( int j = 0; j < MaxPlayers; ++j )
+					instances[i]->SetPlayerInput( j, frame.input[i*MaxPlayers+j] );
+
+			for ( int i = 0; i < (int) frame.packets.size(); ++i )
+			{
+				const ReplayPacket & replayPacket = frame.packets[i];
+				if ( replayPacket.bytes < 0 || replayPacket.bytes > (int) sizeof( AuthorityPacket ) )
+				{
+					corrupt = true;
+					break;
+				}
+				memcpy( &packet, replayPacket.data, replayPacket.bytes );
+				ApplyAuthorityPacket( instances[replayPacket.to], replayPacket.from, replayPacket.to, packet, syncMode );
+				packets++;
+			}
+
+			if ( corrupt )
+				break;
+
+			const double frameStart = timer.time();
+
+			for ( int i = 0; i < numInstances; ++i )
+				instances[i]->Update( frame.deltaTime );
+
+			const double frameTime = timer.time() - frameStart;
+			if ( frameTime > maxFrameTime )
+				maxFrameTime = frameTime;
+			if ( frameTime > 1.0 / 60.0 )
+				spikes++;
+
+			frames++;
+		}
+
+		const double replayTime = timer.delta();
+
+		if ( corrupt || replay.IsCorrupt() )
+			printf( "bad frame %d in session \"%s\", replay stopped there\n", frames, filename );
+
+		printf( "replayed %d frames, %d packets in %.2f seconds (startup %.2f seconds)\n", frames, packets, replayTime, startupTime );
+		if ( frames > 0 && replayTime > 0.0 )
+			printf( "%.1f simulated frames per second, %.2fms average, %.2fms worst, %d frames over 16ms\n", frames / replayTime, replayTime / frames * 1000.0, maxFrameTime * 1000.0, spikes );
+
+		#ifdef PROFILE
+
+		const profile::Profiler * profilers[Recorder::MaxInstances];
+		for ( int i = 0; i < numInstances; ++i )
+		{
+			printf( "instance %d:\n", i );
+			instances[i]->GetProfiler().SetThreadId( i );
+			instances[i]->GetProfiler().Print();
+			profilers[i] = &instances[i]->GetProfiler();
+		}
+
+		const char * traceFilename = getenv( "CUBES_TRACE" );
+		if ( traceFilename && !profile::Profiler::WriteChromeTrace( traceFilename, profilers, numInstances ) )
+			printf( "failed to write trace \"%s\"\n", traceFilename );
+
+		#endif
+
+		for ( int i = 0; i < numInstances; ++i )
+			delete instances[i];
+	}
+
+	return 0;
+}
@@ -0,0 +1,333 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+
+#include "Config.h"
+#include "Platform.h"
+#include "Network.h"
+#include "NetworkThread.h"
+#include "Authority.h"
+
+#if PLATFORM == PLATFORM_MAC
+#include <sys/resource.h>
+#endif
+
+using namespace game;
+
+/*
+	Headless dedicated server.
+	Runs the authority world with no display or renderer at a fixed tick
+	rate. A client connects over the network, sends its input each tick and
+	receives authority packets for the objects around it. Once a second the
+	server prints ticks/sec, per-phase update times and resident memory.
+	The connection lives on a network thread, so the world never waits on a
+	socket. Input and authority packets cross between the threads in pooled
+	buffers on lock free rings, and the report includes how long received
+	packets waited to be handed over plus the backpressure counters. The
+	world ticks off a reactor timer while a client is connected. With no
+	client the tick timer stops and the server sleeps until the network
+	thread wakes it through an event, so an idle server uses next to no cpu.
+	Built with PROFILE, per-phase histograms are printed at exit and the
+	recent ticks are written as a chrome trace to CUBES_TRACE, if set.
+	CUBES_COUNTERS adds hardware counters per phase on linux.
+
+	usage: cubes_server [port] [seconds]
+*/
+
+const int ServerPort = 30000;
+const unsigned int ProtocolId = 0x43554245;		// "CUBE"
+const float TimeOut = 10.0f;
+const float TickRate = 60.0f;
+const float DeltaTime = 1.0f / TickRate;
+const int MaxObjectsPerPacket = 16;				// keeps packets around 1k, well under the mtu
+const int ServerPlayer = 0;
+const int ClientPlayer = 1;
+
+static volatile bool quit = false;
+
+static void OnInterrupt( int )
+{
+	quit = true;
+}
+
+const char * GetPhaseName( FramePhase phase )
+{
+	switch ( phase )
+	{
+		case PHASE_Input:			return "input";
+		case PHASE_Activation:		return "activation";
+		case PHASE_Priority:		return "priority";
+		case PHASE_Simulation:		return "simulation";
+		case PHASE_Authority:		return "authority";
+		case PHASE_View:			return "view";
+		default:					break;
+	}
+	return "???";
+}
+
+// resident memory in bytes, 0 if unknown
+
+uint64_t GetMemoryUsage()
+{
+	#if PLATFORM == PLATFORM_UNIX
+	FILE * file = fopen( "/proc/self/statm", "r" );
+	if ( !file )
+		return 0;
+	unsigned long size = 0, resident = 0;
+	const bool result = fscanf( file, "%lu %lu", &size, &resident ) == 2;
+	fclose( file );
+	return result ? (uint64_t) resident * sysconf( _SC_PAGESIZE ) : 0;
+	#elif PLATFORM == PLATFORM_MAC
+	rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+		return 0;
+	return usage.ru_maxrss;
+	#else
+	return 0;
+	#endif
+}
+
+struct Server
+{
+	AuthorityInstance * instance;
+	net::NetworkThread * network;
+	net::Reactor * reactor;
+	AuthorityPacket packet;
+	int tickTimer;
+
+	int ticks;
+	int totalTicks;
+	float phaseTime[PHASE_Count];
+	float totalTime;
+	float maxTime;
+	unsigned int wakeups;
+
+	Server()
+	{
+		instance = NULL;
+		network = NULL;
+		reactor = NULL;
+		tickTimer = 0;
+		ticks = 0;
+		totalTicks = 0;
+		for ( int i = 0; i < PHASE_Count; ++i )
+			phaseTime[i] = 0.0f;
+		totalTime = 0.0f;
+		maxTime = 0.0f;
+		wakeups = 0;
+	}
+};
+
+void OnReceive( void * data );
+
+// tick the world on client input and send the client the objects around it
+
+void OnTick( void * data )
+{
+	Server & server = *(Server*) data;
+	AuthorityInstance * instance = server.instance;
+	net::NetworkThread & network = *server.network;
+
+	#ifndef MULTITHREADED
+	network.Pump( 0.0f );
+	#endif
+
+	while ( net::PacketBuffer * buffer = network.ReceivePacket() )
+	{
+		if ( buffer->GetSize() == sizeof( Input ) )
+		{
+			Input input;
+			memcpy( &input, buffer->GetData(), sizeof( Input ) );
+			instance->SetPlayerInput( ClientPlayer, input );
+		}
+		network.ReleasePacket();
+	}
+
+	instance->Update( DeltaTime );
+
+	const FrameTimings & timings = instance->GetFrameTimings();
+	for ( int i = 0; i < PHASE_Count; ++i )
+		server.phaseTime[i] += timings.phase[i];
+	server.totalTime += timings.total;
+	if ( timings.total > server.maxTime )
+		server.maxTime = timings.total;
+	server.ticks++;
+	server.totalTicks++;
+
+	if ( network.IsConnected() && server.totalTicks % instance->GetSendInterval() == 0 )
+	{
+		net::PacketBuffer * buffer = network.AcquireSendBuffer();
+		if ( buffer )
+		{
+			BuildAuthorityPacket( instance, ServerPlayer, ClientPlayer, SYNC_InteractionAuthority, server.packet, MaxObjectsPerPacket );
+			memcpy( buffer->Append( server.packet.GetBytes() ), &server.packet, server.packet.GetBytes() );
+			network.SendPacket();
+		}
+	}
+
+	// nobody left to simulate for: stop ticking and sleep until the network thread says a client connected
+
+	if ( !network.IsConnected() )
+	{
+		server.reactor->CancelTimer( server.tickTimer );
+		server.tickTimer = 0;
+		network.AttachReceiver( *server.reactor, OnReceive, &server );
+	}
+}
+
+// the network thread handed over packets or the connection changed. ticks drain the packets, so only wake for them while idle
+
+void OnReceive( void * data )
+{
+	Server & server = *(Server*) data;
+
+	if ( server.network->IsConnected() && !server.tickTimer )
+	{
+		server.network->DetachReceiver();
+		server.tickTimer = server.reactor->AddTimer( 0.0f, DeltaTime, OnTick, &server );
+	}
+}
+
+void OnReport( void * data )
+{
+	Server & server = *(Server*) data;
+
+	const unsigned int wakeups = server.reactor->GetStats().wakeups;
+
+	if ( server.ticks > 0 )
+	{
+		printf( "%d ticks/sec, %.2fms avg, %.2fms max |", server.ticks, server.totalTime / server.ticks * 1000.0f, server.maxTime * 1000.0f );
+		for ( int i = 0; i < PHASE_Count; ++i )
+			printf( " %s %.2f", GetPhaseName( (FramePhase) i ), server.phaseTime[i] / server.ticks * 1000.0f );
+		printf( " | %d active, %.1fMB, %d wakeups, %s\n", server.instance->GetActiveObjectCount(), GetMemoryUsage() / ( 1000.0f * 1000.0f ), wakeups - server.wakeups, server.network->IsConnected() ? "client connected" : "no client" );
+	}
+	else
+		printf( "idle | %.1fMB, %d wakeups, no client\n", GetMemoryUsage() / ( 1000.0f * 1000.0f ), wakeups - server.wakeups );
+
+	profile::Histogram & handoff = server.network->GetHandoffTimes();
+	if ( handoff.GetCount() > 0 )
+	{
+		const net::NetworkThreadStats stats = server.network->GetStats();
+		printf( "  handoff p50 %.0fus, p99 %.0fus, max %.0fus over %d packets | %u received, %u sent, %u receive stalls, %u send ring full, %u dropped\n", 
+			handoff.GetPercentile( 0.5f ) * 1000000.0f, handoff.GetPercentile( 0.99f ) * 1000000.0f, handoff.GetMax() * 1000000.0f, handoff.GetCount(),
+			stats.packetsReceived, stats.packetsSent, stats.receiveStalls, stats.sendQueueFull, stats.sendDropped );
+		handoff.Clear();
+	}
+
+	fflush( stdout );
+
+	server.ticks = 0;
+	server.totalTime = 0.0f;
+	server.maxTime = 0.0f;
+	for ( int i = 0; i < PHASE_Count; ++i )
+		server.phaseTime[i] = 0.0f;
+	server.wakeups = wakeups;
+}
+
+int main( int argc, char * argv[] )
+{
+	const int port = argc >= 2 ? atoi( argv[1] ) : ServerPort;
+	const float seconds = argc >= 3 ? (float) atof( argv[2] ) : 0.0f;
+
+	signal( SIGINT, OnInterrupt );
+	signal( SIGTERM, OnInterrupt );
+
+	if ( !net::InitializeSockets() )
+	{
+		printf( "failed to initialize sockets\n" );
+		return 1;
+	}
+
+	platform::Timer timer;
+
+	AuthorityInstance * instance = CreateAuthorityInstance( ServerPlayer );
+
+	printf( "world startup took %.2f seconds, %.1fMB resident\n", timer.delta(), GetMemoryUsage() / ( 1000.0f * 1000.0f ) );
+
+	#ifdef PROFILE
+	if ( getenv( "CUBES_COUNTERS" ) && !instance->GetProfiler().EnableCounters() )
+		printf( "hardware counters are not available\n" );
+	#endif
+
+	net::ReliableConnection connection( ProtocolId, TimeOut );
+	if ( !connection.Start( port ) )
+	{
+		printf( "could not start server on port %d\n", port );
+		delete instance;
+		net::ShutdownSockets();
+		return 1;
+	}
+
+	connection.Listen();
+
+	net::NetworkThread network( connection );
+	if ( !network.Start() )
+	{
+		printf( "could not start network thread\n" );
+		delete instance;
+		net::ShutdownSockets();
+		return 1;
+	}
+
+	net::Reactor reactor;
+
+	static Server server;
+	server.instance = instance;
+	server.network = &network;
+	server.reactor = &reactor;
+
+	if ( !network.AttachReceiver( reactor, OnReceive, &server ) )
+	{
+		printf( "could not wake the server from the network thread\n" );
+		network.Stop();
+		connection.Stop();
+		delete instance;
+		net::ShutdownSockets();
+		return 1;
+	}
+
+	reactor.AddTimer( 1.0f, 1.0f, OnReport, &server );
+
+	while ( !quit && ( seconds <= 0.0f || timer.time() < seconds ) )
+	{
+		#ifndef MULTITHREADED
+		if ( !server.tickTimer )
+		{
+			// no network thread: wait on the connection here until a client turns up
+			network.Pump( 0.25f );
+			reactor.Poll( 0.0f );
+			continue;
+		}
+		#endif
+		reactor.Poll( 0.25f );
+	}
+
+	printf( "server ran %d ticks\n", server.totalTicks );
+
+	#ifdef PROFILE
+
+	instance->GetProfiler().Print();
+
+	const char * traceFilename = getenv( "CUBES_TRACE" );
+	if ( traceFilename && !instance->GetProfiler().WriteChromeTrace( traceFilename ) )
+		printf( "failed to write trace \"%s\"\n", traceFilename );
+
+	#endif
+
+	network.Stop();
+	connection.Stop();
+
+	delete instance;
+
+	net::ShutdownSockets();
+
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef SIMULATION_BACKEND_H
+#define SIMULATION_BACKEND_H
+
+#include "Config.h"
+#include "Mathematics.h"
+#include "Profiler.h"
+
+#include <stdint.h>
+#include <vector>
+
+namespace engine
+{
+	// broadphase collision detection
+
+	enum BroadphaseType
+	{
+		BROADPHASE_Hash,				// ode hash space (default levels)
+		BROADPHASE_SweepAndPrune,		// ode sweep and prune space
+		BROADPHASE_Grid					// uniform 2D grid sized to the cube scales
+	};
+
+	// simulation backend
+
+	enum SimulationBackendType
+	{
+		BACKEND_ODE,					// ode rigid bodies (see OdeSimulation.h)
+		BACKEND_Cubes					// in-house solver for cubes on a plane (see CubeSimulation.h)
+	};
+
+	// simulation config
+
+	struct SimulationConfig
+	{
+		float ERP;
+		float CFM;
+	 	int MaxIterations;
+		float Gravity;
+		float LinearDrag;
+		float AngularDrag;
+		float Friction;
+		float Elasticity;
+		float ContactSurfaceLayer;
+		float MaximumCorrectingVelocity;
+		bool QuickStep;
+		float RestTime;
+		float LinearRestThresholdSquared;
+		float AngularRestThresholdSquared;
+		BroadphaseType Broadphase;
+		float GridCellSize;
+		bool CubeCollider;
+		int IslandWorlds;
+		int IslandThreads;
+		SimulationBackendType Backend;
+
+		SimulationConfig()
+		{
+			ERP = 0.1f;
+			CFM = 0.001f;
+			MaxIterations = 12;
+			MaximumCorrectingVelocity = 100.0f;
+			ContactSurfaceLayer = 0.02f;
+			Elasticity = 0.2f;
+			LinearDrag = 0.0f;
+			AngularDrag = 0.0f;
+			Friction = 100.0f;
+			Gravity = 20.0f;
+			QuickStep = true;
+			RestTime = 0.2f;
+			LinearRestThresholdSquared = 0.2f * 0.2f;
+			AngularRestThresholdSquared = 0.2f * 0.2f;
+			Broadphase = BROADPHASE_Hash;
+			GridCellSize = 0.0f;			// note: zero means size grid cells to the largest cube
+			CubeCollider = false;
+			IslandWorlds = 1;				// note: keep this fixed across machines, results depend on it but not on thread count
+			IslandThreads = 0;				// note: extra threads stepping island worlds alongside the calling thread
+			Backend = BACKEND_ODE;
+		}  
+	};
+
+	// new simulation state
+
+	struct SimulationObjectState
+	{
+		SimulationObjectState()
+		{
+			enabled = true;
+			scale = 1.0f;
+			density = 1.0f;
+			position = math::Vector(0,0,0);
+	 		orientation = math::Quaternion(1,0,0,0);
+			linearVelocity = math::Vector(0,0,0);
+			angularVelocity = math::Vector(0,0,0);
+		}
+
+		bool enabled;
+		float scale;
+		float density;
+		math::Vector position;
+		math::Quaternion orientation;
+		math::Vector linearVelocity;
+		math::Vector angularVelocity;
+	};
+
+	/*
+		Batched object state, structure of arrays.
+		Used with Simulation::GetObjectStates and SetObjectStates to move the
+		state of many objects in and out of the simulation in a single pass.
+	*/
+
+	struct SimulationObjectStates
+	{
+		std::vector<math::Vector> position;
+		std::vector<math::Quaternion> orientation;
+		std::vector<math::Vector> linearVelocity;
+		std::vector<math::Vector> angularVelocity;
+		std::vector<uint8_t> enabled;
+
+		void Resize( int count )
+		{
+			position.resize( count );
+			orientation.resize( count );
+			linearVelocity.resize( count );
+			angularVelocity.resize( count );
+			enabled.resize( count );
+		}
+
+		int GetCount() const
+		{
+			return position.size();
+		}
+
+		void Get( int index, SimulationObjectState & state ) const
+		{
+			state.position = position[index];
+			state.orientation = orientation[index];
+			state.linearVelocity = linearVelocity[index];
+			state.angularVelocity = angularVelocity[index];
+			state.enabled = enabled[index] != 0;
+		}
+
+		void Set( int index, const SimulationObjectState & state )
+		{
+			position[index] = state.position;
+			orientation[index] = state.orientation;
+			linearVelocity[index] = state.linearVelocity;
+			angularVelocity[index] = state.angularVelocity;
+			enabled[index] = state.enabled;
+		}
+	};
+
+	// per step collision stats
+
+	struct SimulationStats
+	{
+		int pairs;						// pairs passed to the narrowphase
+		int collidingPairs;				// pairs that generated contacts
+		int contacts;					// total contacts generated
+
+		SimulationStats()
+		{
+			pairs = 0;
+			collidingPairs = 0;
+			contacts = 0;
+		}
+	};
+
+	// interaction pair for walking contacts
+
+	struct InteractionPair
+	{
+		int a,b;
+	};
+
+	/*
+		Simulation backend.
+		Everything the game needs from a physics simulation, so the rigid body
+		engine can be swapped underneath Simulation. Objects are identified by
+		small integer ids handed out by AddObject and reused after removal.
+	*/
+
+	class SimulationBackend
+	{
+	public:
+
+		SimulationBackend()
+		{
+			profiler = NULL;
+		}
+
+		virtual ~SimulationBackend() {}
+
+		virtual void Initialize( const SimulationConfig & config ) = 0;
+		virtual void Update( float deltaTime ) = 0;
+		virtual void Reset() = 0;
+
+		virtual int AddObject( const SimulationObjectState & initialObjectState ) = 0;
+		virtual void RemoveObject( int id ) = 0;
+		virtual bool ObjectExists( int id ) = 0;
+		virtual float GetObjectMass( int id ) = 0;
+		virtual void AddPlane( const math::Vector & normal, float d ) = 0;
+
+		virtual void GetObjectState( int id, SimulationObjectState & objectState ) = 0;
+		virtual void SetObjectState( int id, const SimulationObjectState & objectState, bool ignoreEnabledFlag ) = 0;
+		virtual void GetObjectStates( const int * ids, int count, SimulationObjectStates & states ) = 0;
+		virtual void SetObjectStates( const int * ids, int count, const SimulationObjectStates & states ) = 0;
+
+		virtual void ApplyForce( int id, const math::Vector & force ) = 0;
+		virtual void ApplyTorque( int id, const math::Vector & torque ) = 0;
+
+		virtual const InteractionPair * GetInteractionPairs() const = 0;
+		virtual int GetNumInteractionPairs() const = 0;
+		virtual const SimulationStats & GetStats() const = 0;
+		virtual int GetNumThreads() const = 0;
+
+		virtual void SetMaxIterations( int iterations ) = 0;
+		virtual int GetMaxIterations() const = 0;
+
+		virtual void WakeObject( int id ) = 0;
+		virtual bool IsObjectAwake( int id ) const = 0;
+		virtual int GetNumAwakeObjects() const = 0;
+		virtual const int * GetAwakeObjects() const = 0;
+		virtual const int * GetUpdatedObjects() const = 0;
+		virtual int GetNumUpdatedObjects() const = 0;
+
+		// collide, step and rest timings go here when built with PROFILE
+
+		void SetProfiler( profile::Profiler * profiler )
+		{
+			this->profiler = profiler;
+		}
+
+	protected:
+
+		profile::Profiler * profiler;
+	};
+}
+
+#endif
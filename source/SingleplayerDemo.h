@@ -56,21 +56,49 @@ public:
 	
 	void Initialize()
 	{
-		gameInstance->InitializeBegin();
+		// set CUBES_SNAPSHOT to load the world from a snapshot, saving one first if it does not exist
 
-		gameInstance->AddPlane( math::Vector(0,0,1), 0 );
+		platform::Timer timer;
 
-		AddCube( gameInstance, 1, math::Vector(0,0,10) );
+		const char * snapshotFile = getenv( "CUBES_SNAPSHOT" );
 
-		const int border = 10.0f;
-		const float origin = -steps / 2 + border;
-		const float z = hypercube::NonPlayerCubeSize / 2;
-		const int count = steps - border * 2;
-		for ( int y = 0; y < count; ++y )
-			for ( int x = 0; x < count; ++x )
-				AddCube( gameInstance, 0, math::Vector(x+origin,y+origin,z) );
+		if ( snapshotFile && gameInstance->LoadSnapshot( snapshotFile ) )
+		{
+			printf( "loaded world snapshot \"%s\"\n", snapshotFile );
+		}
+		else
+		{
+			gameInstance->InitializeBegin();
+
+			gameInstance->AddPlane( math::Vector(0,0,1), 0 );
+
+			AddCube( gameInstance, 1, math::Vector(0,0,10) );
+
+			const int border = 10.0f;
+			const float origin = -steps / 2 + border;
+			const float z = hypercube::NonPlayerCubeSize / 2;
+			const int count = steps - border * 2;
+			std::vector<hypercube::DatabaseObject> objects( count * count );
+			std::vector<float> objectX( count * count ), objectY( count * count );
+			for ( int y = 0; y < count; ++y )
+			{
+				for ( int x = 0; x < count; ++x )
+				{
+					const int index = x + y * count;
+					objectX[index] = x + origin;
+					objectY[index] = y + origin;
+					MakeCube( 0, math::Vector(objectX[index],objectY[index],z), objects[index] );
+				}
+			}
+			gameInstance->AddObjects( &objects[0], &objectX[0], &objectY[0], count * count, 3 );
+
+			gameInstance->InitializeEnd();
+
+			if ( snapshotFile && gameInstance->SaveSnapshot( snapshotFile ) )
+				printf( "saved world snapshot \"%s\"\n", snapshotFile );
+		}
 
-		gameInstance->InitializeEnd();
+		printf( "world startup took %.2f seconds\n", timer.delta() );
 
 		gameInstance->OnPlayerJoined( 0 );
 		gameInstance->SetLocalPlayer( 0 );
@@ -80,9 +108,8 @@ public:
 		gameInstance->SetFlag( game::FLAG_Katamari );
 	}
 	
-	void AddCube( game::Instance<hypercube::DatabaseObject, hypercube::ActiveObject> * gameInstance, int player, const math::Vector & position )
+	void MakeCube( int player, const math::Vector & position, hypercube::DatabaseObject & object )
 	{
-		hypercube::DatabaseObject object;
 		CompressPosition( position, object.position );
 		CompressOrientation( math::Quaternion(1,0,0,0), object.orientation );
 		object.enabled = player;
@@ -90,6 +117,12 @@ public:
 		object.confirmed = 0;
 		object.corrected = 0;
 		object.player = player;
+	}
+
+	void AddCube( game::Instance<hypercube::DatabaseObject, hypercube::ActiveObject> * gameInstance, int player, const math::Vector & position )
+	{
+		hypercube::DatabaseObject object;
+		MakeCube( player, position, object );
 		gameInstance->AddObject( object, position.x, position.y );
 	}
 
@@ -0,0 +1,199 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "Config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace engine
+{
+	/*
+		World snapshot.
+		A game instance saved as one flat binary blob: header, then 16 byte
+		aligned sections addressed by offset from the start of the file.
+		Nothing in it is a pointer, so the whole file is brought in with a
+		single read and loading is a copy of the object database plus a walk
+		over the grid cells to rebuild the activation system.
+
+			header			magic | version | sizes | counts | frame counters | section offsets
+			database		DatabaseObject x objectCount (ids 1..objectCount)
+			cell counts		uint32 x cellWidth * cellHeight
+			cell objects	SnapshotCellObject x cellObjectCount, in cell order
+			authority		SnapshotAuthority x authorityCount
+			planes			SnapshotPlane x planeCount
+
+		The checksum covers everything after the header. Objects are stored
+		inactive: active objects are written back into the database copy on
+		save and the activation circle is rebuilt on the first update.
+	*/
+
+	const uint32_t SnapshotMagic = 0x53425543;		// "CUBS"
+	const uint32_t SnapshotVersion = 1;
+
+	struct SnapshotHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t bytes;							// whole file, including the header
+		uint32_t checksum;
+		uint32_t databaseObjectBytes;			// sizeof( DatabaseObject ). catches loading into the wrong instance type
+		uint32_t objectCount;
+		uint32_t cellWidth;
+		uint32_t cellHeight;
+		float cellSize;
+		uint32_t cellObjectCount;
+		uint32_t authorityCount;
+		uint32_t planeCount;
+		uint32_t flags;
+		uint32_t tierFrame;
+		uint32_t frame[MaxPlayers];
+		uint32_t databaseOffset;
+		uint32_t cellCountOffset;
+		uint32_t cellObjectOffset;
+		uint32_t authorityOffset;
+		uint32_t planeOffset;
+	};
+
+	struct SnapshotCellObject
+	{
+		uint32_t id;
+		float x,y;
+	};
+
+	struct SnapshotAuthority
+	{
+		uint32_t id;
+		int32_t authority;
+		uint32_t forced;
+		float time;
+	};
+
+	struct SnapshotPlane
+	{
+		float normal[3];
+		float d;
+	};
+
+	// fnv-1a over 32 bit words. fast enough to check a million objects at startup
+
+	inline uint32_t SnapshotChecksum( const uint8_t * data, uint32_t bytes )
+	{
+		uint32_t hash = 2166136261U;
+		const uint32_t words = bytes / 4;
+		for ( uint32_t i = 0; i < words; ++i )
+		{
+			uint32_t word;
+			memcpy( &word, data + i * 4, 4 );
+			hash = ( hash ^ word ) * 16777619U;
+		}
+		for ( uint32_t i = words * 4; i < bytes; ++i )
+			hash = ( hash ^ data[i] ) * 16777619U;
+		return hash;
+	}
+
+	/*
+		Builds a snapshot in memory. Sections are appended in order;
+		pointers returned by Append are valid until the next append.
+	*/
+
+	class SnapshotWriter
+	{
+	public:
+
+		SnapshotWriter( std::vector<uint8_t> & buffer ) : buffer( buffer )
+		{
+			buffer.assign( sizeof( SnapshotHeader ), 0 );
+			SnapshotHeader & header = GetHeader();
+			header.magic = SnapshotMagic;
+			header.version = SnapshotVersion;
+		}
+
+		SnapshotHeader & GetHeader()
+		{
+			return *(SnapshotHeader*) &buffer[0];
+		}
+
+		template <typename T> T * Append( uint32_t count, uint32_t & offset )
+		{
+			const uint32_t aligned = ( buffer.size() + 15 ) & ~15;
+			offset = aligned;
+			buffer.resize( aligned + sizeof( T ) * count, 0 );
+			return count > 0 ? (T*) &buffer[aligned] : NULL;
+		}
+
+		void Finish()
+		{
+			SnapshotHeader & header = GetHeader();
+			header.bytes = buffer.size();
+			header.checksum = SnapshotChecksum( &buffer[0] + sizeof( SnapshotHeader ), buffer.size() - sizeof( SnapshotHeader ) );
+		}
+
+	private:
+
+		std::vector<uint8_t> & buffer;
+	};
+
+	// returns the header if the snapshot is intact, NULL if it is truncated, corrupt or from another version
+
+	inline const SnapshotHeader * ValidateSnapshot( const uint8_t * data, uint32_t bytes )
+	{
+		if ( !data || bytes < sizeof( SnapshotHeader ) )
+			return NULL;
+		const SnapshotHeader * header = (const SnapshotHeader*) data;
+		if ( header->magic != SnapshotMagic || header->version != SnapshotVersion || header->bytes != bytes )
+			return NULL;
+		if ( SnapshotChecksum( data + sizeof( SnapshotHeader ), bytes - sizeof( SnapshotHeader ) ) != header->checksum )
+			return NULL;
+		return header;
+	}
+
+	// true if a section of count items of the given size fits inside the snapshot
+
+	inline bool ValidateSnapshotSection( const SnapshotHeader & header, uint32_t offset, uint32_t count, uint32_t size )
+	{
+		if ( offset < sizeof( SnapshotHeader ) || offset > header.bytes )
+			return false;
+		return (uint64_t) count * size <= header.bytes - offset;
+	}
+
+	inline bool WriteSnapshotFile( const char * filename, const std::vector<uint8_t> & buffer )
+	{
+		FILE * file = fopen( filename, "wb" );
+		if ( !file )
+			return false;
+		const bool result = fwrite( &buffer[0], 1, buffer.size(), file ) == buffer.size();
+		fclose( file );
+		return result;
+	}
+
+	// the whole file comes in with one read
+
+	inline bool ReadSnapshotFile( const char * filename, std::vector<uint8_t> & buffer )
+	{
+		FILE * file = fopen( filename, "rb" );
+		if ( !file )
+			return false;
+		fseek( file, 0, SEEK_END );
+		const long bytes = ftell( file );
+		fseek( file, 0, SEEK_SET );
+		if ( bytes < (long) sizeof( SnapshotHeader ) )
+		{
+			fclose( file );
+			return false;
+		}
+		buffer.resize( bytes );
+		const bool result = fread( &buffer[0], 1, bytes, file ) == (size_t) bytes;
+		fclose( file );
+		return result;
+	}
+}
+
+#endif
@@ -0,0 +1,431 @@
+/*
+	Fiedler's Cubes
+	Copyright © 2008-2009 Glenn Fiedler
+	http://www.gafferongames.com/fiedlers-cubes
+*/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "Config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <vector>
+
+// note: threads are implemented with pthreads only
+
+#if PLATFORM != PLATFORM_MAC && PLATFORM != PLATFORM_UNIX
+#undef MULTITHREADED
+#endif
+
+#ifdef MULTITHREADED
+#include <pthread.h>
+#endif
+
+namespace platform
+{
+	// worker thread 
+
+	class WorkerThread
+	{
+	public:
+	
+		WorkerThread()
+		{
+			#ifdef MULTITHREADED
+			thread = 0;
+			#endif
+		}
+	
+		virtual ~WorkerThread()
+		{
+			#ifdef MULTITHREADED
+			thread = 0;
+			#endif
+		}
+	
+		bool Start()
+		{
+			#ifdef MULTITHREADED
+
+				pthread_attr_t attr;	
+				pthread_attr_init( &attr );
+				pthread_attr_setstacksize( &attr, 32 * 1024 * 1024 );
+				if ( pthread_create( &thread, &attr, StaticRun, (void*)this ) != 0 )
+				{
+					printf( "error: pthread_create failed\n" );
+					return false;
+				}
+		
+			#else
+		
+				Run();
+			
+			#endif
+		
+			return true;
+		}
+	
+		bool Join()
+		{
+			#ifdef MULTITHREADED
+			if ( pthread_join( thread, NULL ) != 0 )
+			{
+				printf( "error: pthread_join failed\n" );
+				return false;
+			}
+			#endif
+			return true;
+		}
+	
+	protected:
+	
+		static void* StaticRun( void * data )
+		{
+			WorkerThread * self = (WorkerThread*) data;
+			self->Run();
+			return NULL;
+		}
+	
+		virtual void Run() = 0;			// note: override this to implement your thread task
+	
+	private:
+
+		#ifdef MULTITHREADED	
+		pthread_t thread;
+		#endif
+	};
+
+	// acquire and release, for handing data between two threads without a lock
+
+	inline unsigned int LoadAcquire( const unsigned int & value )
+	{
+		#if defined( __GNUC__ )
+		return __atomic_load_n( &value, __ATOMIC_ACQUIRE );
+		#else
+		return *(const volatile unsigned int*) &value;			// note: msvc volatile loads acquire
+		#endif
+	}
+
+	inline void StoreRelease( unsigned int & value, unsigned int newValue )
+	{
+		#if defined( __GNUC__ )
+		__atomic_store_n( &value, newValue, __ATOMIC_RELEASE );
+		#else
+		*(volatile unsigned int*) &value = newValue;			// note: msvc volatile stores release
+		#endif
+	}
+
+	/*
+		Single producer, single consumer ring.
+		Bounded and lock free. The producer fills slots in place and publishes
+		them, the consumer reads them in place and releases them, so nothing
+		is copied and a ring of buffers doubles as their pool. Reserve and Peek
+		hand out runs of contiguous slots for batching. A run stops at the end
+		of the array, so call again after a wrap. Each side caches the other's
+		index and only reloads it when it looks full or empty, and the indices
+		sit on separate cache lines, so the two threads rarely share a line.
+	*/
+
+	template <typename T> class SPSCQueue
+	{
+	public:
+
+		SPSCQueue( int capacity )
+		{
+			assert( capacity > 0 );
+			assert( ( capacity & ( capacity - 1 ) ) == 0 );
+			items.resize( capacity );
+			mask = capacity - 1;
+			head = 0;
+			cachedTail = 0;
+			tail = 0;
+			cachedHead = 0;
+		}
+
+		// producer: empty slots from the write position on. fill some, then Push them
+
+		int Reserve( T *& first )
+		{
+			unsigned int free = GetCapacity() - ( tail - cachedHead );
+			if ( free == 0 )
+			{
+				cachedHead = LoadAcquire( head );
+				free = GetCapacity() - ( tail - cachedHead );
+			}
+			const unsigned int index = tail & mask;
+			const unsigned int run = GetCapacity() - index;
+			first = &items[index];
+			return free < run ? free : run;
+		}
+
+		void Push( int count )
+		{
+			assert( count >= 0 );
+			assert( tail + count - cachedHead <= (unsigned int) GetCapacity() );
+			StoreRelease( tail, tail + count );
+		}
+
+		// consumer: published slots from the read position on. read some, then Pop them
+
+		int Peek( T *& first )
+		{
+			unsigned int available = cachedTail - head;
+			if ( available == 0 )
+			{
+				cachedTail = LoadAcquire( tail );
+				available = cachedTail - head;
+			}
+			const unsigned int index = head & mask;
+			const unsigned int run = GetCapacity() - index;
+			first = &items[index];
+			return available < run ? available : run;
+		}
+
+		void Pop( int count )
+		{
+			assert( count >= 0 );
+			assert( (unsigned int) count <= cachedTail - head );
+			StoreRelease( head, head + count );
+		}
+
+		int GetCapacity() const
+		{
+			return mask + 1;
+		}
+
+		// from either thread, so only a snapshot
+
+		int GetSize() const
+		{
+			return (int) ( LoadAcquire( tail ) - LoadAcquire( head ) );
+		}
+
+		int GetIndex( const T * item ) const
+		{
+			assert( item >= &items[0] && item < &items[0] + items.size() );
+			return (int) ( item - &items[0] );
+		}
+
+	private:
+
+		SPSCQueue( const SPSCQueue & other );
+		SPSCQueue & operator = ( const SPSCQueue & other );
+
+		enum { CacheLineSize = 64 };
+
+		std::vector<T> items;
+		unsigned int mask;
+		char pad0[CacheLineSize];
+		unsigned int head;				// consumer
+		unsigned int cachedTail;
+		char pad1[CacheLineSize];
+		unsigned int tail;				// producer
+		unsigned int cachedHead;
+		char pad2[CacheLineSize];
+	};
+
+	/*
+		Worker pool.
+		Persistent threads for splitting per-frame work into independent tasks.
+		Run hands out task indices to the pool threads and the calling thread,
+		and returns once every task has completed. Without MULTITHREADED the
+		tasks simply run in order on the calling thread. Libraries that keep
+		per-thread state can set it up and tear it down in the optional thread
+		start and stop functions, which run on each pool thread.
+	*/
+
+	class WorkerPool
+	{
+	public:
+
+		typedef void (*TaskFunction)( void * data, int task );
+		typedef void (*ThreadFunction)( void * data );
+
+		WorkerPool()
+		{
+			numThreads = 0;
+			threadStart = NULL;
+			threadStop = NULL;
+			threadData = NULL;
+			function = NULL;
+			data = NULL;
+			numTasks = 0;
+			nextTask = 0;
+			tasksRemaining = 0;
+			generation = 0;
+			quit = false;
+			#ifdef MULTITHREADED
+			pthread_mutex_init( &mutex, NULL );
+			pthread_cond_init( &workAvailable, NULL );
+			pthread_cond_init( &workComplete, NULL );
+			#endif
+		}
+
+		~WorkerPool()
+		{
+			Stop();
+			#ifdef MULTITHREADED
+			pthread_cond_destroy( &workComplete );
+			pthread_cond_destroy( &workAvailable );
+			pthread_mutex_destroy( &mutex );
+			#endif
+		}
+
+		// note: the calling thread also runs tasks, so threads = cores - 1 keeps every core busy
+
+		bool Start( int threads, ThreadFunction threadStart = NULL, ThreadFunction threadStop = NULL, void * threadData = NULL )
+		{
+			assert( numThreads == 0 );
+			assert( threads >= 0 );
+			this->threadStart = threadStart;
+			this->threadStop = threadStop;
+			this->threadData = threadData;
+			#ifdef MULTITHREADED
+			if ( threads > MaxThreads )
+				threads = MaxThreads;
+			quit = false;
+			for ( int i = 0; i < threads; ++i )
+			{
+				if ( pthread_create( &thread[i], NULL, StaticRun, (void*)this ) != 0 )
+				{
+					printf( "error: pthread_create failed\n" );
+					Stop();
+					return false;
+				}
+				numThreads++;
+			}
+			#endif
+			return true;
+		}
+
+		void Stop()
+		{
+			#ifdef MULTITHREADED
+			if ( numThreads == 0 )
+				return;
+			pthread_mutex_lock( &mutex );
+			quit = true;
+			pthread_cond_broadcast( &workAvailable );
+			pthread_mutex_unlock( &mutex );
+			for ( int i = 0; i < numThreads; ++i )
+				pthread_join( thread[i], NULL );
+			numThreads = 0;
+			#endif
+		}
+
+		int GetNumThreads() const
+		{
+			return numThreads + 1;
+		}
+
+		void Run( TaskFunction function, void * data, int numTasks )
+		{
+			assert( function );
+
+			#ifdef MULTITHREADED
+
+				if ( numThreads > 0 && numTasks > 1 )
+				{
+					pthread_mutex_lock( &mutex );
+					this->function = function;
+					this->data = data;
+					this->numTasks = numTasks;
+					nextTask = 0;
+					tasksRemaining = numTasks;
+					generation++;
+					pthread_cond_broadcast( &workAvailable );
+					pthread_mutex_unlock( &mutex );
+
+					DoTasks();
+
+					pthread_mutex_lock( &mutex );
+					while ( tasksRemaining > 0 )
+						pthread_cond_wait( &workComplete, &mutex );
+					this->function = NULL;
+					pthread_mutex_unlock( &mutex );
+					return;
+				}
+
+			#endif
+
+			for ( int i = 0; i < numTasks; ++i )
+				function( data, i );
+		}
+
+	private:
+
+		#ifdef MULTITHREADED
+
+		void DoTasks()
+		{
+			while ( true )
+			{
+				pthread_mutex_lock( &mutex );
+				if ( nextTask >= numTasks )
+				{
+					pthread_mutex_unlock( &mutex );
+					return;
+				}
+				const int task = nextTask++;
+				TaskFunction taskFunction = function;
+				void * taskData = data;
+				pthread_mutex_unlock( &mutex );
+
+				taskFunction( taskData, task );
+
+				pthread_mutex_lock( &mutex );
+				if ( --tasksRemaining == 0 )
+					pthread_cond_signal( &workComplete );
+				pthread_mutex_unlock( &mutex );
+			}
+		}
+
+		static void* StaticRun( void * data )
+		{
+			WorkerPool * self = (WorkerPool*) data;
+			if ( self->threadStart )
+				self->threadStart( self->threadData );
+			int lastGeneration = 0;
+			while ( true )
+			{
+				pthread_mutex_lock( &self->mutex );
+				while ( !self->quit && self->generation == lastGeneration )
+					pthread_cond_wait( &self->workAvailable, &self->mutex );
+				const bool quit = self->quit;
+				lastGeneration = self->generation;
+				pthread_mutex_unlock( &self->mutex );
+				if ( quit )
+					break;
+				self->DoTasks();
+			}
+			if ( self->threadStop )
+				self->threadStop( self->threadData );
+			return NULL;
+		}
+
+		enum { MaxThreads = 64 };
+
+		pthread_t thread[MaxThreads];
+		pthread_mutex_t mutex;
+		pthread_cond_t workAvailable;
+		pthread_cond_t workComplete;
+
+		#endif
+
+		int numThreads;
+		ThreadFunction threadStart;
+		ThreadFunction threadStop;
+		void * threadData;
+		TaskFunction function;
+		void * data;
+		int numTasks;
+		int nextTask;
+		int tasksRemaining;
+		int generation;
+		bool quit;
+	};
+}
+
+#endif
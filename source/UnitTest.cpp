@@ -37,7 +37,9 @@ void print_trace()
 #include "Engine.h"
 #include "Game.h"
 #include "Cubes.h"
+#include "Recorder.h"
 #include "Network.h"
+#include "NetworkThread.h"
 #include <unistd.h>
 
 using namespace net;
@@ -297,6 +299,110 @@ SUITE( Activation )
 		}
 	}
 
+	TEST( activation_system_set_radius )
+	{
+		printf( "activation system set radius\n" );
+
+		const float activation_radius = 10.0f;
+		const int grid_width = 40;
+		const int grid_height = 40;
+		const int cell_size = 1;
+
+		activation::ActivationSystem activationSystem( 1024, activation_radius, grid_width, grid_height, cell_size, 32, 32 );
+		int id = 1;
+		for ( int i = 0; i < 10; ++i )
+			activationSystem.InsertObject( id++, math::random_float(-1.0f, 1.0f ), math::random_float(-1.0f, 1.0f ) );
+		for ( int i = 0; i < 10; ++i )
+			activationSystem.InsertObject( id++, math::random_float( 7.0f, 8.0f ), math::random_float(-1.0f, 1.0f ) );
+
+		for ( int i = 0; i < 10; ++i )
+			activationSystem.Update( 0.1f );
+		CHECK( activationSystem.GetActiveCount() == 20 );
+		activationSystem.ClearEvents();
+
+		// shrinking the radius deactivates the outer ring
+
+		activationSystem.SetActivationRadius( 5.0f );
+		CHECK_EQUAL( activationSystem.GetActivationRadius(), 5.0f );
+		activationSystem.Update( 0.1f );
+		CHECK( activationSystem.GetActiveCount() == 10 );
+		CHECK( activationSystem.GetEventCount() == 10 );
+		for ( int i = 0; i < activationSystem.GetEventCount(); ++i )
+		{
+			const activation::Event & event = activationSystem.GetEvent(i);
+			CHECK( event.type == activation::Event::Deactivate );
+			CHECK( event.id > 10 );
+		}
+		activationSystem.ClearEvents();
+		activationSystem.Validate();
+
+		// growing it again activates them straight away
+
+		activationSystem.SetActivationRadius( 10.0f );
+		CHECK( activationSystem.GetActiveCount() == 20 );
+		CHECK( activationSystem.GetEventCount() == 10 );
+		for ( int i = 1; i <= 20; ++i )
+			CHECK( activationSystem.IsActive(i) );
+		activationSystem.ClearEvents();
+		activationSystem.Validate();
+	}
+
+	TEST( activation_system_bulk_insert )
+	{
+		printf( "activation system bulk insert\n" );
+
+		const int grid_width = 16;
+		const int grid_height = 16;
+		const int count = 2000;
+
+		std::vector<float> x( count ), y( count );
+		for ( int i = 0; i < count; ++i )
+		{
+			x[i] = math::random_float( -8.0f, 8.0f );
+			y[i] = math::random_float( -8.0f, 8.0f );
+		}
+
+		// bulk insert on top of a few existing objects matches inserting one at a time
+
+		activation::ActivationSystem single( count + 10, 3.0f, grid_width, grid_height, 1.0f, 4, 32 );
+		activation::ActivationSystem bulk( count + 10, 3.0f, grid_width, grid_height, 1.0f, 4, 32 );
+		for ( int i = 0; i < 5; ++i )
+		{
+			single.InsertObject( i + 1, x[i], y[i] );
+			bulk.InsertObject( i + 1, x[i], y[i] );
+		}
+		for ( int i = 5; i < count; ++i )
+			single.InsertObject( i + 1, x[i], y[i] );
+
+		platform::WorkerPool pool;
+		pool.Start( 3 );
+		bulk.InsertObjects( 6, &x[5], &y[5], count - 5, &pool );
+
+		for ( int iy = 0; iy < grid_height; ++iy )
+		{
+			for ( int ix = 0; ix < grid_width; ++ix )
+			{
+				activation::Cell * a = single.GetCellAtIndex( ix, iy );
+				activation::Cell * b = bulk.GetCellAtIndex( ix, iy );
+				CHECK_EQUAL( a->GetObjectCount(), b->GetObjectCount() );
+				for ( int i = 0; i < a->GetObjectCount() && i < b->GetObjectCount(); ++i )
+				{
+					CHECK( a->GetObject(i).id == b->GetObject(i).id );
+					CHECK( a->GetObject(i).x == b->GetObject(i).x );
+				}
+			}
+		}
+
+		// objects can be moved and activated afterwards
+
+		for ( int i = 0; i < 10; ++i )
+			bulk.Update( 0.1f );
+		CHECK( bulk.GetActiveCount() > 0 );
+		bulk.MoveObject( count, 0.0f, 0.0f );
+		CHECK( bulk.IsActive( count ) );
+		bulk.Validate();
+	}
+
 	TEST( activation_system_sweep )
 	{
 		printf( "activation system sweep\n" );
@@ -779,6 +885,212 @@ SUITE( PrioritySet )
 		CHECK_EQUAL( prioritySet.GetPriorityAtIndex(4), 0.1f );
 		CHECK_EQUAL( prioritySet.GetPriorityAtIndex(5), 0.0f );
 	}
+
+	TEST( priority_rates )
+	{
+		printf( "priority set rates\n" );
+
+		engine::PrioritySet prioritySet;
+
+		prioritySet.AddObject( 1 );
+		prioritySet.AddObject( 2 );
+		prioritySet.AddObject( 3 );
+
+		prioritySet.SetObjectRate( 1, 0.25f );
+		prioritySet.SetObjectRate( 2, 2.0f );
+		prioritySet.SetObjectRate( 3, 0.0f );
+		prioritySet.SetObjectPriority( 3, 1.0f );
+
+		prioritySet.Advance( 1.0f );
+
+		CHECK( prioritySet.GetPriorityObject(0) == 2 );
+		CHECK( prioritySet.GetPriorityObject(1) == 3 );
+		CHECK( prioritySet.GetPriorityObject(2) == 1 );
+		CHECK_EQUAL( prioritySet.GetPriorityAtIndex(0), 2.0f );
+		CHECK_EQUAL( prioritySet.GetPriorityAtIndex(1), 1.0f );
+		CHECK_EQUAL( prioritySet.GetPriorityAtIndex(2), 0.25f );
+
+		// a priority set by index holds the order until the next sort
+
+		prioritySet.SetPriorityAtIndex( 0, 0.0f );
+		CHECK( prioritySet.GetPriorityObject(0) == 2 );
+		CHECK_EQUAL( prioritySet.GetPriority( 2 ), 2.0f );
+
+		prioritySet.SortObjects();
+		CHECK( prioritySet.GetPriorityObject(0) == 3 );
+		CHECK( prioritySet.GetPriorityObject(1) == 1 );
+		CHECK( prioritySet.GetPriorityObject(2) == 2 );
+
+		// changing rate keeps the priority reached so far
+
+		prioritySet.SetObjectRate( 1, 4.0f );
+		CHECK_EQUAL( prioritySet.GetPriority( 1 ), 0.25f );
+
+		prioritySet.Advance( 1.0f );
+
+		CHECK( prioritySet.GetPriorityObject(0) == 1 );
+		CHECK( prioritySet.GetPriorityObject(1) == 2 );
+		CHECK( prioritySet.GetPriorityObject(2) == 3 );
+		CHECK_EQUAL( prioritySet.GetPriorityAtIndex(0), 4.25f );
+		CHECK_EQUAL( prioritySet.GetPriorityAtIndex(1), 2.0f );
+		CHECK_EQUAL( prioritySet.GetPriorityAtIndex(2), 1.0f );
+
+		prioritySet.RemoveObject( 1 );
+		CHECK( prioritySet.GetObjectCount() == 2 );
+		CHECK( !prioritySet.ObjectExists( 1 ) );
+		CHECK( prioritySet.GetPriorityObject(0) == 2 );
+	}
+}
+
+SUITE( FrameGovernor )
+{
+	engine::FrameTimings MakeTimings( float simulation, float total )
+	{
+		engine::FrameTimings timings;
+		timings.phase[engine::PHASE_Simulation] = simulation;
+		timings.total = total;
+		return timings;
+	}
+
+	TEST( frame_governor_degrade_restore )
+	{
+		printf( "frame governor degrade/restore\n" );
+
+		engine::GovernorConfig config;
+		config.Enabled = true;
+		config.TargetFrameTime = 0.01f;
+		config.Smoothing = 1.0f;
+		config.DegradeFrames = 2;
+		config.RestoreFrames = 3;
+		config.Cooldown = 1;
+		config.MinIterations = 4;
+		config.MaxIterations = 10;
+		config.IterationStep = 2;
+		config.MaxSendInterval = 3;
+		config.MinActivationDistance = 4.0f;
+		config.MaxActivationDistance = 5.0f;
+		config.ActivationDistanceStep = 0.5f;
+
+		engine::FrameGovernor governor( config );
+		CHECK( governor.GetIterations() == 10 );
+		CHECK( governor.GetSendInterval() == 1 );
+		CHECK_EQUAL( governor.GetActivationDistance(), 5.0f );
+
+		// inside the hysteresis band nothing changes
+
+		for ( int i = 0; i < 100; ++i )
+			CHECK( !governor.Update( MakeTimings( 0.004f, 0.008f ) ) );
+		CHECK( governor.GetNumAdjustments() == 0 );
+
+		// simulation bound frames over budget cut iterations first, then send rate, then activation distance
+
+		for ( int i = 0; i < 100; ++i )
+			governor.Update( MakeTimings( 0.015f, 0.02f ) );
+
+		CHECK( governor.GetIterations() == 4 );
+		CHECK( governor.GetSendInterval() == 3 );
+		CHECK_EQUAL( governor.GetActivationDistance(), 4.0f );
+		CHECK( governor.GetStats().degrades == 7 );
+		CHECK( governor.GetNumAdjustments() == 7 );
+
+		const engine::GovernorAdjustment & first = governor.GetAdjustment( 0 );
+		CHECK( first.knob == engine::KNOB_Iterations );
+		CHECK_EQUAL( first.oldValue, 10.0f );
+		CHECK_EQUAL( first.newValue, 8.0f );
+		CHECK( first.frame == 102 );
+		CHECK( governor.GetAdjustment( 3 ).knob == engine::KNOB_SendInterval );
+		CHECK( governor.GetAdjustment( 6 ).knob == engine::KNOB_ActivationDistance );
+
+		// well under budget restores in reverse order, more slowly
+
+		for ( int i = 0; i < 4; ++i )
+			governor.Update( MakeTimings( 0.001f, 0.002f ) );
+		CHECK( governor.GetStats().restores == 1 );
+		CHECK_EQUAL( governor.GetActivationDistance(), 4.5f );
+
+		for ( int i = 0; i < 100; ++i )
+			governor.Update( MakeTimings( 0.001f, 0.002f ) );
+
+		CHECK( governor.GetIterations() == 10 );
+		CHECK( governor.GetSendInterval() == 1 );
+		CHECK_EQUAL( governor.GetActivationDistance(), 5.0f );
+		CHECK( governor.GetStats().restores == 7 );
+		CHECK( governor.GetNumAdjustments() == 14 );
+	}
+
+	TEST( frame_governor_disabled )
+	{
+		printf( "frame governor disabled\n" );
+
+		engine::FrameGovernor governor;
+		for ( int i = 0; i < 100; ++i )
+			CHECK( !governor.Update( MakeTimings( 0.1f, 0.2f ) ) );
+		CHECK( governor.GetNumAdjustments() == 0 );
+		CHECK( governor.GetStats().averageFrameTime > 0.1f );
+	}
+}
+
+SUITE( Profiler )
+{
+	TEST( profiler_histogram_and_trace )
+	{
+		printf( "profiler histogram and trace\n" );
+
+		// 99 fast samples of 100us and one slow 10ms sample
+
+		profile::Profiler profiler( 64 );
+		profiler.SetThreadId( 3 );
+		for ( int i = 0; i < 99; ++i )
+			profiler.Record( profile::ZONE_Step, i * 0.001, i * 0.001 + 0.0001 );
+		profiler.Record( profile::ZONE_Step, 1.0, 1.01 );
+
+		const profile::Histogram & histogram = profiler.GetHistogram( profile::ZONE_Step );
+		CHECK( histogram.GetCount() == 100 );
+		CHECK( profiler.GetHistogram( profile::ZONE_Collide ).GetCount() == 0 );
+		CHECK_CLOSE( histogram.GetPercentile( 0.5f ), 0.0001f, 0.00001f );
+		CHECK_CLOSE( histogram.GetPercentile( 0.99f ), 0.0001f, 0.00001f );
+		CHECK_CLOSE( histogram.GetPercentile( 1.0f ), 0.01f, 0.001f );
+		CHECK_CLOSE( histogram.GetMax(), 0.01f, 0.00001f );
+
+		// only the most recent events are kept for the trace
+
+		CHECK( profiler.GetNumEvents() == 64 );
+
+		const char * filename = "profiler_trace.json";
+		CHECK( profiler.WriteChromeTrace( filename ) );
+
+		FILE * file = fopen( filename, "r" );
+		CHECK( file );
+		char text[256];
+		const int bytes = fread( text, 1, sizeof( text ) - 1, file );
+		text[bytes] = '\0';
+		fclose( file );
+		remove( filename );
+
+		CHECK( strncmp( text, "{\"traceEvents\":[", 16 ) == 0 );
+		CHECK( strstr( text, "\"name\":\"step\",\"ph\":\"X\",\"pid\":0,\"tid\":3" ) != NULL );
+
+		// counters only total while enabled, and only where the kernel allows them
+
+		CHECK( profiler.GetNumCounterSamples( profile::ZONE_Step ) == 0 );
+
+		profiler.Clear();
+		CHECK( histogram.GetCount() == 0 );
+		CHECK( profiler.GetNumEvents() == 0 );
+
+		if ( profiler.EnableCounters() )
+		{
+			profile::CounterValues begin, end;
+			profiler.ReadCounters( begin );
+			volatile int sum = 0;
+			for ( int i = 0; i < 100000; ++i )
+				sum += i;
+			profiler.ReadCounters( end );
+			profiler.Record( profile::ZONE_Step, 0.0, 0.001, begin, end );
+			CHECK( profiler.GetNumCounterSamples( profile::ZONE_Step ) == 1 );
+			CHECK( profiler.GetCounters( profile::ZONE_Step ).instructions > 100000 );
+		}
+	}
 }
 
 SUITE( Compression )
@@ -813,140 +1125,595 @@ SUITE( Compression )
 	}
 }
 
-SUITE( Game )
+SUITE( Collision )
 {
-	TEST( game_initial_conditions )
+	collision::Box MakeBox( const math::Vector & position, math::Quaternion orientation, float size )
 	{
-		printf( "game initial conditions\n" );
+		collision::Box box;
+		box.position = position;
+		box.axis[0] = orientation.transform( math::Vector(1,0,0) );
+		box.axis[1] = orientation.transform( math::Vector(0,1,0) );
+		box.axis[2] = orientation.transform( math::Vector(0,0,1) );
+		box.extents[0] = box.extents[1] = box.extents[2] = size * 0.5f;
+		return box;
+	}
 
-		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance;
-		CHECK( instance.GetLocalPlayer() == -1 );
-		for ( int i = 0; i < MaxPlayers; ++i )
+	TEST( box_plane_resting )
+	{
+		printf( "box plane resting\n" );
+
+		collision::Box box = MakeBox( math::Vector(1,2,0.45f), math::Quaternion(1,0,0,0), 1.0f );
+		collision::Contact contacts[collision::MaxContacts];
+		const int count = collision::CollideBoxPlane( box, math::Vector(0,0,1), 0.0f, contacts );
+		CHECK( count == 4 );
+		for ( int i = 0; i < count; ++i )
 		{
-			CHECK( !instance.IsPlayerJoined(i) );
-			game::Input input;
-			instance.GetPlayerInput( i, input );
-			CHECK( input == game::Input() );
-			CHECK( instance.GetPlayerFocus( i ) == 0 );
+			CHECK_CLOSE( contacts[i].depth, 0.05f, 0.0001f );
+			CHECK_CLOSE( contacts[i].point.z, -0.05f, 0.0001f );
+			CHECK( contacts[i].normal == math::Vector(0,0,1) );
 		}
-		CHECK( instance.GetLocalPlayer() == -1 );
-		CHECK( !instance.InGame() );
 	}
-	
-	TEST( game_initialize_shutdown )
+
+	TEST( box_plane_separated )
 	{
-		printf( "game initialize/shutdown\n" );
+		printf( "box plane separated\n" );
 
-		game::Config config;
-		config.cellSize = 4.0f;
-		config.cellWidth = 16;
-		config.cellHeight = 16;
+		collision::Box box = MakeBox( math::Vector(0,0,0.55f), math::Quaternion(1,0,0,0), 1.0f );
+		collision::Contact contacts[collision::MaxContacts];
+		CHECK( collision::CollideBoxPlane( box, math::Vector(0,0,1), 0.0f, contacts ) == 0 );
+	}
 
-		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
+	TEST( box_plane_corner )
+	{
+		printf( "box plane corner\n" );
 
-		for ( int i = 0; i < 2; ++i )
-		{
-			instance.InitializeBegin();
-			instance.InitializeEnd();
-			instance.Shutdown();
-		}
+		// balanced on a corner: only the lowest vertex touches
+
+		math::Quaternion orientation( 0.8880738f, 0.3250576f, -0.3250576f, 0.0f );
+		orientation.normalize();
+		collision::Box box = MakeBox( math::Vector(0,0,0.85f), orientation, 1.0f );
+		collision::Contact contacts[collision::MaxContacts];
+		const int count = collision::CollideBoxPlane( box, math::Vector(0,0,1), 0.0f, contacts );
+		CHECK( count == 1 );
+		CHECK( contacts[0].depth > 0.0f );
 	}
-	
-	void AddCube( game::Instance<cubes::DatabaseObject, cubes::ActiveObject> * gameInstance, float scale, const math::Vector & position, const math::Vector & linearVelocity = math::Vector(0,0,0), const math::Vector & angularVelocity = math::Vector(0,0,0) )
+
+	TEST( box_box_stacked )
 	{
-		cubes::DatabaseObject object;
-		object.position = position;
-		object.orientation = math::Quaternion(1,0,0,0);
-		object.scale = scale;
-		object.linearVelocity = linearVelocity;
-		object.angularVelocity = angularVelocity;
-		object.enabled = 1;
-		object.activated = 0;
-		gameInstance->AddObject( object, position.x, position.y );
+		printf( "box box stacked\n" );
+
+		collision::Box upper = MakeBox( math::Vector(0.1f,0,0.95f), math::Quaternion(1,0,0,0), 1.0f );
+		collision::Box lower = MakeBox( math::Vector(0,0,0), math::Quaternion(1,0,0,0), 1.0f );
+		collision::Contact contacts[collision::MaxContacts];
+		const int count = collision::CollideBoxBox( upper, lower, contacts );
+		CHECK( count == 4 );
+		for ( int i = 0; i < count; ++i )
+		{
+			CHECK_CLOSE( contacts[i].depth, 0.05f, 0.0001f );
+			CHECK_CLOSE( contacts[i].normal.z, 1.0f, 0.0001f );
+			CHECK( contacts[i].point.x >= -0.4001f && contacts[i].point.x <= 0.5001f );
+		}
+
+		// swapping the boxes flips the normal
+
+		CHECK( collision::CollideBoxBox( lower, upper, contacts ) == 4 );
+		CHECK_CLOSE( contacts[0].normal.z, -1.0f, 0.0001f );
 	}
 
-	TEST( game_player_join_and_leave )
+	TEST( box_box_separated )
 	{
-		printf( "game join and leave\n" );
+		printf( "box box separated\n" );
 
-		game::Config config;
-		config.cellSize = 4.0f;
-		config.cellWidth = 16;
-		config.cellHeight = 16;
+		collision::Box a = MakeBox( math::Vector(0,0,0), math::Quaternion(1,0,0,0), 1.0f );
+		collision::Box b = MakeBox( math::Vector(1.01f,0,0), math::Quaternion(1,0,0,0), 1.0f );
+		collision::Contact contacts[collision::MaxContacts];
+		CHECK( collision::CollideBoxBox( a, b, contacts ) == 0 );
 
-		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
-		
-		instance.InitializeBegin();
-		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
-		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
-		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
-		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
-		instance.InitializeEnd();
-		
-		for ( int i = 0; i < MaxPlayers; ++i )
+		// rotated 45 degrees about z, corners would overlap the aabb but not the box
+
+		const float s = math::sqrt( 0.5f );
+		math::Quaternion rotation( math::cos( math::pi / 8 ), 0, 0, math::sin( math::pi / 8 ) );
+		collision::Box c = MakeBox( math::Vector(1.0f + s - 0.01f,1.0f + s - 0.01f,0), rotation, 1.0f );
+		CHECK( collision::CollideBoxBox( a, c, contacts ) == 0 );
+	}
+
+	TEST( box_box_edge )
+	{
+		printf( "box box edge\n" );
+
+		// edge of b (rotated 45 degrees about x and z) poking down onto the top of a
+
+		math::Quaternion qx( math::cos( math::pi / 8 ), math::sin( math::pi / 8 ), 0, 0 );
+		math::Quaternion qz( math::cos( math::pi / 8 ), 0, 0, math::sin( math::pi / 8 ) );
+		collision::Box a = MakeBox( math::Vector(0,0,0), math::Quaternion(1,0,0,0), 1.0f );
+		collision::Box b = MakeBox( math::Vector(0,0,0.5f + math::sqrt(0.5f) - 0.02f), qz * qx, 1.0f );
+		collision::Contact contacts[collision::MaxContacts];
+		const int count = collision::CollideBoxBox( b, a, contacts );
+		CHECK( count >= 1 );
+		CHECK( count <= collision::MaxContacts );
+		for ( int i = 0; i < count; ++i )
 		{
-			CHECK( !instance.IsPlayerJoined( i ) );
-			instance.OnPlayerJoined( i );
-			instance.SetPlayerFocus( i, i + 1 );
-			CHECK( instance.IsPlayerJoined( i ) );
-			CHECK( instance.GetPlayerFocus( i ) == ObjectId( i + 1 ) );
+			CHECK_CLOSE( contacts[i].normal.z, 1.0f, 0.01f );
+			CHECK( contacts[i].depth > 0.0f );
+			CHECK( contacts[i].depth < 0.05f );
 		}
+	}
+}
 
-		CHECK( !instance.InGame() );
-		CHECK( instance.GetLocalPlayer() == -1 );
-		instance.SetLocalPlayer( 1 );
-		CHECK( instance.GetLocalPlayer() == 1 );
-		CHECK( instance.InGame() );		
-		
-		for ( int i = 0; i < MaxPlayers; ++i )
+SUITE( Simulation )
+{
+	void CreateStacks( Simulation & simulation )
+	{
+		simulation.AddPlane( math::Vector(0,0,1), 0 );
+		for ( int i = 0; i < 32; ++i )
 		{
-			CHECK( instance.IsPlayerJoined( i ) );
-			instance.OnPlayerLeft( i );
-			CHECK( !instance.IsPlayerJoined( i ) );
+			SimulationObjectState object;
+			object.position = math::Vector( ( i % 4 ) * 0.9f, ( i / 16 ) * 5.0f, 0.5f + ( i % 16 ) / 4 * 1.1f );
+			object.linearVelocity = math::Vector( 0, 0, -1.0f );
+			simulation.AddObject( object );
 		}
-		
-		instance.Shutdown();
+	}
 
-		CHECK( instance.GetLocalPlayer() == -1 );
-		CHECK( !instance.InGame() );
+	void CheckIslandWorldsDeterministic( bool quickStep )
+	{
+		SimulationConfig config;
+		config.QuickStep = quickStep;
+		config.IslandWorlds = 4;
 
-		for ( int i = 0; i < MaxPlayers; ++i )
+		Simulation single;
+		single.Initialize( config );
+		CreateStacks( single );
+
+		config.IslandThreads = 3;
+
+		Simulation threaded;
+		threaded.Initialize( config );
+		CreateStacks( threaded );
+
+		// note: interleaved, so quickstep results can't depend on the global random seed left by the other simulation
+
+		for ( int i = 0; i < 60; ++i )
 		{
-			CHECK( !instance.IsPlayerJoined( i ) );
-			CHECK( instance.GetPlayerFocus( i ) == 0 );
+			single.Update( 1.0f / 60.0f );
+			threaded.Update( 1.0f / 60.0f );
+			threaded.Update( 1.0f / 60.0f );
+			single.Update( 1.0f / 60.0f );
+		}
+
+		for ( int i = 0; i < 32; ++i )
+		{
+			SimulationObjectState a, b;
+			single.GetObjectState( i, a );
+			threaded.GetObjectState( i, b );
+			CHECK( memcmp( &a.position, &b.position, sizeof( a.position ) ) == 0 );
+			CHECK( memcmp( &a.orientation, &b.orientation, sizeof( a.orientation ) ) == 0 );
+			CHECK( a.position.z > 0.0f );
 		}
 	}
-	
-	TEST( game_object_activation )
+
+	TEST( island_worlds_deterministic )
 	{
-		printf( "game object activation\n" );
+		printf( "island worlds deterministic\n" );
 
-		game::Config config;
-		config.cellSize = 4.0f;
-		config.cellWidth = 16;
-		config.cellHeight = 16;
+		CheckIslandWorldsDeterministic( false );
+		CheckIslandWorldsDeterministic( true );
+	}
 
-		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
-		
-		instance.InitializeBegin();
-		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
-		instance.InitializeEnd();
+	void CheckIslandSleep( BroadphaseType broadphase )
+	{
+		SimulationConfig config;
+		config.Broadphase = broadphase;
 
-		instance.SetFlag( game::FLAG_Pause );
+		Simulation simulation;
+		simulation.Initialize( config );
+		simulation.AddPlane( math::Vector(0,0,1), 0 );
 
-		instance.OnPlayerJoined( 0 );
-		instance.SetPlayerFocus( 0, 1 );
-		instance.SetLocalPlayer( 0 );
+		SimulationObjectState object;
+		object.position = math::Vector( 0, 0, 0.5f );
+		const int bottom = simulation.AddObject( object );
+		object.position = math::Vector( 0, 0, 1.5f );
+		const int top = simulation.AddObject( object );
+		object.position = math::Vector( 10, 0, 0.5f );
+		const int other = simulation.AddObject( object );
 
-		instance.Update();
-		
-		int numActiveObjects = 0;
-		cubes::ActiveObject activeObjects[1];
-		instance.GetActiveObjects( activeObjects, numActiveObjects );
-		CHECK( numActiveObjects == 1 );
-		CHECK( instance.IsObjectActive( 1 ) );
+		CHECK( simulation.GetNumAwakeObjects() == 3 );
 
-		instance.OnPlayerLeft( 0 );
+		for ( int i = 0; i < 120; ++i )
+			simulation.Update( 1.0f / 60.0f );
+
+		// everything comes to rest, the stack sleeps as one island
+
+		CHECK( simulation.GetNumAwakeObjects() == 0 );
+		SimulationObjectState state;
+		simulation.GetObjectState( top, state );
+		CHECK( !state.enabled );
+
+		simulation.Update( 1.0f / 60.0f );
+		CHECK( simulation.GetNumUpdatedObjects() == 0 );
+
+		// pushing the bottom cube wakes the whole stack, but not the separate cube
+
+		simulation.ApplyForce( bottom, math::Vector( 10, 0, 0 ) );
+		CHECK( simulation.IsObjectAwake( bottom ) );
+		CHECK( simulation.IsObjectAwake( top ) );
+		CHECK( !simulation.IsObjectAwake( other ) );
+
+		// a falling cube wakes the separate cube on contact
+
+		object.position = math::Vector( 10, 0, 1.6f );
+		object.linearVelocity = math::Vector( 0, 0, -2.0f );
+		simulation.AddObject( object );
+		for ( int i = 0; i < 10 && !simulation.IsObjectAwake( other ); ++i )
+			simulation.Update( 1.0f / 60.0f );
+		CHECK( simulation.IsObjectAwake( other ) );
+	}
+
+	TEST( island_sleep )
+	{
+		printf( "island sleep\n" );
+
+		CheckIslandSleep( BROADPHASE_Hash );
+	}
+
+	TEST( island_sleep_grid )
+	{
+		printf( "island sleep grid\n" );
+
+		CheckIslandSleep( BROADPHASE_Grid );
+	}
+
+	TEST( batched_object_states )
+	{
+		printf( "batched object states\n" );
+
+		Simulation simulation;
+		simulation.Initialize();
+
+		const int NumObjects = 64;
+		int ids[NumObjects];
+		for ( int i = 0; i < NumObjects; ++i )
+		{
+			SimulationObjectState object;
+			object.position = math::Vector( i * 2.0f, 0, 1 );
+			ids[i] = simulation.AddObject( object );
+		}
+
+		// write every other object in reverse order
+
+		int subset[NumObjects/2];
+		SimulationObjectStates states;
+		states.Resize( NumObjects / 2 );
+		for ( int i = 0; i < NumObjects / 2; ++i )
+		{
+			subset[i] = ids[NumObjects-1-i*2];
+			SimulationObjectState state;
+			state.position = math::Vector( i, i + 1, i + 2 );
+			state.orientation = math::Quaternion( 0, 1, 0, 0 );
+			state.linearVelocity = math::Vector( 1, 2, 3 );
+			state.angularVelocity = math::Vector( -1, -2, -3 );
+			states.Set( i, state );
+		}
+
+		simulation.SetObjectStates( subset, NumObjects / 2, states );
+
+		for ( int i = 0; i < NumObjects / 2; ++i )
+		{
+			SimulationObjectState state;
+			simulation.GetObjectState( subset[i], state );
+			CHECK( state.position == math::Vector( i, i + 1, i + 2 ) );
+			CHECK( state.orientation == math::Quaternion( 0, 1, 0, 0 ) );
+			CHECK( state.linearVelocity == math::Vector( 1, 2, 3 ) );
+			CHECK( state.angularVelocity == math::Vector( -1, -2, -3 ) );
+		}
+
+		// batched reads match single reads
+
+		simulation.GetObjectStates( ids, NumObjects, states );
+		CHECK( states.GetCount() == NumObjects );
+		for ( int i = 0; i < NumObjects; ++i )
+		{
+			SimulationObjectState single, batched;
+			simulation.GetObjectState( ids[i], single );
+			states.Get( i, batched );
+			CHECK( single.position == batched.position );
+			CHECK( single.orientation == batched.orientation );
+			CHECK( single.linearVelocity == batched.linearVelocity );
+			CHECK( single.angularVelocity == batched.angularVelocity );
+			CHECK( single.enabled == batched.enabled );
+		}
+	}
+}
+
+SUITE( CubeSimulation )
+{
+	TEST( cube_backend_rest )
+	{
+		printf( "cube backend rest\n" );
+
+		CubeSimulation simulation;
+		simulation.Initialize();
+		simulation.AddPlane( math::Vector(0,0,1), 0 );
+
+		SimulationObjectState object;
+		object.position = math::Vector( 0, 0, 2.0f );
+		object.orientation = math::Quaternion( 0.3f, math::Vector(1,1,0).normalize() );
+		const int id = simulation.AddObject( object );
+
+		CHECK_CLOSE( 1.0f, simulation.GetObjectMass( id ), 0.0001f );
+
+		for ( int i = 0; i < 300; ++i )
+			simulation.Update( 1.0f / 60.0f );
+
+		// the cube lands on a face and goes to sleep
+
+		SimulationObjectState state;
+		simulation.GetObjectState( id, state );
+		CHECK_CLOSE( 0.5f, state.position.z, 0.05f );
+		CHECK( !state.enabled );
+		CHECK( !simulation.IsObjectAwake( id ) );
+	}
+
+	TEST( cube_backend_stack )
+	{
+		printf( "cube backend stack\n" );
+
+		CubeSimulation simulation;
+		simulation.Initialize();
+		simulation.AddPlane( math::Vector(0,0,1), 0 );
+
+		const int NumCubes = 5;
+		int ids[NumCubes];
+		for ( int i = 0; i < NumCubes; ++i )
+		{
+			SimulationObjectState object;
+			object.position = math::Vector( 0, 0, 0.5f + i * 1.01f );
+			ids[i] = simulation.AddObject( object );
+		}
+
+		for ( int i = 0; i < 120; ++i )
+		{
+			simulation.Update( 1.0f / 60.0f );
+			CHECK( simulation.GetNumInteractionPairs() <= NumCubes - 1 );
+		}
+
+		for ( int i = 0; i < NumCubes; ++i )
+		{
+			SimulationObjectState state;
+			simulation.GetObjectState( ids[i], state );
+			CHECK_CLOSE( 0.5f + i, state.position.z, 0.1f );
+			CHECK_CLOSE( 0.0f, state.position.x, 0.01f );
+			CHECK_CLOSE( 0.0f, state.position.y, 0.01f );
+		}
+
+		// the stack sleeps as one island and wakes as one
+
+		CHECK( simulation.GetNumAwakeObjects() == 0 );
+		simulation.ApplyForce( ids[NumCubes-1], math::Vector( 10, 0, 0 ) );
+		CHECK( simulation.GetNumAwakeObjects() == NumCubes );
+	}
+
+	TEST( cube_backend_collision )
+	{
+		printf( "cube backend collision\n" );
+
+		SimulationConfig config;
+		config.Gravity = 0.0f;
+
+		CubeSimulation simulation;
+		simulation.Initialize( config );
+
+		SimulationObjectState object;
+		object.position = math::Vector( -2, 0, 0.5f );
+		object.linearVelocity = math::Vector( 5, 0, 0 );
+		const int a = simulation.AddObject( object );
+		object.position = math::Vector( 2, 0, 0.5f );
+		object.linearVelocity = math::Vector( -5, 0, 0 );
+		const int b = simulation.AddObject( object );
+
+		bool touched = false;
+		for ( int i = 0; i < 60; ++i )
+		{
+			simulation.Update( 1.0f / 60.0f );
+			if ( simulation.GetNumInteractionPairs() > 0 )
+				touched = true;
+		}
+		CHECK( touched );
+
+		// cubes thrown at each other bounce apart instead of passing through
+
+		SimulationObjectState stateA, stateB;
+		simulation.GetObjectState( a, stateA );
+		simulation.GetObjectState( b, stateB );
+		CHECK( stateB.position.x - stateA.position.x > 1.0f );
+		CHECK( stateA.linearVelocity.x < 0.0f );
+		CHECK( stateB.linearVelocity.x > 0.0f );
+	}
+
+	TEST( cube_backend_wake_sleeping )
+	{
+		printf( "cube backend wake sleeping\n" );
+
+		CubeSimulation simulation;
+		simulation.Initialize();
+		simulation.AddPlane( math::Vector(0,0,1), 0 );
+
+		SimulationObjectState object;
+		object.position = math::Vector( 0, 0, 0.5f );
+		const int sleeper = simulation.AddObject( object );
+		object.position = math::Vector( 5, 0, 0.5f );
+		const int other = simulation.AddObject( object );
+
+		for ( int i = 0; i < 300; ++i )
+			simulation.Update( 1.0f / 60.0f );
+
+		CHECK( simulation.GetNumAwakeObjects() == 0 );
+
+		// a sleeping cube is only found through the sleeping grid, and wakes when an awake cube lands on it
+
+		object.position = math::Vector( 0, 0, 3.0f );
+		const int dropped = simulation.AddObject( object );
+
+		bool woken = false;
+		for ( int i = 0; i < 120; ++i )
+		{
+			simulation.Update( 1.0f / 60.0f );
+			if ( simulation.IsObjectAwake( sleeper ) )
+				woken = true;
+		}
+		CHECK( woken );
+		CHECK( !simulation.IsObjectAwake( other ) );
+
+		SimulationObjectState state;
+		simulation.GetObjectState( dropped, state );
+		CHECK_CLOSE( 1.5f, state.position.z, 0.1f );
+
+		// removing the bottom cube drops the top one onto the plane
+
+		simulation.RemoveObject( sleeper );
+		CHECK( simulation.IsObjectAwake( dropped ) );
+
+		for ( int i = 0; i < 120; ++i )
+			simulation.Update( 1.0f / 60.0f );
+
+		simulation.GetObjectState( dropped, state );
+		CHECK_CLOSE( 0.5f, state.position.z, 0.1f );
+	}
+}
+
+SUITE( Game )
+{
+	TEST( game_initial_conditions )
+	{
+		printf( "game initial conditions\n" );
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance;
+		CHECK( instance.GetLocalPlayer() == -1 );
+		for ( int i = 0; i < MaxPlayers; ++i )
+		{
+			CHECK( !instance.IsPlayerJoined(i) );
+			game::Input input;
+			instance.GetPlayerInput( i, input );
+			CHECK( input == game::Input() );
+			CHECK( instance.GetPlayerFocus( i ) == 0 );
+		}
+		CHECK( instance.GetLocalPlayer() == -1 );
+		CHECK( !instance.InGame() );
+	}
+	
+	TEST( game_initialize_shutdown )
+	{
+		printf( "game initialize/shutdown\n" );
+
+		game::Config config;
+		config.cellSize = 4.0f;
+		config.cellWidth = 16;
+		config.cellHeight = 16;
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
+
+		for ( int i = 0; i < 2; ++i )
+		{
+			instance.InitializeBegin();
+			instance.InitializeEnd();
+			instance.Shutdown();
+		}
+	}
+	
+	void AddCube( game::Instance<cubes::DatabaseObject, cubes::ActiveObject> * gameInstance, float scale, const math::Vector & position, const math::Vector & linearVelocity = math::Vector(0,0,0), const math::Vector & angularVelocity = math::Vector(0,0,0) )
+	{
+		cubes::DatabaseObject object;
+		object.position = position;
+		object.orientation = math::Quaternion(1,0,0,0);
+		object.scale = scale;
+		object.linearVelocity = linearVelocity;
+		object.angularVelocity = angularVelocity;
+		object.enabled = 1;
+		object.activated = 0;
+		gameInstance->AddObject( object, position.x, position.y );
+	}
+
+	TEST( game_player_join_and_leave )
+	{
+		printf( "game join and leave\n" );
+
+		game::Config config;
+		config.cellSize = 4.0f;
+		config.cellWidth = 16;
+		config.cellHeight = 16;
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
+		
+		instance.InitializeBegin();
+		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
+		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
+		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
+		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
+		instance.InitializeEnd();
+		
+		for ( int i = 0; i < MaxPlayers; ++i )
+		{
+			CHECK( !instance.IsPlayerJoined( i ) );
+			instance.OnPlayerJoined( i );
+			instance.SetPlayerFocus( i, i + 1 );
+			CHECK( instance.IsPlayerJoined( i ) );
+			CHECK( instance.GetPlayerFocus( i ) == ObjectId( i + 1 ) );
+		}
+
+		CHECK( !instance.InGame() );
+		CHECK( instance.GetLocalPlayer() == -1 );
+		instance.SetLocalPlayer( 1 );
+		CHECK( instance.GetLocalPlayer() == 1 );
+		CHECK( instance.InGame() );		
+		
+		for ( int i = 0; i < MaxPlayers; ++i )
+		{
+			CHECK( instance.IsPlayerJoined( i ) );
+			instance.OnPlayerLeft( i );
+			CHECK( !instance.IsPlayerJoined( i ) );
+		}
+		
+		instance.Shutdown();
+
+		CHECK( instance.GetLocalPlayer() == -1 );
+		CHECK( !instance.InGame() );
+
+		for ( int i = 0; i < MaxPlayers; ++i )
+		{
+			CHECK( !instance.IsPlayerJoined( i ) );
+			CHECK( instance.GetPlayerFocus( i ) == 0 );
+		}
+	}
+	
+	TEST( game_object_activation )
+	{
+		printf( "game object activation\n" );
+
+		game::Config config;
+		config.cellSize = 4.0f;
+		config.cellWidth = 16;
+		config.cellHeight = 16;
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
+		
+		instance.InitializeBegin();
+		AddCube( &instance, 1.0f, math::Vector(0,0,0) );
+		instance.InitializeEnd();
+
+		instance.SetFlag( game::FLAG_Pause );
+
+		instance.OnPlayerJoined( 0 );
+		instance.SetPlayerFocus( 0, 1 );
+		instance.SetLocalPlayer( 0 );
+
+		instance.Update();
+		
+		int numActiveObjects = 0;
+		cubes::ActiveObject activeObjects[1];
+		instance.GetActiveObjects( activeObjects, numActiveObjects );
+		CHECK( numActiveObjects == 1 );
+		CHECK( instance.IsObjectActive( 1 ) );
+
+		instance.OnPlayerLeft( 0 );
 
 		instance.Update();
 		
@@ -1044,6 +1811,262 @@ SUITE( Game )
 		}		
 	}
 
+	TEST( game_tiered_updates )
+	{
+		printf( "game tiered updates\n" );
+
+		game::Config config;
+		config.cellSize = 4.0f;
+		config.cellWidth = 16;
+		config.cellHeight = 16;
+		config.activationDistance = 8.0f;
+		config.tieredUpdates = true;
+		config.simConfig.Backend = BACKEND_Cubes;
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
+		
+		instance.InitializeBegin();
+		AddCube( &instance, 1.4f, math::Vector(0,0,10) );
+		AddCube( &instance, 0.4f, math::Vector(2,0,10) );
+		AddCube( &instance, 0.4f, math::Vector(0,5,10) );
+		AddCube( &instance, 0.4f, math::Vector(-7,0,10) );
+		instance.InitializeEnd();
+
+		instance.OnPlayerJoined( 0 );
+		instance.SetLocalPlayer( 0 );
+		instance.SetPlayerFocus( 0, 1 );
+
+		instance.Update();
+
+		CHECK( instance.GetActiveObjectCount() == 4 );
+		CHECK( instance.GetTierCount( 0 ) == 2 );
+		CHECK( instance.GetTierCount( 1 ) == 1 );
+		CHECK( instance.GetTierCount( 2 ) == 1 );
+
+		// everything is falling, but outer objects only pick up new state every 2nd or 4th frame
+
+		int changes[5] = { 0, 0, 0, 0, 0 };
+		float previous_z[5];
+		for ( int id = 1; id <= 4; ++id )
+		{
+			cubes::ActiveObject object;
+			instance.GetObjectState( id, object );
+			previous_z[id] = object.position.z;
+		}
+
+		for ( int i = 0; i < 16; ++i )
+		{
+			instance.Update();
+			for ( int id = 1; id <= 4; ++id )
+			{
+				cubes::ActiveObject object;
+				instance.GetObjectState( id, object );
+				if ( object.position.z != previous_z[id] )
+					changes[id]++;
+				previous_z[id] = object.position.z;
+			}
+		}
+
+		CHECK( changes[1] == 16 );
+		CHECK( changes[2] == 16 );
+		CHECK( changes[3] == 8 );
+		CHECK( changes[4] == 4 );
+
+		// the simulation still steps outer objects every frame, so when
+		// they are pulled they have fallen just as far as inner objects
+
+		cubes::ActiveObject inner, outer;
+		for ( int i = 0; i < 4; ++i )
+		{
+			instance.Update();
+			instance.GetObjectState( 2, inner );
+			instance.GetObjectState( 4, outer );
+			if ( outer.position.z == previous_z[4] )
+				continue;
+			CHECK_CLOSE( inner.position.z, outer.position.z, 0.0001f );
+			previous_z[4] = outer.position.z;
+		}
+
+		// moving an object re-tiers it without waiting for the origin to move
+
+		cubes::ActiveObject object;
+		instance.GetObjectState( 4, object );
+		object.position.x = 1.0f;
+		instance.SetObjectState( 4, object );
+		instance.Update();
+
+		CHECK( instance.GetTierCount( 0 ) == 3 );
+		CHECK( instance.GetTierCount( 1 ) == 1 );
+		CHECK( instance.GetTierCount( 2 ) == 0 );
+	}
+
+	TEST( game_rollback_correction )
+	{
+		printf( "game rollback correction\n" );
+
+		game::Config config;
+		config.cellSize = 4.0f;
+		config.cellWidth = 16;
+		config.cellHeight = 16;
+		config.rollbackFrames = 16;
+		config.simConfig.Backend = BACKEND_Cubes;
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
+		
+		instance.InitializeBegin();
+		AddCube( &instance, 1.4f, math::Vector(0,0,0) );
+		AddCube( &instance, 0.4f, math::Vector(2,0,10), math::Vector(1,0,0) );
+		AddCube( &instance, 0.4f, math::Vector(-2,0,10), math::Vector(-1,0,0) );
+		instance.InitializeEnd();
+
+		instance.OnPlayerJoined( 0 );
+		instance.SetLocalPlayer( 0 );
+		instance.SetPlayerFocus( 0, 1 );
+
+		instance.Update();
+
+		// remember the state of object 2 at some frame, then keep going
+
+		const uint32_t correctionFrame = instance.GetPlayerFrame( 0 );
+		cubes::ActiveObject before;
+		instance.GetObjectState( 2, before );
+
+		for ( int i = 0; i < 5; ++i )
+			instance.Update();
+
+		cubes::ActiveObject uncorrected, untouched;
+		instance.GetObjectState( 2, uncorrected );
+		instance.GetObjectState( 3, untouched );
+
+		// correct it one unit along y at that frame. the rest of its motion replays on top
+
+		cubes::ActiveObject correction = before;
+		correction.position.y += 1.0f;
+		CHECK( instance.CorrectObjectState( 2, correction, correctionFrame ) );
+
+		const game::RollbackStats & stats = instance.GetRollbackStats();
+		CHECK( stats.corrections == 1 );
+		CHECK( stats.snapped == 0 );
+		CHECK( stats.lastFrames == 5 );
+		CHECK( stats.lastObjects == 1 );
+
+		cubes::ActiveObject corrected, other;
+		instance.GetObjectState( 2, corrected );
+		instance.GetObjectState( 3, other );
+		CHECK_CLOSE( corrected.position.x, uncorrected.position.x, 0.001f );
+		CHECK_CLOSE( corrected.position.y, uncorrected.position.y + 1.0f, 0.001f );
+		CHECK_CLOSE( corrected.position.z, uncorrected.position.z, 0.001f );
+		CHECK( other.position.x == untouched.position.x );
+		CHECK( other.position.z == untouched.position.z );
+
+		// input history is available for the window
+
+		game::Input input;
+		CHECK( instance.GetRollbackInput( correctionFrame, 0, input ) );
+
+		// corrections older than the window are applied at the present frame
+
+		for ( int i = 0; i < 20; ++i )
+			instance.Update();
+
+		CHECK( !instance.CorrectObjectState( 2, correction, correctionFrame ) );
+		CHECK( stats.snapped == 1 );
+		CHECK( !instance.GetRollbackInput( correctionFrame, 0, input ) );
+		instance.GetObjectState( 2, corrected );
+		CHECK( corrected.position.y == correction.position.y );
+	}
+
+	TEST( game_snapshot )
+	{
+		printf( "game snapshot\n" );
+
+		game::Config config;
+		config.cellSize = 4.0f;
+		config.cellWidth = 16;
+		config.cellHeight = 16;
+		config.simConfig.Backend = BACKEND_Cubes;
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> instance( config );
+
+		instance.InitializeBegin();
+		instance.AddPlane( math::Vector(0,0,1), 0 );
+		AddCube( &instance, 1.4f, math::Vector(0,0,0) );
+		for ( int i = 0; i < 20; ++i )
+			AddCube( &instance, 0.4f, math::Vector( -20.0f + i * 2.0f, 5.0f, 1.0f ), math::Vector(1,0,0) );
+		instance.InitializeEnd();
+
+		instance.OnPlayerJoined( 0 );
+		instance.SetLocalPlayer( 0 );
+		instance.SetPlayerFocus( 0, 1 );
+
+		for ( int i = 0; i < 10; ++i )
+			instance.Update();
+
+		instance.SetObjectAuthority( 1, 0 );
+
+		CHECK( instance.GetActiveObjectCount() > 0 );
+
+		std::vector<uint8_t> buffer;
+		instance.SaveSnapshot( buffer );
+
+		// a fresh instance loaded from the snapshot sees the same world, active objects included
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> loaded( config );
+		CHECK( loaded.LoadSnapshot( &buffer[0], buffer.size() ) );
+		CHECK( loaded.GetPlayerFrame( 0 ) == instance.GetPlayerFrame( 0 ) );
+		CHECK( loaded.GetObjectAuthority( 1 ) == 0 );
+		CHECK( loaded.GetActiveObjectCount() == 0 );
+
+		for ( int i = 1; i <= 21; ++i )
+		{
+			cubes::ActiveObject a, b;
+			instance.GetObjectState( i, a );
+			loaded.GetObjectState( i, b );
+			CHECK( a.position.x == b.position.x );
+			CHECK( a.position.y == b.position.y );
+			CHECK( a.position.z == b.position.z );
+			CHECK( a.scale == b.scale );
+		}
+
+		loaded.OnPlayerJoined( 0 );
+		loaded.SetLocalPlayer( 0 );
+		loaded.SetPlayerFocus( 0, 1 );
+		loaded.Update();
+		CHECK( loaded.GetActiveObjectCount() > 0 );
+
+		// corrupt, truncated and mismatched snapshots are rejected
+
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> rejected( config );
+		std::vector<uint8_t> corrupt = buffer;
+		corrupt[corrupt.size()-1] ^= 1;
+		CHECK( !rejected.LoadSnapshot( &corrupt[0], corrupt.size() ) );
+		CHECK( !rejected.LoadSnapshot( &buffer[0], buffer.size() - 4 ) );
+
+		game::Config otherConfig = config;
+		otherConfig.cellWidth = 32;
+		game::Instance<cubes::DatabaseObject, cubes::ActiveObject> mismatched( otherConfig );
+		CHECK( !mismatched.LoadSnapshot( &buffer[0], buffer.size() ) );
+
+		// so are snapshots with a good checksum but a duplicate id or a position off the grid
+
+		for ( int i = 0; i < 2; ++i )
+		{
+			std::vector<uint8_t> tampered = buffer;
+			game::SnapshotHeader * header = (game::SnapshotHeader*) &tampered[0];
+			game::SnapshotCellObject * cellObjects = (game::SnapshotCellObject*) ( &tampered[0] + header->cellObjectOffset );
+			if ( i == 0 )
+				cellObjects[1].id = cellObjects[0].id;
+			else
+				cellObjects[0].x = 1000.0f;
+			header->checksum = game::SnapshotChecksum( &tampered[0] + sizeof( game::SnapshotHeader ), tampered.size() - sizeof( game::SnapshotHeader ) );
+			CHECK( !rejected.LoadSnapshot( &tampered[0], tampered.size() ) );
+		}
+
+		// and a rejected snapshot leaves the instance untouched
+
+		CHECK( rejected.LoadSnapshot( &buffer[0], buffer.size() ) );
+	}
+
 	TEST( game_object_persistence )
 	{
 		printf( "game object persistence\n" );
@@ -1262,6 +2285,133 @@ SUITE( Game )
 		}
 	}
 }
+
+SUITE( Recorder )
+{
+	TEST( recorder_round_trip )
+	{
+		printf( "recorder round trip\n" );
+
+		const char * filename = "recorder_round_trip.cubes";
+
+		game::Input input;
+		input.left = 1.0f;
+		input.push = 0.5f;
+
+		game::Input other;
+		other.up = 1.0f;
+
+		const unsigned char a[] = { 1, 2, 3, 4, 5 };
+		const unsigned char b[] = { 9, 8, 7 };
+
+		// inputs are only written when they change, so the second frame carries none
+
+		game::Recorder recorder;
+		CHECK( recorder.Open( filename, 2 ) );
+
+		recorder.BeginFrame( 1.0f / 60, 1, game::RECORDER_Send );
+		recorder.RecordInput( 1, 2, input );
+		recorder.RecordPacket( 0, 1, a, sizeof( a ) );
+		recorder.RecordPacket( 1, 0, b, sizeof( b ) );
+		recorder.EndFrame();
+
+		recorder.BeginFrame( 1.0f / 30, 0, 0 );
+		recorder.RecordInput( 1, 2, input );
+		recorder.EndFrame();
+
+		recorder.BeginFrame( 1.0f / 60, 2, 0 );
+		recorder.RecordInput( 0, 0, other );
+		recorder.RecordPacket( 1, 0, NULL, 0 );
+		recorder.EndFrame();
+
+		CHECK( recorder.GetFrames() == 3 );
+		recorder.Close();
+
+		game::Replay replay;
+		CHECK( replay.Open( filename, 16 ) );
+		CHECK( replay.GetNumInstances() == 2 );
+
+		game::ReplayFrame frame;
+		CHECK( replay.ReadFrame( frame ) );
+		CHECK( frame.deltaTime == 1.0f / 60 );
+		CHECK( frame.syncMode == 1 );
+		CHECK( frame.flags == game::RECORDER_Send );
+		CHECK( frame.input[MaxPlayers+2].left == 1.0f );
+		CHECK( frame.input[MaxPlayers+2].push == 0.5f );
+		CHECK( frame.input[0].up == 0.0f );
+		CHECK( frame.packets.size() == 2 );
+		if ( frame.packets.size() == 2 )
+		{
+			CHECK( frame.packets[0].from == 0 );
+			CHECK( frame.packets[0].to == 1 );
+			CHECK( frame.packets[0].bytes == (int) sizeof( a ) );
+			CHECK( memcmp( frame.packets[0].data, a, sizeof( a ) ) == 0 );
+			CHECK( frame.packets[1].from == 1 );
+			CHECK( frame.packets[1].to == 0 );
+			CHECK( frame.packets[1].bytes == (int) sizeof( b ) );
+			CHECK( memcmp( frame.packets[1].data, b, sizeof( b ) ) == 0 );
+		}
+
+		CHECK( replay.ReadFrame( frame ) );
+		CHECK( frame.deltaTime == 1.0f / 30 );
+		CHECK( frame.syncMode == 0 );
+		CHECK( frame.flags == 0 );
+		CHECK( frame.input[MaxPlayers+2].left == 1.0f );
+		CHECK( frame.packets.size() == 0 );
+
+		CHECK( replay.ReadFrame( frame ) );
+		CHECK( frame.syncMode == 2 );
+		CHECK( frame.input[0].up == 1.0f );
+		CHECK( frame.input[MaxPlayers+2].push == 0.5f );
+		CHECK( frame.packets.size() == 1 );
+		if ( frame.packets.size() == 1 )
+		{
+			CHECK( frame.packets[0].bytes == 0 );
+			CHECK( frame.packets[0].data == NULL );
+		}
+
+		CHECK( !replay.ReadFrame( frame ) );
+		CHECK( !replay.IsCorrupt() );
+		replay.Close();
+
+		// packets larger than the receiver can hold are corrupt
+
+		CHECK( replay.Open( filename, 4 ) );
+		CHECK( !replay.ReadFrame( frame ) );
+		CHECK( replay.IsCorrupt() );
+		replay.Close();
+
+		// so is a log cut off partway through a frame
+
+		std::vector<unsigned char> log;
+		FILE * file = fopen( filename, "rb" );
+		CHECK( file );
+		if ( file )
+		{
+			unsigned char buffer[256];
+			int bytes;
+			while ( ( bytes = fread( buffer, 1, sizeof( buffer ), file ) ) > 0 )
+				log.insert( log.end(), buffer, buffer + bytes );
+			fclose( file );
+		}
+		file = fopen( filename, "wb" );
+		CHECK( file );
+		if ( file )
+		{
+			fwrite( &log[0], 1, log.size() - 2, file );
+			fclose( file );
+		}
+
+		CHECK( replay.Open( filename, 16 ) );
+		CHECK( replay.ReadFrame( frame ) );
+		CHECK( replay.ReadFrame( frame ) );
+		CHECK( !replay.ReadFrame( frame ) );
+		CHECK( replay.IsCorrupt() );
+		replay.Close();
+
+		remove( filename );
+	}
+}
 	
 // ------------------------------------------------------------------------------------------------------
 
@@ -1470,6 +2620,136 @@ SUITE( BitPacker )
 		CHECK( g == g_out );
 		CHECK( h == h_out );
 	}
+
+	TEST( unaligned_tail )
+	{
+		unsigned char buffer[16];
+		memset( buffer, 0xCD, sizeof( buffer ) );
+
+		// 11 bytes: two whole words then a short one. no clearing first
+
+		const int bytes = 11;
+		const int bits[] = { 5, 32, 27, 17, 7 };
+		const unsigned int values[] = { 0x15, 0xDEADBEEF, 0x5A5A5A5, 0x1ABCD, 0x55 };
+
+		BitPacker bitpacker( BitPacker::Write, buffer, bytes );
+		for ( int i = 0; i < 5; ++i )
+			bitpacker.WriteBits( values[i], bits[i] );
+		CHECK( bitpacker.GetBits() == bytes * 8 );
+		CHECK( bitpacker.GetBytes() == bytes );
+		CHECK( bitpacker.BitsRemaining() == 0 );
+		for ( int i = bytes; i < (int) sizeof( buffer ); ++i )
+			CHECK( buffer[i] == 0xCD );
+
+		bitpacker = BitPacker( BitPacker::Read, buffer, bytes );
+		for ( int i = 0; i < 5; ++i )
+		{
+			unsigned int value = 0;
+			bitpacker.ReadBits( value, bits[i] );
+			CHECK( value == values[i] );
+		}
+		CHECK( bitpacker.BitsRemaining() == 0 );
+	}
+}
+
+SUITE( ArithmeticCoder )
+{
+	TEST( models_and_direct_bits )
+	{
+		unsigned char buffer[8192];
+		memset( buffer, 0, sizeof( buffer ) );
+
+		const int count = 1000;
+
+		BitModel writeBit;
+		IntegerModel writeInteger;
+
+		ArithmeticCoder writer( ArithmeticCoder::Write, buffer, sizeof( buffer ) );
+		srand( 100 );
+		for ( int i = 0; i < count; ++i )
+		{
+			writer.EncodeBit( writeBit, rand() % 10 == 0 );
+			writer.EncodeInteger( rand() % 4 == 0 ? rand() : rand() % 8, writeInteger );
+			writer.EncodeDirectBits( i, 1 + i % 32 );
+			CHECK( writer.WriteInteger( i, 0, count ) );
+		}
+		writer.Flush();
+		CHECK( !writer.IsOverflow() );
+
+		// bit packed this is 1 + 32 + 16.5 + 10 bits per iteration
+
+		const int bytes = writer.GetBytes();
+		CHECK( bytes < count * ( 1 + 32 + 17 + 10 ) / 8 * 3 / 4 );
+
+		BitModel readBit;
+		IntegerModel readInteger;
+
+		ArithmeticCoder reader( ArithmeticCoder::Read, buffer, bytes );
+		srand( 100 );
+		for ( int i = 0; i < count; ++i )
+		{
+			const unsigned int bit = rand() % 10 == 0;
+			CHECK( reader.DecodeBit( readBit ) == bit );
+			const unsigned int integer = rand() % 4 == 0 ? rand() : rand() % 8;
+			CHECK( reader.DecodeInteger( readInteger ) == integer );
+			const unsigned int direct = 1 + i % 32 < 32 ? i & ( ( 1 << ( 1 + i % 32 ) ) - 1 ) : i;
+			CHECK( reader.DecodeDirectBits( 1 + i % 32 ) == direct );
+			unsigned int value = 0xFFFFFFFF;
+			CHECK( reader.ReadInteger( value, 0, count ) );
+			CHECK( value == (unsigned int) i );
+		}
+		CHECK( !reader.IsOverflow() );
+		CHECK( readBit.probability == writeBit.probability );
+	}
+
+	TEST( skewed_bits )
+	{
+		unsigned char buffer[256];
+
+		BitModel model;
+		ArithmeticCoder writer( ArithmeticCoder::Write, buffer, sizeof( buffer ) );
+		for ( int i = 0; i < 1000; ++i )
+			writer.EncodeBit( model, i % 50 == 0 );
+		writer.Flush();
+
+		// 1000 bits at 1 in 50 is ~140 bits of information
+
+		CHECK( !writer.IsOverflow() );
+		CHECK( writer.GetBytes() < 40 );
+
+		model = BitModel();
+		ArithmeticCoder reader( ArithmeticCoder::Read, buffer, writer.GetBytes() );
+		int errors = 0;
+		for ( int i = 0; i < 1000; ++i )
+			if ( reader.DecodeBit( model ) != ( i % 50 == 0 ) )
+				errors++;
+		CHECK( errors == 0 );
+		CHECK( !reader.IsOverflow() );
+	}
+
+	TEST( overflow )
+	{
+		unsigned char buffer[8];
+
+		ArithmeticCoder writer( ArithmeticCoder::Write, buffer, sizeof( buffer ) );
+		for ( int i = 0; i < 4; ++i )
+			writer.EncodeDirectBits( 0x12345678, 32 );
+		writer.Flush();
+		CHECK( writer.IsOverflow() );
+		CHECK( writer.GetBytes() == 8 );
+
+		writer = ArithmeticCoder( ArithmeticCoder::Write, buffer, sizeof( buffer ) );
+		writer.EncodeDirectBits( 0x12345678, 32 );
+		writer.Flush();
+		CHECK( !writer.IsOverflow() );
+
+		ArithmeticCoder reader( ArithmeticCoder::Read, buffer, writer.GetBytes() );
+		CHECK( reader.DecodeDirectBits( 32 ) == 0x12345678 );
+		CHECK( !reader.IsOverflow() );
+		reader.DecodeDirectBits( 32 );
+		reader.DecodeDirectBits( 32 );
+		CHECK( reader.IsOverflow() );
+	}
 }
 
 SUITE( Stream )
@@ -1966,9 +3246,116 @@ SUITE( Stream )
 		CHECK( stream.SerializeInteger( c_out, 0, c ) );
 		CHECK( stream.Checkpoint() );
 
-		CHECK( a == a_out );
-		CHECK( b == b_out );
-		CHECK( c == c_out );
+		CHECK( a == a_out );
+		CHECK( b == b_out );
+		CHECK( c == c_out );
+	}
+	TEST( range_coded )
+	{
+		unsigned int ProtocolId = 0x12345678;
+
+		unsigned char buffer[1024];
+		unsigned char journal[1024];
+		unsigned char packet[2048];
+
+		const int count = 100;
+
+		IntegerModel integerModel;
+		IntegerModel floatModel;
+		BitModel boolModel;
+
+		Stream stream( Stream::Write, Stream::RangeCoded, buffer, sizeof(buffer), journal, sizeof(journal) );
+		CHECK( stream.GetBackend() == Stream::RangeCoded );
+		for ( int i = 0; i < count; ++i )
+		{
+			unsigned int integer = 1000 + i % 3;
+			float velocity = ( i % 5 - 2 ) * 0.25f;
+			bool enabled = i % 10 == 0;
+			unsigned int raw = i * 12345;
+			CHECK( stream.SerializeInteger( integer, 1000, 100000, integerModel ) );
+			CHECK( stream.SerializeCompressedFloat( velocity, -64.0f, +64.0f, 1.0f / 256, floatModel ) );
+			CHECK( stream.SerializeBoolean( enabled, boolModel ) );
+			CHECK( stream.SerializeBits( raw, 24 ) );
+		}
+		CHECK( stream.Checkpoint() );
+		CHECK( stream.Finish() );
+
+		// the same values bit packed: 17 + 16 + 1 + 24 bits each
+
+		CHECK( stream.GetDataBytes() < count * ( 17 + 16 + 1 + 24 ) / 8 * 3 / 4 );
+
+		int packetSize = sizeof( packet );
+		BuildStreamPacket( stream, packet, packetSize, ProtocolId );
+
+		CHECK( ReadStreamPacket( stream, packet, packetSize, ProtocolId, Stream::RangeCoded ) );
+
+		integerModel = IntegerModel();
+		floatModel = IntegerModel();
+		boolModel = BitModel();
+
+		for ( int i = 0; i < count; ++i )
+		{
+			unsigned int integer = 0;
+			float velocity = 100.0f;
+			bool enabled = false;
+			unsigned int raw = 0;
+			CHECK( stream.SerializeInteger( integer, 1000, 100000, integerModel ) );
+			CHECK( stream.SerializeCompressedFloat( velocity, -64.0f, +64.0f, 1.0f / 256, floatModel ) );
+			CHECK( stream.SerializeBoolean( enabled, boolModel ) );
+			CHECK( stream.SerializeBits( raw, 24 ) );
+			CHECK( integer == (unsigned int) ( 1000 + i % 3 ) );
+			CHECK_CLOSE( ( i % 5 - 2 ) * 0.25f, velocity, 0.001f );
+			CHECK( enabled == ( i % 10 == 0 ) );
+			CHECK( raw == ( ( i * 12345 ) & 0xFFFFFF ) );
+		}
+		CHECK( stream.Checkpoint() );
+		CHECK( stream.Finish() );
+	}
+	TEST( range_coded_prediction )
+	{
+		unsigned int ProtocolId = 0x12345678;
+
+		unsigned char buffer[1024];
+		unsigned char journal[1024];
+		unsigned char packet[2048];
+
+		const int count = 100;
+		const float resolution = 1.0f / 512;
+
+		// positions between quantization steps, so predicting from the float would differ on each side
+
+		IntegerModel model;
+		unsigned int previous = Stream::QuantizeFloat( 0.0f, -256.0f, +256.0f, resolution );
+		unsigned int writtenPrevious[count];
+
+		Stream stream( Stream::Write, Stream::RangeCoded, buffer, sizeof(buffer), journal, sizeof(journal) );
+		for ( int i = 0; i < count; ++i )
+		{
+			float position = i * 0.37f + resolution * 0.49f;
+			CHECK( stream.SerializeCompressedFloat( position, -256.0f, +256.0f, resolution, model, previous ) );
+			writtenPrevious[i] = previous;
+			CHECK( previous == Stream::QuantizeFloat( position, -256.0f, +256.0f, resolution ) );
+		}
+		CHECK( stream.Checkpoint() );
+		CHECK( stream.Finish() );
+
+		int packetSize = sizeof( packet );
+		BuildStreamPacket( stream, packet, packetSize, ProtocolId );
+
+		CHECK( ReadStreamPacket( stream, packet, packetSize, ProtocolId, Stream::RangeCoded ) );
+
+		model = IntegerModel();
+		previous = Stream::QuantizeFloat( 0.0f, -256.0f, +256.0f, resolution );
+
+		for ( int i = 0; i < count; ++i )
+		{
+			float position = 0.0f;
+			CHECK( stream.SerializeCompressedFloat( position, -256.0f, +256.0f, resolution, model, previous ) );
+			CHECK( previous == writtenPrevious[i] );
+			CHECK_CLOSE( i * 0.37f, position, resolution );
+		}
+		CHECK( stream.Checkpoint() );
+		CHECK( stream.Finish() );
 	}
 }
 
@@ -2364,63 +3751,56 @@ SUITE( Connection )
 
 // ------------------------------------------------------------------------------------------------------
 
-SUITE( PacketQueue )
+SUITE( SequenceBuffer )
 {
-	const unsigned int MaximumSequence = 255;
-
-	TEST( insert_back )
+	TEST( insert_find_remove )
 	{
-		net::PacketQueue packetQueue;
-		for ( int i = 0; i < 100; ++i )
-		{
-			PacketData data;
-			data.sequence = i;
-			packetQueue.insert_sorted( data, MaximumSequence );
-			packetQueue.verify_sorted( MaximumSequence );
-		}
-	}
-	
-	TEST( insert_front )
-	{		
-		net::PacketQueue packetQueue;
-		for ( int i = 100; i < 0; ++i )
+		SequenceBuffer<int> buffer( 16 );
+		CHECK( buffer.GetSize() == 16 );
+		for ( int i = 0; i < 16; ++i )
+			*buffer.Insert( i ) = i;
+		for ( int i = 0; i < 16; ++i )
 		{
-			PacketData data;
-			data.sequence = i;
-			packetQueue.insert_sorted( data, MaximumSequence );
-			packetQueue.verify_sorted( MaximumSequence );
+			const int * entry = buffer.Find( i );
+			CHECK( entry && *entry == i );
 		}
-	}
 
-	TEST( insert_random )
-	{
-		net::PacketQueue packetQueue;
-		for ( int i = 100; i < 0; ++i )
-		{
-			PacketData data;
-			data.sequence = rand() & 0xFF;
-			packetQueue.insert_sorted( data, MaximumSequence );
-			packetQueue.verify_sorted( MaximumSequence );
-		}
+		// a newer sequence takes over the slot, the old one is gone
+
+		*buffer.Insert( 16 ) = 16;
+		CHECK( buffer.Find( 0 ) == NULL );
+		CHECK( buffer.Find( 16 ) && *buffer.Find( 16 ) == 16 );
+
+		// removing a sequence the slot no longer holds leaves it alone
+
+		buffer.Remove( 0 );
+		CHECK( buffer.Find( 16 ) != NULL );
+		buffer.Remove( 16 );
+		CHECK( buffer.Find( 16 ) == NULL );
+
+		buffer.Reset();
+		for ( int i = 0; i < 16; ++i )
+			CHECK( buffer.Find( i ) == NULL );
 	}
 
-	TEST( insert_wrap_around )
+	TEST( wrap_around )
 	{
-		net::PacketQueue packetQueue;
+		SequenceBuffer<int> buffer( 256 );
 		for ( int i = 200; i <= 255; ++i )
-		{
-			PacketData data;
-			data.sequence = i;
-			packetQueue.insert_sorted( data, MaximumSequence );
-			packetQueue.verify_sorted( MaximumSequence );
-		}
+			*buffer.Insert( i ) = i;
 		for ( int i = 0; i <= 50; ++i )
-		{
-			PacketData data;
-			data.sequence = i;
-			packetQueue.insert_sorted( data, MaximumSequence );
-			packetQueue.verify_sorted( MaximumSequence );
-		}
+			*buffer.Insert( i ) = i;
+		for ( int i = 200; i <= 255; ++i )
+			CHECK( buffer.Find( i ) && *buffer.Find( i ) == i );
+		for ( int i = 0; i <= 50; ++i )
+			CHECK( buffer.Find( i ) && *buffer.Find( i ) == i );
+		for ( int i = 51; i < 200; ++i )
+			CHECK( buffer.Find( i ) == NULL );
+
+		unsigned int slotSequence = 0;
+		CHECK( buffer.GetSlot( 300, slotSequence ) != NULL );
+		CHECK( slotSequence == 44 );
+		CHECK( buffer.GetSlot( 100, slotSequence ) == NULL );
 	}
 }
 
@@ -2428,235 +3808,179 @@ SUITE( PacketQueue )
 
 SUITE( Reliability )
 {
-	const int MaximumSequence = 255;
+	const unsigned int MaximumSequence = 255;
 
-	TEST( bit_index_for_sequence )
-	{
-		CHECK( ReliabilitySystem::bit_index_for_sequence( 99, 100, MaximumSequence ) == 0 );
-		CHECK( ReliabilitySystem::bit_index_for_sequence( 90, 100, MaximumSequence ) == 9 );
-		CHECK( ReliabilitySystem::bit_index_for_sequence( 0, 1, MaximumSequence ) == 0 );
-		CHECK( ReliabilitySystem::bit_index_for_sequence( 255, 0, MaximumSequence ) == 0 );
-		CHECK( ReliabilitySystem::bit_index_for_sequence( 255, 1, MaximumSequence ) == 1 );
-		CHECK( ReliabilitySystem::bit_index_for_sequence( 254, 1, MaximumSequence ) == 2 );
-		CHECK( ReliabilitySystem::bit_index_for_sequence( 254, 2, MaximumSequence ) == 3 );
-	}
-	
 	TEST( generate_ack_bits )
 	{
-		net::PacketQueue packetQueue;
-		for ( int i = 0; i < 32; ++i )
-		{
-			PacketData data;
-			data.sequence = i;
-			packetQueue.insert_sorted( data, MaximumSequence );
-			packetQueue.verify_sorted( MaximumSequence );
-		}
-		CHECK( ReliabilitySystem::generate_ack_bits( 32, packetQueue, MaximumSequence ) == 0xFFFFFFFF );
-		CHECK( ReliabilitySystem::generate_ack_bits( 31, packetQueue, MaximumSequence ) == 0x7FFFFFFF );
-		CHECK( ReliabilitySystem::generate_ack_bits( 33, packetQueue, MaximumSequence ) == 0xFFFFFFFE );
-		CHECK( ReliabilitySystem::generate_ack_bits( 16, packetQueue, MaximumSequence ) == 0x0000FFFF );
-		CHECK( ReliabilitySystem::generate_ack_bits( 48, packetQueue, MaximumSequence ) == 0xFFFF0000 );
+		ReliabilitySystem receiver( MaximumSequence );
+		for ( int i = 0; i <= 64; ++i )
+			receiver.PacketReceived( i, 100 );
+		CHECK( receiver.GetRemoteSequence() == 64 );
+		CHECK( receiver.GenerateAckBits() == ~0ULL );
+
+		// every other packet dropped
+
+		ReliabilitySystem sparse( MaximumSequence );
+		for ( int i = 0; i <= 100; i += 2 )
+			sparse.PacketReceived( i, 100 );
+		CHECK( sparse.GetRemoteSequence() == 100 );
+		CHECK( sparse.GenerateAckBits() == 0xAAAAAAAAAAAAAAAAULL );
 	}
-	
+
 	TEST( generate_ack_bits_with_wrap )
 	{
-		net::PacketQueue packetQueue;
-		for ( int i = 255 - 31; i <= 255; ++i )
+		ReliabilitySystem receiver( MaximumSequence );
+		for ( int i = 0; i <= 72; ++i )
 		{
-			PacketData data;
-			data.sequence = i;
-			packetQueue.insert_sorted( data, MaximumSequence );
-			packetQueue.verify_sorted( MaximumSequence );
+			if ( i % 4 != 1 )
+				receiver.PacketReceived( ( 200 + i ) & 0xFF, 100 );
 		}
-		CHECK( packetQueue.size() == 32 );
-		CHECK( ReliabilitySystem::generate_ack_bits( 0, packetQueue, MaximumSequence ) == 0xFFFFFFFF );
-		CHECK( ReliabilitySystem::generate_ack_bits( 255, packetQueue, MaximumSequence ) == 0x7FFFFFFF );
-		CHECK( ReliabilitySystem::generate_ack_bits( 1, packetQueue, MaximumSequence ) == 0xFFFFFFFE );
-		CHECK( ReliabilitySystem::generate_ack_bits( 240, packetQueue, MaximumSequence ) == 0x0000FFFF );
-		CHECK( ReliabilitySystem::generate_ack_bits( 16, packetQueue, MaximumSequence ) == 0xFFFF0000 );
+		CHECK( receiver.GetRemoteSequence() == 16 );
+
+		// bit n is sequence 15 - n, which wraps back through 255 to 208
+
+		const uint64_t ack_bits = receiver.GenerateAckBits();
+		for ( int n = 0; n < 64; ++n )
+			CHECK( ( ( ack_bits >> n ) & 1 ) == ( ( 71 - n ) % 4 != 1 ) );
 	}
-	
-	TEST( process_ack_1 )
-	{
-		net::PacketQueue pendingAckQueue;
-		for ( int i = 0; i < 33; ++i )
-		{
-			PacketData data;
-			data.sequence = i;
-			data.time = 0.0f;
-			pendingAckQueue.insert_sorted( data, MaximumSequence );
-			pendingAckQueue.verify_sorted( MaximumSequence );
-		}
-		net::PacketQueue ackedQueue;
-		std::vector<unsigned int> acks;
-		float rtt = 0.0f;
-		unsigned int acked_packets = 0;
-		ReliabilitySystem::process_ack( 32, 0xFFFFFFFF, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, MaximumSequence );
-		CHECK( acks.size() == 33 );
-		CHECK( acked_packets == 33 );
-		CHECK( ackedQueue.size() == 33 );
-		CHECK( pendingAckQueue.size() == 0 );
-		ackedQueue.verify_sorted( MaximumSequence );
-		for ( unsigned int i = 0; i < acks.size(); ++i )
-			CHECK( acks[i] == i );
-		unsigned int i = 0;
-		for ( net::PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == i );
+
+	TEST( generate_ack_bits_out_of_order )
+	{
+		ReliabilitySystem receiver( MaximumSequence );
+		receiver.PacketReceived( 10, 100 );
+		receiver.PacketReceived( 8, 100 );
+		receiver.PacketReceived( 9, 100 );
+		receiver.PacketReceived( 5, 100 );
+		receiver.PacketReceived( 8, 100 );
+		CHECK( receiver.GetRemoteSequence() == 10 );
+		CHECK( receiver.GenerateAckBits() == ( 1ULL | 2ULL | 16ULL ) );
+
+		// older than the window is not acked, the oldest bit is exactly 64 back
+
+		receiver.PacketReceived( 100, 100 );
+		CHECK( receiver.GenerateAckBits() == 0 );
+		receiver.PacketReceived( 30, 100 );
+		CHECK( receiver.GenerateAckBits() == 0 );
+		receiver.PacketReceived( 36, 100 );
+		CHECK( receiver.GenerateAckBits() == 1ULL << 63 );
 	}
-	
-	TEST( process_ack_2 )
-	{
-		net::PacketQueue pendingAckQueue;
-		for ( int i = 0; i < 33; ++i )
-		{
-			PacketData data;
-			data.sequence = i;
-			data.time = 0.0f;
-			pendingAckQueue.insert_sorted( data, MaximumSequence );
-			pendingAckQueue.verify_sorted( MaximumSequence );
-		}
-		net::PacketQueue ackedQueue;
-		std::vector<unsigned int> acks;
-		float rtt = 0.0f;
-		unsigned int acked_packets = 0;
-		ReliabilitySystem::process_ack( 32, 0x0000FFFF, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, MaximumSequence );
-		CHECK( acks.size() == 17 );
-		CHECK( acked_packets == 17 );
-		CHECK( ackedQueue.size() == 17 );
-		CHECK( pendingAckQueue.size() == 33 - 17 );
-		ackedQueue.verify_sorted( MaximumSequence );
-		unsigned int i = 0;
-		for ( net::PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == i );
-		i = 0;
-		for ( net::PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == i + 16 );
-		for ( unsigned int i = 0; i < acks.size(); ++i )
-			CHECK( acks[i] == i + 16 );
-	}
-
-	TEST( process_ack_3 )
-	{
-		net::PacketQueue pendingAckQueue;
-		for ( int i = 0; i < 32; ++i )
-		{
-			PacketData data;
-			data.sequence = i;
-			data.time = 0.0f;
-			pendingAckQueue.insert_sorted( data, MaximumSequence );
-			pendingAckQueue.verify_sorted( MaximumSequence );
-		}
-		net::PacketQueue ackedQueue;
-		std::vector<unsigned int> acks;
-		float rtt = 0.0f;
-		unsigned int acked_packets = 0;
-		ReliabilitySystem::process_ack( 48, 0xFFFF0000, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, MaximumSequence );
-		CHECK( acks.size() == 16 );
-		CHECK( acked_packets == 16 );
-		CHECK( ackedQueue.size() == 16 );
-		CHECK( pendingAckQueue.size() == 16 );
-		ackedQueue.verify_sorted( MaximumSequence );
-		unsigned int i = 0;
-		for ( net::PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == i );
-		i = 0;
-		for ( net::PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == i + 16 );
-		for ( unsigned int i = 0; i < acks.size(); ++i )
-			CHECK( acks[i] == i + 16 );
+
+	TEST( small_max_sequence_narrows_window )
+	{
+		// with sequences 0..31 anything more than 15 back is ambiguous
+
+		ReliabilitySystem receiver( 31 );
+		for ( int i = 0; i <= 20; ++i )
+			receiver.PacketReceived( i, 100 );
+		CHECK( receiver.GenerateAckBits() == 0x7FFF );
+
+		ReliabilitySystem sender( 31 );
+		for ( int i = 0; i <= 20; ++i )
+			sender.PacketSent( 100 );
+		sender.ProcessAck( 20, ~0ULL );
+		CHECK( sender.GetAckedPackets() == 16 );
 	}
-	
-	TEST( process_ack_wrap_around_1 )
-	{
-		net::PacketQueue pendingAckQueue;
-		for ( int i = 255 - 31; i <= 256; ++i )
-		{
-			PacketData data;
-			data.sequence = i & 0xFF;
-			data.time = 0.0f;
-			pendingAckQueue.insert_sorted( data, MaximumSequence );
-			pendingAckQueue.verify_sorted( MaximumSequence );
-		}
-		CHECK( pendingAckQueue.size() == 33 );
-		net::PacketQueue ackedQueue;
-		std::vector<unsigned int> acks;
-		float rtt = 0.0f;
-		unsigned int acked_packets = 0;
-		ReliabilitySystem::process_ack( 0, 0xFFFFFFFF, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, MaximumSequence );
-		CHECK( acks.size() == 33 );
-		CHECK( acked_packets == 33 );
-		CHECK( ackedQueue.size() == 33 );
-		CHECK( pendingAckQueue.size() == 0 );
-		ackedQueue.verify_sorted( MaximumSequence );
-		for ( unsigned int i = 0; i < acks.size(); ++i )
-			CHECK( acks[i] == ( (i+255-31) & 0xFF ) );
-		unsigned int i = 0;
-		for ( net::PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == ( (i+255-31) & 0xFF ) );
+
+	TEST( process_ack_with_wrap )
+	{
+		ReliabilitySystem sender( MaximumSequence );
+
+		// send 200 and let them all go, then 100 more across the wrap: 200..255, 0..43
+
+		for ( int i = 0; i < 200; ++i )
+			sender.PacketSent( 100 );
+		sender.Update( 2.0f );
+		CHECK( sender.GetLostPackets() == 200 );
+		for ( int i = 0; i < 100; ++i )
+			sender.PacketSent( 100 );
+		CHECK( sender.GetLocalSequence() == 44 );
+
+		// a full ack of 16 covers 208..255 and 0..16, oldest first
+
+		sender.ProcessAck( 16, ~0ULL );
+		unsigned int * acks = NULL;
+		int ack_count = 0;
+		sender.GetAcks( &acks, ack_count );
+		CHECK( ack_count == 65 );
+		for ( int i = 0; i < ack_count; ++i )
+			CHECK( acks[i] == ( ( 208 + i ) & 0xFF ) );
+		sender.Update( 0.0f );
+
+		// only the low 16 bits: 27..42 plus the ack itself
+
+		sender.ProcessAck( 43, 0xFFFFULL );
+		sender.GetAcks( &acks, ack_count );
+		CHECK( ack_count == 17 );
+		for ( int i = 0; i < ack_count; ++i )
+			CHECK( acks[i] == (unsigned int) ( 27 + i ) );
+		sender.Update( 0.0f );
+
+		// a full ack of 43 reaches back to 235, only 17..26 are new
+
+		sender.ProcessAck( 43, ~0ULL );
+		sender.GetAcks( &acks, ack_count );
+		CHECK( ack_count == 10 );
+		for ( int i = 0; i < ack_count; ++i )
+			CHECK( acks[i] == (unsigned int) ( 17 + i ) );
+		CHECK( sender.GetAckedPackets() == 92 );
+
+		// 200..207 were never acked
+
+		sender.Update( 1.5f );
+		CHECK( sender.GetLostPackets() == 208 );
 	}
-	
-	TEST( process_ack_wrap_around_2 )
-	{
-		net::PacketQueue pendingAckQueue;
-		for ( int i = 255 - 31; i <= 256; ++i )
-		{
-			PacketData data;
-			data.sequence = i & 0xFF;
-			data.time = 0.0f;
-			pendingAckQueue.insert_sorted( data, MaximumSequence );
-			pendingAckQueue.verify_sorted( MaximumSequence );
-		}
-		CHECK( pendingAckQueue.size() == 33 );
-		net::PacketQueue ackedQueue;
-		std::vector<unsigned int> acks;
-		float rtt = 0.0f;
-		unsigned int acked_packets = 0;
-		ReliabilitySystem::process_ack( 0, 0x0000FFFF, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, MaximumSequence );
-		CHECK( acks.size() == 17 );
-		CHECK( acked_packets == 17 );
-		CHECK( ackedQueue.size() == 17 );
-		CHECK( pendingAckQueue.size() == 33 - 17 );
-		ackedQueue.verify_sorted( MaximumSequence );
-		for ( unsigned int i = 0; i < acks.size(); ++i )
-			CHECK( acks[i] == ( (i+255-15) & 0xFF ) );
-		unsigned int i = 0;
-		for ( net::PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == i + 255 - 31 );
-		i = 0;
-		for ( net::PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == ( (i+255-15) & 0xFF ) );
-	}
-
-	TEST( process_ack_wrap_around_3 )
-	{
-		net::PacketQueue pendingAckQueue;
-		for ( int i = 255 - 31; i <= 255; ++i )
-		{
-			PacketData data;
-			data.sequence = i & 0xFF;
-			data.time = 0.0f;
-			pendingAckQueue.insert_sorted( data, MaximumSequence );
-			pendingAckQueue.verify_sorted( MaximumSequence );
-		}
-		CHECK( pendingAckQueue.size() == 32 );
-		net::PacketQueue ackedQueue;
-		std::vector<unsigned int> acks;
-		float rtt = 0.0f;
-		unsigned int acked_packets = 0;
-		ReliabilitySystem::process_ack( 16, 0xFFFF0000, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, MaximumSequence );
-		CHECK( acks.size() == 16 );
-		CHECK( acked_packets == 16 );
-		CHECK( ackedQueue.size() == 16 );
-		CHECK( pendingAckQueue.size() == 16 );
-		ackedQueue.verify_sorted( MaximumSequence );
-		for ( unsigned int i = 0; i < acks.size(); ++i )
-			CHECK( acks[i] == ( (i+255-15) & 0xFF ) );
-		unsigned int i = 0;
-		for ( net::PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == i + 255 - 31 );
-		i = 0;
-		for ( net::PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor, ++i )
-			CHECK( itor->sequence == ( (i+255-15) & 0xFF ) );
+
+	TEST( reliability_system_ack_window )
+	{
+		ReliabilitySystem sender;
+		ReliabilitySystem receiver;
+
+		// every tenth packet is dropped on the way
+
+		for ( int i = 0; i < 100; ++i )
+		{
+			sender.PacketSent( 100 );
+			if ( i % 10 != 0 )
+				receiver.PacketReceived( i, 100 );
+		}
+
+		CHECK( receiver.GetRemoteSequence() == 99 );
+
+		const uint64_t ack_bits = receiver.GenerateAckBits();
+		for ( int n = 0; n < 64; ++n )
+			CHECK( ( ( ack_bits >> n ) & 1 ) == ( ( 98 - n ) % 10 != 0 ) );
+
+		// the ack and its 64 bits cover 35..99, less the six dropped in that range
+
+		sender.ProcessAck( 99, ack_bits );
+		sender.ProcessAck( 99, ack_bits );
+
+		unsigned int * acks = NULL;
+		int ack_count = 0;
+		sender.GetAcks( &acks, ack_count );
+		CHECK( ack_count == 59 );
+		CHECK( acks[0] == 35 );
+		CHECK( acks[ack_count-1] == 99 );
+		CHECK( sender.GetAckedPackets() == 59 );
+		CHECK( sender.GetLostPackets() == 0 );
+
+		// anything not acked by rtt maximum is lost
+
+		sender.Update( 0.5f );
+		CHECK( sender.GetLostPackets() == 0 );
+		CHECK( sender.GetSentBandwidth() > 0.0f );
+		sender.Update( 0.6f );
+		CHECK( sender.GetLostPackets() == 41 );
+		CHECK( sender.GetSentBandwidth() == 0.0f );
+
+		// a jump of exactly the window keeps the old remote sequence in the last bit, anything further drops it
+
+		ReliabilitySystem jump;
+		jump.PacketReceived( 0, 100 );
+		jump.PacketReceived( 64, 100 );
+		CHECK( jump.GenerateAckBits() == 1ULL << 63 );
+		jump.PacketReceived( 129, 100 );
+		CHECK( jump.GenerateAckBits() == 0 );
 	}
 }
 
@@ -3506,6 +4830,297 @@ SUITE( ReliableConnection )
 		CHECK( server.IsConnected() );
 	}
 
+
+	TEST( reliable_connection_packet_buffer )
+	{
+		const int ServerPort = 20000;
+		const int ClientPort = 20001;
+		const int ProtocolId = 0x11112222;
+		const float DeltaTime = 0.001f;
+		const float TimeOut = 0.1f;
+
+		ReliableConnection client( ProtocolId, TimeOut );
+		ReliableConnection server( ProtocolId, TimeOut );
+
+		CHECK( client.Start( ClientPort ) );
+		CHECK( server.Start( ServerPort ) );
+
+		client.Connect( Address(127,0,0,1,ServerPort ) );
+		server.Listen();
+
+		const char message[] = "client to server";
+
+		int received = 0;
+
+		for ( int i = 0; i < 100 && received < 10; ++i )
+		{
+			// headers are written in place in front of the payload
+
+			PacketBuffer buffer;
+			memcpy( buffer.Append( sizeof( message ) ), message, sizeof( message ) );
+			const unsigned char * payload = buffer.GetData();
+			CHECK( client.SendPacket( buffer ) );
+			CHECK( buffer.GetSize() == (int) sizeof( message ) + client.GetHeaderSize() );
+			CHECK( buffer.GetData() + client.GetHeaderSize() == payload );
+			CHECK( buffer.GetData()[0] == 0x11 && buffer.GetData()[3] == 0x22 );
+
+			// and the payload comes back as a view into the receive buffer
+
+			while ( true )
+			{
+				PacketBuffer packet;
+				const int bytes = server.ReceivePacket( packet );
+				if ( bytes == 0 )
+					break;
+				CHECK( bytes == (int) sizeof( message ) );
+				CHECK( packet.GetSize() == bytes );
+				CHECK( packet.GetData() == packet.GetBuffer() + server.GetHeaderSize() );
+				CHECK( memcmp( packet.GetData(), message, sizeof( message ) ) == 0 );
+				received++;
+			}
+
+			client.Update( DeltaTime );
+			server.Update( DeltaTime );
+		}
+
+		CHECK( received >= 10 );
+		CHECK( server.IsConnected() );
+	}
+
+	TEST( reliable_connection_batch )
+	{
+		const int ServerPort = 20000;
+		const int ClientPort = 20001;
+		const int ProtocolId = 0x11112222;
+		const float TimeOut = 0.1f;
+		const int BatchSize = 40;
+
+		ReliableConnection client( ProtocolId, TimeOut );
+		ReliableConnection server( ProtocolId, TimeOut );
+
+		CHECK( client.Start( ClientPort ) );
+		CHECK( server.Start( ServerPort ) );
+
+		client.Connect( Address(127,0,0,1,ServerPort ) );
+		server.Listen();
+
+		std::vector<PacketBuffer> buffers( BatchSize );
+		for ( int i = 0; i < BatchSize; ++i )
+			*buffers[i].Append( 1 ) = (unsigned char) i;
+
+		CHECK( client.SendPackets( &buffers[0], BatchSize ) == BatchSize );
+		CHECK( client.GetReliabilitySystem().GetLocalSequence() == BatchSize );
+
+		int received = 0;
+		while ( true )
+		{
+			const int count = server.ReceivePackets( &buffers[0], BatchSize );
+			for ( int i = 0; i < count; ++i )
+			{
+				CHECK( buffers[i].GetSize() == 1 );
+				CHECK( buffers[i].GetData()[0] == received );
+				received++;
+			}
+			if ( count < BatchSize )
+				break;
+		}
+
+		CHECK( received == BatchSize );
+		CHECK( server.IsConnected() );
+		CHECK( server.GetSocketStats().packetsReceived == BatchSize );
+		CHECK( server.GetReliabilitySystem().GetRemoteSequence() == BatchSize - 1 );
+		#ifdef NET_BATCHED_IO
+		CHECK( client.GetSocketStats().sendCalls == 1 );
+		CHECK( server.GetSocketStats().receiveCalls <= 2 );
+		#endif
+	}
+}
+
+// ------------------------------------------------------------------------------------------------------
+
+SUITE( ServerEndpoint )
+{
+	// each client sends the server a packet, the server answers every client it has, then everyone updates
+
+	void ExchangePackets( ServerEndpoint & server, ReliableConnection * client[], int numClients, float deltaTime )
+	{
+		unsigned char packet[256];
+		memset( packet, 0, sizeof( packet ) );
+
+		for ( int i = 0; i < numClients; ++i )
+		{
+			if ( client[i]->IsRunning() && ( client[i]->IsConnecting() || client[i]->IsConnected() ) )
+				client[i]->SendPacket( packet, 32 );
+		}
+
+		int clientIndex = -1;
+		while ( server.ReceivePacket( clientIndex, packet, sizeof( packet ) ) )
+		{
+			CHECK( clientIndex >= 0 );
+			CHECK( clientIndex < server.GetMaxClients() );
+		}
+
+		for ( int i = 0; i < server.GetMaxClients(); ++i )
+		{
+			if ( server.IsClientConnected( i ) )
+				CHECK( server.SendPacket( i, packet, 64 ) );
+		}
+
+		for ( int i = 0; i < numClients; ++i )
+		{
+			if ( !client[i]->IsRunning() )
+				continue;
+			while ( client[i]->ReceivePacket( packet, sizeof( packet ) ) )
+				;
+			client[i]->Update( deltaTime );
+		}
+
+		server.Update( deltaTime );
+	}
+
+	TEST( server_endpoint_clients )
+	{
+		const int MaxClients = 4;
+		const int NumClients = MaxClients + 1;
+		const int ServerPort = 20000;
+		const int ClientPort = 20001;
+		const int ProtocolId = 0x11112222;
+		const float DeltaTime = 0.001f;
+		const float TimeOut = 0.1f;
+
+		ServerEndpoint server( ProtocolId, TimeOut, MaxClients );
+		CHECK( server.Start( ServerPort ) );
+
+		ReliableConnection * client[NumClients];
+		for ( int i = 0; i < NumClients; ++i )
+		{
+			client[i] = new ReliableConnection( ProtocolId, TimeOut );
+			CHECK( client[i]->Start( ClientPort + i ) );
+		}
+
+		// the first clients fill the server. the last one has no slot and times out connecting
+
+		for ( int i = 0; i < NumClients; ++i )
+		{
+			client[i]->Connect( Address(127,0,0,1,ServerPort) );
+			ExchangePackets( server, client, i + 1, DeltaTime );
+		}
+
+		while ( !client[MaxClients]->ConnectFailed() )
+			ExchangePackets( server, client, NumClients, DeltaTime );
+
+		CHECK( server.GetNumClients() == MaxClients );
+		CHECK( server.FindClient( Address(127,0,0,1,ClientPort+MaxClients) ) == -1 );
+
+		for ( int i = 0; i < MaxClients; ++i )
+		{
+			CHECK( client[i]->IsConnected() );
+			const int clientIndex = server.FindClient( Address(127,0,0,1,ClientPort+i) );
+			CHECK( clientIndex == i );
+			CHECK( server.IsClientConnected( clientIndex ) );
+			CHECK( server.GetClientAddress( clientIndex ) == Address(127,0,0,1,ClientPort+i) );
+			CHECK( server.GetReliabilitySystem( clientIndex ).GetAckedPackets() > 0 );
+			CHECK( client[i]->GetReliabilitySystem().GetAckedPackets() > 0 );
+		}
+
+		// each client has its own sequence numbers: the first client has been sending the longest
+
+		CHECK( server.GetReliabilitySystem( 0 ).GetRemoteSequence() > server.GetReliabilitySystem( MaxClients - 1 ).GetRemoteSequence() );
+
+		// a client that goes quiet times out and frees its slot for the next client
+
+		client[0]->Stop();
+
+		while ( server.IsClientConnected( 0 ) )
+			ExchangePackets( server, client, MaxClients, DeltaTime );
+
+		CHECK( server.GetNumClients() == MaxClients - 1 );
+		CHECK( server.FindClient( Address(127,0,0,1,ClientPort) ) == -1 );
+
+		client[MaxClients]->Connect( Address(127,0,0,1,ServerPort) );
+		while ( !client[MaxClients]->IsConnected() )
+			ExchangePackets( server, client, NumClients, DeltaTime );
+
+		CHECK( server.GetNumClients() == MaxClients );
+		CHECK( server.FindClient( Address(127,0,0,1,ClientPort+MaxClients) ) == 0 );
+		for ( int i = 1; i < MaxClients; ++i )
+			CHECK( client[i]->IsConnected() );
+
+		server.Stop();
+
+		CHECK( server.GetNumClients() == 0 );
+
+		for ( int i = 0; i < NumClients; ++i )
+			delete client[i];
+	}
+
+	TEST( server_endpoint_batch )
+	{
+		const int MaxClients = 16;
+		const int ServerPort = 20000;
+		const int ClientPort = 20001;
+		const int ProtocolId = 0x11112222;
+		const float DeltaTime = 0.001f;
+		const float TimeOut = 1.0f;
+
+		ServerEndpoint server( ProtocolId, TimeOut, MaxClients );
+		CHECK( server.Start( ServerPort ) );
+
+		ReliableConnection * client[MaxClients];
+		for ( int i = 0; i < MaxClients; ++i )
+		{
+			client[i] = new ReliableConnection( ProtocolId, TimeOut );
+			CHECK( client[i]->Start( ClientPort + i ) );
+			client[i]->Connect( Address(127,0,0,1,ServerPort) );
+		}
+
+		while ( server.GetNumClients() < MaxClients )
+			ExchangePackets( server, client, MaxClients, DeltaTime );
+
+		// one packet for every client goes out in a single batch
+
+		PacketBuffer buffers[MaxClients];
+		int clientIndex[MaxClients];
+		for ( int i = 0; i < MaxClients; ++i )
+		{
+			buffers[i].Reset();
+			*buffers[i].Append( 1 ) = (unsigned char) i;
+			clientIndex[i] = server.FindClient( Address(127,0,0,1,ClientPort+i) );
+			CHECK( clientIndex[i] >= 0 );
+		}
+
+		const unsigned int sendCalls = server.GetSocketStats().sendCalls;
+
+		CHECK( server.SendPackets( buffers, clientIndex, MaxClients ) == MaxClients );
+
+		#ifdef NET_BATCHED_IO
+		CHECK( server.GetSocketStats().sendCalls == sendCalls + 1 );
+		#else
+		CHECK( server.GetSocketStats().sendCalls == sendCalls + (unsigned int) MaxClients );
+		#endif
+
+		usleep( 10000 );
+
+		for ( int i = 0; i < MaxClients; ++i )
+		{
+			unsigned char packet[256];
+			int bytes = 0;
+			while ( true )
+			{
+				const int size = client[i]->ReceivePacket( packet, sizeof( packet ) );
+				if ( size == 0 )
+					break;
+				bytes = size;
+			}
+			CHECK( bytes == 1 );
+			CHECK( packet[0] == i );
+		}
+
+		server.Stop();
+
+		for ( int i = 0; i < MaxClients; ++i )
+			delete client[i];
+	}
 }
 
 // ------------------------------------------------------------------------------------------------------
@@ -3804,12 +5419,90 @@ SUITE( NodeMesh )
 
 			client.Update( DeltaTime );
 			server.Update( DeltaTime );
-
+
+			mesh.Update( DeltaTime );
+		}
+
+		CHECK( client.IsConnected() );
+		CHECK( server.IsConnected() );
+
+		mesh.Stop();
+	}
+
+	TEST( node_receive_order )
+	{
+		const int MaxNodes = 2;
+		const int MeshPort = 20000;
+		const int ClientPort = 20001;
+		const int ServerPort = 20002;
+		const int ProtocolId = 0x12345678;
+		const float DeltaTime = 0.01f;
+		const float SendRate = 0.01f;
+		const float TimeOut = 1.0f;
+		const int MaxPacketSize = 256;
+		const int QueueSize = 4;
+
+		Mesh mesh( ProtocolId, MaxNodes, SendRate, TimeOut );
+		CHECK( mesh.Start( MeshPort ) );
+
+		Node client( ProtocolId, SendRate, TimeOut );
+		CHECK( client.Start( ClientPort ) );
+
+		Node server( ProtocolId, SendRate, TimeOut, MaxPacketSize, QueueSize );
+		CHECK( server.Start( ServerPort ) );
+
+		mesh.Reserve( 0, Address(127,0,0,1,ServerPort) );
+
+		server.Connect( Address(127,0,0,1,MeshPort) );
+		client.Connect( Address(127,0,0,1,MeshPort) );
+
+		while ( !client.IsConnected() || !server.IsConnected() || !client.IsNodeConnected( 0 ) || !server.IsNodeConnected( 1 ) )
+		{
+			client.Update( DeltaTime );
+			server.Update( DeltaTime );
 			mesh.Update( DeltaTime );
 		}
 
-		CHECK( client.IsConnected() );
-		CHECK( server.IsConnected() );
+		// packets come out in the order they arrived, and those that don't fit are dropped and counted
+
+		int nodeId = -1;
+		unsigned char packet[MaxPacketSize];
+		for ( int i = 0; i < QueueSize * 2; ++i )
+		{
+			packet[0] = (unsigned char) i;
+			CHECK( client.SendPacket( 0, packet, 1 ) );
+		}
+
+		usleep( 10000 );
+		server.Update( 0.0f );
+
+		for ( int i = 0; i < QueueSize; ++i )
+		{
+			CHECK( server.ReceivePacket( nodeId, packet, sizeof( packet ) ) == 1 );
+			CHECK( nodeId == 1 );
+			CHECK( packet[0] == i );
+		}
+		CHECK( server.ReceivePacket( nodeId, packet, sizeof( packet ) ) == 0 );
+		CHECK( server.GetReceiveOverflow() == QueueSize );
+
+		// and keep their order across the wrap
+
+		for ( int i = 0; i < QueueSize - 1; ++i )
+		{
+			packet[0] = (unsigned char) ( 100 + i );
+			CHECK( client.SendPacket( 0, packet, 1 ) );
+		}
+
+		usleep( 10000 );
+		server.Update( 0.0f );
+
+		for ( int i = 0; i < QueueSize - 1; ++i )
+		{
+			CHECK( server.ReceivePacket( nodeId, packet, sizeof( packet ) ) == 1 );
+			CHECK( packet[0] == 100 + i );
+		}
+		CHECK( server.ReceivePacket( nodeId, packet, sizeof( packet ) ) == 0 );
+		CHECK( server.GetReceiveOverflow() == QueueSize );
 
 		mesh.Stop();
 	}
@@ -4030,6 +5723,568 @@ SUITE( NodeMesh )
 
 		mesh.Stop();
 	}
+
+	TEST( address_hash )
+	{
+		const int Count = 1000;
+
+		AddressHash hash( Count );
+
+		for ( int i = 0; i < Count; ++i )
+			hash.Insert( Address( 10, 0, (unsigned char) ( i / 100 ), 1, (unsigned short) ( 30000 + i % 100 ) ), i );
+
+		CHECK( hash.GetCount() == Count );
+		for ( int i = 0; i < Count; ++i )
+			CHECK( hash.Find( Address( 10, 0, (unsigned char) ( i / 100 ), 1, (unsigned short) ( 30000 + i % 100 ) ) ) == i );
+		CHECK( hash.Find( Address( 10, 0, 0, 2, 30000 ) ) == -1 );
+
+		// entries probed past a removed one must still be found
+
+		for ( int i = 0; i < Count; i += 2 )
+			CHECK( hash.Remove( Address( 10, 0, (unsigned char) ( i / 100 ), 1, (unsigned short) ( 30000 + i % 100 ) ) ) );
+		CHECK( !hash.Remove( Address( 10, 0, 0, 1, 30000 ) ) );
+
+		CHECK( hash.GetCount() == Count / 2 );
+		for ( int i = 0; i < Count; ++i )
+			CHECK( hash.Find( Address( 10, 0, (unsigned char) ( i / 100 ), 1, (unsigned short) ( 30000 + i % 100 ) ) ) == ( i % 2 ? i : -1 ) );
+
+		hash.Insert( Address( 10, 0, 0, 1, 30001 ), 5 );
+		CHECK( hash.Find( Address( 10, 0, 0, 1, 30001 ) ) == 5 );
+		CHECK( hash.GetCount() == Count / 2 );
+
+		hash.Clear();
+		CHECK( hash.GetCount() == 0 );
+		CHECK( hash.Find( Address( 10, 0, 0, 1, 30001 ) ) == -1 );
+	}
+
+	TEST( mesh_membership_updates )
+	{
+		const int MaxNodes = 260;				// the table takes more than one resync packet
+		const int MeshPort = 20000;
+		const int NodePort = 20001;
+		const int ProtocolId = 0x12345678;
+		const float DeltaTime = 0.01f;
+		const float SendRate = 0.01f;
+		const float TimeOut = 1.0f;
+		const int MaxPacketSize = 1024;
+		const int QueueSize = 4;
+
+		Mesh mesh( ProtocolId, MaxNodes, SendRate, TimeOut );
+		CHECK( mesh.Start( MeshPort ) );
+
+		Node * node[MaxNodes];
+		for ( int i = 0; i < MaxNodes; ++i )
+		{
+			node[i] = new Node( ProtocolId, SendRate, TimeOut, MaxPacketSize, QueueSize );
+			CHECK( node[i]->Start( NodePort + i ) );
+			node[i]->Connect( Address(127,0,0,1,MeshPort) );
+		}
+
+		// wait for every node to have the whole table
+
+		while ( true )
+		{
+			bool allConnected = true;
+			for ( int i = 0; i < MaxNodes; ++i )
+			{
+				node[i]->Update( DeltaTime );
+				if ( !node[i]->IsConnected() )
+					allConnected = false;
+				else
+				{
+					for ( int j = 0; j < MaxNodes; ++j )
+						if ( !node[i]->IsNodeConnected( j ) )
+							allConnected = false;
+				}
+			}
+			if ( allConnected )
+				break;
+			mesh.Update( DeltaTime );
+		}
+
+		for ( int i = 0; i < MaxNodes; ++i )
+		{
+			CHECK( node[i]->GetMaxNodes() == MaxNodes );
+			for ( int j = 0; j < MaxNodes; ++j )
+				CHECK( mesh.GetNodeAddress(j) == node[i]->GetNodeAddress(j) );
+		}
+
+		CHECK( mesh.GetStats().resyncPackets >= MaxNodes * 3 );
+
+		// once everyone is up to date, each node gets one small update per send
+
+		for ( int i = 0; i < 10; ++i )
+		{
+			for ( int j = 0; j < MaxNodes; ++j )
+				node[j]->Update( DeltaTime );
+			mesh.Update( DeltaTime );
+		}
+
+		const MeshStats before = mesh.GetStats();
+
+		for ( int i = 0; i < 100; ++i )
+		{
+			for ( int j = 0; j < MaxNodes; ++j )
+				node[j]->Update( DeltaTime );
+			mesh.Update( DeltaTime );
+		}
+
+		const MeshStats after = mesh.GetStats();
+		const double bytesPerNode = ( after.bytesSent - before.bytesSent ) / ( after.nodeSeconds - before.nodeSeconds );
+
+		printf( "mesh of %d nodes sends %.0f bytes per node per second\n", MaxNodes, bytesPerNode );
+
+		CHECK( after.resyncPackets == before.resyncPackets );
+		CHECK( bytesPerNode < 11 / SendRate * 1.5f );
+
+		// a node leaving reaches the others as an update
+
+		node[0]->Stop();
+
+		while ( true )
+		{
+			bool othersSeeFirstNodeDisconnected = true;
+			for ( int i = 1; i < MaxNodes; ++i )
+			{
+				node[i]->Update( DeltaTime );
+				if ( node[i]->IsNodeConnected(0) )
+					othersSeeFirstNodeDisconnected = false;
+			}
+			if ( othersSeeFirstNodeDisconnected )
+				break;
+			mesh.Update( DeltaTime );
+		}
+
+		CHECK( !mesh.IsNodeConnected(0) );
+		CHECK( mesh.GetStats().resyncPackets == after.resyncPackets );
+		for ( int i = 1; i < MaxNodes; ++i )
+		{
+			CHECK( node[i]->GetMembershipSequence() == mesh.GetMembershipSequence() );
+			for ( int j = 1; j < MaxNodes; ++j )
+				CHECK( node[i]->IsNodeConnected(j) );
+		}
+
+		for ( int i = 0; i < MaxNodes; ++i )
+			delete node[i];
+
+		mesh.Stop();
+	}
+}
+
+// ------------------------------------------------------------------------------------------------------
+
+SUITE( Reactor )
+{
+	void CountTimer( void * data )
+	{
+		( *(int*) data )++;
+	}
+
+	struct Reader
+	{
+		Socket * socket;
+		int packets;
+	};
+
+	void ReadSocket( void * data )
+	{
+		Reader * reader = (Reader*) data;
+		Address sender;
+		unsigned char packet[256];
+		while ( reader->socket->Receive( sender, packet, sizeof( packet ) ) )
+			reader->packets++;
+	}
+
+	TEST( timer_wheel )
+	{
+		const double Tick = 1.0 / 1024.0;
+
+		TimerWheel wheel( Tick );
+		wheel.Reset( 0.0 );
+
+		int oneShot = 0;
+		int periodic = 0;
+		int far = 0;
+		int cancelled = 0;
+
+		const int a = wheel.Schedule( 5 * Tick, 0.0f, CountTimer, &oneShot );
+		const int b = wheel.Schedule( 10 * Tick, (float) ( 10 * Tick ), CountTimer, &periodic );
+		wheel.Schedule( 1024 * Tick, 0.0f, CountTimer, &far );
+		const int c = wheel.Schedule( 3 * Tick, 0.0f, CountTimer, &cancelled );
+		wheel.Cancel( c );
+
+		CHECK( wheel.GetNumTimers() == 3 );
+
+		double expiry = 0.0;
+		CHECK( wheel.GetNextExpiry( expiry ) );
+		CHECK( expiry == 5 * Tick );
+
+		CHECK( wheel.Advance( 4 * Tick ) == 0 );
+		CHECK( wheel.Advance( 5 * Tick ) == 1 );
+		CHECK( oneShot == 1 );
+		CHECK( wheel.GetNumTimers() == 2 );
+		CHECK( wheel.GetNextExpiry( expiry ) );
+		CHECK( expiry == 10 * Tick );
+
+		CHECK( wheel.Advance( 20 * Tick ) == 2 );
+		CHECK( periodic == 2 );
+		CHECK( wheel.GetNextExpiry( expiry ) );
+		CHECK( expiry == 30 * Tick );
+
+		// a periodic timer that falls behind fires once and skips the periods it missed
+
+		CHECK( wheel.Advance( 100 * Tick ) == 1 );
+		CHECK( periodic == 3 );
+		CHECK( wheel.Advance( 109 * Tick ) == 0 );
+		CHECK( wheel.Advance( 110 * Tick ) == 1 );
+		CHECK( periodic == 4 );
+
+		// more than one turn of the wheel out
+
+		CHECK( far == 0 );
+		CHECK( wheel.Advance( 1024 * Tick ) == 2 );
+		CHECK( far == 1 );
+		CHECK( periodic == 5 );
+
+		wheel.Cancel( b );
+		CHECK( wheel.GetNumTimers() == 0 );
+		CHECK( !wheel.GetNextExpiry( expiry ) );
+		CHECK( wheel.Advance( 2000 * Tick ) == 0 );
+		CHECK( periodic == 5 );
+		CHECK( cancelled == 0 );
+
+		// stale ids don't cancel the timer that reused their slot
+
+		wheel.Schedule( 2010 * Tick, 0.0f, CountTimer, &oneShot );
+		wheel.Cancel( a );
+		CHECK( wheel.GetNumTimers() == 1 );
+		CHECK( wheel.Advance( 2010 * Tick ) == 1 );
+		CHECK( oneShot == 2 );
+	}
+
+	TEST( reactor_sockets_and_timers )
+	{
+		Socket a, b, sender;
+		CHECK( a.Open( 20000 ) );
+		CHECK( b.Open( 20001 ) );
+		CHECK( sender.Open( 20002 ) );
+
+		Reactor reactor;
+
+		Reader readerA = { &a, 0 };
+		Reader readerB = { &b, 0 };
+		CHECK( reactor.Add( a, ReadSocket, &readerA ) );
+		CHECK( reactor.Add( b, ReadSocket, &readerB ) );
+		CHECK( reactor.GetNumSockets() == 2 );
+
+		CHECK( reactor.Poll( 0.0f ) == 0 );
+
+		unsigned char packet[] = "packet";
+		CHECK( sender.Send( Address(127,0,0,1,20000), packet, sizeof( packet ) ) );
+		CHECK( sender.Send( Address(127,0,0,1,20000), packet, sizeof( packet ) ) );
+
+		while ( readerA.packets < 2 )
+			reactor.Poll( 1.0f );
+
+		CHECK( readerA.packets == 2 );
+		CHECK( readerB.packets == 0 );
+
+		// the wait is cut short by the next timer
+
+		int fired = 0;
+		reactor.AddTimer( 0.01f, 0.0f, CountTimer, &fired );
+		const double start = profile::GetTime();
+		while ( fired == 0 )
+			reactor.Poll( 1.0f );
+		CHECK( profile::GetTime() - start < 0.5 );
+		CHECK( reactor.GetNumTimers() == 0 );
+
+		// removed sockets are no longer waited on
+
+		reactor.Remove( a );
+		CHECK( reactor.GetNumSockets() == 1 );
+		CHECK( sender.Send( Address(127,0,0,1,20000), packet, sizeof( packet ) ) );
+		reactor.Poll( 0.01f );
+		CHECK( readerA.packets == 2 );
+
+		CHECK( reactor.GetStats().socketEvents >= 1 );
+		CHECK( reactor.GetStats().timersFired == 1 );
+	}
+
+	struct Waiter
+	{
+		ReactorEvent * event;
+		int wakeups;
+	};
+
+	void WakeWaiter( void * data )
+	{
+		Waiter * waiter = (Waiter*) data;
+		waiter->event->Clear();
+		waiter->wakeups++;
+	}
+
+	TEST( reactor_event )
+	{
+		ReactorEvent event;
+		CHECK( event.Open() );
+
+		Reactor reactor;
+		Waiter waiter = { &event, 0 };
+		CHECK( reactor.Add( event, WakeWaiter, &waiter ) );
+
+		CHECK( reactor.Poll( 0.0f ) == 0 );
+
+		// signals before the clear collapse into one wakeup, and cut the wait short
+
+		event.Signal();
+		event.Signal();
+		const double start = profile::GetTime();
+		CHECK( reactor.Poll( 1.0f ) == 1 );
+		CHECK( profile::GetTime() - start < 0.5 );
+		CHECK( waiter.wakeups == 1 );
+		CHECK( reactor.Poll( 0.0f ) == 0 );
+
+		// removed events are no longer waited on
+
+		reactor.Remove( event );
+		event.Signal();
+		CHECK( reactor.Poll( 0.01f ) == 0 );
+		CHECK( waiter.wakeups == 1 );
+	}
+
+	TEST( reactor_node_mesh )
+	{
+		const int MaxNodes = 2;
+		const int MeshPort = 20000;
+		const int NodePort = 20001;
+		const int ProtocolId = 0x12345678;
+		const float SendRate = 0.01f;
+		const float TimeOut = 0.1f;
+
+		Reactor reactor;
+
+		Mesh mesh( ProtocolId, MaxNodes, SendRate, TimeOut );
+		CHECK( mesh.Start( MeshPort ) );
+		CHECK( mesh.Attach( reactor ) );
+
+		Node node( ProtocolId, SendRate, TimeOut );
+		CHECK( node.Start( NodePort ) );
+		CHECK( node.Attach( reactor ) );
+
+		node.Connect( Address(127,0,0,1,MeshPort) );
+		while ( node.IsConnecting() || !mesh.IsNodeConnected( 0 ) )
+			reactor.Poll( 1.0f );
+
+		CHECK( node.IsConnected() );
+		CHECK( reactor.GetNumSockets() == 2 );
+		CHECK( reactor.GetNumTimers() == 2 );
+
+		// the mesh times the node out from its timer once the node stops
+
+		node.Stop();
+		CHECK( reactor.GetNumSockets() == 1 );
+		CHECK( reactor.GetNumTimers() == 1 );
+
+		while ( mesh.IsNodeConnected( 0 ) )
+			reactor.Poll( 1.0f );
+
+		mesh.Stop();
+		CHECK( reactor.GetNumSockets() == 0 );
+		CHECK( reactor.GetNumTimers() == 0 );
+	}
+}
+
+// ------------------------------------------------------------------------------------------------------
+
+SUITE( NetworkThread )
+{
+	TEST( spsc_queue )
+	{
+		platform::SPSCQueue<int> queue( 8 );
+
+		int * items;
+		CHECK( queue.Peek( items ) == 0 );
+		CHECK( queue.Reserve( items ) == 8 );
+
+		for ( int i = 0; i < 6; ++i )
+			items[i] = i;
+		queue.Push( 6 );
+		CHECK( queue.GetSize() == 6 );
+
+		CHECK( queue.Peek( items ) == 6 );
+		CHECK( items[0] == 0 && items[5] == 5 );
+		queue.Pop( 4 );
+
+		// runs stop at the end of the array
+
+		CHECK( queue.Reserve( items ) == 2 );
+		items[0] = 6;
+		items[1] = 7;
+		queue.Push( 2 );
+		CHECK( queue.Reserve( items ) == 4 );
+		CHECK( queue.GetIndex( items ) == 0 );
+		for ( int i = 0; i < 4; ++i )
+			items[i] = 8 + i;
+		queue.Push( 4 );
+		CHECK( queue.Reserve( items ) == 0 );
+		CHECK( queue.GetSize() == 8 );
+
+		int expected = 4;
+		int count;
+		while ( ( count = queue.Peek( items ) ) > 0 )
+		{
+			for ( int i = 0; i < count; ++i )
+				CHECK( items[i] == expected++ );
+			queue.Pop( count );
+		}
+		CHECK( expected == 12 );
+		CHECK( queue.GetSize() == 0 );
+	}
+
+	#ifdef MULTITHREADED
+
+	class Producer : public platform::WorkerThread
+	{
+	public:
+		platform::SPSCQueue<unsigned int> * queue;
+		unsigned int count;
+	protected:
+		void Run()
+		{
+			unsigned int next = 0;
+			while ( next < count )
+			{
+				unsigned int * items;
+				int space = queue->Reserve( items );
+				if ( space == 0 )
+					usleep( 10 );			// let the consumer run, there may be only one core
+				if ( space > (int) ( count - next ) )
+					space = count - next;
+				for ( int i = 0; i < space; ++i )
+					items[i] = next++;
+				queue->Push( space );
+			}
+		}
+	};
+
+	TEST( spsc_queue_threads )
+	{
+		platform::SPSCQueue<unsigned int> queue( 64 );
+
+		Producer producer;
+		producer.queue = &queue;
+		producer.count = 100000;
+		CHECK( producer.Start() );
+
+		unsigned int expected = 0;
+		bool ordered = true;
+		while ( expected < producer.count )
+		{
+			unsigned int * items;
+			const int count = queue.Peek( items );
+			if ( count == 0 )
+				usleep( 10 );
+			for ( int i = 0; i < count; ++i )
+				ordered &= items[i] == expected++;
+			queue.Pop( count );
+		}
+
+		CHECK( producer.Join() );
+		CHECK( ordered );
+		CHECK( queue.GetSize() == 0 );
+	}
+
+	#endif
+
+	void CountWakeup( void * data )
+	{
+		( *(int*) data )++;
+	}
+
+	TEST( network_thread_loopback )
+	{
+		const int ServerPort = 20000;
+		const int ClientPort = 20001;
+		const int ProtocolId = 0x11112222;
+		const float DeltaTime = 0.001f;
+		const float TimeOut = 1.0f;
+		const int NumPackets = 20;
+
+		ReliableConnection server( ProtocolId, TimeOut );
+		CHECK( server.Start( ServerPort ) );
+		server.Listen();
+
+		NetworkThread network( server );
+		CHECK( network.Start() );
+
+		// the game thread sleeps in its own reactor until packets are handed over
+
+		Reactor reactor;
+		int wakeups = 0;
+		CHECK( network.AttachReceiver( reactor, CountWakeup, &wakeups ) );
+
+		ReliableConnection client( ProtocolId, TimeOut );
+		CHECK( client.Start( ClientPort ) );
+		client.Connect( Address(127,0,0,1,ServerPort) );
+
+		int received = 0;
+		bool replied = false;
+		while ( ( received < NumPackets || !replied ) && !client.ConnectFailed() )
+		{
+			unsigned char packet[] = "client to server";
+			client.SendPacket( packet, sizeof( packet ) );
+
+			reactor.Poll( 0.0f );
+
+			while ( PacketBuffer * buffer = network.ReceivePacket() )
+			{
+				CHECK( buffer->GetSize() == sizeof( packet ) );
+				CHECK( memcmp( buffer->GetData(), packet, sizeof( packet ) ) == 0 );
+				network.ReleasePacket();
+				received++;
+			}
+
+			if ( network.IsConnected() )
+			{
+				PacketBuffer * buffer = network.AcquireSendBuffer();
+				CHECK( buffer );
+				const unsigned char reply[] = "server to client";
+				memcpy( buffer->Append( sizeof( reply ) ), reply, sizeof( reply ) );
+				network.SendPacket();
+			}
+
+			unsigned char data[256];
+			while ( int bytes = client.ReceivePacket( data, sizeof( data ) ) )
+			{
+				if ( bytes > 0 && strcmp( (const char*) data, "server to client" ) == 0 )
+					replied = true;
+			}
+
+			#ifndef MULTITHREADED
+			network.Pump( 0.0f );
+			#endif
+
+			client.Update( DeltaTime );
+			usleep( 1000 );
+		}
+
+		CHECK( received >= NumPackets );
+		CHECK( replied );
+		CHECK( network.GetHandoffTimes().GetCount() == received );
+
+		const NetworkThreadStats stats = network.GetStats();
+		CHECK( stats.packetsReceived >= (unsigned int) received );
+		CHECK( stats.packetsSent >= 1 );
+		CHECK( stats.sendQueueFull == 0 );
+
+		CHECK( wakeups >= 1 );
+		CHECK( reactor.GetNumSockets() == 1 );
+
+		network.Stop();
+		CHECK( reactor.GetNumSockets() == 0 );
+		server.Stop();
+	}
 }
 
 // ------------------------------------------------------------------------------------------------------
@@ -18,7 +18,7 @@ namespace view
 		unsigned int id;
 		unsigned int owner;
 		unsigned int authority;
-		unsigned int framesSinceLastUpdate;
+		unsigned int lastUpdateFrame;
 		float scale;
 		math::Vector position;
 		math::Quaternion orientation;
@@ -37,7 +37,7 @@ namespace view
 			angularVelocity = math::Vector(0,0,0);
 			scale = 1.0f;
 			pendingDeactivation = true;
-			framesSinceLastUpdate = 0;
+			lastUpdateFrame = 0;
 		}
 	};
 
@@ -47,6 +47,7 @@ namespace view
 		float netTime;
 		float simTime;
 		math::Vector origin;
+		unsigned int frame;
 		int objectCount;
 		ObjectState object[MaxViewObjects];
 	
@@ -56,8 +57,19 @@ namespace view
 			netTime = 0.0f;
 			simTime = 0.0f;
 			origin = math::Vector(0,0,0);
+			frame = 0;
 			objectCount = 0;
 		}
+
+		// frames since the object was activated or last set from the network, up to 255
+
+		unsigned int GetFramesSinceLastUpdate( int index ) const
+		{
+			assert( index >= 0 );
+			assert( index < objectCount );
+			const unsigned int frames = frame - object[index].lastUpdateFrame;
+			return frames < 255 ? frames : 255;
+		}
 	};
 }
 